@@ -0,0 +1,252 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <vdpau/vdpau.h>
+
+/*
+ * Host side driver for the library. The V4L2 decoder, the parser library,
+ * libdrm and EGL/GLES/X11 are replaced by the mocks in this directory, so
+ * everything the library does on the CPU runs as it would on the board.
+ */
+
+typedef struct
+{
+    const char *stream;     /* canned stream, see stream.c */
+    int frames;             /* frames to decode, 0 for the suite default */
+    int hw_us;              /* simulated decode time of one frame */
+    int client_us;          /* simulated client work per frame */
+    int quick;              /* short runs with correctness checks only */
+} bench_opts_t;
+
+extern bench_opts_t bench_opts;
+extern int bench_failures;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        bench_failures++; \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fputc('\n', stderr); \
+    } \
+} while (0)
+
+uint64_t bench_now_ns(void);
+/* process CPU time, not counting the simulated hardware */
+uint64_t bench_cpu_ns(void);
+void bench_spin_us(int us);
+
+/* allocator calls made by the library and the bench, see --wrap in the Makefile */
+typedef struct
+{
+    uint64_t allocs;
+    uint64_t frees;
+} bench_allocs_t;
+
+void bench_allocs(bench_allocs_t *out);
+
+/* headless device, mocked X display and EGL */
+VdpDevice bench_device_create(void);
+
+/*
+ * Mock file descriptors. Every mock device is backed by a real eventfd
+ * so its number can't collide with real files, and poll() waits on
+ * mock and real descriptors alike.
+ */
+typedef struct
+{
+    int (*ioctl)(void *obj, unsigned long request, void *arg);
+    /* ready events, and the time they become ready if not yet */
+    short (*poll)(void *obj, short events, uint64_t *deadline_ns);
+    void *(*mmap)(void *obj, size_t length, int prot, int flags, off_t offset);
+    void (*close)(void *obj);
+} mock_fd_ops_t;
+
+int mock_fd_open(const mock_fd_ops_t *ops, void *obj);
+void *mock_fd_get(int fd, const mock_fd_ops_t *ops);
+/* state of a mock device changed, re-check pollers */
+void mock_fd_notify(void);
+/* CPU time spent by mock hardware threads, excluded from bench_cpu_ns() */
+void mock_cpu_exclude(uint64_t ns);
+/* identity of a buffer shared between the mocks, by dma-buf fd */
+int mock_buffer_id(int fd, dev_t *dev, ino_t *ino);
+
+/* mock_v4l2.c */
+typedef struct
+{
+    int hw_us;
+    /* write a pattern into the whole frame instead of just a stamp */
+    int fill;
+    /* fail the n-th S_EXT_CTRLS/input QBUF from now on, 0 for never */
+    int fail_ext_ctrls;
+    int fail_qbuf_input;
+    /*
+     * poll() as the library used to wait before it had poll(): ready at
+     * once for the bitstream queue, a busy retry of DQBUF, and after a
+     * 1 ms sleep for the capture queue.
+     */
+    int spin_dqbuf;
+} mock_v4l2_config_t;
+
+typedef struct
+{
+    uint64_t jobs;
+    uint64_t ext_ctrls;
+    uint64_t sps_sets, pps_sets;
+    /* jobs queued or being decoded, at most since mock_v4l2_peak_reset() */
+    int max_jobs_queued;
+    /* protocol violations, all expected to stay 0 */
+    uint64_t double_queued;
+    uint64_t stale_params;
+    uint64_t overwrote_shown;
+    /* frames put on screen other than the one after the last shown */
+    uint64_t wrong_frame_shown;
+} mock_v4l2_stats_t;
+
+extern mock_v4l2_config_t mock_v4l2;
+void mock_v4l2_stats(mock_v4l2_stats_t *out);
+void mock_v4l2_peak_reset(void);
+/* frame number the simulated hardware stamped into a decoded picture */
+uint32_t mock_v4l2_stamp(const uint8_t *luma);
+/* pattern written with mock_v4l2.fill, luma or interleaved chroma */
+uint8_t mock_v4l2_pixel(uint32_t frame, int plane, uint32_t x, uint32_t y);
+/* a buffer went on screen, checked against the frames shown before */
+void mock_v4l2_presented(dev_t dev, ino_t ino);
+
+/* mock_h264d.c */
+typedef struct
+{
+    /* reference pictures kept, up to 16 */
+    int max_refs;
+} mock_h264d_config_t;
+
+typedef struct
+{
+    uint64_t frames;
+    uint64_t nals;
+    uint64_t junk_nals;
+    /* SEI, AUD, filler and the like, which the caller should skip */
+    uint64_t unneeded_nals;
+    uint64_t concurrent_calls;
+    uint64_t duplicate_pictures;
+} mock_h264d_stats_t;
+
+extern mock_h264d_config_t mock_h264d;
+void mock_h264d_stats(mock_h264d_stats_t *out);
+
+/* mock_drm.c */
+typedef struct
+{
+    int vblank_us;
+    int no_atomic;
+} mock_drm_config_t;
+
+typedef struct
+{
+    uint64_t prime_imports;
+    uint64_t addfb;
+    uint64_t rmfb;
+    uint64_t commits;
+    uint64_t flips;
+    uint64_t setplane;
+    uint64_t busy_commits;
+    uint64_t rmfb_shown;
+    uint64_t bad_fb_commits;
+    /* plane updates or event handling entered by two threads at once */
+    uint64_t overlapping_calls;
+    /* card polled for a flip event while none was pending */
+    uint64_t idle_polls;
+    VdpTime last_flip_time;
+} mock_drm_stats_t;
+
+extern mock_drm_config_t mock_drm;
+void mock_drm_stats(mock_drm_stats_t *out);
+int mock_drm_buffer_shown(dev_t dev, ino_t ino);
+
+/* mock_gl.c */
+typedef struct
+{
+    const char *extensions;
+} mock_gl_config_t;
+
+typedef struct
+{
+    uint64_t images_created;
+    uint64_t images_destroyed;
+    uint64_t tex_uploads;
+    uint64_t tex_upload_bytes;
+    uint64_t swaps;
+    /* dma-bufs that could not be imported, closed or never valid */
+    uint64_t bad_imports;
+} mock_gl_stats_t;
+
+extern mock_gl_config_t mock_gl;
+void mock_gl_stats(mock_gl_stats_t *out);
+int mock_gl_buffer_sampled(dev_t dev, ino_t ino);
+
+/* stream.c */
+#define BENCH_MAX_NALS 16
+
+typedef struct
+{
+    VdpBitstreamBuffer buffers[BENCH_MAX_NALS];
+    uint32_t buffer_count;
+    uint32_t bytes;
+    int idr;
+    int ref;
+} bench_frame_t;
+
+typedef struct
+{
+    const char *name;
+    uint32_t width, height;
+    uint32_t frame_count;
+    bench_frame_t *frames;
+    uint8_t *data;
+    size_t size;
+} bench_stream_t;
+
+int bench_stream_open(bench_stream_t *s, const char *name, uint32_t frames);
+void bench_stream_close(bench_stream_t *s);
+void bench_stream_list(FILE *f);
+/* picture info matching the parameter sets of the canned streams */
+void bench_picture_info(VdpPictureInfoH264 *info, const bench_frame_t *frame);
+
+#define BENCH_MAX_SURFACES 16
+
+/*
+ * A device with an H.264 decoder and video surfaces sized for a canned
+ * stream. Handles that could not be created stay 0 and the device
+ * VDP_INVALID_HANDLE, bench_decoder_close() takes whatever is there.
+ */
+typedef struct
+{
+    const bench_stream_t *stream;
+    VdpDevice device;
+    VdpDecoder decoder;
+    VdpVideoSurface surfaces[BENCH_MAX_SURFACES];
+    int num_surfaces;
+} bench_decoder_t;
+
+int bench_decoder_open(bench_decoder_t *d, const bench_stream_t *stream, int num_surfaces);
+/* decode frame n of the stream into a surface */
+VdpStatus bench_decoder_render(bench_decoder_t *d, uint32_t n, VdpVideoSurface surface);
+void bench_decoder_close(bench_decoder_t *d);
+
+/* suites */
+int bench_decode(void);
+int bench_present(void);
+int bench_nal(void);
+int bench_handles(void);
+int bench_blend(void);
+int bench_latency(void);
+int bench_trace(void);
+int bench_readback(void);
+int bench_threads(void);
+int bench_rgba(void);
+int bench_wait(void);
+
+#endif
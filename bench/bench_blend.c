@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "vdpau_private.h"
+#include "rgba.h"
+
+/*
+ * The blend kernels of rgba_blit(). rgba_blend_pixel() is checked
+ * against the formula it documents for every source alpha, then
+ * rgba_blend_row(), SIMD where the host has it, against the scalar
+ * pixel for every alpha, odd widths and unaligned rows. Throughput is
+ * measured on a subtitle-like OSD and on translucent pixels only.
+ */
+
+#define BLEND_MAX_WIDTH 40
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+
+static uint32_t rand_state = 1;
+
+static uint32_t rand_next(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static uint32_t blend_ref(uint32_t s, uint32_t d)
+{
+    uint32_t a = s >> 24, r = 0;
+    int shift;
+
+    if (!a)
+        return d;
+    if (a == 0xff)
+        return s;
+
+    for (shift = 0; shift < 24; shift += 8)
+        r |= ((((d >> shift) & 0xff) * (256 - a) + ((s >> shift) & 0xff) * a) >> 8) << shift;
+
+    return r | (a + ((d >> 24) * (255 - a) >> 8)) << 24;
+}
+
+static void check_pixel(void)
+{
+    uint32_t alpha, wrong = 0, s = 0, d = 0;
+    int i;
+
+    for (alpha = 0; alpha < 256; alpha++)
+        for (i = 0; i < 256; i++) {
+            s = (alpha << 24) | (rand_next() & 0xffffff);
+            d = rand_next();
+            if (rgba_blend_pixel(s, d) != blend_ref(s, d))
+                wrong++;
+        }
+
+    CHECK(!wrong, "blend: %u pixels differ from the formula, last %08x over %08x",
+            wrong, s, d);
+}
+
+/*
+ * Rows of one alpha take the all clear and all opaque shortcuts, rows
+ * of mixed alpha put several cases into one vector.
+ */
+static void check_row(void)
+{
+    uint32_t buf[BLEND_MAX_WIDTH + 3], dst[BLEND_MAX_WIDTH + 3], expect[BLEND_MAX_WIDTH];
+    uint32_t alpha, wrong = 0;
+    int width, offset, mixed, i;
+
+    for (alpha = 0; alpha < 256; alpha++)
+        for (width = 1; width <= BLEND_MAX_WIDTH; width++)
+            for (offset = 0; offset < 4; offset++)
+                for (mixed = 0; mixed < 2; mixed++) {
+                    uint32_t *src = buf + offset % 3, *row = dst + offset;
+
+                    for (i = 0; i < width; i++) {
+                        uint32_t a = mixed ? (alpha + i * 97) & 0xff : alpha;
+
+                        src[i] = (a << 24) | (rand_next() & 0xffffff);
+                        row[i] = rand_next();
+                        expect[i] = rgba_blend_pixel(src[i], row[i]);
+                    }
+                    rgba_blend_row(row, src, width);
+                    if (memcmp(row, expect, width * 4))
+                        wrong++;
+                }
+
+    CHECK(!wrong, "blend: %u rows differ from the scalar blend", wrong);
+}
+
+static void blend_rows_scalar(uint32_t *dst, const uint32_t *src, int width, int height)
+{
+    int i;
+
+    for (i = 0; i < width * height; i++)
+        dst[i] = rgba_blend_pixel(src[i], dst[i]);
+}
+
+static void blend_rows_simd(uint32_t *dst, const uint32_t *src, int width, int height)
+{
+    int y;
+
+    for (y = 0; y < height; y++)
+        rgba_blend_row(dst + y * width, src + y * width, width);
+}
+
+static double blend_rate(void (*blend)(uint32_t *, const uint32_t *, int, int),
+                         uint32_t *dst, const uint32_t *src, int passes)
+{
+    uint64_t start = bench_now_ns();
+    int i;
+
+    for (i = 0; i < passes; i++)
+        blend(dst, src, BENCH_WIDTH, BENCH_HEIGHT);
+
+    return (double)BENCH_WIDTH * BENCH_HEIGHT * passes * 1000 / (bench_now_ns() - start);
+}
+
+/* two subtitle lines: opaque glyphs with soft edges, nothing elsewhere */
+static void make_osd(uint32_t *src)
+{
+    int x, y;
+
+    for (y = 0; y < BENCH_HEIGHT; y++)
+        for (x = 0; x < BENCH_WIDTH; x++) {
+            int text = y >= BENCH_HEIGHT - 160 && x >= 320 && x < BENCH_WIDTH - 320;
+            uint32_t r = rand_next(), a = 0;
+
+            if (text)
+                a = r % 4 == 0 ? 0xff : r % 4 == 1 ? (r >> 8) & 0xff : 0;
+            src[y * BENCH_WIDTH + x] = a << 24 | 0xf0f0f0;
+        }
+}
+
+static void make_translucent(uint32_t *src)
+{
+    int i;
+
+    for (i = 0; i < BENCH_WIDTH * BENCH_HEIGHT; i++)
+        src[i] = (0x20 + rand_next() % 0xc0) << 24 | (rand_next() & 0xffffff);
+}
+
+int bench_blend(void)
+{
+    static const struct
+    {
+        const char *name;
+        void (*make)(uint32_t *src);
+    } patterns[] = {
+        { "osd", make_osd },
+        { "alpha", make_translucent },
+    };
+    int failures = bench_failures, passes = bench_opts.quick ? 2 : 20, i;
+    uint32_t *src = malloc(BENCH_WIDTH * BENCH_HEIGHT * 4);
+    uint32_t *dst = malloc(BENCH_WIDTH * BENCH_HEIGHT * 4);
+
+    check_pixel();
+    check_row();
+
+    if (!src || !dst) {
+        CHECK(0, "blend: out of memory");
+        free(src);
+        free(dst);
+        return bench_failures - failures;
+    }
+
+    memset(dst, 0x40, BENCH_WIDTH * BENCH_HEIGHT * 4);
+    for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        double simd, scalar;
+
+        patterns[i].make(src);
+        simd = blend_rate(blend_rows_simd, dst, src, passes);
+        scalar = blend_rate(blend_rows_scalar, dst, src, passes);
+        printf("blend %-6s: %7.1f Mpixel/s, scalar %7.1f Mpixel/s, %ux%u\n",
+                patterns[i].name, simd, scalar, BENCH_WIDTH, BENCH_HEIGHT);
+    }
+
+    free(src);
+    free(dst);
+
+    return bench_failures - failures;
+}
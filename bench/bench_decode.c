@@ -0,0 +1,601 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "vdpau_private.h"
+#include "v4l2.h"
+
+/*
+ * Decode a canned stream through vdp_decoder_render and hand every
+ * frame to the client side: read back with get_bits, composited by the
+ * mixer and the GL presentation queue, or put on the overlay plane.
+ *
+ * With lag 0 each frame is consumed right after it was submitted, so
+ * client and hardware take turns. With lag n the client works n frames
+ * behind the decoder, like a player buffering ahead, and the hardware
+ * time hides behind the client's. With LAG_THREAD the client runs on a
+ * thread of its own, up to THREAD_DEPTH frames behind, and syncs and
+ * releases pictures while the next ones are being submitted.
+ */
+
+#define NUM_SURFACES 8
+#define NUM_OUTPUTS 3
+#define LAG_THREAD -1
+#define THREAD_DEPTH 4
+
+typedef enum
+{
+    MODE_GETBITS,
+    MODE_MIXER,
+    MODE_OVERLAY,
+} decode_mode_t;
+
+static const char *mode_names[] = {
+    [MODE_GETBITS] = "getbits",
+    [MODE_MIXER] = "mixer",
+    [MODE_OVERLAY] = "overlay",
+};
+
+typedef struct
+{
+    decode_mode_t mode;
+    const bench_stream_t *stream;
+
+    bench_decoder_t dec;
+    VdpVideoMixer mixer;
+    VdpOutputSurface outputs[NUM_OUTPUTS];
+    VdpPresentationQueueTarget target;
+    VdpPresentationQueue queue;
+
+    uint8_t *luma, *chroma;
+    uint32_t bad_stamps;
+
+    /* frames submitted and consumed, for the client thread */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint32_t decoded, consumed;
+} decode_ctx_t;
+
+typedef struct
+{
+    uint64_t time, cpu;
+    bench_allocs_t allocs;
+    mock_v4l2_stats_t v4l2;
+    mock_h264d_stats_t h264d;
+    mock_drm_stats_t drm;
+} snapshot_t;
+
+static void snapshot(snapshot_t *s)
+{
+    s->time = bench_now_ns();
+    s->cpu = bench_cpu_ns();
+    bench_allocs(&s->allocs);
+    mock_v4l2_stats(&s->v4l2);
+    mock_h264d_stats(&s->h264d);
+    mock_drm_stats(&s->drm);
+}
+
+static int decode_open(decode_ctx_t *ctx)
+{
+    const bench_stream_t *s = ctx->stream;
+    VdpStatus ret = VDP_STATUS_OK;
+    int i;
+
+    if (ctx->mode == MODE_OVERLAY)
+        setenv("OVERLAY", "1", 1);
+    if (bench_decoder_open(&ctx->dec, s, NUM_SURFACES) < 0)
+        ret = VDP_STATUS_ERROR;
+    unsetenv("OVERLAY");
+    if (ctx->dec.device == VDP_INVALID_HANDLE)
+        return -1;
+
+    if (ctx->mode == MODE_GETBITS) {
+        ctx->luma = malloc(s->width * s->height);
+        ctx->chroma = malloc(s->width * s->height / 2);
+        return ret != VDP_STATUS_OK || !ctx->luma || !ctx->chroma ? -1 : 0;
+    }
+
+    {
+        static const VdpVideoMixerParameter params[] = {
+            VDP_VIDEO_MIXER_PARAMETER_VIDEO_SURFACE_WIDTH,
+            VDP_VIDEO_MIXER_PARAMETER_VIDEO_SURFACE_HEIGHT,
+            VDP_VIDEO_MIXER_PARAMETER_CHROMA_TYPE,
+        };
+        uint32_t width = s->width, height = s->height;
+        VdpChromaType chroma = VDP_CHROMA_TYPE_420;
+        const void *values[] = { &width, &height, &chroma };
+
+        ret |= vdp_video_mixer_create(ctx->dec.device, 0, NULL, 3, params, values,
+                &ctx->mixer);
+    }
+    for (i = 0; i < NUM_OUTPUTS; i++)
+        ret |= vdp_output_surface_create(ctx->dec.device, VDP_RGBA_FORMAT_B8G8R8A8,
+                s->width, s->height, &ctx->outputs[i]);
+    ret |= vdp_presentation_queue_target_create_x11(ctx->dec.device, 1, &ctx->target);
+    ret |= vdp_presentation_queue_create(ctx->dec.device, ctx->target, &ctx->queue);
+
+    return ret != VDP_STATUS_OK ? -1 : 0;
+}
+
+static void decode_close(decode_ctx_t *ctx)
+{
+    int i;
+
+    if (ctx->queue)
+        vdp_presentation_queue_destroy(ctx->queue);
+    if (ctx->target)
+        vdp_presentation_queue_target_destroy(ctx->target);
+    for (i = 0; i < NUM_OUTPUTS; i++)
+        if (ctx->outputs[i])
+            vdp_output_surface_destroy(ctx->outputs[i]);
+    if (ctx->mixer)
+        vdp_video_mixer_destroy(ctx->mixer);
+    bench_decoder_close(&ctx->dec);
+    free(ctx->luma);
+    free(ctx->chroma);
+}
+
+static void decode_consume(decode_ctx_t *ctx, uint32_t frame)
+{
+    VdpVideoSurface surface = ctx->dec.surfaces[frame % NUM_SURFACES];
+
+    if (ctx->mode == MODE_GETBITS) {
+        void *data[2] = { ctx->luma, ctx->chroma };
+        uint32_t pitches[2] = { ctx->stream->width, ctx->stream->width };
+
+        vdp_video_surface_get_bits_y_cb_cr(surface, VDP_YCBCR_FORMAT_NV12,
+                data, pitches);
+        /* the mock hardware numbers its jobs from 1 */
+        if (mock_v4l2_stamp(ctx->luma) != frame + 1)
+            ctx->bad_stamps++;
+    } else {
+        VdpOutputSurface output = ctx->outputs[frame % NUM_OUTPUTS];
+        VdpTime time;
+
+        vdp_presentation_queue_block_until_surface_idle(ctx->queue, output, &time);
+        vdp_video_mixer_render(ctx->mixer, VDP_INVALID_HANDLE, NULL,
+                VDP_VIDEO_MIXER_PICTURE_STRUCTURE_FRAME, 0, NULL, surface,
+                0, NULL, NULL, output, NULL, NULL, 0, NULL);
+        vdp_presentation_queue_display(ctx->queue, output, 0, 0, 0);
+    }
+}
+
+static void *decode_client(void *arg)
+{
+    decode_ctx_t *ctx = arg;
+    uint32_t frame;
+
+    for (frame = 0; frame < ctx->stream->frame_count; frame++) {
+        pthread_mutex_lock(&ctx->mutex);
+        while (ctx->decoded <= frame)
+            pthread_cond_wait(&ctx->cond, &ctx->mutex);
+        pthread_mutex_unlock(&ctx->mutex);
+
+        decode_consume(ctx, frame);
+
+        pthread_mutex_lock(&ctx->mutex);
+        ctx->consumed = frame + 1;
+        pthread_cond_signal(&ctx->cond);
+        pthread_mutex_unlock(&ctx->mutex);
+    }
+
+    return NULL;
+}
+
+static void decode_run(const bench_stream_t *stream, decode_mode_t mode, int lag)
+{
+    decode_ctx_t ctx = {
+        .mode = mode,
+        .stream = stream,
+        .dec.device = VDP_INVALID_HANDLE,
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    uint32_t warmup = stream->frame_count / 10, frames, i;
+    int threaded = lag == LAG_THREAD;
+    pthread_t client;
+    snapshot_t start, a, b;
+    char label[16];
+    double n;
+
+    if (threaded)
+        snprintf(label, sizeof(label), "thread");
+    else
+        snprintf(label, sizeof(label), "lag %d", lag);
+
+    snapshot(&start);
+    if (decode_open(&ctx) < 0) {
+        CHECK(0, "%s %s: could not set up the decoder", stream->name, mode_names[mode]);
+        decode_close(&ctx);
+        return;
+    }
+    if (threaded && pthread_create(&client, NULL, decode_client, &ctx)) {
+        CHECK(0, "%s %s: could not start the client thread", stream->name, mode_names[mode]);
+        decode_close(&ctx);
+        return;
+    }
+    mock_v4l2_peak_reset();
+
+    for (i = 0; i < stream->frame_count + (threaded ? 0 : lag); i++) {
+        if (i == warmup)
+            snapshot(&a);
+
+        if (threaded) {
+            /* the client must be done with the surface before it is reused */
+            pthread_mutex_lock(&ctx.mutex);
+            while (i - ctx.consumed >= THREAD_DEPTH)
+                pthread_cond_wait(&ctx.cond, &ctx.mutex);
+            pthread_mutex_unlock(&ctx.mutex);
+        }
+
+        if (i < stream->frame_count) {
+            if (bench_opts.client_us)
+                bench_spin_us(bench_opts.client_us);
+            bench_decoder_render(&ctx.dec, i, ctx.dec.surfaces[i % NUM_SURFACES]);
+        }
+
+        if (threaded) {
+            pthread_mutex_lock(&ctx.mutex);
+            ctx.decoded = i + 1;
+            pthread_cond_signal(&ctx.cond);
+            pthread_mutex_unlock(&ctx.mutex);
+        } else if (i >= lag) {
+            decode_consume(&ctx, i - lag);
+        }
+    }
+    if (threaded)
+        pthread_join(client, NULL);
+
+    if (mode != MODE_GETBITS) {
+        VdpTime time;
+
+        vdp_presentation_queue_block_until_surface_idle(ctx.queue,
+                ctx.outputs[(stream->frame_count - 1) % NUM_OUTPUTS], &time);
+    }
+    snapshot(&b);
+    decode_close(&ctx);
+
+    frames = stream->frame_count - warmup;
+    n = frames;
+    printf("%-8s %-8s %s: %7.1f fps %7.3f ms CPU/frame %6.2f allocs/frame, "
+            "%llu SPS %llu PPS uploads, %d jobs queued at most\n",
+            stream->name, mode_names[mode], label,
+            n * 1e9 / (b.time - a.time), (b.cpu - a.cpu) / n / 1e6,
+            (b.allocs.allocs - a.allocs.allocs) / n,
+            (unsigned long long)(b.v4l2.sps_sets - a.v4l2.sps_sets),
+            (unsigned long long)(b.v4l2.pps_sets - a.v4l2.pps_sets),
+            b.v4l2.max_jobs_queued);
+
+    if (b.v4l2.overwrote_shown != a.v4l2.overwrote_shown ||
+        b.h264d.junk_nals != a.h264d.junk_nals ||
+        b.drm.rmfb_shown != a.drm.rmfb_shown ||
+        b.drm.busy_commits != a.drm.busy_commits)
+        printf("%-8s %-8s %s: %llu frames overwritten on screen, %llu junk NALs, "
+                "%llu framebuffers removed on screen, %llu commits while busy\n",
+                stream->name, mode_names[mode], label,
+                (unsigned long long)(b.v4l2.overwrote_shown - a.v4l2.overwrote_shown),
+                (unsigned long long)(b.h264d.junk_nals - a.h264d.junk_nals),
+                (unsigned long long)(b.drm.rmfb_shown - a.drm.rmfb_shown),
+                (unsigned long long)(b.drm.busy_commits - a.drm.busy_commits));
+
+    CHECK(b.v4l2.jobs - start.v4l2.jobs == stream->frame_count,
+            "%s %s %s: %llu of %u frames decoded", stream->name, mode_names[mode], label,
+            (unsigned long long)(b.v4l2.jobs - start.v4l2.jobs), stream->frame_count);
+    CHECK(!ctx.bad_stamps, "%s %s %s: %u frames read back with the wrong picture",
+            stream->name, mode_names[mode], label, ctx.bad_stamps);
+    CHECK(b.v4l2.double_queued == a.v4l2.double_queued, "%s %s %s: buffers queued twice",
+            stream->name, mode_names[mode], label);
+    CHECK(b.v4l2.stale_params == a.v4l2.stale_params, "%s %s %s: frames decoded with stale parameter sets",
+            stream->name, mode_names[mode], label);
+    CHECK(b.h264d.concurrent_calls == a.h264d.concurrent_calls, "%s %s %s: concurrent parser calls",
+            stream->name, mode_names[mode], label);
+    CHECK(b.h264d.junk_nals == a.h264d.junk_nals, "%s %s %s: NALs without payload handed to the parser",
+            stream->name, mode_names[mode], label);
+    CHECK(b.h264d.unneeded_nals == a.h264d.unneeded_nals, "%s %s %s: %llu SEI/AUD/filler NALs handed to the parser",
+            stream->name, mode_names[mode], label,
+            (unsigned long long)(b.h264d.unneeded_nals - a.h264d.unneeded_nals));
+    CHECK(b.h264d.duplicate_pictures == a.h264d.duplicate_pictures, "%s %s %s: picture handed to the parser twice",
+            stream->name, mode_names[mode], label);
+}
+
+/*
+ * Frames per second with the client depth frames behind the decoder, or
+ * with depth 0 waiting for each picture right after submitting it, as
+ * vdp_decoder_render() itself did before it returned early. Pictures
+ * are synced, not read back, so only the client's own work overlaps
+ * with the hardware.
+ */
+static double pipeline_fps(const bench_stream_t *stream, int depth, int client_us,
+                           int *max_jobs)
+{
+    decode_ctx_t ctx = { .mode = MODE_GETBITS, .stream = stream };
+    uint32_t warmup = stream->frame_count / 10, i;
+    snapshot_t a, b;
+
+    if (decode_open(&ctx) < 0) {
+        decode_close(&ctx);
+        return 0;
+    }
+
+    mock_v4l2_peak_reset();
+    for (i = 0; i < stream->frame_count + depth; i++) {
+        if (i == warmup)
+            snapshot(&a);
+
+        if (i < stream->frame_count)
+            bench_decoder_render(&ctx.dec, i, ctx.dec.surfaces[i % NUM_SURFACES]);
+        if (i >= depth) {
+            video_surface_ctx_t *vs = handle_get(ctx.dec.surfaces[(i - depth) % NUM_SURFACES],
+                    HANDLE_TYPE_VIDEO_SURFACE);
+
+            vs->dec->sync_picture(vs->dec, vs);
+        }
+        if (i < stream->frame_count)
+            bench_spin_us(client_us);
+    }
+    snapshot(&b);
+    decode_close(&ctx);
+
+    *max_jobs = b.v4l2.max_jobs_queued;
+    return (stream->frame_count - warmup) * 1e9 / (b.time - a.time);
+}
+
+/*
+ * Pipelined decoding against the synchronous baseline. The hardware
+ * decodes one job at a time, so a frame costs client + hw time when
+ * the two take turns and max(client, hw) when they overlap. With the
+ * client as busy as the hardware, the best case, that is at most twice
+ * the frame rate. The run has to come within 10% of that bound.
+ */
+static void pipeline_run(const bench_stream_t *stream)
+{
+    int hw_us = mock_v4l2.hw_us, client_us = hw_us, sync_jobs, jobs;
+    double sync, piped, bound = (double)(client_us + hw_us) / max(client_us, hw_us);
+
+    sync = pipeline_fps(stream, 0, client_us, &sync_jobs);
+    piped = pipeline_fps(stream, THREAD_DEPTH, client_us, &jobs);
+
+    printf("%-8s pipeline: %7.1f fps, %d jobs queued at most, synchronous %7.1f fps, "
+            "x%.2f of x%.2f possible with %d us client and hw time\n",
+            stream->name, piped, jobs, sync, sync ? piped / sync : 0, bound, hw_us);
+
+    CHECK(sync && piped, "%s pipeline: could not set up", stream->name);
+    CHECK(jobs >= 2, "%s pipeline: %d jobs queued at most", stream->name, jobs);
+    CHECK(sync && piped / sync >= 0.9 * bound, "%s pipeline: x%.2f over synchronous decoding, "
+            "expected x%.2f", stream->name, sync ? piped / sync : 0, 0.9 * bound);
+}
+
+typedef struct
+{
+    video_surface_ctx_t *vs;
+    uint64_t done_ns;
+} interrupt_ctx_t;
+
+static void *interrupt_sync(void *arg)
+{
+    interrupt_ctx_t *ictx = arg;
+
+    ictx->vs->dec->sync_picture(ictx->vs->dec, ictx->vs);
+    ictx->done_ns = bench_now_ns();
+
+    return NULL;
+}
+
+/*
+ * Destroy the decoder while a thread syncs a picture the hardware takes
+ * longer than kPollTimeoutMs for. The thread has to be woken up right
+ * away, not when its poll() times out.
+ */
+static void interrupt_run(const bench_stream_t *stream)
+{
+    decode_ctx_t ctx = { .mode = MODE_GETBITS, .stream = stream };
+    interrupt_ctx_t ictx = { NULL, 0 };
+    pthread_t thread;
+    uint64_t start;
+    double ms;
+
+    if (decode_open(&ctx) < 0) {
+        CHECK(0, "%s interrupt: could not set up", stream->name);
+        decode_close(&ctx);
+        return;
+    }
+
+    mock_v4l2.hw_us = (kPollTimeoutMs + 500) * 1000;
+    bench_decoder_render(&ctx.dec, 0, ctx.dec.surfaces[0]);
+    ictx.vs = handle_get(ctx.dec.surfaces[0], HANDLE_TYPE_VIDEO_SURFACE);
+    pthread_create(&thread, NULL, interrupt_sync, &ictx);
+
+    /* long enough for the thread to block in poll() */
+    bench_spin_us(50000);
+    start = bench_now_ns();
+    vdp_decoder_destroy(ctx.dec.decoder);
+    ctx.dec.decoder = 0;
+    pthread_join(thread, NULL);
+    ms = (ictx.done_ns - start) / 1e6;
+
+    /* the surface keeps the decoder until the stream is turned off */
+    decode_close(&ctx);
+    mock_v4l2.hw_us = 0;
+
+    printf("%-8s interrupt: sync returned %.2f ms after the decoder was destroyed\n",
+            stream->name, ms);
+    CHECK(ms < kPollTimeoutMs / 10, "%s interrupt: sync returned %.2f ms after the decoder "
+            "was destroyed", stream->name, ms);
+}
+
+/*
+ * Fail S_EXT_CTRLS or the input QBUF of one frame, the IDR frame that
+ * brings a new PPS version. The frame is lost, but the following ones
+ * must still be decoded with the parameter sets they refer to and land
+ * in the capture buffers their surfaces point at.
+ */
+static void failure_run(const bench_stream_t *stream, const char *label,
+                        int *fail, uint32_t failed)
+{
+    decode_ctx_t ctx = { .mode = MODE_GETBITS, .stream = stream };
+    uint32_t i, decoded = 0, wrong_status = 0;
+    snapshot_t a, b;
+
+    if (decode_open(&ctx) < 0) {
+        CHECK(0, "%s %s: could not set up", stream->name, label);
+        decode_close(&ctx);
+        return;
+    }
+
+    snapshot(&a);
+    /* both happen once per frame, for its last slice */
+    *fail = failed + 1;
+    for (i = 0; i < stream->frame_count; i++) {
+        VdpVideoSurface surface = ctx.dec.surfaces[i % NUM_SURFACES];
+        void *data[2] = { ctx.luma, ctx.chroma };
+        uint32_t pitches[2] = { stream->width, stream->width };
+        VdpStatus ret;
+
+        ret = bench_decoder_render(&ctx.dec, i, surface);
+        wrong_status += (ret == VDP_STATUS_OK) != (i != failed);
+        if (i == failed)
+            continue;
+
+        decoded++;
+        vdp_video_surface_get_bits_y_cb_cr(surface, VDP_YCBCR_FORMAT_NV12,
+                data, pitches);
+        if (mock_v4l2_stamp(ctx.luma) != decoded)
+            ctx.bad_stamps++;
+    }
+    *fail = 0;
+    snapshot(&b);
+    decode_close(&ctx);
+
+    printf("%-8s %s: %llu of %u frames decoded, %llu with stale parameter sets\n",
+            stream->name, label, (unsigned long long)(b.v4l2.jobs - a.v4l2.jobs),
+            stream->frame_count,
+            (unsigned long long)(b.v4l2.stale_params - a.v4l2.stale_params));
+
+    CHECK(b.v4l2.jobs - a.v4l2.jobs == stream->frame_count - 1,
+            "%s %s: %llu of %u frames decoded", stream->name, label,
+            (unsigned long long)(b.v4l2.jobs - a.v4l2.jobs), stream->frame_count - 1);
+    CHECK(b.v4l2.stale_params == a.v4l2.stale_params,
+            "%s %s: frames decoded with stale parameter sets", stream->name, label);
+    CHECK(!ctx.bad_stamps, "%s %s: %u frames read back with the wrong picture",
+            stream->name, label, ctx.bad_stamps);
+    CHECK(b.v4l2.double_queued == a.v4l2.double_queued, "%s %s: buffers queued twice",
+            stream->name, label);
+    CHECK(!wrong_status, "%s %s: %u frames with the wrong status, only the lost one fails",
+            stream->name, label, wrong_status);
+}
+
+/*
+ * More video surfaces than the decoder has capture buffers, each
+ * keeping the picture last decoded into it, as a client with a large
+ * surface pool does. The decoder has to take back the pictures the
+ * parser is done with instead of running out of buffers.
+ */
+static void surfaces_run(const bench_stream_t *stream, int count)
+{
+    decode_ctx_t ctx = { .mode = MODE_GETBITS, .stream = stream };
+    VdpVideoSurface *surfaces = calloc(count, sizeof(*surfaces));
+    uint32_t i, failed = 0;
+    snapshot_t a, b;
+    int n;
+
+    if (!surfaces || decode_open(&ctx) < 0) {
+        CHECK(0, "%s %d surfaces: could not set up", stream->name, count);
+        decode_close(&ctx);
+        free(surfaces);
+        return;
+    }
+    for (n = 0; n < count; n++)
+        if (vdp_video_surface_create(ctx.dec.device, VDP_CHROMA_TYPE_420,
+                    stream->width, stream->height, &surfaces[n]) != VDP_STATUS_OK)
+            break;
+
+    snapshot(&a);
+    for (i = 0; i < stream->frame_count && n == count; i++) {
+        VdpVideoSurface surface = surfaces[i % count];
+        void *data[2] = { ctx.luma, ctx.chroma };
+        uint32_t pitches[2] = { stream->width, stream->width };
+
+        if (bench_decoder_render(&ctx.dec, i, surface) != VDP_STATUS_OK)
+            failed++;
+        vdp_video_surface_get_bits_y_cb_cr(surface, VDP_YCBCR_FORMAT_NV12,
+                data, pitches);
+        if (mock_v4l2_stamp(ctx.luma) != i + 1)
+            ctx.bad_stamps++;
+    }
+    snapshot(&b);
+
+    while (n--)
+        vdp_video_surface_destroy(surfaces[n]);
+    decode_close(&ctx);
+    free(surfaces);
+
+    printf("%-8s %d surfaces: %llu of %u frames decoded, %u failed\n", stream->name, count,
+            (unsigned long long)(b.v4l2.jobs - a.v4l2.jobs), stream->frame_count, failed);
+
+    CHECK(b.v4l2.jobs - a.v4l2.jobs == stream->frame_count,
+            "%s %d surfaces: %llu of %u frames decoded", stream->name, count,
+            (unsigned long long)(b.v4l2.jobs - a.v4l2.jobs), stream->frame_count);
+    CHECK(!failed, "%s %d surfaces: %u frames failed to decode", stream->name, count, failed);
+    CHECK(!ctx.bad_stamps, "%s %d surfaces: %u frames read back with the wrong picture",
+            stream->name, count, ctx.bad_stamps);
+}
+
+int bench_decode(void)
+{
+    static const char *quick_streams[] = { "cif-sei", "1080p", NULL };
+    static const char *all_streams[] = { "1080p", "4k", "720p", "cif-sei", NULL };
+    static const int lags[] = { 0, 3, LAG_THREAD };
+    const char *one[] = { bench_opts.stream, NULL };
+    const char **names = bench_opts.stream ? one :
+        bench_opts.quick ? quick_streams : all_streams;
+    int failures = bench_failures;
+    int mode, l;
+
+    mock_v4l2.hw_us = bench_opts.quick ? 500 : bench_opts.hw_us;
+
+    for (; *names; names++) {
+        bench_stream_t stream;
+
+        if (bench_stream_open(&stream, *names,
+                    bench_opts.frames ? bench_opts.frames : bench_opts.quick ? 90 : 0) < 0) {
+            CHECK(0, "unknown stream %s", *names);
+            continue;
+        }
+
+        for (mode = MODE_GETBITS; mode <= MODE_OVERLAY; mode++)
+            for (l = 0; l < sizeof(lags) / sizeof(lags[0]); l++)
+                decode_run(&stream, mode, lags[l]);
+
+        bench_stream_close(&stream);
+    }
+
+    {
+        bench_stream_t stream;
+
+        /* long enough a hardware time that sleeping overshoots don't count */
+        mock_v4l2.hw_us = bench_opts.quick ? 2000 : bench_opts.hw_us;
+        if (bench_stream_open(&stream, "1080p", bench_opts.quick ? 60 : 300) == 0) {
+            pipeline_run(&stream);
+            bench_stream_close(&stream);
+        }
+    }
+
+    mock_v4l2.hw_us = 0;
+
+    {
+        bench_stream_t stream;
+
+        /* the fifth IDR, at frame 240, updates the PPS */
+        if (bench_stream_open(&stream, "1080p", 300) == 0) {
+            failure_run(&stream, "failed S_EXT_CTRLS", &mock_v4l2.fail_ext_ctrls, 240);
+            failure_run(&stream, "failed input QBUF", &mock_v4l2.fail_qbuf_input, 240);
+            /* a DPB-sized pool and then some, past kOutputBufferCnt */
+            surfaces_run(&stream, 28);
+            interrupt_run(&stream);
+            bench_stream_close(&stream);
+        }
+    }
+
+    return bench_failures - failures;
+}
@@ -0,0 +1,189 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "vdpau_private.h"
+
+/*
+ * Handle lookups racing with destruction and reuse of the same slots.
+ * Every thread creates handles for objects of its own type, publishes
+ * them and destroys them again, while looking up the handles the other
+ * threads published. A lookup may fail once the handle is gone, but it
+ * must never return an object created under another handle or of
+ * another type.
+ *
+ * Then the cost of each call with as many live handles as a busy
+ * player holds, looked up in random order.
+ */
+
+#define STRESS_THREADS 8
+#define STRESS_PUBLISHED 64
+#define LIVE_HANDLES 10000
+
+typedef struct
+{
+    int handle;         /* set once handle_create() returned */
+    int thread;
+} stress_obj_t;
+
+typedef struct
+{
+    int index;
+    handle_type_t type;
+    int iterations;
+    stress_obj_t *objs;
+    uint64_t hits, wrong;
+} stress_thread_t;
+
+static int published[STRESS_THREADS][STRESS_PUBLISHED];
+static stress_thread_t stress[STRESS_THREADS];
+
+static void *stress_thread(void *arg)
+{
+    stress_thread_t *t = arg;
+    uint32_t seed = t->index + 1;
+    int i;
+
+    for (i = 0; i < t->iterations; i++) {
+        stress_obj_t *obj = &t->objs[i];
+        int slot = i % STRESS_PUBLISHED, other, handle, j;
+
+        /* the oldest published handle goes, its slot is free for reuse */
+        handle = __atomic_exchange_n(&published[t->index][slot], 0, __ATOMIC_ACQ_REL);
+        if (handle)
+            handle_destroy(handle);
+
+        obj->thread = t->index;
+        handle = handle_create(obj, t->type);
+        __atomic_store_n(&obj->handle, handle, __ATOMIC_RELEASE);
+        __atomic_store_n(&published[t->index][slot], handle, __ATOMIC_RELEASE);
+
+        for (j = 0; j < 4; j++) {
+            stress_obj_t *found;
+            int h;
+
+            seed = seed * 1664525 + 1013904223;
+            other = (seed >> 8) % STRESS_THREADS;
+            h = __atomic_load_n(&published[other][(seed >> 16) % STRESS_PUBLISHED],
+                    __ATOMIC_ACQUIRE);
+            if (!h)
+                continue;
+
+            found = handle_get(h, stress[other].type);
+            if (!found)
+                continue;
+            t->hits++;
+
+            /* an object whose handle is not known yet can't be told apart */
+            handle = __atomic_load_n(&found->handle, __ATOMIC_ACQUIRE);
+            if ((handle && handle != h) || found->thread != other)
+                t->wrong++;
+        }
+    }
+
+    return NULL;
+}
+
+static void stress_run(int iterations)
+{
+    pthread_t threads[STRESS_THREADS];
+    uint64_t hits = 0, wrong = 0, start;
+    int i, j, started = 0;
+
+    start = bench_now_ns();
+    for (i = 0; i < STRESS_THREADS; i++) {
+        stress_thread_t *t = &stress[i];
+
+        t->index = i;
+        /* neighbours share slots but not types */
+        t->type = i & 1 ? HANDLE_TYPE_VIDEO_SURFACE : HANDLE_TYPE_OUTPUT_SURFACE;
+        t->iterations = iterations;
+        t->objs = calloc(iterations, sizeof(*t->objs));
+        t->hits = t->wrong = 0;
+    }
+    for (i = 0; i < STRESS_THREADS; i++) {
+        if (!stress[i].objs || pthread_create(&threads[i], NULL, stress_thread, &stress[i]))
+            break;
+        started++;
+    }
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (i = 0; i < STRESS_THREADS; i++) {
+        hits += stress[i].hits;
+        wrong += stress[i].wrong;
+        for (j = 0; j < STRESS_PUBLISHED; j++)
+            if (published[i][j])
+                handle_destroy(published[i][j]);
+        free(stress[i].objs);
+    }
+
+    printf("handles : %d threads, %d create/destroy each, %llu lookups found, %llu wrong, %.1f ms\n",
+            STRESS_THREADS, iterations, (unsigned long long)hits,
+            (unsigned long long)wrong, (bench_now_ns() - start) / 1e6);
+
+    CHECK(started == STRESS_THREADS, "handles: could not start the threads");
+    CHECK(!wrong, "handles: %llu lookups returned an object of another handle",
+            (unsigned long long)wrong);
+}
+
+static void live_run(int iterations)
+{
+    static int handles[LIVE_HANDLES], objs[LIVE_HANDLES];
+    uint64_t start, create_ns, get_ns, cycle_ns;
+    uint32_t seed = 1;
+    int i, wrong = 0, stale = 0, failed = 0;
+
+    start = bench_now_ns();
+    for (i = 0; i < LIVE_HANDLES; i++) {
+        handles[i] = handle_create(&objs[i], HANDLE_TYPE_OUTPUT_SURFACE);
+        failed += handles[i] == -1;
+    }
+    create_ns = bench_now_ns() - start;
+
+    start = bench_now_ns();
+    for (i = 0; i < iterations; i++) {
+        int n;
+
+        seed = seed * 1664525 + 1013904223;
+        n = (seed >> 8) % LIVE_HANDLES;
+        wrong += handle_get(handles[n], HANDLE_TYPE_OUTPUT_SURFACE) != &objs[n];
+    }
+    get_ns = bench_now_ns() - start;
+
+    /* a slot freed and taken again, the old handle must not find it */
+    start = bench_now_ns();
+    for (i = 0; i < iterations; i++) {
+        int n, old;
+
+        seed = seed * 1664525 + 1013904223;
+        n = (seed >> 8) % LIVE_HANDLES;
+        old = handles[n];
+        handle_destroy(old);
+        handles[n] = handle_create(&objs[n], HANDLE_TYPE_OUTPUT_SURFACE);
+        failed += handles[n] == -1;
+        stale += handle_get(old, HANDLE_TYPE_OUTPUT_SURFACE) != NULL;
+    }
+    cycle_ns = bench_now_ns() - start;
+
+    for (i = 0; i < LIVE_HANDLES; i++)
+        handle_destroy(handles[i]);
+
+    printf("handles : %d live, create %.1f ns, get %.1f ns, destroy+create %.1f ns\n",
+            LIVE_HANDLES, (double)create_ns / LIVE_HANDLES,
+            (double)get_ns / iterations, (double)cycle_ns / iterations);
+
+    CHECK(!failed, "handles: %d of the creates failed", failed);
+    CHECK(!wrong, "handles: %d lookups of live handles went wrong", wrong);
+    CHECK(!stale, "handles: %d destroyed handles still found", stale);
+}
+
+int bench_handles(void)
+{
+    int failures = bench_failures;
+
+    stress_run(bench_opts.quick ? 20000 : 200000);
+    live_run(bench_opts.quick ? 100000 : 10000000);
+
+    return bench_failures - failures;
+}
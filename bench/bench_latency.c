@@ -0,0 +1,73 @@
+#include <pthread.h>
+
+#include "bench.h"
+#include "latency.h"
+
+/*
+ * Latency histograms read and reset while samples keep landing, as a
+ * monitor polling VdpRockchipGetLatency with reset does during playback.
+ * Every sample has to show up in exactly one of the snapshots. Neither
+ * thread yields, so they are switched in the middle of each other.
+ */
+
+#define RECORD_STAGE VDP_ROCKCHIP_STAGE_ASSEMBLE
+
+typedef struct
+{
+    int samples;
+    int done;
+} record_ctx_t;
+
+static void *record_thread(void *arg)
+{
+    record_ctx_t *ctx = arg;
+    int i;
+
+    for (i = 0; i < ctx->samples; i++)
+        latency_record(RECORD_STAGE, i & 1023);
+    __atomic_store_n(&ctx->done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static void reset_run(int samples)
+{
+    record_ctx_t ctx = { .samples = samples };
+    VdpRockchipLatency l;
+    uint64_t counted = 0, resets = 0, start;
+    pthread_t thread;
+
+    /* whatever other suites left behind */
+    latency_get(RECORD_STAGE, 1, &l);
+
+    start = bench_now_ns();
+    if (pthread_create(&thread, NULL, record_thread, &ctx)) {
+        CHECK(0, "latency: could not start the recording thread");
+        return;
+    }
+    while (!__atomic_load_n(&ctx.done, __ATOMIC_ACQUIRE)) {
+        latency_get(RECORD_STAGE, 1, &l);
+        counted += l.count;
+        resets++;
+    }
+    pthread_join(thread, NULL);
+    latency_get(RECORD_STAGE, 1, &l);
+    counted += l.count;
+    resets++;
+
+    printf("latency : %d samples, %llu counted over %llu resets, %.1f ms\n",
+            samples, (unsigned long long)counted, (unsigned long long)resets,
+            (bench_now_ns() - start) / 1e6);
+
+    CHECK(counted == samples, "latency: %llu of %d samples counted across resets",
+            (unsigned long long)counted, samples);
+}
+
+int bench_latency(void)
+{
+    int failures = bench_failures;
+
+    reset_run(bench_opts.quick ? 200000 : 2000000);
+
+    return bench_failures - failures;
+}
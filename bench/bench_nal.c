@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "nal.h"
+
+/*
+ * nal_scan() against a byte by byte reference, on random input dense
+ * with zero bytes and on an Annex B stream with known start codes and
+ * emulation prevention bytes, then
+ * its throughput on slice data, where zero bytes are as rare as in any
+ * compressed payload.
+ */
+
+#define STREAM_SIZE (4 << 20)
+#define STREAM_NAL_SIZE (16 << 10)
+
+static uint32_t rand_state = 1;
+
+static uint32_t rand_next(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static void nal_scan_ref(const uint8_t *buf, size_t size, nal_scan_t *scan)
+{
+    size_t i;
+
+    scan->num_starts = 0;
+    scan->num_epbs = 0;
+    for (i = 0; i + 2 < size; i++) {
+        if (buf[i] || buf[i + 1])
+            continue;
+        if (buf[i + 2] == 1) {
+            scan->starts[scan->num_starts++] = i && !buf[i - 1] ? i - 1 : i;
+            if (scan->num_starts == NAL_MAX_STARTS)
+                return;
+            i += 2;
+        } else if (buf[i + 2] == 3) {
+            if (scan->num_epbs < NAL_MAX_EPBS)
+                scan->epbs[scan->num_epbs] = i + 2;
+            scan->num_epbs++;
+            i += 2;
+        }
+    }
+}
+
+/* index of the first offset that differs, -1 if none does */
+static int offsets_diff(const uint32_t *a, uint32_t num_a, const uint32_t *b, uint32_t num_b,
+                        uint32_t max)
+{
+    uint32_t i;
+
+    for (i = 0; i < num_a && i < num_b && i < max; i++)
+        if (a[i] != b[i])
+            return i;
+
+    return num_a == num_b ? -1 : (int)i;
+}
+
+static int scan_diff(const nal_scan_t *a, const nal_scan_t *b)
+{
+    return offsets_diff(a->starts, a->num_starts, b->starts, b->num_starts, NAL_MAX_STARTS);
+}
+
+static int epb_diff(const nal_scan_t *a, const nal_scan_t *b)
+{
+    return offsets_diff(a->epbs, a->num_epbs, b->epbs, b->num_epbs, NAL_MAX_EPBS);
+}
+
+static uint32_t start_at(const nal_scan_t *scan, int i)
+{
+    return i < scan->num_starts ? scan->starts[i] : UINT32_MAX;
+}
+
+static uint32_t epb_at(const nal_scan_t *scan, int i)
+{
+    return i < scan->num_epbs && i < NAL_MAX_EPBS ? scan->epbs[i] : UINT32_MAX;
+}
+
+/*
+ * Slice data with emulation prevention, no start code inside, at offset
+ * pos of the stream. The emulation prevention bytes go to expect.
+ */
+static size_t put_payload(uint8_t *buf, size_t pos, size_t size, nal_scan_t *expect)
+{
+    uint8_t *p = buf + pos;
+    size_t i, zeros = 0;
+
+    for (i = 0; i < size; i++) {
+        uint8_t b = rand_next();
+
+        /* a zero run that needs emulation prevention every KiB */
+        if (i % 1024 == 1000 || i % 1024 == 1001)
+            b = 0;
+        else if (i % 1024 == 1002)
+            b &= 3;
+
+        if (zeros >= 2 && b <= 3) {
+            /* nal_scan() stops at the last start code it can record */
+            if (expect->num_starts < NAL_MAX_STARTS && expect->num_epbs < NAL_MAX_EPBS)
+                expect->epbs[expect->num_epbs] = pos + i;
+            expect->num_epbs += expect->num_starts < NAL_MAX_STARTS;
+            p[i++] = 3;
+            zeros = 0;
+            if (i == size)
+                break;
+        }
+        p[i] = b;
+        zeros = b ? 0 : zeros + 1;
+    }
+    /* a trailing zero would belong to the next start code */
+    if (i && !p[i - 1])
+        p[i - 1] = 0x80;
+
+    return i;
+}
+
+/*
+ * An Annex B stream of NALs about nal_size bytes long, the first one
+ * and every fourth behind a four byte start code. Returns the size.
+ */
+static size_t make_stream(uint8_t *buf, size_t size, size_t nal_size, nal_scan_t *expect)
+{
+    size_t pos = 0;
+
+    expect->num_starts = 0;
+    expect->num_epbs = 0;
+    while (pos + 8 < size && expect->num_starts < NAL_MAX_STARTS) {
+        static const uint8_t start[] = { 0, 0, 0, 1 };
+        int long_start = !(expect->num_starts % 4);
+        size_t len = nal_size / 2 + rand_next() % nal_size;
+
+        expect->starts[expect->num_starts++] = pos;
+        memcpy(buf + pos, start + !long_start, 4 - !long_start);
+        pos += 4 - !long_start;
+        buf[pos++] = 0x65;
+        if (len > size - pos)
+            len = size - pos;
+        pos += put_payload(buf, pos, len, expect);
+    }
+
+    return pos;
+}
+
+static void check_random(void)
+{
+    static uint8_t buf[8192];
+    nal_scan_t *a = malloc(sizeof(*a)), *b = malloc(sizeof(*b));
+    int i, diff = -1, epb = -1;
+    size_t size = 0;
+
+    for (i = 0; i < 4000 && diff < 0 && epb < 0; i++) {
+        /* up to one byte in two is zero, ones and threes most of the rest */
+        uint32_t zero_mask = (1u << (1 + i % 6)) - 1;
+        size_t j;
+
+        size = i < 3000 ? rand_next() % 200 : rand_next() % sizeof(buf);
+        for (j = 0; j < size; j++) {
+            uint32_t r = rand_next();
+
+            buf[j] = !(r & zero_mask) ? 0 : (r >> 8) & 1 ? 1 : (r >> 9) & 1 ? 3 : r >> 16;
+        }
+        nal_scan(buf, size, a);
+        nal_scan_ref(buf, size, b);
+        diff = scan_diff(a, b);
+        epb = epb_diff(a, b);
+    }
+    CHECK(diff < 0, "nal_scan: start code %d at %u, expected at %u in %zu random bytes",
+            diff, start_at(a, diff), start_at(b, diff), size);
+    CHECK(epb < 0, "nal_scan: emulation prevention byte %d at %u, expected at %u in %zu random bytes",
+            epb, epb_at(a, epb), epb_at(b, epb), size);
+
+    free(a);
+    free(b);
+}
+
+static void check_stream(void)
+{
+    uint8_t *buf = malloc(1 << 20);
+    nal_scan_t *a = malloc(sizeof(*a)), *expect = malloc(sizeof(*expect));
+    size_t size;
+    int diff;
+
+    /* small NALs run into NAL_MAX_STARTS */
+    size = make_stream(buf, 1 << 20, 1024, expect);
+    nal_scan(buf, size, a);
+    diff = scan_diff(a, expect);
+    CHECK(diff < 0, "nal_scan: start code %d at %u, expected at %u in an Annex B stream",
+            diff, start_at(a, diff), start_at(expect, diff));
+    diff = epb_diff(a, expect);
+    CHECK(diff < 0, "nal_scan: emulation prevention byte %d at %u, expected at %u in an Annex B stream",
+            diff, epb_at(a, diff), epb_at(expect, diff));
+
+    free(buf);
+    free(a);
+    free(expect);
+}
+
+static double scan_rate(void (*scan)(const uint8_t *, size_t, nal_scan_t *),
+                        const uint8_t *buf, size_t size, nal_scan_t *out, int passes)
+{
+    uint64_t start;
+    int i;
+
+    start = bench_now_ns();
+    for (i = 0; i < passes; i++)
+        scan(buf, size, out);
+
+    return (double)size * passes / (bench_now_ns() - start);
+}
+
+int bench_nal(void)
+{
+    int failures = bench_failures, passes = bench_opts.quick ? 8 : 64;
+    uint8_t *buf = malloc(STREAM_SIZE);
+    nal_scan_t *a = malloc(sizeof(*a)), *b = malloc(sizeof(*b)), *expect = malloc(sizeof(*expect));
+    double fast, ref;
+    size_t size;
+    int diff;
+
+    check_random();
+    check_stream();
+
+    size = make_stream(buf, STREAM_SIZE, STREAM_NAL_SIZE, expect);
+    fast = scan_rate(nal_scan, buf, size, a, passes);
+    ref = scan_rate(nal_scan_ref, buf, size, b, passes);
+    printf("nal_scan: %6.2f GB/s, byte loop %6.2f GB/s, %u NALs, %u emulation prevention "
+            "bytes in %zu KiB\n", fast, ref, a->num_starts, a->num_epbs, size >> 10);
+    diff = scan_diff(a, expect);
+    CHECK(diff < 0, "nal_scan: start code %d at %u, expected at %u in slice data",
+            diff, start_at(a, diff), start_at(expect, diff));
+    diff = epb_diff(a, expect);
+    CHECK(diff < 0, "nal_scan: emulation prevention byte %d at %u, expected at %u in slice data",
+            diff, epb_at(a, diff), epb_at(expect, diff));
+
+    free(buf);
+    free(a);
+    free(b);
+    free(expect);
+
+    return bench_failures - failures;
+}
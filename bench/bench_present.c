@@ -0,0 +1,484 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <libdrm/drm_fourcc.h>
+
+#include "bench.h"
+#include "vdpau_private.h"
+
+/*
+ * Pictures queued for display ahead of time. The client decodes and
+ * mixes as fast as it can and queues every output surface a period
+ * after the previous one, so up to NUM_OUTPUTS - 1 pictures wait in the
+ * presentation queue while the decoder runs ahead.
+ *
+ * A full DPB leaves few capture buffers cycling through the driver,
+ * and the parser hands non-reference pictures back right after they
+ * were decoded. A buffer returned to the driver before its picture was
+ * shown is decoded into again and the wrong frame goes on screen.
+ *
+ * The decoder is destroyed while its last pictures are still queued,
+ * like a player tearing down at the end of a file, and the queue has
+ * to show them from buffers that are still valid.
+ *
+ * In overlay mode every capture buffer is registered as a framebuffer
+ * once. By the second half of the stream a frame costs one plane
+ * update, no import, AddFB or RmFB.
+ *
+ * Last, the overlay is closed over and over from the client thread
+ * while another thread keeps flipping a picture onto it, as the
+ * presentation thread does when a decoder goes away mid-stream.
+ *
+ * Separately, subtitles are redrawn on an OSD only surface every frame
+ * and only the tiles they touch may be uploaded. Without
+ * GL_EXT_unpack_subimage the uploads take whole rows, each of them once.
+ *
+ * Last, a dma-buf import is cached by fd and its fd closed behind the
+ * cache's back, the next buffer opened gets the same number and must be
+ * imported as itself.
+ */
+
+#define NUM_SURFACES 8
+#define NUM_OUTPUTS 8
+#define MAX_REFS 16
+#define PERIOD_US 2000
+
+typedef enum
+{
+    MODE_MIXER,
+    MODE_OVERLAY,
+} present_mode_t;
+
+static const char *mode_names[] = {
+    [MODE_MIXER] = "mixer",
+    [MODE_OVERLAY] = "overlay",
+};
+
+typedef struct
+{
+    uint64_t time;
+    mock_v4l2_stats_t v4l2;
+    mock_drm_stats_t drm;
+    mock_gl_stats_t gl;
+} snapshot_t;
+
+static void snapshot(snapshot_t *s)
+{
+    s->time = bench_now_ns();
+    mock_v4l2_stats(&s->v4l2);
+    mock_drm_stats(&s->drm);
+    mock_gl_stats(&s->gl);
+}
+
+static void present_run(const bench_stream_t *stream, present_mode_t mode)
+{
+    static const VdpVideoMixerParameter params[] = {
+        VDP_VIDEO_MIXER_PARAMETER_VIDEO_SURFACE_WIDTH,
+        VDP_VIDEO_MIXER_PARAMETER_VIDEO_SURFACE_HEIGHT,
+        VDP_VIDEO_MIXER_PARAMETER_CHROMA_TYPE,
+    };
+    uint32_t width = stream->width, height = stream->height, i;
+    VdpChromaType chroma = VDP_CHROMA_TYPE_420;
+    const void *values[] = { &width, &height, &chroma };
+    VdpDevice device;
+    VdpDecoder decoder = 0;
+    VdpVideoSurface surfaces[NUM_SURFACES] = { 0 };
+    VdpVideoMixer mixer = 0;
+    VdpOutputSurface outputs[NUM_OUTPUTS] = { 0 };
+    VdpPresentationQueueTarget target = 0;
+    VdpPresentationQueue queue = 0;
+    VdpStatus ret = VDP_STATUS_OK;
+    VdpTime start_time, time;
+    snapshot_t a, half, b;
+
+    snapshot(&a);
+
+    if (mode == MODE_OVERLAY)
+        setenv("OVERLAY", "1", 1);
+    device = bench_device_create();
+    unsetenv("OVERLAY");
+    if (device == VDP_INVALID_HANDLE) {
+        CHECK(0, "%s %s: could not create the device", stream->name, mode_names[mode]);
+        return;
+    }
+
+    ret |= vdp_decoder_create(device, VDP_DECODER_PROFILE_H264_HIGH,
+            stream->width, stream->height, MAX_REFS, &decoder);
+    for (i = 0; i < NUM_SURFACES; i++)
+        ret |= vdp_video_surface_create(device, VDP_CHROMA_TYPE_420,
+                stream->width, stream->height, &surfaces[i]);
+    ret |= vdp_video_mixer_create(device, 0, NULL, 3, params, values, &mixer);
+    for (i = 0; i < NUM_OUTPUTS; i++)
+        ret |= vdp_output_surface_create(device, VDP_RGBA_FORMAT_B8G8R8A8,
+                stream->width, stream->height, &outputs[i]);
+    ret |= vdp_presentation_queue_target_create_x11(device, 1, &target);
+    ret |= vdp_presentation_queue_create(device, target, &queue);
+    CHECK(ret == VDP_STATUS_OK, "%s %s: could not set up", stream->name, mode_names[mode]);
+
+    vdp_presentation_queue_get_time(queue, &start_time);
+    for (i = 0; ret == VDP_STATUS_OK && i < stream->frame_count; i++) {
+        const bench_frame_t *frame = &stream->frames[i];
+        VdpVideoSurface surface = surfaces[i % NUM_SURFACES];
+        VdpOutputSurface output = outputs[i % NUM_OUTPUTS];
+        VdpPictureInfoH264 info;
+
+        if (i == stream->frame_count / 2)
+            snapshot(&half);
+
+        bench_picture_info(&info, frame);
+        vdp_decoder_render(decoder, surface, (VdpPictureInfo *)&info,
+                frame->buffer_count, frame->buffers);
+
+        vdp_presentation_queue_block_until_surface_idle(queue, output, &time);
+        vdp_video_mixer_render(mixer, VDP_INVALID_HANDLE, NULL,
+                VDP_VIDEO_MIXER_PICTURE_STRUCTURE_FRAME, 0, NULL, surface,
+                0, NULL, NULL, output, NULL, NULL, 0, NULL);
+        vdp_presentation_queue_display(queue, output, 0, 0,
+                start_time + (i + 1) * PERIOD_US * 1000ULL);
+    }
+
+    /* the last pictures are still queued */
+    vdp_decoder_destroy(decoder);
+    vdp_presentation_queue_block_until_surface_idle(queue,
+            outputs[(stream->frame_count - 1) % NUM_OUTPUTS], &time);
+    snapshot(&b);
+
+    vdp_presentation_queue_destroy(queue);
+    vdp_presentation_queue_target_destroy(target);
+    for (i = 0; i < NUM_OUTPUTS; i++)
+        vdp_output_surface_destroy(outputs[i]);
+    vdp_video_mixer_destroy(mixer);
+    for (i = 0; i < NUM_SURFACES; i++)
+        vdp_video_surface_destroy(surfaces[i]);
+    vdp_device_destroy(device);
+
+    printf("%-8s %-8s: %7.1f fps shown, %llu wrong frames shown, %llu overwritten on screen, "
+            "%llu stale framebuffers committed, %llu stale imports\n",
+            stream->name, mode_names[mode],
+            stream->frame_count * 1e9 / (b.time - a.time),
+            (unsigned long long)(b.v4l2.wrong_frame_shown - a.v4l2.wrong_frame_shown),
+            (unsigned long long)(b.v4l2.overwrote_shown - a.v4l2.overwrote_shown),
+            (unsigned long long)(b.drm.bad_fb_commits - a.drm.bad_fb_commits),
+            (unsigned long long)(b.gl.bad_imports - a.gl.bad_imports));
+
+    CHECK(b.v4l2.jobs - a.v4l2.jobs == stream->frame_count,
+            "%s %s: %llu of %u frames decoded", stream->name, mode_names[mode],
+            (unsigned long long)(b.v4l2.jobs - a.v4l2.jobs), stream->frame_count);
+    CHECK(b.v4l2.wrong_frame_shown == a.v4l2.wrong_frame_shown,
+            "%s %s: capture buffers decoded into before they were shown",
+            stream->name, mode_names[mode]);
+    CHECK(b.v4l2.overwrote_shown == a.v4l2.overwrote_shown,
+            "%s %s: capture buffers decoded into while on screen",
+            stream->name, mode_names[mode]);
+    CHECK(b.drm.rmfb_shown == a.drm.rmfb_shown,
+            "%s %s: framebuffers removed while on screen", stream->name, mode_names[mode]);
+    CHECK(b.drm.bad_fb_commits == a.drm.bad_fb_commits && b.gl.bad_imports == a.gl.bad_imports,
+            "%s %s: pictures of a destroyed decoder presented", stream->name, mode_names[mode]);
+
+    if (mode == MODE_OVERLAY) {
+        uint64_t registered = b.drm.prime_imports - half.drm.prime_imports +
+                b.drm.addfb - half.drm.addfb + b.drm.rmfb - half.drm.rmfb;
+        uint64_t updates = b.drm.commits - half.drm.commits +
+                b.drm.setplane - half.drm.setplane;
+        uint64_t flips = b.drm.flips - half.drm.flips;
+
+        printf("%-8s fb      : %.2f kernel calls a frame, %llu imports, AddFB or RmFB "
+                "over the last %llu frames\n", stream->name,
+                flips ? (double)(registered + updates) / flips : 0,
+                (unsigned long long)registered, (unsigned long long)flips);
+
+        CHECK(!registered, "%s %s: %llu framebuffers registered or removed in steady state",
+                stream->name, mode_names[mode], (unsigned long long)registered);
+        CHECK(flips && updates <= flips, "%s %s: %llu plane updates for %llu frames",
+                stream->name, mode_names[mode], (unsigned long long)updates,
+                (unsigned long long)flips);
+    }
+}
+
+typedef struct
+{
+    device_ctx_t *dev;
+    uint32_t fb_id;
+    uint32_t width, height;
+    int count;
+} flip_ctx_t;
+
+static void *flip_client(void *arg)
+{
+    flip_ctx_t *ctx = arg;
+    VdpTime time;
+    int i;
+
+    for (i = 0; i < ctx->count; i++) {
+        /* reopen the overlay the other thread just closed */
+        pthread_mutex_lock(&ctx->dev->overlay.mutex);
+        ctx->dev->dsp_mode = OVERLAY_FULLSCREEN;
+        pthread_mutex_unlock(&ctx->dev->overlay.mutex);
+
+        render_overlay(ctx->dev, ctx->fb_id, 1, ctx->width, ctx->height, 0, 0);
+        overlay_wait_flip(ctx->dev, &time);
+    }
+
+    return NULL;
+}
+
+static void close_run(const bench_stream_t *stream, int count)
+{
+    static const VdpVideoMixerParameter params[] = {
+        VDP_VIDEO_MIXER_PARAMETER_VIDEO_SURFACE_WIDTH,
+        VDP_VIDEO_MIXER_PARAMETER_VIDEO_SURFACE_HEIGHT,
+        VDP_VIDEO_MIXER_PARAMETER_CHROMA_TYPE,
+    };
+    uint32_t width = stream->width, height = stream->height;
+    VdpChromaType chroma = VDP_CHROMA_TYPE_420;
+    const void *values[] = { &width, &height, &chroma };
+    VdpVideoSurface surface;
+    VdpVideoMixer mixer = 0;
+    VdpOutputSurface output = 0;
+    VdpStatus ret = VDP_STATUS_OK;
+    bench_decoder_t d;
+    video_surface_ctx_t *vs;
+    flip_ctx_t ctx = { .width = width, .height = height, .count = count };
+    pthread_t client;
+    snapshot_t a, b;
+    int i;
+
+    setenv("OVERLAY", "1", 1);
+    if (bench_decoder_open(&d, stream, 1) < 0)
+        ret = VDP_STATUS_ERROR;
+    unsetenv("OVERLAY");
+    if (d.device == VDP_INVALID_HANDLE) {
+        CHECK(0, "%s close: could not create the device", stream->name);
+        return;
+    }
+
+    surface = d.surfaces[0];
+    ret |= vdp_video_mixer_create(d.device, 0, NULL, 3, params, values, &mixer);
+    ret |= vdp_output_surface_create(d.device, VDP_RGBA_FORMAT_B8G8R8A8,
+            stream->width, stream->height, &output);
+
+    /* the mixer puts the picture into a framebuffer in overlay mode */
+    ret |= bench_decoder_render(&d, 0, surface);
+    ret |= vdp_video_mixer_render(mixer, VDP_INVALID_HANDLE, NULL,
+            VDP_VIDEO_MIXER_PICTURE_STRUCTURE_FRAME, 0, NULL, surface,
+            0, NULL, NULL, output, NULL, NULL, 0, NULL);
+
+    ctx.dev = handle_get(d.device, HANDLE_TYPE_DEVICE);
+    vs = handle_get(surface, HANDLE_TYPE_VIDEO_SURFACE);
+    ctx.fb_id = vs ? vs->fb_id : 0;
+    CHECK(ret == VDP_STATUS_OK && ctx.fb_id, "%s close: could not set up", stream->name);
+
+    if (ret == VDP_STATUS_OK && ctx.fb_id) {
+        snapshot(&a);
+        if (pthread_create(&client, NULL, flip_client, &ctx)) {
+            CHECK(0, "%s close: could not start the client thread", stream->name);
+        } else {
+            for (i = 0; i < count; i++) {
+                close_overlay(ctx.dev);
+                sched_yield();
+            }
+            pthread_join(client, NULL);
+        }
+        snapshot(&b);
+
+        printf("%-8s close   : %llu commits, %llu overlapping calls, %llu idle polls, "
+                "%llu busy commits\n", stream->name,
+                (unsigned long long)(b.drm.commits - a.drm.commits),
+                (unsigned long long)(b.drm.overlapping_calls - a.drm.overlapping_calls),
+                (unsigned long long)(b.drm.idle_polls - a.drm.idle_polls),
+                (unsigned long long)(b.drm.busy_commits - a.drm.busy_commits));
+
+        CHECK(b.drm.overlapping_calls == a.drm.overlapping_calls,
+                "%s close: plane updated from two threads at once", stream->name);
+        CHECK(b.drm.idle_polls == a.drm.idle_polls,
+                "%s close: waited for a flip event somebody else consumed", stream->name);
+        CHECK(b.drm.busy_commits == a.drm.busy_commits,
+                "%s close: commits while a flip was pending", stream->name);
+    }
+
+    vdp_output_surface_destroy(output);
+    vdp_video_mixer_destroy(mixer);
+    bench_decoder_close(&d);
+}
+
+/* 32 pixel tiles at 1080p, two lines of text and a wider one below */
+static const VdpRect osd_rects[] = {
+    { 320, 864, 480, 928 },
+    { 1440, 864, 1600, 928 },
+    { 800, 928, 1000, 960 },
+};
+
+#define OSD_WIDTH 1920
+#define OSD_HEIGHT 1080
+#define OSD_TILE 32
+
+static void osd_run(int subimage, int frames)
+{
+    const char *name = subimage ? "subimage" : "rows";
+    static uint32_t pixels[OSD_WIDTH * 64];
+    const void *data[] = { pixels };
+    uint32_t pitches[] = { OSD_WIDTH * 4 };
+    uint64_t bytes = 0, expect;
+    VdpDevice device;
+    VdpOutputSurface outputs[2] = { 0 };
+    VdpPresentationQueueTarget target = 0;
+    VdpPresentationQueue queue = 0;
+    VdpStatus ret = VDP_STATUS_OK;
+    VdpTime time;
+    snapshot_t a, b;
+    int i, j;
+
+    mock_gl.extensions = subimage ?
+            "GL_OES_EGL_image_external GL_EXT_unpack_subimage" : "GL_OES_EGL_image_external";
+    device = bench_device_create();
+    mock_gl.extensions = "GL_OES_EGL_image_external";
+    if (device == VDP_INVALID_HANDLE) {
+        CHECK(0, "osd %s: could not create the device", name);
+        return;
+    }
+
+    for (i = 0; i < 2; i++)
+        ret |= vdp_output_surface_create(device, VDP_RGBA_FORMAT_B8G8R8A8,
+                OSD_WIDTH, OSD_HEIGHT, &outputs[i]);
+    ret |= vdp_presentation_queue_target_create_x11(device, 1, &target);
+    ret |= vdp_presentation_queue_create(device, target, &queue);
+    CHECK(ret == VDP_STATUS_OK, "osd %s: could not set up", name);
+
+    for (i = 0; i < OSD_WIDTH * 64; i++)
+        pixels[i] = 0xc0f0f0f0;
+
+    snapshot(&a);
+    for (i = 0; ret == VDP_STATUS_OK && i < frames; i++) {
+        VdpOutputSurface output = outputs[i % 2];
+
+        vdp_presentation_queue_block_until_surface_idle(queue, output, &time);
+        for (j = 0; j < sizeof(osd_rects) / sizeof(osd_rects[0]); j++)
+            vdp_output_surface_put_bits_native(output, data, pitches, &osd_rects[j]);
+        vdp_presentation_queue_display(queue, output, 0, 0, 0);
+    }
+    /* the last surface was shown once the one before it is idle */
+    vdp_presentation_queue_block_until_surface_idle(queue, outputs[frames % 2], &time);
+    snapshot(&b);
+
+    vdp_presentation_queue_destroy(queue);
+    vdp_presentation_queue_target_destroy(target);
+    for (i = 0; i < 2; i++)
+        vdp_output_surface_destroy(outputs[i]);
+    vdp_device_destroy(device);
+
+    /* the tiles touched, or the rows of the band they span */
+    if (subimage) {
+        expect = 0;
+        for (j = 0; j < sizeof(osd_rects) / sizeof(osd_rects[0]); j++) {
+            const VdpRect *r = &osd_rects[j];
+            uint32_t x0 = r->x0 & ~(OSD_TILE - 1), x1 = (r->x1 + OSD_TILE - 1) & ~(OSD_TILE - 1);
+            uint32_t y0 = r->y0 & ~(OSD_TILE - 1), y1 = (r->y1 + OSD_TILE - 1) & ~(OSD_TILE - 1);
+
+            expect += (uint64_t)(x1 - x0) * (y1 - y0) * 4;
+        }
+    } else {
+        expect = (uint64_t)OSD_WIDTH * (960 - 864) * 4;
+    }
+    /* each surface is uploaded whole the first time */
+    expect = expect * (frames - 2) + 2ULL * OSD_WIDTH * OSD_HEIGHT * 4;
+    bytes = b.gl.tex_upload_bytes - a.gl.tex_upload_bytes;
+
+    printf("osd      %-8s: %llu uploads, %.1f KiB a frame, %llu KiB expected in total\n",
+            name, (unsigned long long)(b.gl.tex_uploads - a.gl.tex_uploads),
+            frames > 2 ? (bytes - 2.0 * OSD_WIDTH * OSD_HEIGHT * 4) / (frames - 2) / 1024 : 0,
+            (unsigned long long)expect >> 10);
+
+    CHECK(bytes == expect, "osd %s: %llu bytes uploaded, expected %llu", name,
+            (unsigned long long)bytes, (unsigned long long)expect);
+}
+
+static void import_run(int count)
+{
+    VdpDevice device = bench_device_create();
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
+    uint64_t stale = 0, reused = 0;
+    snapshot_t a, b;
+    int i;
+
+    if (!dev) {
+        CHECK(0, "import: could not create the device");
+        return;
+    }
+
+    snapshot(&a);
+    for (i = 0; i < count; i++) {
+        int fd = memfd_create("bench-import", MFD_CLOEXEC), next;
+        uint64_t created;
+
+        if (fd < 0 || ftruncate(fd, 64 * 64 * 4) < 0) {
+            CHECK(0, "import: could not create a buffer");
+            break;
+        }
+        gl_get_dmabuf_image(dev, fd, DRM_FORMAT_ARGB8888, 64, 64);
+        /* the same buffer again is a cache hit */
+        gl_get_dmabuf_image(dev, fd, DRM_FORMAT_ARGB8888, 64, 64);
+        close(fd);
+
+        next = memfd_create("bench-import", MFD_CLOEXEC);
+        if (next < 0 || ftruncate(next, 64 * 64 * 4) < 0) {
+            CHECK(0, "import: could not create a buffer");
+            break;
+        }
+        reused += next == fd;
+        snapshot(&b);
+        created = b.gl.images_created;
+        gl_get_dmabuf_image(dev, next, DRM_FORMAT_ARGB8888, 64, 64);
+        snapshot(&b);
+        stale += next == fd && b.gl.images_created == created;
+
+        gl_release_dmabuf_image(dev, next);
+        close(next);
+    }
+    snapshot(&b);
+    vdp_device_destroy(device);
+
+    printf("import   : %llu images for %d buffers, %llu fds reused, %llu stale images\n",
+            (unsigned long long)(b.gl.images_created - a.gl.images_created), 2 * count,
+            (unsigned long long)reused, (unsigned long long)stale);
+
+    CHECK(reused, "import: no fd was reused, nothing tested");
+    CHECK(!stale, "import: %llu buffers got the image of a closed one",
+            (unsigned long long)stale);
+    CHECK(b.gl.images_created - a.gl.images_created == 2 * count,
+            "import: %llu images for %d buffers",
+            (unsigned long long)(b.gl.images_created - a.gl.images_created), 2 * count);
+}
+
+int bench_present(void)
+{
+    const char *name = bench_opts.stream ? bench_opts.stream : "720p";
+    int failures = bench_failures;
+    bench_stream_t stream;
+    int mode;
+
+    if (bench_stream_open(&stream, name,
+                bench_opts.frames ? bench_opts.frames : bench_opts.quick ? 120 : 600) < 0) {
+        CHECK(0, "unknown stream %s", name);
+        return 1;
+    }
+
+    mock_v4l2.hw_us = 200;
+    mock_h264d.max_refs = MAX_REFS;
+
+    for (mode = MODE_MIXER; mode <= MODE_OVERLAY; mode++)
+        present_run(&stream, mode);
+
+    mock_h264d.max_refs = 4;
+    mock_v4l2.hw_us = 0;
+    close_run(&stream, bench_opts.quick ? 100 : 500);
+    bench_stream_close(&stream);
+
+    osd_run(0, bench_opts.quick ? 20 : 200);
+    osd_run(1, bench_opts.quick ? 20 : 200);
+    import_run(bench_opts.quick ? 20 : 200);
+
+    return bench_failures - failures;
+}
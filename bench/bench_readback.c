@@ -0,0 +1,401 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "vdpau_private.h"
+#include "yuv.h"
+
+/*
+ * Reading decoded pictures back to the client. yuv_nv12_read_rows() is
+ * checked against a byte by byte reference for NV12, YV12 and I420
+ * output, with odd widths, padded pitches and in bands, the way the
+ * workers split a picture. I420 is YV12 with the chroma planes swapped,
+ * which VDPAU has no format for but players convert to. Then
+ * get_bits_y_cb_cr on a decoded picture is checked against the pattern
+ * the mock hardware wrote and its throughput measured. Last, the time
+ * of every single call at 1080p and 4K, a player reading back to draw
+ * in software waits for each one.
+ */
+
+static uint32_t rand_state = 1;
+
+static uint32_t rand_next(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+typedef enum
+{
+    OUT_NV12,
+    OUT_YV12,
+    OUT_I420,
+} out_format_t;
+
+static const char *out_names[] = {
+    [OUT_NV12] = "NV12",
+    [OUT_YV12] = "YV12",
+    [OUT_I420] = "I420",
+};
+
+typedef struct
+{
+    uint32_t width, height;
+    uint32_t y_pitch, c_pitch;
+    uint8_t *planes[3];     /* Y, then U and V or UV */
+} picture_t;
+
+static int picture_alloc(picture_t *p, uint32_t width, uint32_t height, uint32_t pad)
+{
+    int i;
+
+    p->width = width;
+    p->height = height;
+    p->y_pitch = width + pad;
+    p->c_pitch = (width + 1) / 2 + pad;
+    p->planes[0] = malloc((size_t)p->y_pitch * height);
+    /* big enough for the UV plane of NV12 too */
+    for (i = 1; i < 3; i++)
+        p->planes[i] = malloc((size_t)(p->y_pitch + 1) * ((height + 1) / 2));
+
+    return p->planes[0] && p->planes[1] && p->planes[2] ? 0 : -1;
+}
+
+static void picture_free(picture_t *p)
+{
+    int i;
+
+    for (i = 0; i < 3; i++)
+        free(p->planes[i]);
+}
+
+static void picture_clear(picture_t *p)
+{
+    int i;
+
+    memset(p->planes[0], 0xee, (size_t)p->y_pitch * p->height);
+    for (i = 1; i < 3; i++)
+        memset(p->planes[i], 0xee, (size_t)(p->y_pitch + 1) * ((p->height + 1) / 2));
+}
+
+/* the planes yuv_nv12_read_rows() writes for a format */
+static void read_rows(const uint8_t *src, uint32_t src_pitch, uint32_t src_height,
+                      picture_t *p, out_format_t format, uint32_t y0, uint32_t y1)
+{
+    switch (format) {
+    case OUT_NV12:
+        yuv_nv12_read_rows(src, src_pitch, src_height, p->width, y0, y1,
+                p->planes[0], p->y_pitch, p->planes[1], p->y_pitch + 1, NULL, 0);
+        break;
+    case OUT_YV12:
+        /* planes[1] is V and planes[2] U, as get_bits hands them over */
+        yuv_nv12_read_rows(src, src_pitch, src_height, p->width, y0, y1,
+                p->planes[0], p->y_pitch, p->planes[2], p->c_pitch,
+                p->planes[1], p->c_pitch);
+        break;
+    case OUT_I420:
+        yuv_nv12_read_rows(src, src_pitch, src_height, p->width, y0, y1,
+                p->planes[0], p->y_pitch, p->planes[1], p->c_pitch,
+                p->planes[2], p->c_pitch);
+        break;
+    }
+}
+
+static void read_rows_ref(const uint8_t *src, uint32_t src_pitch, uint32_t src_height,
+                          picture_t *p, out_format_t format)
+{
+    const uint8_t *uv = src + (size_t)src_pitch * src_height;
+    uint8_t *u = p->planes[format == OUT_YV12 ? 2 : 1];
+    uint8_t *v = p->planes[format == OUT_YV12 ? 1 : 2];
+    uint32_t x, y;
+
+    for (y = 0; y < p->height; y++)
+        for (x = 0; x < p->width; x++)
+            p->planes[0][y * p->y_pitch + x] = src[y * src_pitch + x];
+
+    for (y = 0; y < (p->height + 1) / 2; y++)
+        for (x = 0; x < (p->width + 1) / 2; x++) {
+            const uint8_t *c = &uv[y * src_pitch + 2 * x];
+
+            if (format == OUT_NV12) {
+                p->planes[1][y * (p->y_pitch + 1) + 2 * x] = c[0];
+                p->planes[1][y * (p->y_pitch + 1) + 2 * x + 1] = c[1];
+            } else {
+                u[y * p->c_pitch + x] = c[0];
+                v[y * p->c_pitch + x] = c[1];
+            }
+        }
+}
+
+/* 0 if equal, else 1 + the plane that differs first */
+static int picture_diff(const picture_t *a, const picture_t *b)
+{
+    size_t size = (size_t)(a->y_pitch + 1) * ((a->height + 1) / 2);
+
+    if (memcmp(a->planes[0], b->planes[0], (size_t)a->y_pitch * a->height))
+        return 1;
+    if (memcmp(a->planes[1], b->planes[1], size))
+        return 2;
+    if (memcmp(a->planes[2], b->planes[2], size))
+        return 3;
+
+    return 0;
+}
+
+static void check_rows(void)
+{
+    static const uint32_t sizes[][2] = {
+        { 1, 2 }, { 2, 2 }, { 3, 5 }, { 17, 9 }, { 33, 18 }, { 63, 31 },
+        { 64, 64 }, { 65, 33 }, { 127, 17 }, { 321, 35 }, { 1920, 64 },
+    };
+    int s, f, pad, wrong = 0, wrong_bands = 0;
+    const char *first = NULL;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        for (pad = 0; pad < 2; pad++)
+            for (f = OUT_NV12; f <= OUT_I420; f++) {
+                uint32_t width = sizes[s][0], height = sizes[s][1];
+                /* coded pictures are wider and taller than shown */
+                uint32_t src_pitch = (width + 15) & ~15, src_height = (height + 15) & ~15;
+                uint8_t *src = malloc((size_t)src_pitch * src_height * 3 / 2);
+                picture_t out, ref;
+                uint32_t i, y;
+
+                if (!src || picture_alloc(&out, width, height, pad * 7) < 0 ||
+                    picture_alloc(&ref, width, height, pad * 7) < 0) {
+                    CHECK(0, "readback: out of memory");
+                    return;
+                }
+                for (i = 0; i < src_pitch * src_height * 3 / 2; i++)
+                    src[i] = rand_next();
+
+                picture_clear(&ref);
+                read_rows_ref(src, src_pitch, src_height, &ref, f);
+
+                picture_clear(&out);
+                read_rows(src, src_pitch, src_height, &out, f, 0, height);
+                if (picture_diff(&out, &ref)) {
+                    wrong++;
+                    first = first ? first : out_names[f];
+                }
+
+                /* in bands of an even number of rows, the last one short */
+                picture_clear(&out);
+                for (y = 0; y < height; y += 4)
+                    read_rows(src, src_pitch, src_height, &out, f, y,
+                            y + 4 < height ? y + 4 : height);
+                if (picture_diff(&out, &ref)) {
+                    wrong_bands++;
+                    first = first ? first : out_names[f];
+                }
+
+                picture_free(&out);
+                picture_free(&ref);
+                free(src);
+            }
+
+    CHECK(!wrong && !wrong_bands, "readback: %d pictures and %d banded pictures differ "
+            "from the reference, first in %s", wrong, wrong_bands, first);
+}
+
+/* a surface with the pattern the mock hardware paints for its first job */
+static int readback_open(bench_decoder_t *ctx, const bench_stream_t *stream)
+{
+    if (bench_decoder_open(ctx, stream, 1) < 0)
+        return -1;
+
+    return bench_decoder_render(ctx, 0, ctx->surfaces[0]) == VDP_STATUS_OK ? 0 : -1;
+}
+
+static VdpStatus get_bits(bench_decoder_t *ctx, picture_t *p, out_format_t format)
+{
+    void *data[3] = { p->planes[0], p->planes[1], p->planes[2] };
+    uint32_t pitches[3] = { p->y_pitch, p->c_pitch, p->c_pitch };
+
+    if (format == OUT_NV12)
+        pitches[1] = p->y_pitch + 1;
+
+    return vdp_video_surface_get_bits_y_cb_cr(ctx->surfaces[0],
+            format == OUT_NV12 ? VDP_YCBCR_FORMAT_NV12 : VDP_YCBCR_FORMAT_YV12,
+            data, pitches);
+}
+
+/* pixels that differ from what the mock hardware wrote for frame 1 */
+static uint64_t check_pattern(const picture_t *p, out_format_t format)
+{
+    uint64_t wrong = 0;
+    uint32_t x, y;
+
+    for (y = 0; y < p->height; y++)
+        for (x = 0; x < p->width; x++)
+            wrong += p->planes[0][y * p->y_pitch + x] != mock_v4l2_pixel(1, 0, x, y);
+
+    for (y = 0; y < p->height / 2; y++)
+        for (x = 0; x < p->width / 2; x++) {
+            uint8_t u = mock_v4l2_pixel(1, 1, 2 * x, y);
+            uint8_t v = mock_v4l2_pixel(1, 1, 2 * x + 1, y);
+
+            if (format == OUT_NV12)
+                wrong += p->planes[1][y * (p->y_pitch + 1) + 2 * x] != u ||
+                         p->planes[1][y * (p->y_pitch + 1) + 2 * x + 1] != v;
+            else
+                wrong += p->planes[2][y * p->c_pitch + x] != u ||
+                         p->planes[1][y * p->c_pitch + x] != v;
+        }
+
+    return wrong;
+}
+
+static void getbits_run(const bench_stream_t *stream, int passes)
+{
+    bench_decoder_t ctx;
+    picture_t p;
+    int f, i;
+
+    mock_v4l2.fill = 1;
+    if (readback_open(&ctx, stream) < 0 ||
+        picture_alloc(&p, stream->width, stream->height, 0) < 0) {
+        CHECK(0, "%s readback: could not set up", stream->name);
+        mock_v4l2.fill = 0;
+        bench_decoder_close(&ctx);
+        return;
+    }
+
+    for (f = OUT_NV12; f <= OUT_YV12; f++) {
+        VdpStatus ret;
+        uint64_t wrong, start;
+        double ns;
+
+        picture_clear(&p);
+        ret = get_bits(&ctx, &p, f);
+        wrong = check_pattern(&p, f);
+
+        start = bench_now_ns();
+        for (i = 0; i < passes && ret == VDP_STATUS_OK; i++)
+            get_bits(&ctx, &p, f);
+        ns = (double)(bench_now_ns() - start) / passes;
+
+        printf("%-8s %s    : %6.2f GB/s, %.2f ms a picture, %llu pixels wrong\n",
+                stream->name, out_names[f],
+                stream->width * stream->height * 1.5 / ns, ns / 1e6,
+                (unsigned long long)wrong);
+
+        CHECK(ret == VDP_STATUS_OK, "%s %s: get_bits failed", stream->name, out_names[f]);
+        CHECK(!wrong, "%s %s: %llu pixels differ from the decoded picture",
+                stream->name, out_names[f], (unsigned long long)wrong);
+    }
+
+    picture_free(&p);
+    bench_decoder_close(&ctx);
+    mock_v4l2.fill = 0;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void latency_run(const bench_stream_t *stream, int calls)
+{
+    uint64_t *ns = malloc(calls * sizeof(*ns));
+    bench_decoder_t ctx;
+    picture_t p;
+    int f, i;
+
+    if (readback_open(&ctx, stream) < 0 || !ns ||
+        picture_alloc(&p, stream->width, stream->height, 0) < 0) {
+        CHECK(0, "%s readback: could not set up", stream->name);
+        free(ns);
+        bench_decoder_close(&ctx);
+        return;
+    }
+
+    for (f = OUT_NV12; f <= OUT_YV12; f++) {
+        int failed = 0;
+
+        for (i = 0; i < calls; i++) {
+            uint64_t start = bench_now_ns();
+
+            failed += get_bits(&ctx, &p, f) != VDP_STATUS_OK;
+            ns[i] = bench_now_ns() - start;
+        }
+        qsort(ns, calls, sizeof(*ns), compare_ns);
+
+        printf("%-8s %s    : %d calls, min %.2f p50 %.2f p99 %.2f max %.2f ms\n",
+                stream->name, out_names[f], calls, ns[0] / 1e6, ns[calls / 2] / 1e6,
+                ns[calls * 99 / 100] / 1e6, ns[calls - 1] / 1e6);
+
+        CHECK(!failed, "%s %s: %d of %d get_bits calls failed", stream->name,
+                out_names[f], failed, calls);
+    }
+
+    picture_free(&p);
+    bench_decoder_close(&ctx);
+    free(ns);
+}
+
+/* the same conversions without the library around them, single threaded */
+static void rows_rate(uint32_t width, uint32_t height, int passes)
+{
+    uint32_t src_pitch = width, src_height = (height + 15) & ~15;
+    uint8_t *src = malloc((size_t)src_pitch * src_height * 3 / 2);
+    picture_t p;
+    int f, i;
+
+    if (!src || picture_alloc(&p, width, height, 0) < 0) {
+        CHECK(0, "readback: out of memory");
+        free(src);
+        return;
+    }
+    memset(src, 0x80, (size_t)src_pitch * src_height * 3 / 2);
+
+    for (f = OUT_NV12; f <= OUT_I420; f++) {
+        uint64_t start = bench_now_ns();
+
+        for (i = 0; i < passes; i++)
+            read_rows(src, src_pitch, src_height, &p, f, 0, height);
+
+        printf("rows     %s    : %6.2f GB/s at %ux%u\n", out_names[f],
+                (double)width * height * 1.5 * passes / (bench_now_ns() - start),
+                width, height);
+    }
+
+    picture_free(&p);
+    free(src);
+}
+
+int bench_readback(void)
+{
+    static const char *latency_streams[] = { "1080p", "4k", NULL };
+    const char *name = bench_opts.stream ? bench_opts.stream : "1080p";
+    int failures = bench_failures, passes = bench_opts.quick ? 4 : 100, i;
+    bench_stream_t stream;
+
+    check_rows();
+
+    if (bench_stream_open(&stream, name, 1) < 0) {
+        CHECK(0, "unknown stream %s", name);
+        return bench_failures - failures;
+    }
+    getbits_run(&stream, passes);
+    rows_rate(stream.width, stream.height, passes);
+    bench_stream_close(&stream);
+
+    for (i = 0; latency_streams[i]; i++) {
+        name = bench_opts.stream ? bench_opts.stream : latency_streams[i];
+        if (bench_stream_open(&stream, name, 1) < 0) {
+            CHECK(0, "unknown stream %s", name);
+            break;
+        }
+        latency_run(&stream, bench_opts.quick ? 16 : 500);
+        bench_stream_close(&stream);
+        if (bench_opts.stream)
+            break;
+    }
+
+    return bench_failures - failures;
+}
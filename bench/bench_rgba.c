@@ -0,0 +1,173 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "vdpau_private.h"
+
+/*
+ * RGBA surface storage. The same OSD frame, a clear to white, a blended
+ * output surface, a bitmap and a put_bits rectangle, is composited into
+ * surfaces allocated with malloc and with memfd, the mappable stand-in
+ * for dma-bufs. The pixels have to match, memfd surfaces must really be
+ * memfd backed and their fds closed on destroy.
+ */
+
+#define RGBA_WIDTH 1920
+#define RGBA_HEIGHT 1080
+
+static uint32_t rand_state = 1;
+
+static uint32_t rand_next(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static const char *alloc_name(rgba_alloc_type_t type)
+{
+    return type == RGBA_ALLOC_MEMFD ? "memfd" : "malloc";
+}
+
+static rgba_surface_t *surface_rgba(uint32_t handle, handle_type_t type)
+{
+    if (type == HANDLE_TYPE_BITMAP_SURFACE) {
+        bitmap_surface_ctx_t *bitmap = handle_get(handle, type);
+
+        return bitmap ? &bitmap->rgba : NULL;
+    } else {
+        output_surface_ctx_t *out = handle_get(handle, type);
+
+        return out ? &out->rgba : NULL;
+    }
+}
+
+static void compose_frame(VdpOutputSurface out, VdpOutputSurface src,
+                          VdpBitmapSurface bitmap, const uint32_t *pixels)
+{
+    static const VdpRect video = { 0, 0, RGBA_WIDTH, RGBA_HEIGHT * 3 / 4 };
+    static const VdpRect subtitle = { 320, RGBA_HEIGHT - 160, RGBA_WIDTH - 320, RGBA_HEIGHT - 40 };
+    static const VdpRect logo = { RGBA_WIDTH - 200, 40, RGBA_WIDTH - 72, 104 };
+    const void *data[] = { pixels };
+    uint32_t pitches[] = { RGBA_WIDTH * 4 };
+
+    vdp_output_surface_render_output_surface(out, NULL, VDP_INVALID_HANDLE,
+            NULL, NULL, NULL, 0);
+    vdp_output_surface_render_output_surface(out, &video, src, NULL, NULL, NULL, 0);
+    vdp_output_surface_render_bitmap_surface(out, &subtitle, bitmap, NULL, NULL, NULL, 0);
+    vdp_output_surface_put_bits_native(out, data, pitches, &logo);
+}
+
+/* composite with surfaces of one allocator, the result goes to frame */
+static void compose_run(VdpDevice device, rgba_alloc_type_t type, const uint32_t *pixels,
+                        uint32_t *frame, int passes)
+{
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
+    rgba_alloc_type_t saved = dev->rgba_alloc;
+    const void *data[] = { pixels };
+    uint32_t pitches[] = { RGBA_WIDTH * 4 };
+    VdpOutputSurface out = VDP_INVALID_HANDLE, src = VDP_INVALID_HANDLE;
+    VdpBitmapSurface bitmap = VDP_INVALID_HANDLE;
+    VdpStatus ret = VDP_STATUS_OK;
+    rgba_surface_t *rgba[3];
+    int fds[3], closed = 0, i;
+    uint64_t start;
+
+    /* the device picked the allocator from VDPAU_RGBA_ALLOC */
+    dev->rgba_alloc = type;
+    ret |= vdp_output_surface_create(device, VDP_RGBA_FORMAT_B8G8R8A8,
+            RGBA_WIDTH, RGBA_HEIGHT, &out);
+    ret |= vdp_output_surface_create(device, VDP_RGBA_FORMAT_B8G8R8A8,
+            RGBA_WIDTH, RGBA_HEIGHT, &src);
+    ret |= vdp_bitmap_surface_create(device, VDP_RGBA_FORMAT_B8G8R8A8,
+            RGBA_WIDTH, RGBA_HEIGHT, VDP_TRUE, &bitmap);
+    dev->rgba_alloc = saved;
+
+    if (ret != VDP_STATUS_OK) {
+        CHECK(0, "rgba %s: could not create the surfaces", alloc_name(type));
+        goto out;
+    }
+
+    rgba[0] = surface_rgba(out, HANDLE_TYPE_OUTPUT_SURFACE);
+    rgba[1] = surface_rgba(src, HANDLE_TYPE_OUTPUT_SURFACE);
+    rgba[2] = surface_rgba(bitmap, HANDLE_TYPE_BITMAP_SURFACE);
+    for (i = 0; i < 3; i++) {
+        fds[i] = rgba[i]->buffer.fd;
+        CHECK(rgba[i]->buffer.type == type, "rgba %s: surface %d fell back to %s",
+                alloc_name(type), i, alloc_name(rgba[i]->buffer.type));
+        CHECK((fds[i] >= 0) == (type == RGBA_ALLOC_MEMFD), "rgba %s: surface %d has fd %d",
+                alloc_name(type), i, fds[i]);
+    }
+
+    vdp_output_surface_put_bits_native(src, data, pitches, NULL);
+    vdp_bitmap_surface_put_bits_native(bitmap, data, pitches, NULL);
+
+    start = bench_now_ns();
+    for (i = 0; i < passes; i++)
+        compose_frame(out, src, bitmap, pixels);
+
+    printf("rgba %-6s: %6.2f ms a frame, %ux%u\n", alloc_name(type),
+            (bench_now_ns() - start) / 1e6 / passes, RGBA_WIDTH, RGBA_HEIGHT);
+
+    rgba_buffer_sync(&rgba[0]->buffer, 0);
+    memcpy(frame, rgba[0]->data, RGBA_WIDTH * RGBA_HEIGHT * 4);
+    rgba_buffer_sync(&rgba[0]->buffer, 1);
+
+out:
+    if (bitmap != VDP_INVALID_HANDLE)
+        vdp_bitmap_surface_destroy(bitmap);
+    if (src != VDP_INVALID_HANDLE)
+        vdp_output_surface_destroy(src);
+    if (out != VDP_INVALID_HANDLE)
+        vdp_output_surface_destroy(out);
+
+    if (ret != VDP_STATUS_OK)
+        return;
+
+    /* nothing else opened files since, the numbers can't be taken again */
+    for (i = 0; i < 3; i++)
+        closed += fds[i] < 0 || fcntl(fds[i], F_GETFD) < 0;
+    CHECK(closed == 3, "rgba %s: %d of 3 surfaces left their fd open",
+            alloc_name(type), 3 - closed);
+}
+
+int bench_rgba(void)
+{
+    int failures = bench_failures, passes = bench_opts.quick ? 2 : 50, wrong = 0, i;
+    uint32_t *pixels = malloc(RGBA_WIDTH * RGBA_HEIGHT * 4);
+    uint32_t *heap = malloc(RGBA_WIDTH * RGBA_HEIGHT * 4);
+    uint32_t *memfd = malloc(RGBA_WIDTH * RGBA_HEIGHT * 4);
+    VdpDevice device = bench_device_create();
+
+    if (!pixels || !heap || !memfd || device == VDP_INVALID_HANDLE) {
+        CHECK(0, "rgba: could not set up");
+        goto out;
+    }
+
+    /* clear, opaque and translucent pixels */
+    for (i = 0; i < RGBA_WIDTH * RGBA_HEIGHT; i++) {
+        uint32_t r = rand_next(), a = r % 3 == 0 ? 0 : r % 3 == 1 ? 0xff : (r >> 8) & 0xff;
+
+        pixels[i] = a << 24 | (rand_next() & 0xffffff);
+    }
+    memset(heap, 0, RGBA_WIDTH * RGBA_HEIGHT * 4);
+    memset(memfd, 0xff, RGBA_WIDTH * RGBA_HEIGHT * 4);
+
+    compose_run(device, RGBA_ALLOC_MALLOC, pixels, heap, passes);
+    compose_run(device, RGBA_ALLOC_MEMFD, pixels, memfd, passes);
+
+    for (i = 0; i < RGBA_WIDTH * RGBA_HEIGHT; i++)
+        wrong += heap[i] != memfd[i];
+    CHECK(!wrong, "rgba: %d pixels differ between malloc and memfd surfaces", wrong);
+
+out:
+    if (device != VDP_INVALID_HANDLE)
+        vdp_device_destroy(device);
+    free(pixels);
+    free(heap);
+    free(memfd);
+
+    return bench_failures - failures;
+}
@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "vdpau_private.h"
+#include "rgba.h"
+
+/*
+ * Scaling of the worker pool with its size. The pool is sized once per
+ * process, so the suite runs itself again with VDPAU_THREADS=1..N and
+ * collects one line from each run: a full screen fill and OSD blend at
+ * 4K and a 4K readback, each timed per call. The composited surface has
+ * to be the source blended over white, the same whatever the number of
+ * threads.
+ *
+ * With VDPAU_THREADS already set the suite measures just that size.
+ */
+
+#define THREADS_WIDTH 3840
+#define THREADS_HEIGHT 2160
+#define THREADS_MAX 8
+
+typedef struct
+{
+    double fill_ms, blit_ms, readback_ms;
+    uint32_t wrong, sum;
+} threads_result_t;
+
+/*
+ * get_bits_native is not implemented for output surfaces, the pixels
+ * are read where the library keeps them. Returns the pixels that are
+ * not src blended over white, and a checksum of all of them.
+ */
+static uint32_t check_blend(VdpOutputSurface surface, const uint32_t *src, uint32_t *sum)
+{
+    output_surface_ctx_t *out = handle_get(surface, HANDLE_TYPE_OUTPUT_SURFACE);
+    const uint32_t *pixels = out->rgba.data;
+    uint32_t wrong = 0;
+    int i;
+
+    *sum = 0;
+    rgba_buffer_sync(&out->rgba.buffer, 0);
+    for (i = 0; i < THREADS_WIDTH * THREADS_HEIGHT; i++) {
+        wrong += pixels[i] != rgba_blend_pixel(src[i], 0xffffffff);
+        *sum = *sum * 31 + pixels[i];
+    }
+    rgba_buffer_sync(&out->rgba.buffer, 1);
+
+    return wrong;
+}
+
+static double time_ms(uint64_t start, int passes)
+{
+    return (bench_now_ns() - start) / 1e6 / passes;
+}
+
+/* one pool size, the numbers of this process */
+static int threads_measure(threads_result_t *r, int passes)
+{
+    uint32_t *pixels = malloc(THREADS_WIDTH * THREADS_HEIGHT * 4);
+    const void *data[] = { pixels };
+    uint32_t pitches[] = { THREADS_WIDTH * 4 };
+    VdpOutputSurface dst = 0, src = 0;
+    VdpVideoSurface surface;
+    VdpStatus ret = VDP_STATUS_OK;
+    bench_stream_t stream;
+    bench_decoder_t d;
+    uint64_t start;
+    int i;
+
+    if (!pixels || bench_stream_open(&stream, "4k", 1) < 0) {
+        free(pixels);
+        return -1;
+    }
+
+    if (bench_decoder_open(&d, &stream, 1) < 0)
+        ret = VDP_STATUS_ERROR;
+    surface = d.surfaces[0];
+    ret |= vdp_output_surface_create(d.device, VDP_RGBA_FORMAT_B8G8R8A8,
+            THREADS_WIDTH, THREADS_HEIGHT, &dst);
+    ret |= vdp_output_surface_create(d.device, VDP_RGBA_FORMAT_B8G8R8A8,
+            THREADS_WIDTH, THREADS_HEIGHT, &src);
+
+    if (ret == VDP_STATUS_OK) {
+        /* clear, opaque and translucent pixels, the same in every run */
+        for (i = 0; i < THREADS_WIDTH * THREADS_HEIGHT; i++) {
+            uint32_t alpha = (i / 7) % 3 == 0 ? 0 : (i / 7) % 3 == 1 ? 0xff : i % 256;
+
+            pixels[i] = alpha << 24 | ((i * 2654435761u) & 0xffffff);
+        }
+        ret |= vdp_output_surface_put_bits_native(src, data, pitches, NULL);
+        ret |= bench_decoder_render(&d, 0, surface);
+    }
+
+    if (ret == VDP_STATUS_OK) {
+        void *planes[3] = { pixels, (uint8_t *)pixels + stream.width * stream.height,
+                (uint8_t *)pixels + stream.width * stream.height * 5 / 4 };
+        uint32_t plane_pitches[3] = { stream.width, stream.width / 2, stream.width / 2 };
+
+        start = bench_now_ns();
+        for (i = 0; i < passes; i++)
+            vdp_output_surface_render_output_surface(dst, NULL, VDP_INVALID_HANDLE,
+                    NULL, NULL, NULL, 0);
+        r->fill_ms = time_ms(start, passes);
+
+        start = bench_now_ns();
+        for (i = 0; i < passes; i++)
+            vdp_output_surface_render_output_surface(dst, NULL, src, NULL, NULL, NULL, 0);
+        r->blit_ms = time_ms(start, passes);
+
+        /* the blend above went over itself, once over white to check */
+        vdp_output_surface_render_output_surface(dst, NULL, VDP_INVALID_HANDLE,
+                NULL, NULL, NULL, 0);
+        vdp_output_surface_render_output_surface(dst, NULL, src, NULL, NULL, NULL, 0);
+        r->wrong = check_blend(dst, pixels, &r->sum);
+
+        start = bench_now_ns();
+        for (i = 0; i < passes; i++)
+            vdp_video_surface_get_bits_y_cb_cr(surface, VDP_YCBCR_FORMAT_YV12,
+                    planes, plane_pitches);
+        r->readback_ms = time_ms(start, passes);
+    }
+
+    if (src)
+        vdp_output_surface_destroy(src);
+    if (dst)
+        vdp_output_surface_destroy(dst);
+    bench_decoder_close(&d);
+    bench_stream_close(&stream);
+    free(pixels);
+
+    return ret == VDP_STATUS_OK ? 0 : -1;
+}
+
+#define THREADS_LINE "threads : VDPAU_THREADS=%d, fill %lf ms, blend %lf ms, readback %lf ms, sum %x\n"
+
+/* run the suite again with a pool of n threads and read its line */
+static int threads_spawn(int n, threads_result_t *r)
+{
+    char exe[256], cmd[320], line[256];
+    ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    int found = 0, threads;
+    FILE *child;
+
+    if (len < 0)
+        return -1;
+    exe[len] = 0;
+
+    snprintf(cmd, sizeof(cmd), "VDPAU_THREADS=%d '%s' %s threads", n, exe,
+            bench_opts.quick ? "-q" : "");
+    fflush(stdout);
+    if (!(child = popen(cmd, "r")))
+        return -1;
+
+    while (fgets(line, sizeof(line), child))
+        if (sscanf(line, THREADS_LINE, &threads, &r->fill_ms, &r->blit_ms,
+                    &r->readback_ms, &r->sum) == 5 && threads == n)
+            found = 1;
+
+    return pclose(child) == 0 && found ? 0 : -1;
+}
+
+int bench_threads(void)
+{
+    const char *env = getenv("VDPAU_THREADS");
+    int failures = bench_failures, passes = bench_opts.quick ? 2 : 20;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max = bench_opts.quick ? 2 : cpus < 2 ? 2 : cpus > THREADS_MAX ? THREADS_MAX : cpus;
+    threads_result_t r, one;
+    int n;
+
+    if (env) {
+        if (threads_measure(&r, passes) < 0) {
+            CHECK(0, "threads: could not set up");
+            return bench_failures - failures;
+        }
+        CHECK(!r.wrong, "threads: %u pixels not blended over white with %s threads",
+                r.wrong, env);
+        printf(THREADS_LINE, atoi(env), r.fill_ms, r.blit_ms, r.readback_ms, r.sum);
+        return bench_failures - failures;
+    }
+
+    for (n = 1; n <= max; n++) {
+        if (threads_spawn(n, &r) < 0) {
+            CHECK(0, "threads: the run with %d threads failed", n);
+            break;
+        }
+        if (n == 1)
+            one = r;
+
+        printf("threads : %d, fill %6.2f ms (x%.2f), blend %6.2f ms (x%.2f), "
+                "readback %6.2f ms (x%.2f) at %ux%u\n", n,
+                r.fill_ms, one.fill_ms / r.fill_ms, r.blit_ms, one.blit_ms / r.blit_ms,
+                r.readback_ms, one.readback_ms / r.readback_ms,
+                THREADS_WIDTH, THREADS_HEIGHT);
+
+        CHECK(r.sum == one.sum, "threads: %d threads composited %08x, one thread %08x",
+                n, r.sum, one.sum);
+    }
+
+    return bench_failures - failures;
+}
@@ -0,0 +1,62 @@
+#include <pthread.h>
+
+#include "bench.h"
+#include "trace.h"
+
+/*
+ * Threads that trace and exit, as a player does with a decoder per file.
+ * The ring of an exited thread is taken by the next new one, so only as
+ * many rings are allocated as threads ever traced at the same time.
+ */
+
+#define TRACE_THREADS 4
+
+static void *trace_thread(void *arg)
+{
+    int i;
+
+    for (i = 0; i < 16; i++)
+        trace_record(TRACE_SUBMIT, i);
+
+    return NULL;
+}
+
+static void churn_run(int rounds)
+{
+    pthread_t threads[TRACE_THREADS];
+    bench_allocs_t a, b;
+    int i, j, started = 0;
+
+    /* the bench thread keeps its own ring */
+    trace_record(TRACE_SUBMIT, 0);
+
+    bench_allocs(&a);
+    for (i = 0; i < rounds; i++) {
+        for (j = 0; j < TRACE_THREADS; j++)
+            if (!pthread_create(&threads[j], NULL, trace_thread, NULL))
+                started++;
+            else
+                threads[j] = 0;
+        for (j = 0; j < TRACE_THREADS; j++)
+            if (threads[j])
+                pthread_join(threads[j], NULL);
+    }
+    bench_allocs(&b);
+
+    printf("trace   : %d threads exited, %llu rings allocated\n",
+            started, (unsigned long long)(b.allocs - a.allocs));
+
+    CHECK(started == rounds * TRACE_THREADS, "trace: could not start the threads");
+    CHECK(b.allocs - a.allocs <= TRACE_THREADS,
+            "trace: %llu rings for %d threads at a time",
+            (unsigned long long)(b.allocs - a.allocs), TRACE_THREADS);
+}
+
+int bench_trace(void)
+{
+    int failures = bench_failures;
+
+    churn_run(bench_opts.quick ? 64 : 1024);
+
+    return bench_failures - failures;
+}
@@ -0,0 +1,106 @@
+#include <stdlib.h>
+
+#include "bench.h"
+#include "vdpau_private.h"
+
+/*
+ * CPU time per decoded frame while the library waits for the hardware,
+ * with the poll() based wait and with the loops it replaced, which
+ * retried DQBUF on the bitstream queue at once and on the capture queue
+ * every 1 ms. Both run against the same mock device. Synced right after
+ * each frame the client waits on the capture queue, decoding ahead of
+ * the client runs out of bitstream buffers and waits on those.
+ */
+
+#define WAIT_SURFACES 16
+#define WAIT_AHEAD 8
+
+typedef struct
+{
+    double fps, cpu_ms;
+} wait_result_t;
+
+static int wait_measure(const bench_stream_t *stream, int ahead, wait_result_t *r)
+{
+    VdpStatus ret = VDP_STATUS_OK;
+    bench_decoder_t d;
+    uint64_t time, cpu;
+    uint32_t i;
+
+    if (bench_decoder_open(&d, stream, WAIT_SURFACES) < 0) {
+        bench_decoder_close(&d);
+        return -1;
+    }
+
+    time = bench_now_ns();
+    cpu = bench_cpu_ns();
+    for (i = 0; ret == VDP_STATUS_OK && i < stream->frame_count + ahead; i++) {
+        if (i < stream->frame_count)
+            ret = bench_decoder_render(&d, i, d.surfaces[i % WAIT_SURFACES]);
+        if (i >= ahead) {
+            video_surface_ctx_t *vs = handle_get(d.surfaces[(i - ahead) % WAIT_SURFACES],
+                    HANDLE_TYPE_VIDEO_SURFACE);
+
+            vs->dec->sync_picture(vs->dec, vs);
+        }
+    }
+    r->fps = stream->frame_count * 1e9 / (bench_now_ns() - time);
+    r->cpu_ms = (bench_cpu_ns() - cpu) / 1e6 / stream->frame_count;
+
+    bench_decoder_close(&d);
+
+    return ret == VDP_STATUS_OK ? 0 : -1;
+}
+
+static void wait_run(const bench_stream_t *stream, int ahead)
+{
+    const char *label = ahead ? "ahead" : "synced";
+    wait_result_t spin, poll;
+    int ret;
+
+    mock_v4l2.spin_dqbuf = 1;
+    ret = wait_measure(stream, ahead, &spin);
+    mock_v4l2.spin_dqbuf = 0;
+    ret |= wait_measure(stream, ahead, &poll);
+
+    if (ret < 0) {
+        CHECK(0, "%s wait %s: could not decode", stream->name, label);
+        return;
+    }
+
+    printf("%-8s wait %-6s: poll %6.3f ms CPU a frame, %6.1f fps, spin and sleep "
+            "%6.3f ms CPU a frame, %6.1f fps, %d us hw time\n", stream->name, label,
+            poll.cpu_ms, poll.fps, spin.cpu_ms, spin.fps, mock_v4l2.hw_us);
+
+    /*
+     * Spinning burns the hardware time. Sleeping costs little CPU but
+     * wakes up late, waking up on the event must not be any slower.
+     */
+    if (ahead)
+        CHECK(poll.cpu_ms < spin.cpu_ms / 2, "%s wait %s: %.3f ms CPU a frame, "
+                "spinning took %.3f ms", stream->name, label, poll.cpu_ms, spin.cpu_ms);
+    else
+        CHECK(poll.fps > 0.95 * spin.fps, "%s wait %s: %.1f fps, sleeping made %.1f fps",
+                stream->name, label, poll.fps, spin.fps);
+}
+
+int bench_wait(void)
+{
+    int failures = bench_failures;
+    bench_stream_t stream;
+
+    if (bench_stream_open(&stream, bench_opts.stream ? bench_opts.stream : "1080p",
+                bench_opts.frames ? bench_opts.frames : bench_opts.quick ? 60 : 300) < 0) {
+        CHECK(0, "wait: unknown stream");
+        return bench_failures - failures;
+    }
+
+    mock_v4l2.hw_us = bench_opts.quick ? 2000 : bench_opts.hw_us;
+    wait_run(&stream, 0);
+    wait_run(&stream, WAIT_AHEAD);
+    mock_v4l2.hw_us = 0;
+
+    bench_stream_close(&stream);
+
+    return bench_failures - failures;
+}
@@ -0,0 +1 @@
+#include <drm/drm_fourcc.h>
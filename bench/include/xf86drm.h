@@ -0,0 +1,58 @@
+/*
+ * Subset of libdrm's xf86drm.h used by the library, backed by the fake
+ * display in bench/mock_drm.c so the bench builds without libdrm.
+ */
+#ifndef BENCH_XF86DRM_H
+#define BENCH_XF86DRM_H
+
+#include <stdint.h>
+#include <linux/types.h>
+
+#define DRM_IOCTL_GEM_CLOSE         0x6409
+#define DRM_IOCTL_MODE_CREATE_DUMB  0x64b2
+#define DRM_IOCTL_MODE_DESTROY_DUMB 0x64b4
+
+#define DRM_CLOEXEC 02000000
+#define DRM_RDWR    02
+
+#define DRM_CLIENT_CAP_UNIVERSAL_PLANES 2
+#define DRM_CLIENT_CAP_ATOMIC           3
+
+#define DRM_EVENT_CONTEXT_VERSION 2
+
+struct drm_gem_close {
+    __u32 handle;
+    __u32 pad;
+};
+
+struct drm_mode_create_dumb {
+    __u32 height;
+    __u32 width;
+    __u32 bpp;
+    __u32 flags;
+    __u32 handle;
+    __u32 pitch;
+    __u64 size;
+};
+
+struct drm_mode_destroy_dumb {
+    __u32 handle;
+};
+
+typedef struct _drmEventContext {
+    int version;
+    void (*vblank_handler)(int fd, unsigned int sequence,
+                           unsigned int tv_sec, unsigned int tv_usec,
+                           void *user_data);
+    void (*page_flip_handler)(int fd, unsigned int sequence,
+                              unsigned int tv_sec, unsigned int tv_usec,
+                              void *user_data);
+} drmEventContext, *drmEventContextPtr;
+
+int drmIoctl(int fd, unsigned long request, void *arg);
+int drmSetClientCap(int fd, uint64_t capability, uint64_t value);
+int drmHandleEvent(int fd, drmEventContextPtr evctx);
+int drmPrimeFDToHandle(int fd, int prime_fd, uint32_t *handle);
+int drmPrimeHandleToFD(int fd, uint32_t handle, uint32_t flags, int *prime_fd);
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * Subset of libdrm's xf86drmMode.h used by the library, see xf86drm.h.
+ */
+#ifndef BENCH_XF86DRMMODE_H
+#define BENCH_XF86DRMMODE_H
+
+#include <stdint.h>
+
+#define DRM_MODE_OBJECT_PLANE    0xeeeeeeee
+#define DRM_MODE_PAGE_FLIP_EVENT 0x01
+#define DRM_MODE_ATOMIC_NONBLOCK 0x0200
+
+#define DRM_PROP_NAME_LEN 32
+
+typedef struct _drmModeRes {
+    int count_fbs;
+    uint32_t *fbs;
+    int count_crtcs;
+    uint32_t *crtcs;
+    int count_connectors;
+    uint32_t *connectors;
+    int count_encoders;
+    uint32_t *encoders;
+    uint32_t min_width, max_width;
+    uint32_t min_height, max_height;
+} drmModeRes, *drmModeResPtr;
+
+typedef struct _drmModeCrtc {
+    uint32_t crtc_id;
+    uint32_t buffer_id;
+    uint32_t x, y;
+    uint32_t width, height;
+    int mode_valid;
+    int gamma_size;
+} drmModeCrtc, *drmModeCrtcPtr;
+
+typedef struct _drmModePlane {
+    uint32_t count_formats;
+    uint32_t *formats;
+    uint32_t plane_id;
+    uint32_t crtc_id;
+    uint32_t fb_id;
+    uint32_t crtc_x, crtc_y;
+    uint32_t x, y;
+    uint32_t possible_crtcs;
+    uint32_t gamma_size;
+} drmModePlane, *drmModePlanePtr;
+
+typedef struct _drmModePlaneRes {
+    uint32_t count_planes;
+    uint32_t *planes;
+} drmModePlaneRes, *drmModePlaneResPtr;
+
+typedef struct _drmModeObjectProperties {
+    uint32_t count_props;
+    uint32_t *props;
+    uint64_t *prop_values;
+} drmModeObjectProperties, *drmModeObjectPropertiesPtr;
+
+typedef struct _drmModeProperty {
+    uint32_t prop_id;
+    uint32_t flags;
+    char name[DRM_PROP_NAME_LEN];
+} drmModePropertyRes, *drmModePropertyPtr;
+
+typedef struct _drmModeAtomicReq drmModeAtomicReq, *drmModeAtomicReqPtr;
+
+drmModeResPtr drmModeGetResources(int fd);
+void drmModeFreeResources(drmModeResPtr ptr);
+drmModeCrtcPtr drmModeGetCrtc(int fd, uint32_t crtc_id);
+void drmModeFreeCrtc(drmModeCrtcPtr ptr);
+drmModePlaneResPtr drmModeGetPlaneResources(int fd);
+void drmModeFreePlaneResources(drmModePlaneResPtr ptr);
+drmModePlanePtr drmModeGetPlane(int fd, uint32_t plane_id);
+void drmModeFreePlane(drmModePlanePtr ptr);
+drmModeObjectPropertiesPtr drmModeObjectGetProperties(int fd, uint32_t object_id,
+                                                      uint32_t object_type);
+void drmModeFreeObjectProperties(drmModeObjectPropertiesPtr ptr);
+drmModePropertyPtr drmModeGetProperty(int fd, uint32_t property_id);
+void drmModeFreeProperty(drmModePropertyPtr ptr);
+
+int drmModeAddFB2(int fd, uint32_t width, uint32_t height,
+                  uint32_t pixel_format, const uint32_t bo_handles[4],
+                  const uint32_t pitches[4], const uint32_t offsets[4],
+                  uint32_t *buf_id, uint32_t flags);
+int drmModeRmFB(int fd, uint32_t buffer_id);
+int drmModeSetPlane(int fd, uint32_t plane_id, uint32_t crtc_id,
+                    uint32_t fb_id, uint32_t flags,
+                    int32_t crtc_x, int32_t crtc_y,
+                    uint32_t crtc_w, uint32_t crtc_h,
+                    uint32_t src_x, uint32_t src_y,
+                    uint32_t src_w, uint32_t src_h);
+
+drmModeAtomicReqPtr drmModeAtomicAlloc(void);
+void drmModeAtomicFree(drmModeAtomicReqPtr req);
+int drmModeAtomicAddProperty(drmModeAtomicReqPtr req, uint32_t object_id,
+                             uint32_t property_id, uint64_t value);
+int drmModeAtomicCommit(int fd, drmModeAtomicReqPtr req, uint32_t flags,
+                        void *user_data);
+
+#endif
@@ -0,0 +1,256 @@
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bench.h"
+#include "mock.h"
+#include "vdpau_private.h"
+
+/*
+ * vdpau-bench [options] [suite...]
+ *
+ * Runs the given suites, all of them with "check". Suites print one
+ * line per measurement and count failed checks, the exit status is
+ * non-zero if any check failed.
+ */
+
+bench_opts_t bench_opts;
+int bench_failures;
+
+static const struct
+{
+    const char *name;
+    int (*run)(void);
+} suites[] = {
+    { "decode", bench_decode },
+    { "present", bench_present },
+    { "nal", bench_nal },
+    { "handles", bench_handles },
+    { "blend", bench_blend },
+    { "latency", bench_latency },
+    { "trace", bench_trace },
+    { "readback", bench_readback },
+    { "threads", bench_threads },
+    { "rgba", bench_rgba },
+    { "wait", bench_wait },
+};
+
+#define SUITE_COUNT (sizeof(suites) / sizeof(suites[0]))
+
+/* allocator calls, see --wrap in the Makefile */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static bench_allocs_t allocs;
+
+void *__wrap_malloc(size_t size)
+{
+    __atomic_fetch_add(&allocs.allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    __atomic_fetch_add(&allocs.allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    __atomic_fetch_add(&allocs.allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr)
+{
+    if (ptr)
+        __atomic_fetch_add(&allocs.frees, 1, __ATOMIC_RELAXED);
+    __real_free(ptr);
+}
+
+void bench_allocs(bench_allocs_t *out)
+{
+    out->allocs = __atomic_load_n(&allocs.allocs, __ATOMIC_RELAXED);
+    out->frees = __atomic_load_n(&allocs.frees, __ATOMIC_RELAXED);
+}
+
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t bench_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec - mock_cpu_excluded();
+}
+
+void bench_spin_us(int us)
+{
+    uint64_t end = bench_now_ns() + us * 1000ULL;
+
+    while (bench_now_ns() < end)
+        ;
+}
+
+VdpDevice bench_device_create(void)
+{
+    VdpGetProcAddress *get_proc_address;
+    VdpDevice device;
+
+    if (vdp_imp_device_create_x11(XOpenDisplay(NULL), 0, &device,
+                &get_proc_address) != VDP_STATUS_OK)
+        return VDP_INVALID_HANDLE;
+
+    return device;
+}
+
+int bench_decoder_open(bench_decoder_t *d, const bench_stream_t *stream, int num_surfaces)
+{
+    VdpStatus ret = VDP_STATUS_OK;
+    int i;
+
+    memset(d, 0, sizeof(*d));
+    d->stream = stream;
+    d->num_surfaces = num_surfaces;
+    d->device = bench_device_create();
+    if (d->device == VDP_INVALID_HANDLE)
+        return -1;
+
+    ret |= vdp_decoder_create(d->device, VDP_DECODER_PROFILE_H264_HIGH,
+            stream->width, stream->height, 4, &d->decoder);
+    for (i = 0; i < num_surfaces; i++)
+        ret |= vdp_video_surface_create(d->device, VDP_CHROMA_TYPE_420,
+                stream->width, stream->height, &d->surfaces[i]);
+
+    return ret == VDP_STATUS_OK ? 0 : -1;
+}
+
+VdpStatus bench_decoder_render(bench_decoder_t *d, uint32_t n, VdpVideoSurface surface)
+{
+    const bench_frame_t *f = &d->stream->frames[n];
+    VdpPictureInfoH264 info;
+
+    bench_picture_info(&info, f);
+    return vdp_decoder_render(d->decoder, surface, (VdpPictureInfo *)&info,
+            f->buffer_count, f->buffers);
+}
+
+void bench_decoder_close(bench_decoder_t *d)
+{
+    int i;
+
+    for (i = 0; i < d->num_surfaces; i++)
+        if (d->surfaces[i])
+            vdp_video_surface_destroy(d->surfaces[i]);
+    if (d->decoder)
+        vdp_decoder_destroy(d->decoder);
+    if (d->device != VDP_INVALID_HANDLE)
+        vdp_device_destroy(d->device);
+    memset(d, 0, sizeof(*d));
+    d->device = VDP_INVALID_HANDLE;
+}
+
+static void usage(FILE *f)
+{
+    int i;
+
+    fprintf(f, "usage: vdpau-bench [options] [suite...]\n"
+            "  -s, --stream NAME     canned stream to decode\n"
+            "  -n, --frames N        frames to decode\n"
+            "      --hw-us US        simulated hardware time per frame\n"
+            "      --client-us US    simulated client work per frame\n"
+            "  -q, --quick           short runs, for \"check\"\n"
+            "suites: check");
+    for (i = 0; i < SUITE_COUNT; i++)
+        fprintf(f, " %s", suites[i].name);
+    fprintf(f, "\nstreams:\n");
+    bench_stream_list(f);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "stream", required_argument, NULL, 's' },
+        { "frames", required_argument, NULL, 'n' },
+        { "hw-us", required_argument, NULL, 'H' },
+        { "client-us", required_argument, NULL, 'C' },
+        { "quick", no_argument, NULL, 'q' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    int c, i, j, ran = 0;
+
+    bench_opts.hw_us = 5000;
+    bench_opts.client_us = 2000;
+
+    while ((c = getopt_long(argc, argv, "s:n:qh", options, NULL)) != -1) {
+        switch (c) {
+        case 's':
+            bench_opts.stream = optarg;
+            break;
+        case 'n':
+            bench_opts.frames = atoi(optarg);
+            break;
+        case 'H':
+            bench_opts.hw_us = atoi(optarg);
+            break;
+        case 'C':
+            bench_opts.client_us = atoi(optarg);
+            break;
+        case 'q':
+            bench_opts.quick = 1;
+            break;
+        case 'h':
+            usage(stdout);
+            return 0;
+        default:
+            usage(stderr);
+            return 2;
+        }
+    }
+
+    if (mock_sysfs_init(MOCK_V4L2_NAME) < 0) {
+        fprintf(stderr, "could not create the mock sysfs tree\n");
+        return 1;
+    }
+
+    for (i = optind; i < argc; i++) {
+        int all = !strcmp(argv[i], "check"), found = 0;
+
+        if (all)
+            bench_opts.quick = 1;
+        for (j = 0; j < SUITE_COUNT; j++)
+            if (all || !strcmp(argv[i], suites[j].name)) {
+                printf("== %s\n", suites[j].name);
+                suites[j].run();
+                found = 1;
+                ran++;
+            }
+
+        if (!found) {
+            usage(stderr);
+            return 2;
+        }
+    }
+
+    if (!ran) {
+        printf("== decode\n");
+        bench_decode();
+    }
+
+    if (bench_failures) {
+        fprintf(stderr, "%d check%s failed\n", bench_failures,
+                bench_failures == 1 ? "" : "s");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef BENCH_MOCK_H
+#define BENCH_MOCK_H
+
+/* shared between the mocks, the suites only need bench.h */
+
+#define MOCK_NOT_MINE (-2)
+
+/* the decoder node as it shows up in /sys/class/video4linux and /dev */
+#define MOCK_V4L2_NODE "video0"
+#define MOCK_V4L2_PATH "/dev/" MOCK_V4L2_NODE
+#define MOCK_V4L2_NAME "rockchip-vpu-vdec"
+
+int mock_v4l2_open(const char *path, int flags);
+int mock_drm_open(const char *path, int flags);
+int mock_sysfs_init(const char *node_name);
+uint64_t mock_cpu_excluded(void);
+
+#endif
@@ -0,0 +1,592 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <drm/drm_fourcc.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "bench.h"
+#include "mock.h"
+
+/*
+ * A display with one active 1080p CRTC, a primary plane and an NV12
+ * overlay plane. Non-blocking atomic commits flip at the next vblank
+ * and deliver their event through the card's fd, like the kernel; a
+ * second non-blocking commit while one is pending fails with EBUSY.
+ *
+ * The library serializes plane updates and event handling, calls that
+ * overlap are counted. They yield the CPU on entry so that an unlocked
+ * caller gets caught on a single core too.
+ */
+
+#define MOCK_CRTC_ID 41
+#define MOCK_PRIMARY_ID 31
+#define MOCK_OVERLAY_ID 32
+#define MOCK_PROP_BASE 100
+#define MOCK_MAX_FBS 256
+#define MOCK_MAX_HANDLES 256
+#define MOCK_MAX_PROPS 32
+
+static const char *prop_names[] = {
+    "FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+    "CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H",
+};
+#define MOCK_PROP_COUNT (sizeof(prop_names) / sizeof(prop_names[0]))
+
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    int memfd;      /* dumb buffers only */
+} mock_handle_t;
+
+typedef struct
+{
+    uint32_t handle;
+    dev_t dev;
+    ino_t ino;
+} mock_fb_t;
+
+struct _drmModeAtomicReq
+{
+    int count;
+    struct { uint32_t obj, prop; uint64_t value; } items[MOCK_MAX_PROPS];
+};
+
+mock_drm_config_t mock_drm = { .vblank_us = 1000 };
+static mock_drm_stats_t stats;
+
+static pthread_mutex_t drm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mock_handle_t handles[MOCK_MAX_HANDLES];
+static mock_fb_t fbs[MOCK_MAX_FBS];
+/* fb on screen and the one waiting for the next vblank */
+static uint32_t scanout_fb, pending_fb;
+static int flip_pending;
+static uint64_t flip_deadline;
+static void *flip_data;
+static uint32_t flip_seq;
+static int atomic_enabled;
+static int overlay_callers;
+
+void mock_drm_stats(mock_drm_stats_t *out)
+{
+    pthread_mutex_lock(&drm_mutex);
+    *out = stats;
+    pthread_mutex_unlock(&drm_mutex);
+}
+
+static int fb_shown(uint32_t fb)
+{
+    return fb && (fb == scanout_fb || (flip_pending && fb == pending_fb));
+}
+
+int mock_drm_buffer_shown(dev_t dev, ino_t ino)
+{
+    int shown = 0;
+
+    pthread_mutex_lock(&drm_mutex);
+    if (scanout_fb && fbs[scanout_fb].dev == dev && fbs[scanout_fb].ino == ino)
+        shown = 1;
+    if (flip_pending && pending_fb && fbs[pending_fb].dev == dev && fbs[pending_fb].ino == ino)
+        shown = 1;
+    pthread_mutex_unlock(&drm_mutex);
+
+    return shown;
+}
+
+static void overlay_enter(void)
+{
+    if (__atomic_fetch_add(&overlay_callers, 1, __ATOMIC_ACQ_REL))
+        __atomic_fetch_add(&stats.overlapping_calls, 1, __ATOMIC_RELAXED);
+    sched_yield();
+}
+
+static void overlay_leave(void)
+{
+    __atomic_fetch_sub(&overlay_callers, 1, __ATOMIC_ACQ_REL);
+}
+
+static short mock_poll(void *obj, short events, uint64_t *deadline)
+{
+    short revents = 0;
+
+    overlay_enter();
+    pthread_mutex_lock(&drm_mutex);
+    if (flip_pending) {
+        if (bench_now_ns() >= flip_deadline)
+            revents = events & POLLIN;
+        else
+            *deadline = flip_deadline;
+    } else {
+        /* the event went to somebody else, this wait times out */
+        stats.idle_polls++;
+    }
+    pthread_mutex_unlock(&drm_mutex);
+    overlay_leave();
+
+    return revents;
+}
+
+static const mock_fd_ops_t mock_drm_ops = {
+    .poll = mock_poll,
+};
+
+int mock_drm_open(const char *path, int flags)
+{
+    if (strcmp(path, "/dev/dri/card0") && strcmp(path, "/dev/dri/controlD64"))
+        return MOCK_NOT_MINE;
+
+    return mock_fd_open(&mock_drm_ops, NULL);
+}
+
+static int new_handle(dev_t dev, ino_t ino, int memfd)
+{
+    int i;
+
+    for (i = 1; i < MOCK_MAX_HANDLES; i++)
+        if (!handles[i].ino) {
+            handles[i].dev = dev;
+            handles[i].ino = ino;
+            handles[i].memfd = memfd;
+            return i;
+        }
+
+    return -1;
+}
+
+int drmIoctl(int fd, unsigned long request, void *arg)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&drm_mutex);
+    switch (request) {
+    case DRM_IOCTL_MODE_CREATE_DUMB: {
+        struct drm_mode_create_dumb *c = arg;
+        int memfd;
+        dev_t dev;
+        ino_t ino;
+
+        c->pitch = c->width * c->bpp / 8;
+        c->size = (uint64_t)c->pitch * c->height;
+        memfd = memfd_create("mock-dumb", MFD_CLOEXEC);
+        if (memfd < 0 || ftruncate(memfd, c->size) < 0 ||
+            mock_buffer_id(memfd, &dev, &ino) < 0) {
+            ret = -1;
+            break;
+        }
+        c->handle = new_handle(dev, ino, memfd);
+        break;
+    }
+    case DRM_IOCTL_MODE_DESTROY_DUMB:
+    case DRM_IOCTL_GEM_CLOSE: {
+        uint32_t h = *(uint32_t *)arg;
+
+        if (h && h < MOCK_MAX_HANDLES && handles[h].ino) {
+            if (handles[h].memfd > 0)
+                close(handles[h].memfd);
+            memset(&handles[h], 0, sizeof(handles[h]));
+        } else {
+            errno = EINVAL;
+            ret = -1;
+        }
+        break;
+    }
+    default:
+        errno = ENOTTY;
+        ret = -1;
+        break;
+    }
+    pthread_mutex_unlock(&drm_mutex);
+
+    return ret;
+}
+
+int drmSetClientCap(int fd, uint64_t capability, uint64_t value)
+{
+    if (capability == DRM_CLIENT_CAP_ATOMIC) {
+        if (mock_drm.no_atomic) {
+            errno = EINVAL;
+            return -1;
+        }
+        atomic_enabled = value;
+    }
+
+    return 0;
+}
+
+int drmPrimeFDToHandle(int fd, int prime_fd, uint32_t *handle)
+{
+    dev_t dev;
+    ino_t ino;
+    int i, ret = -1;
+
+    if (mock_buffer_id(prime_fd, &dev, &ino) < 0)
+        return -1;
+
+    pthread_mutex_lock(&drm_mutex);
+    stats.prime_imports++;
+    /* one GEM handle per buffer, however often it's imported */
+    for (i = 1; i < MOCK_MAX_HANDLES; i++)
+        if (handles[i].ino == ino && handles[i].dev == dev) {
+            *handle = i;
+            ret = 0;
+            break;
+        }
+    if (ret < 0 && (i = new_handle(dev, ino, -1)) > 0) {
+        *handle = i;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&drm_mutex);
+
+    return ret;
+}
+
+int drmPrimeHandleToFD(int fd, uint32_t handle, uint32_t flags, int *prime_fd)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&drm_mutex);
+    if (handle && handle < MOCK_MAX_HANDLES && handles[handle].memfd > 0)
+        ret = *prime_fd = fcntl(handles[handle].memfd, F_DUPFD_CLOEXEC, 0);
+    pthread_mutex_unlock(&drm_mutex);
+
+    return ret < 0 ? -1 : 0;
+}
+
+int drmModeAddFB2(int fd, uint32_t width, uint32_t height,
+                  uint32_t pixel_format, const uint32_t bo_handles[4],
+                  const uint32_t pitches[4], const uint32_t offsets[4],
+                  uint32_t *buf_id, uint32_t flags)
+{
+    uint32_t h = bo_handles[0];
+    int i, ret = -1;
+
+    pthread_mutex_lock(&drm_mutex);
+    stats.addfb++;
+    if (h && h < MOCK_MAX_HANDLES && handles[h].ino)
+        for (i = 1; i < MOCK_MAX_FBS; i++)
+            if (!fbs[i].handle) {
+                fbs[i].handle = h;
+                fbs[i].dev = handles[h].dev;
+                fbs[i].ino = handles[h].ino;
+                *buf_id = i;
+                ret = 0;
+                break;
+            }
+    pthread_mutex_unlock(&drm_mutex);
+
+    if (ret < 0)
+        errno = EINVAL;
+    return ret;
+}
+
+int drmModeRmFB(int fd, uint32_t buffer_id)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&drm_mutex);
+    stats.rmfb++;
+    if (buffer_id && buffer_id < MOCK_MAX_FBS && fbs[buffer_id].handle) {
+        /* the kernel would disable the plane */
+        if (fb_shown(buffer_id))
+            stats.rmfb_shown++;
+        memset(&fbs[buffer_id], 0, sizeof(fbs[buffer_id]));
+    } else {
+        errno = ENOENT;
+        ret = -1;
+    }
+    pthread_mutex_unlock(&drm_mutex);
+
+    return ret;
+}
+
+drmModeResPtr drmModeGetResources(int fd)
+{
+    drmModeResPtr r = calloc(1, sizeof(*r) + sizeof(uint32_t));
+
+    if (r) {
+        r->count_crtcs = 1;
+        r->crtcs = (uint32_t *)(r + 1);
+        r->crtcs[0] = MOCK_CRTC_ID;
+    }
+    return r;
+}
+
+void drmModeFreeResources(drmModeResPtr ptr)
+{
+    free(ptr);
+}
+
+drmModeCrtcPtr drmModeGetCrtc(int fd, uint32_t crtc_id)
+{
+    drmModeCrtcPtr c;
+
+    if (crtc_id != MOCK_CRTC_ID || !(c = calloc(1, sizeof(*c))))
+        return NULL;
+
+    c->crtc_id = crtc_id;
+    c->width = 1920;
+    c->height = 1080;
+    c->mode_valid = 1;
+    return c;
+}
+
+void drmModeFreeCrtc(drmModeCrtcPtr ptr)
+{
+    free(ptr);
+}
+
+drmModePlaneResPtr drmModeGetPlaneResources(int fd)
+{
+    drmModePlaneResPtr pr = calloc(1, sizeof(*pr) + 2 * sizeof(uint32_t));
+
+    if (pr) {
+        pr->count_planes = 2;
+        pr->planes = (uint32_t *)(pr + 1);
+        pr->planes[0] = MOCK_PRIMARY_ID;
+        pr->planes[1] = MOCK_OVERLAY_ID;
+    }
+    return pr;
+}
+
+void drmModeFreePlaneResources(drmModePlaneResPtr ptr)
+{
+    free(ptr);
+}
+
+drmModePlanePtr drmModeGetPlane(int fd, uint32_t plane_id)
+{
+    drmModePlanePtr p;
+
+    if ((plane_id != MOCK_PRIMARY_ID && plane_id != MOCK_OVERLAY_ID) ||
+        !(p = calloc(1, sizeof(*p) + sizeof(uint32_t))))
+        return NULL;
+
+    p->plane_id = plane_id;
+    p->possible_crtcs = 1;
+    p->count_formats = 1;
+    p->formats = (uint32_t *)(p + 1);
+    p->formats[0] = plane_id == MOCK_OVERLAY_ID ? DRM_FORMAT_NV12 : DRM_FORMAT_XRGB8888;
+    pthread_mutex_lock(&drm_mutex);
+    p->fb_id = plane_id == MOCK_OVERLAY_ID ? scanout_fb : 0;
+    pthread_mutex_unlock(&drm_mutex);
+    return p;
+}
+
+void drmModeFreePlane(drmModePlanePtr ptr)
+{
+    free(ptr);
+}
+
+drmModeObjectPropertiesPtr drmModeObjectGetProperties(int fd, uint32_t object_id,
+                                                      uint32_t object_type)
+{
+    drmModeObjectPropertiesPtr props;
+    uint32_t i;
+
+    if (object_id != MOCK_OVERLAY_ID ||
+        !(props = calloc(1, sizeof(*props) + MOCK_PROP_COUNT * sizeof(uint32_t))))
+        return NULL;
+
+    props->count_props = MOCK_PROP_COUNT;
+    props->props = (uint32_t *)(props + 1);
+    for (i = 0; i < MOCK_PROP_COUNT; i++)
+        props->props[i] = MOCK_PROP_BASE + i;
+    return props;
+}
+
+void drmModeFreeObjectProperties(drmModeObjectPropertiesPtr ptr)
+{
+    free(ptr);
+}
+
+drmModePropertyPtr drmModeGetProperty(int fd, uint32_t property_id)
+{
+    drmModePropertyPtr prop;
+
+    if (property_id < MOCK_PROP_BASE || property_id >= MOCK_PROP_BASE + MOCK_PROP_COUNT ||
+        !(prop = calloc(1, sizeof(*prop))))
+        return NULL;
+
+    prop->prop_id = property_id;
+    strcpy(prop->name, prop_names[property_id - MOCK_PROP_BASE]);
+    return prop;
+}
+
+void drmModeFreeProperty(drmModePropertyPtr ptr)
+{
+    free(ptr);
+}
+
+/* called with drm_mutex held, drops it */
+static void fb_presented(uint32_t fb)
+{
+    mock_fb_t shown = fbs[fb];
+
+    pthread_mutex_unlock(&drm_mutex);
+    if (fb)
+        mock_v4l2_presented(shown.dev, shown.ino);
+}
+
+static int set_plane(uint32_t plane_id, uint32_t fb_id)
+{
+    pthread_mutex_lock(&drm_mutex);
+    stats.setplane++;
+    if (fb_id && (fb_id >= MOCK_MAX_FBS || !fbs[fb_id].handle)) {
+        stats.bad_fb_commits++;
+        pthread_mutex_unlock(&drm_mutex);
+        errno = ENOENT;
+        return -1;
+    }
+    if (plane_id == MOCK_OVERLAY_ID)
+        scanout_fb = fb_id;
+    fb_presented(plane_id == MOCK_OVERLAY_ID ? fb_id : 0);
+
+    return 0;
+}
+
+int drmModeSetPlane(int fd, uint32_t plane_id, uint32_t crtc_id,
+                    uint32_t fb_id, uint32_t flags,
+                    int32_t crtc_x, int32_t crtc_y,
+                    uint32_t crtc_w, uint32_t crtc_h,
+                    uint32_t src_x, uint32_t src_y,
+                    uint32_t src_w, uint32_t src_h)
+{
+    int ret;
+
+    overlay_enter();
+    ret = set_plane(plane_id, fb_id);
+    overlay_leave();
+
+    return ret;
+}
+
+drmModeAtomicReqPtr drmModeAtomicAlloc(void)
+{
+    return calloc(1, sizeof(drmModeAtomicReq));
+}
+
+void drmModeAtomicFree(drmModeAtomicReqPtr req)
+{
+    free(req);
+}
+
+int drmModeAtomicAddProperty(drmModeAtomicReqPtr req, uint32_t object_id,
+                             uint32_t property_id, uint64_t value)
+{
+    if (req->count == MOCK_MAX_PROPS) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    req->items[req->count].obj = object_id;
+    req->items[req->count].prop = property_id;
+    req->items[req->count].value = value;
+    return ++req->count;
+}
+
+static int atomic_commit(drmModeAtomicReqPtr req, uint32_t flags, void *user_data)
+{
+    uint32_t fb;
+    int i;
+
+    pthread_mutex_lock(&drm_mutex);
+    stats.commits++;
+    fb = scanout_fb;
+
+    if (!atomic_enabled) {
+        pthread_mutex_unlock(&drm_mutex);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((flags & DRM_MODE_ATOMIC_NONBLOCK) && flip_pending) {
+        stats.busy_commits++;
+        pthread_mutex_unlock(&drm_mutex);
+        errno = EBUSY;
+        return -1;
+    }
+
+    for (i = 0; i < req->count; i++)
+        if (req->items[i].obj == MOCK_OVERLAY_ID && req->items[i].prop == MOCK_PROP_BASE)
+            fb = req->items[i].value;
+
+    if (fb && (fb >= MOCK_MAX_FBS || !fbs[fb].handle)) {
+        stats.bad_fb_commits++;
+        pthread_mutex_unlock(&drm_mutex);
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (flags & DRM_MODE_ATOMIC_NONBLOCK) {
+        uint64_t now = bench_now_ns(), vblank = mock_drm.vblank_us * 1000ULL;
+
+        pending_fb = fb;
+        flip_pending = 1;
+        flip_data = user_data;
+        flip_deadline = vblank ? (now / vblank + 1) * vblank : now;
+    } else {
+        /* waits for a pending flip, whose event is still to come */
+        if (flip_pending)
+            pending_fb = fb;
+        scanout_fb = fb;
+    }
+    fb_presented(fb);
+
+    mock_fd_notify();
+    return 0;
+}
+
+int drmModeAtomicCommit(int fd, drmModeAtomicReqPtr req, uint32_t flags,
+                        void *user_data)
+{
+    int ret;
+
+    overlay_enter();
+    ret = atomic_commit(req, flags, user_data);
+    overlay_leave();
+
+    return ret;
+}
+
+static void handle_event(int fd, drmEventContextPtr evctx)
+{
+    void *data;
+    uint64_t time;
+    uint32_t seq;
+
+    pthread_mutex_lock(&drm_mutex);
+    if (!flip_pending || bench_now_ns() < flip_deadline) {
+        pthread_mutex_unlock(&drm_mutex);
+        return;
+    }
+
+    scanout_fb = pending_fb;
+    flip_pending = 0;
+    time = flip_deadline;
+    data = flip_data;
+    seq = ++flip_seq;
+    stats.flips++;
+    stats.last_flip_time = time;
+    pthread_mutex_unlock(&drm_mutex);
+
+    if (evctx->page_flip_handler)
+        evctx->page_flip_handler(fd, seq, time / 1000000000ULL,
+                (time % 1000000000ULL) / 1000, data);
+}
+
+int drmHandleEvent(int fd, drmEventContextPtr evctx)
+{
+    overlay_enter();
+    handle_event(fd, evctx);
+    overlay_leave();
+
+    return 0;
+}
@@ -0,0 +1,359 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bench.h"
+#include "mock.h"
+
+/*
+ * The library's system calls are redirected here at link time with
+ * --wrap, see the Makefile. Calls on mock descriptors go to the mock,
+ * everything else to the real function.
+ */
+int __real_open(const char *path, int flags, ...);
+int __real_close(int fd);
+int __real_ioctl(int fd, unsigned long request, ...);
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+void *__real_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+DIR *__real_opendir(const char *name);
+FILE *__real_fopen(const char *path, const char *mode);
+
+#define MOCK_MAX_FDS 4096
+
+typedef struct
+{
+    const mock_fd_ops_t *ops;
+    void *obj;
+} mock_fd_t;
+
+static mock_fd_t mock_fds[MOCK_MAX_FDS];
+static pthread_mutex_t mock_fds_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct waiter
+{
+    int fd;
+    struct waiter *next;
+} waiter_t;
+
+static waiter_t *waiters;
+static pthread_mutex_t waiters_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int waiter_fd = -1;
+
+static uint64_t excluded_ns;
+
+int mock_fd_open(const mock_fd_ops_t *ops, void *obj)
+{
+    int fd = eventfd(0, EFD_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    if (fd >= MOCK_MAX_FDS) {
+        __real_close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+
+    pthread_mutex_lock(&mock_fds_mutex);
+    mock_fds[fd].obj = obj;
+    __atomic_store_n(&mock_fds[fd].ops, ops, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mock_fds_mutex);
+
+    return fd;
+}
+
+static const mock_fd_ops_t *mock_fd_lookup(int fd, void **obj)
+{
+    const mock_fd_ops_t *ops;
+
+    if (fd < 0 || fd >= MOCK_MAX_FDS)
+        return NULL;
+
+    ops = __atomic_load_n(&mock_fds[fd].ops, __ATOMIC_ACQUIRE);
+    if (ops)
+        *obj = mock_fds[fd].obj;
+
+    return ops;
+}
+
+void *mock_fd_get(int fd, const mock_fd_ops_t *ops)
+{
+    void *obj = NULL;
+
+    return mock_fd_lookup(fd, &obj) == ops ? obj : NULL;
+}
+
+void mock_fd_notify(void)
+{
+    uint64_t one = 1;
+    waiter_t *w;
+
+    pthread_mutex_lock(&waiters_mutex);
+    for (w = waiters; w; w = w->next)
+        if (write(w->fd, &one, sizeof(one)) < 0)
+            ;
+    pthread_mutex_unlock(&waiters_mutex);
+}
+
+void mock_cpu_exclude(uint64_t ns)
+{
+    __atomic_fetch_add(&excluded_ns, ns, __ATOMIC_RELAXED);
+}
+
+uint64_t mock_cpu_excluded(void)
+{
+    return __atomic_load_n(&excluded_ns, __ATOMIC_RELAXED);
+}
+
+int mock_buffer_id(int fd, dev_t *dev, ino_t *ino)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+
+    *dev = st.st_dev;
+    *ino = st.st_ino;
+    return 0;
+}
+
+int __wrap_open(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    int fd;
+
+    if ((fd = mock_v4l2_open(path, flags)) != MOCK_NOT_MINE)
+        return fd;
+    if ((fd = mock_drm_open(path, flags)) != MOCK_NOT_MINE)
+        return fd;
+
+    if (flags & O_CREAT) {
+        va_list ap;
+
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+
+    return __real_open(path, flags, mode);
+}
+
+int __wrap_close(int fd)
+{
+    const mock_fd_ops_t *ops;
+    void *obj;
+
+    if ((ops = mock_fd_lookup(fd, &obj))) {
+        pthread_mutex_lock(&mock_fds_mutex);
+        __atomic_store_n(&mock_fds[fd].ops, NULL, __ATOMIC_RELEASE);
+        mock_fds[fd].obj = NULL;
+        pthread_mutex_unlock(&mock_fds_mutex);
+
+        if (ops->close)
+            ops->close(obj);
+        mock_fd_notify();
+    }
+
+    return __real_close(fd);
+}
+
+int __wrap_ioctl(int fd, unsigned long request, ...)
+{
+    const mock_fd_ops_t *ops;
+    void *obj, *arg;
+    va_list ap;
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    if ((ops = mock_fd_lookup(fd, &obj))) {
+        if (!ops->ioctl) {
+            errno = ENOTTY;
+            return -1;
+        }
+        return ops->ioctl(obj, request, arg);
+    }
+
+    return __real_ioctl(fd, request, arg);
+}
+
+void *__wrap_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    const mock_fd_ops_t *ops;
+    void *obj;
+
+    if ((ops = mock_fd_lookup(fd, &obj))) {
+        if (!ops->mmap) {
+            errno = ENODEV;
+            return MAP_FAILED;
+        }
+        return ops->mmap(obj, length, prot, flags, offset);
+    }
+
+    return __real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+/*
+ * Mock descriptors report their state through ops->poll, real ones are
+ * polled as usual. The caller sleeps on a per-thread eventfd that every
+ * mock_fd_notify() kicks, or until the earliest deadline a mock gave.
+ */
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    struct pollfd real[nfds + 1];
+    int map[nfds + 1];
+    uint64_t end = timeout < 0 ? UINT64_MAX : bench_now_ns() + timeout * 1000000ULL;
+    waiter_t self;
+    nfds_t i;
+    int mocks = 0, ready = 0;
+
+    for (i = 0; i < nfds; i++) {
+        void *obj;
+
+        if (mock_fd_lookup(fds[i].fd, &obj))
+            mocks++;
+    }
+
+    if (!mocks)
+        return __real_poll(fds, nfds, timeout);
+
+    if (waiter_fd < 0)
+        waiter_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    self.fd = waiter_fd;
+    pthread_mutex_lock(&waiters_mutex);
+    self.next = waiters;
+    waiters = &self;
+    pthread_mutex_unlock(&waiters_mutex);
+
+    for (;;) {
+        uint64_t wake = end, now, value;
+        int count = 0, ret;
+
+        ready = 0;
+        for (i = 0; i < nfds; i++) {
+            const mock_fd_ops_t *ops;
+            void *obj;
+
+            fds[i].revents = 0;
+            if ((ops = mock_fd_lookup(fds[i].fd, &obj))) {
+                uint64_t deadline = 0;
+
+                fds[i].revents = ops->poll(obj, fds[i].events, &deadline);
+                if (deadline && deadline < wake)
+                    wake = deadline;
+            } else if (fds[i].fd >= 0) {
+                real[count] = fds[i];
+                map[count++] = i;
+            }
+        }
+
+        ret = count ? __real_poll(real, count, 0) : 0;
+        for (i = 0; ret > 0 && i < count; i++)
+            fds[map[i]].revents = real[i].revents;
+
+        for (i = 0; i < nfds; i++)
+            if (fds[i].revents)
+                ready++;
+
+        now = bench_now_ns();
+        if (ready || now >= end)
+            break;
+
+        /* sleep until a mock changes, a real fd fires or a deadline passes */
+        real[count].fd = waiter_fd;
+        real[count].events = POLLIN;
+        __real_poll(real, count + 1,
+                wake == UINT64_MAX ? -1 : (int)((wake - now + 999999) / 1000000));
+        if (read(waiter_fd, &value, sizeof(value)) < 0)
+            ;
+    }
+
+    pthread_mutex_lock(&waiters_mutex);
+    {
+        waiter_t **p;
+
+        for (p = &waiters; *p; p = &(*p)->next)
+            if (*p == &self) {
+                *p = self.next;
+                break;
+            }
+    }
+    pthread_mutex_unlock(&waiters_mutex);
+
+    return ready;
+}
+
+/* sysfs lookups of the decoder node are answered from a scratch tree */
+static char sysfs_root[64];
+
+static const char *sysfs_path(const char *path, char *buf, size_t size)
+{
+#define SYSFS_V4L2 "/sys/class/video4linux/"
+    if (!sysfs_root[0] || strncmp(path, SYSFS_V4L2, strlen(SYSFS_V4L2)))
+        return path;
+
+    snprintf(buf, size, "%s/%s", sysfs_root, path + strlen(SYSFS_V4L2));
+    return buf;
+}
+
+DIR *__wrap_opendir(const char *name)
+{
+    char buf[256];
+
+    return __real_opendir(sysfs_path(name, buf, sizeof(buf)));
+}
+
+FILE *__wrap_fopen(const char *path, const char *mode)
+{
+    char buf[256];
+
+    return __real_fopen(sysfs_path(path, buf, sizeof(buf)), mode);
+}
+
+static void mock_sysfs_remove(void)
+{
+    char path[128];
+
+    snprintf(path, sizeof(path), "%s/" MOCK_V4L2_NODE "/name", sysfs_root);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/" MOCK_V4L2_NODE, sysfs_root);
+    rmdir(path);
+    rmdir(sysfs_root);
+}
+
+int mock_sysfs_init(const char *node_name)
+{
+    char path[128];
+    FILE *f;
+
+    snprintf(sysfs_root, sizeof(sysfs_root), "/tmp/vdpau-bench-XXXXXX");
+    if (!mkdtemp(sysfs_root)) {
+        sysfs_root[0] = '\0';
+        return -1;
+    }
+    atexit(mock_sysfs_remove);
+
+    snprintf(path, sizeof(path), "%s/" MOCK_V4L2_NODE, sysfs_root);
+    if (mkdir(path, 0700) < 0)
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/" MOCK_V4L2_NODE "/name", sysfs_root);
+    if (!(f = __real_fopen(path, "w")))
+        return -1;
+    fprintf(f, "%s\n", node_name);
+    fclose(f);
+
+    return 0;
+}
@@ -0,0 +1,301 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/Xlibint.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+
+#include "bench.h"
+
+/*
+ * Headless X11, EGL and GLES2. Calls succeed and draw nothing; what the
+ * bench cares about is counted: imported dma-bufs, texture uploads and
+ * which buffers the GPU may still be reading. A buffer bound to a
+ * texture counts as sampled until the swap after the one presenting it.
+ */
+
+#define MOCK_MAX_SAMPLED 64
+
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+} mock_image_t;
+
+mock_gl_config_t mock_gl = { .extensions = "GL_OES_EGL_image_external" };
+static mock_gl_stats_t stats;
+static pthread_mutex_t gl_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* bound since the last swap, and during the frame on screen */
+static mock_image_t drawing[MOCK_MAX_SAMPLED], showing[MOCK_MAX_SAMPLED];
+static int drawing_count, showing_count;
+static GLuint next_name = 1;
+
+void mock_gl_stats(mock_gl_stats_t *out)
+{
+    pthread_mutex_lock(&gl_mutex);
+    *out = stats;
+    pthread_mutex_unlock(&gl_mutex);
+}
+
+int mock_gl_buffer_sampled(dev_t dev, ino_t ino)
+{
+    int i, sampled = 0;
+
+    pthread_mutex_lock(&gl_mutex);
+    for (i = 0; i < drawing_count; i++)
+        sampled |= drawing[i].dev == dev && drawing[i].ino == ino;
+    for (i = 0; i < showing_count; i++)
+        sampled |= showing[i].dev == dev && showing[i].ino == ino;
+    pthread_mutex_unlock(&gl_mutex);
+
+    return sampled;
+}
+
+/* X11 */
+
+static Screen mock_screen = { .root = 1, .width = 1920, .height = 1080 };
+static __typeof__(*(_XPrivDisplay)0) mock_display = {
+    .default_screen = 0,
+    .nscreens = 1,
+    .screens = &mock_screen,
+};
+
+Status XInitThreads(void) { return 1; }
+Display *XOpenDisplay(_Xconst char *name) { return (Display *)&mock_display; }
+int XCloseDisplay(Display *display) { return 0; }
+char *XDisplayString(Display *display) { return ":0"; }
+void XLockDisplay(Display *display) { }
+void XUnlockDisplay(Display *display) { }
+int XSetWindowBackground(Display *display, Window w, unsigned long pixel) { return 0; }
+
+/* the window sits at the origin of the root window */
+Bool XTranslateCoordinates(Display *display, Window src, Window dst,
+                           int src_x, int src_y, int *dst_x, int *dst_y,
+                           Window *child)
+{
+    *dst_x = src_x;
+    *dst_y = src_y;
+    *child = 0;
+    return True;
+}
+
+/* EGL */
+
+EGLDisplay eglGetDisplay(EGLNativeDisplayType display_id) { return (EGLDisplay)1; }
+EGLint eglGetError(void) { return EGL_SUCCESS; }
+EGLBoolean eglTerminate(EGLDisplay dpy) { return EGL_TRUE; }
+
+EGLBoolean eglInitialize(EGLDisplay dpy, EGLint *major, EGLint *minor)
+{
+    *major = 1;
+    *minor = 4;
+    return EGL_TRUE;
+}
+
+EGLBoolean eglChooseConfig(EGLDisplay dpy, const EGLint *attrib_list,
+                           EGLConfig *configs, EGLint config_size, EGLint *num_config)
+{
+    if (configs && config_size)
+        configs[0] = (EGLConfig)1;
+    *num_config = 1;
+    return EGL_TRUE;
+}
+
+EGLContext eglCreateContext(EGLDisplay dpy, EGLConfig config,
+                            EGLContext share_context, const EGLint *attrib_list)
+{
+    return (EGLContext)(uintptr_t)__atomic_add_fetch(&next_name, 1, __ATOMIC_RELAXED);
+}
+
+EGLBoolean eglDestroyContext(EGLDisplay dpy, EGLContext ctx) { return EGL_TRUE; }
+
+EGLSurface eglCreateWindowSurface(EGLDisplay dpy, EGLConfig config,
+                                  EGLNativeWindowType win, const EGLint *attrib_list)
+{
+    return (EGLSurface)(uintptr_t)__atomic_add_fetch(&next_name, 1, __ATOMIC_RELAXED);
+}
+
+EGLBoolean eglDestroySurface(EGLDisplay dpy, EGLSurface surface) { return EGL_TRUE; }
+
+EGLBoolean eglMakeCurrent(EGLDisplay dpy, EGLSurface draw, EGLSurface read, EGLContext ctx)
+{
+    return EGL_TRUE;
+}
+
+EGLBoolean eglSwapBuffers(EGLDisplay dpy, EGLSurface surface)
+{
+    pthread_mutex_lock(&gl_mutex);
+    memcpy(showing, drawing, drawing_count * sizeof(drawing[0]));
+    showing_count = drawing_count;
+    drawing_count = 0;
+    stats.swaps++;
+    pthread_mutex_unlock(&gl_mutex);
+
+    return EGL_TRUE;
+}
+
+EGLImageKHR eglCreateImageKHR(EGLDisplay dpy, EGLContext ctx, EGLenum target,
+                              EGLClientBuffer buffer, const EGLint *attrib_list)
+{
+    mock_image_t *image;
+    int fd = -1;
+
+    for (; attrib_list && *attrib_list != EGL_NONE; attrib_list += 2)
+        if (attrib_list[0] == EGL_DMA_BUF_PLANE0_FD_EXT)
+            fd = attrib_list[1];
+
+    if (!(image = calloc(1, sizeof(*image))))
+        return EGL_NO_IMAGE_KHR;
+    if (mock_buffer_id(fd, &image->dev, &image->ino) < 0) {
+        pthread_mutex_lock(&gl_mutex);
+        stats.bad_imports++;
+        pthread_mutex_unlock(&gl_mutex);
+        free(image);
+        return EGL_NO_IMAGE_KHR;
+    }
+
+    pthread_mutex_lock(&gl_mutex);
+    stats.images_created++;
+    pthread_mutex_unlock(&gl_mutex);
+
+    return image;
+}
+
+EGLBoolean eglDestroyImageKHR(EGLDisplay dpy, EGLImageKHR image)
+{
+    pthread_mutex_lock(&gl_mutex);
+    stats.images_destroyed++;
+    pthread_mutex_unlock(&gl_mutex);
+    free(image);
+
+    return EGL_TRUE;
+}
+
+/* GLES2 */
+
+void glEGLImageTargetTexture2DOES(GLenum target, GLeglImageOES image)
+{
+    mock_image_t *img = image;
+
+    if (!img)
+        return;
+
+    pthread_mutex_lock(&gl_mutex);
+    if (drawing_count < MOCK_MAX_SAMPLED)
+        drawing[drawing_count++] = *img;
+    pthread_mutex_unlock(&gl_mutex);
+
+    mock_v4l2_presented(img->dev, img->ino);
+}
+
+const GLubyte *glGetString(GLenum name)
+{
+    return (const GLubyte *)(name == GL_EXTENSIONS ? mock_gl.extensions : "mock");
+}
+
+static void mock_upload(GLsizei width, GLsizei height)
+{
+    pthread_mutex_lock(&gl_mutex);
+    stats.tex_uploads++;
+    stats.tex_upload_bytes += (uint64_t)width * height * 4;
+    pthread_mutex_unlock(&gl_mutex);
+}
+
+void glTexImage2D(GLenum target, GLint level, GLint internalformat,
+                  GLsizei width, GLsizei height, GLint border, GLenum format,
+                  GLenum type, const void *pixels)
+{
+    mock_upload(width, height);
+}
+
+void glTexSubImage2D(GLenum target, GLint level, GLint xoffset, GLint yoffset,
+                     GLsizei width, GLsizei height, GLenum format, GLenum type,
+                     const void *pixels)
+{
+    mock_upload(width, height);
+}
+
+void glGenTextures(GLsizei n, GLuint *textures)
+{
+    while (n--)
+        *textures++ = __atomic_add_fetch(&next_name, 1, __ATOMIC_RELAXED);
+}
+
+void glGenFramebuffers(GLsizei n, GLuint *framebuffers)
+{
+    glGenTextures(n, framebuffers);
+}
+
+GLuint glCreateShader(GLenum type)
+{
+    return __atomic_add_fetch(&next_name, 1, __ATOMIC_RELAXED);
+}
+
+GLuint glCreateProgram(void)
+{
+    return __atomic_add_fetch(&next_name, 1, __ATOMIC_RELAXED);
+}
+
+void glGetShaderiv(GLuint shader, GLenum pname, GLint *params)
+{
+    *params = pname == GL_COMPILE_STATUS;
+}
+
+void glGetProgramiv(GLuint program, GLenum pname, GLint *params)
+{
+    *params = pname == GL_LINK_STATUS;
+}
+
+void glGetShaderInfoLog(GLuint shader, GLsizei size, GLsizei *length, GLchar *log)
+{
+    if (length)
+        *length = 0;
+    if (size)
+        log[0] = '\0';
+}
+
+void glGetProgramInfoLog(GLuint program, GLsizei size, GLsizei *length, GLchar *log)
+{
+    glGetShaderInfoLog(program, size, length, log);
+}
+
+GLint glGetAttribLocation(GLuint program, const GLchar *name) { return 0; }
+GLint glGetUniformLocation(GLuint program, const GLchar *name) { return 0; }
+GLenum glCheckFramebufferStatus(GLenum target) { return GL_FRAMEBUFFER_COMPLETE; }
+GLenum glGetError(void) { return GL_NO_ERROR; }
+
+void glActiveTexture(GLenum texture) { }
+void glAttachShader(GLuint program, GLuint shader) { }
+void glBindAttribLocation(GLuint program, GLuint index, const GLchar *name) { }
+void glBindFramebuffer(GLenum target, GLuint framebuffer) { }
+void glBindTexture(GLenum target, GLuint texture) { }
+void glBlendFunc(GLenum sfactor, GLenum dfactor) { }
+void glClear(GLbitfield mask) { }
+void glCompileShader(GLuint shader) { }
+void glDeleteFramebuffers(GLsizei n, const GLuint *framebuffers) { }
+void glDeleteProgram(GLuint program) { }
+void glDeleteShader(GLuint shader) { }
+void glDeleteTextures(GLsizei n, const GLuint *textures) { }
+void glDisable(GLenum cap) { }
+void glDrawArrays(GLenum mode, GLint first, GLsizei count) { }
+void glDrawElements(GLenum mode, GLsizei count, GLenum type, const void *indices) { }
+void glEnable(GLenum cap) { }
+void glEnableVertexAttribArray(GLuint index) { }
+void glFramebufferTexture2D(GLenum target, GLenum attachment, GLenum textarget,
+                            GLuint texture, GLint level) { }
+void glLinkProgram(GLuint program) { }
+void glPixelStorei(GLenum pname, GLint param) { }
+void glShaderSource(GLuint shader, GLsizei count, const GLchar *const *string,
+                    const GLint *length) { }
+void glTexParameteri(GLenum target, GLenum pname, GLint param) { }
+void glUniform1f(GLint location, GLfloat v0) { }
+void glUniform1i(GLint location, GLint v0) { }
+void glUniform3fv(GLint location, GLsizei count, const GLfloat *value) { }
+void glUseProgram(GLuint program) { }
+void glVertexAttribPointer(GLuint index, GLint size, GLenum type, GLboolean normalized,
+                           GLsizei stride, const void *pointer) { }
+void glViewport(GLint x, GLint y, GLsizei width, GLsizei height) { }
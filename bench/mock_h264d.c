@@ -0,0 +1,267 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+#include <linux/v4l2-controls.h>
+
+#include "bench.h"
+#include "h264d.h"
+
+/*
+ * Stand-in for librkdec-h264d. It understands the NAL layout written by
+ * stream.c only:
+ *
+ *   SPS   [start code] 67 <sps id> <version>
+ *   PPS   [start code] 68 <pps id> <sps id> <version>
+ *   slice [start code] 65|41|01 <pps id> ...
+ *
+ * The ids and versions of the parameter sets a slice refers to go into
+ * the decode parameters, so the mock hardware can tell whether the
+ * controls it ended up with are the ones this frame was parsed against.
+ * Reference handling is a plain sliding window of max_refs pictures,
+ * pictures with nal_ref_idc 0 are handed back as soon as they are ready.
+ */
+
+#define MOCK_MAX_REFS 16
+#define MOCK_MAX_PICTURES 32
+
+typedef struct
+{
+    uint8_t sps_version[32];
+    uint8_t pps_sps[256];
+    uint8_t pps_version[256];
+
+    struct v4l2_ctrl_h264_sps sps;
+    struct v4l2_ctrl_h264_pps pps;
+    struct v4l2_ctrl_h264_scaling_matrix scaling;
+    struct v4l2_ctrl_h264_slice_param slice;
+    struct v4l2_ctrl_h264_decode_param decode;
+
+    int idr, ref;
+    int dpb[MOCK_MAX_REFS];
+    int dpb_count;
+    int unrefed[MOCK_MAX_PICTURES];
+    int unrefed_head, unrefed_count;
+    uint32_t owned;
+    int busy;
+} mock_h264d_t;
+
+mock_h264d_config_t mock_h264d = { .max_refs = 4 };
+static mock_h264d_stats_t stats;
+
+#define STAT_ADD(field, n) __atomic_fetch_add(&stats.field, n, __ATOMIC_RELAXED)
+
+void mock_h264d_stats(mock_h264d_stats_t *out)
+{
+    out->frames = __atomic_load_n(&stats.frames, __ATOMIC_RELAXED);
+    out->nals = __atomic_load_n(&stats.nals, __ATOMIC_RELAXED);
+    out->junk_nals = __atomic_load_n(&stats.junk_nals, __ATOMIC_RELAXED);
+    out->unneeded_nals = __atomic_load_n(&stats.unneeded_nals, __ATOMIC_RELAXED);
+    out->concurrent_calls = __atomic_load_n(&stats.concurrent_calls, __ATOMIC_RELAXED);
+    out->duplicate_pictures = __atomic_load_n(&stats.duplicate_pictures, __ATOMIC_RELAXED);
+}
+
+/*
+ * The real parser isn't thread safe either, callers must serialize.
+ * Yielding inside every call lets a racing thread walk in even on a
+ * single CPU.
+ */
+static void enter(mock_h264d_t *d)
+{
+    if (__atomic_fetch_add(&d->busy, 1, __ATOMIC_ACQUIRE))
+        STAT_ADD(concurrent_calls, 1);
+    sched_yield();
+}
+
+static void leave(mock_h264d_t *d)
+{
+    __atomic_fetch_sub(&d->busy, 1, __ATOMIC_RELEASE);
+}
+
+void *h264d_init(void)
+{
+    return calloc(1, sizeof(mock_h264d_t));
+}
+
+void h264d_deinit(void *dec)
+{
+    free(dec);
+}
+
+static void unref(mock_h264d_t *d, int index)
+{
+    d->unrefed[(d->unrefed_head + d->unrefed_count++) % MOCK_MAX_PICTURES] = index;
+}
+
+int h264d_prepare_data_raw(void *dec, void *buffer, size_t size,
+                           size_t *num_ctrls, uint32_t *ctrl_ids,
+                           void **payloads, uint32_t *payload_sizes)
+{
+    mock_h264d_t *d = dec;
+    const uint8_t *b = buffer;
+    size_t hdr;
+    int type, ret = 0;
+
+    enter(d);
+    *num_ctrls = 0;
+
+    if (size >= 4 && !b[0] && !b[1] && b[2] == 1)
+        hdr = 3;
+    else if (size >= 5 && !b[0] && !b[1] && !b[2] && b[3] == 1)
+        hdr = 4;
+    else
+        hdr = size;
+
+    /* no start code or nothing behind it */
+    if (hdr + 1 >= size) {
+        STAT_ADD(junk_nals, 1);
+        leave(d);
+        return 0;
+    }
+
+    STAT_ADD(nals, 1);
+    b += hdr;
+    size -= hdr;
+    type = b[0] & 0x1f;
+    if (!((type >= 1 && type <= 5) || type == 7 || type == 8))
+        STAT_ADD(unneeded_nals, 1);
+
+    switch (type) {
+    case 7:
+        if (size >= 3)
+            d->sps_version[b[1] % 32] = b[2];
+        break;
+    case 8:
+        if (size >= 4) {
+            d->pps_sps[b[1]] = b[2] % 32;
+            d->pps_version[b[1]] = b[3];
+        }
+        break;
+    case 1:
+    case 5: {
+        int pps_id = b[1], sps_id = d->pps_sps[pps_id];
+
+        memset(&d->sps, 0, sizeof(d->sps));
+        d->sps.seq_parameter_set_id = sps_id;
+        d->sps.level_idc = d->sps_version[sps_id];
+        d->sps.profile_idc = 100;
+        d->sps.chroma_format_idc = 1;
+        d->sps.max_num_ref_frames = mock_h264d.max_refs;
+        d->sps.flags = V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY;
+
+        memset(&d->pps, 0, sizeof(d->pps));
+        d->pps.pic_parameter_set_id = pps_id;
+        d->pps.seq_parameter_set_id = sps_id;
+        d->pps.pic_init_qs_minus26 = d->pps_version[pps_id];
+
+        memset(&d->slice, 0, sizeof(d->slice));
+        d->slice.size = size;
+        d->slice.pic_parameter_set_id = pps_id;
+        d->slice.slice_type = type == 5 ? 2 : 0;
+
+        memset(&d->decode, 0, sizeof(d->decode));
+        d->decode.num_slices = 1;
+        d->decode.idr_pic_flag = type == 5;
+        d->decode.nal_ref_idc = (b[0] >> 5) & 3;
+        d->decode.top_field_order_cnt = sps_id * 1000 + d->sps.level_idc;
+        d->decode.bottom_field_order_cnt = pps_id * 1000 + d->pps.pic_init_qs_minus26;
+        d->idr = type == 5;
+        d->ref = d->decode.nal_ref_idc != 0;
+
+        ctrl_ids[0] = V4L2_CID_MPEG_VIDEO_H264_SPS;
+        payloads[0] = &d->sps;
+        payload_sizes[0] = sizeof(d->sps);
+        ctrl_ids[1] = V4L2_CID_MPEG_VIDEO_H264_PPS;
+        payloads[1] = &d->pps;
+        payload_sizes[1] = sizeof(d->pps);
+        ctrl_ids[2] = V4L2_CID_MPEG_VIDEO_H264_SCALING_MATRIX;
+        payloads[2] = &d->scaling;
+        payload_sizes[2] = sizeof(d->scaling);
+        ctrl_ids[3] = V4L2_CID_MPEG_VIDEO_H264_SLICE_PARAM;
+        payloads[3] = &d->slice;
+        payload_sizes[3] = sizeof(d->slice);
+        ctrl_ids[4] = V4L2_CID_MPEG_VIDEO_H264_DECODE_PARAM;
+        payloads[4] = &d->decode;
+        payload_sizes[4] = sizeof(d->decode);
+        *num_ctrls = 5;
+        ret = 1;
+        break;
+    }
+    }
+
+    leave(d);
+    return ret;
+}
+
+bool h264d_prepare_data(void *dec, struct v4l2_buffer *buffer,
+                        size_t *num_ctrls, uint32_t *ctrl_ids,
+                        void **payloads, uint32_t *payload_sizes)
+{
+    return false;
+}
+
+void h264d_update_info(void *dec, VdpDecoderProfile profile,
+                       int width, int height, VdpPictureInfoH264 *info)
+{
+    mock_h264d_t *d = dec;
+
+    enter(d);
+    leave(d);
+}
+
+void h264d_picture_ready(void *dec, int index)
+{
+    mock_h264d_t *d = dec;
+    int i;
+
+    enter(d);
+    STAT_ADD(frames, 1);
+
+    if (index < 0 || index >= MOCK_MAX_PICTURES || (d->owned & (1u << index))) {
+        STAT_ADD(duplicate_pictures, 1);
+        leave(d);
+        return;
+    }
+    d->owned |= 1u << index;
+
+    if (!d->ref) {
+        unref(d, index);
+        leave(d);
+        return;
+    }
+
+    /* an IDR drops every reference, otherwise the oldest one goes */
+    if (d->idr) {
+        for (i = 0; i < d->dpb_count; i++)
+            unref(d, d->dpb[i]);
+        d->dpb_count = 0;
+    } else if (d->dpb_count >= mock_h264d.max_refs) {
+        unref(d, d->dpb[0]);
+        memmove(&d->dpb[0], &d->dpb[1], --d->dpb_count * sizeof(d->dpb[0]));
+    }
+    d->dpb[d->dpb_count++] = index;
+
+    leave(d);
+}
+
+int h264d_get_picture(void *dec)
+{
+    return -1;
+}
+
+int h264d_get_unrefed_picture(void *dec)
+{
+    mock_h264d_t *d = dec;
+    int index = -1;
+
+    enter(d);
+    if (d->unrefed_count) {
+        index = d->unrefed[d->unrefed_head];
+        d->unrefed_head = (d->unrefed_head + 1) % MOCK_MAX_PICTURES;
+        d->unrefed_count--;
+        d->owned &= ~(1u << index);
+    }
+    leave(d);
+
+    return index;
+}
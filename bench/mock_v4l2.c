@@ -0,0 +1,679 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+#include <linux/v4l2-controls.h>
+
+#include "bench.h"
+#include "mock.h"
+
+/*
+ * Stateless H.264 decoder node as the library uses it: bitstream buffers
+ * with per-buffer config stores on the OUTPUT queue, NV12 frames on the
+ * CAPTURE queue. A thread plays the hardware, taking jobs in queue order
+ * and spending hw_us on each, so the library's pipelining shows up in
+ * the frame rate just as on the board.
+ *
+ * Controls set on a config store are applied when its job starts and
+ * controls not set keep their current value.
+ */
+
+#define MOCK_INPUTS 8
+#define MOCK_CAPTURES VIDEO_MAX_FRAME
+#define MOCK_STORES (MOCK_INPUTS + 1)
+#define MOCK_STAMP_MAGIC 0x42504456
+
+#define PARAM_SPS (1 << 0)
+#define PARAM_PPS (1 << 1)
+#define PARAM_SCALING (1 << 2)
+#define PARAM_DECODE (1 << 3)
+
+enum { BUF_DEQUEUED, BUF_QUEUED, BUF_ACTIVE, BUF_DONE };
+
+typedef struct
+{
+    uint32_t set;
+    struct v4l2_ctrl_h264_sps sps;
+    struct v4l2_ctrl_h264_pps pps;
+    struct v4l2_ctrl_h264_scaling_matrix scaling;
+    struct v4l2_ctrl_h264_decode_param decode;
+} mock_params_t;
+
+typedef struct
+{
+    int items[MOCK_CAPTURES];
+    int head, count;
+} ring_t;
+
+typedef struct
+{
+    int fd;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int quit;
+    int streaming;
+
+    uint32_t width, height;
+
+    size_t input_size;
+    int num_inputs;
+    int input_fds[MOCK_INPUTS];
+    int input_state[MOCK_INPUTS];
+    uint32_t input_store[MOCK_INPUTS];
+    ring_t jobs, inputs_done;
+
+    size_t capture_size;
+    int num_captures;
+    int capture_fds[MOCK_CAPTURES];
+    uint8_t *capture_maps[MOCK_CAPTURES];
+    dev_t capture_dev[MOCK_CAPTURES];
+    ino_t capture_ino[MOCK_CAPTURES];
+    int capture_state[MOCK_CAPTURES];
+    ring_t captures, captures_done;
+
+    mock_params_t stores[MOCK_STORES];
+    mock_params_t current;
+    uint32_t seq;
+    /* last frame put on screen */
+    uint32_t presented;
+} mock_dev_t;
+
+#define MOCK_MAX_DEVS 4
+
+mock_v4l2_config_t mock_v4l2;
+static mock_v4l2_stats_t stats;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* open devices, to tell which frame a buffer put on screen holds */
+static mock_dev_t *devs[MOCK_MAX_DEVS];
+static pthread_mutex_t devs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define STAT_ADD(field, n) __atomic_fetch_add(&stats.field, n, __ATOMIC_RELAXED)
+
+void mock_v4l2_stats(mock_v4l2_stats_t *out)
+{
+    pthread_mutex_lock(&stats_mutex);
+    *out = stats;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+void mock_v4l2_peak_reset(void)
+{
+    pthread_mutex_lock(&stats_mutex);
+    stats.max_jobs_queued = 0;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+static void ring_push(ring_t *r, int item)
+{
+    r->items[(r->head + r->count++) % MOCK_CAPTURES] = item;
+}
+
+static int ring_pop(ring_t *r)
+{
+    int item;
+
+    if (!r->count)
+        return -1;
+
+    item = r->items[r->head];
+    r->head = (r->head + 1) % MOCK_CAPTURES;
+    r->count--;
+    return item;
+}
+
+uint8_t mock_v4l2_pixel(uint32_t frame, int plane, uint32_t x, uint32_t y)
+{
+    return (x * 7 + y * 13 + frame * 31 + plane * 101) & 0xff;
+}
+
+uint32_t mock_v4l2_stamp(const uint8_t *luma)
+{
+    uint32_t stamp[2];
+
+    memcpy(stamp, luma, sizeof(stamp));
+    return stamp[0] == MOCK_STAMP_MAGIC ? stamp[1] : UINT32_MAX;
+}
+
+/*
+ * Frames are shown in decode order, each one once or repeated. Any
+ * other stamp means the buffer was decoded into again before it made
+ * it to the screen.
+ */
+void mock_v4l2_presented(dev_t dev, ino_t ino)
+{
+    int d, i;
+
+    pthread_mutex_lock(&devs_mutex);
+    for (d = 0; d < MOCK_MAX_DEVS; d++) {
+        mock_dev_t *m = devs[d];
+
+        if (!m)
+            continue;
+        pthread_mutex_lock(&m->mutex);
+        for (i = 0; i < m->num_captures; i++) {
+            uint32_t seq;
+
+            if (m->capture_dev[i] != dev || m->capture_ino[i] != ino)
+                continue;
+            seq = mock_v4l2_stamp(m->capture_maps[i]);
+            if (seq != m->presented && seq != m->presented + 1)
+                STAT_ADD(wrong_frame_shown, 1);
+            m->presented = seq;
+        }
+        pthread_mutex_unlock(&m->mutex);
+    }
+    pthread_mutex_unlock(&devs_mutex);
+}
+
+static void mock_write_frame(mock_dev_t *m, int index, uint32_t seq)
+{
+    uint8_t *luma = m->capture_maps[index];
+    uint8_t *chroma = luma + m->width * m->height;
+    uint32_t stamp[2] = { MOCK_STAMP_MAGIC, seq };
+    uint32_t x, y;
+
+    if (!mock_v4l2.fill) {
+        memcpy(luma, stamp, sizeof(stamp));
+        memcpy(chroma, stamp, sizeof(stamp));
+        return;
+    }
+
+    for (y = 0; y < m->height; y++)
+        for (x = 0; x < m->width; x++)
+            luma[y * m->width + x] = mock_v4l2_pixel(seq, 0, x, y);
+
+    for (y = 0; y < m->height / 2; y++)
+        for (x = 0; x < m->width; x++)
+            chroma[y * m->width + x] = mock_v4l2_pixel(seq, 1, x, y);
+}
+
+/* the parameters the parser meant this frame to use, see mock_h264d.c */
+static int mock_params_stale(const mock_params_t *p)
+{
+    const struct v4l2_ctrl_h264_decode_param *d = &p->decode;
+
+    if ((p->set & (PARAM_SPS | PARAM_PPS)) != (PARAM_SPS | PARAM_PPS))
+        return 1;
+
+    return d->top_field_order_cnt !=
+               p->sps.seq_parameter_set_id * 1000 + p->sps.level_idc ||
+           d->bottom_field_order_cnt !=
+               p->pps.pic_parameter_set_id * 1000 + p->pps.pic_init_qs_minus26 ||
+           p->pps.seq_parameter_set_id != p->sps.seq_parameter_set_id;
+}
+
+static void mock_apply_store(mock_dev_t *m, mock_params_t *store)
+{
+    if (store->set & PARAM_SPS)
+        m->current.sps = store->sps;
+    if (store->set & PARAM_PPS)
+        m->current.pps = store->pps;
+    if (store->set & PARAM_SCALING)
+        m->current.scaling = store->scaling;
+    if (store->set & PARAM_DECODE)
+        m->current.decode = store->decode;
+    m->current.set |= store->set;
+    store->set = 0;
+}
+
+/* the decode time of one job, cut short when the stream is turned off */
+static void mock_hw_sleep(mock_dev_t *m, int us)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += us / 1000000;
+    ts.tv_nsec += (us % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    while (m->streaming && !m->quit && pthread_cond_timedwait(&m->cond, &m->mutex, &ts) != ETIMEDOUT)
+        ;
+}
+
+static void *mock_hw_thread(void *arg)
+{
+    mock_dev_t *m = arg;
+    struct timespec cpu0, cpu1;
+
+    pthread_mutex_lock(&m->mutex);
+    while (!m->quit) {
+        int input, capture;
+        uint32_t seq;
+
+        if (!m->streaming || !m->jobs.count || !m->captures.count) {
+            pthread_cond_wait(&m->cond, &m->mutex);
+            continue;
+        }
+
+        input = ring_pop(&m->jobs);
+        capture = ring_pop(&m->captures);
+        m->input_state[input] = BUF_ACTIVE;
+        m->capture_state[capture] = BUF_ACTIVE;
+
+        mock_apply_store(m, &m->stores[m->input_store[input] % MOCK_STORES]);
+        if (mock_params_stale(&m->current))
+            STAT_ADD(stale_params, 1);
+        seq = ++m->seq;
+        pthread_mutex_unlock(&m->mutex);
+
+        if (mock_drm_buffer_shown(m->capture_dev[capture], m->capture_ino[capture]) ||
+            mock_gl_buffer_sampled(m->capture_dev[capture], m->capture_ino[capture]))
+            STAT_ADD(overwrote_shown, 1);
+
+        if (mock_v4l2.hw_us) {
+            pthread_mutex_lock(&m->mutex);
+            mock_hw_sleep(m, mock_v4l2.hw_us);
+            pthread_mutex_unlock(&m->mutex);
+        }
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+        mock_write_frame(m, capture, seq);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+        mock_cpu_exclude((cpu1.tv_sec - cpu0.tv_sec) * 1000000000ULL
+                + cpu1.tv_nsec - cpu0.tv_nsec);
+        STAT_ADD(jobs, 1);
+
+        pthread_mutex_lock(&m->mutex);
+        m->input_state[input] = BUF_DONE;
+        ring_push(&m->inputs_done, input);
+        m->capture_state[capture] = BUF_DONE;
+        ring_push(&m->captures_done, capture);
+        pthread_cond_broadcast(&m->cond);
+        pthread_mutex_unlock(&m->mutex);
+        mock_fd_notify();
+        pthread_mutex_lock(&m->mutex);
+    }
+    pthread_mutex_unlock(&m->mutex);
+
+    return NULL;
+}
+
+static int mock_memfd(const char *name, size_t size)
+{
+    int fd = memfd_create(name, MFD_CLOEXEC);
+
+    if (fd >= 0 && ftruncate(fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void mock_free_inputs(mock_dev_t *m)
+{
+    int i;
+
+    for (i = 0; i < m->num_inputs; i++)
+        close(m->input_fds[i]);
+    m->num_inputs = 0;
+}
+
+static void mock_free_captures(mock_dev_t *m)
+{
+    int i;
+
+    for (i = 0; i < m->num_captures; i++) {
+        munmap(m->capture_maps[i], m->capture_size);
+        close(m->capture_fds[i]);
+    }
+    m->num_captures = 0;
+}
+
+static int mock_reqbufs(mock_dev_t *m, struct v4l2_requestbuffers *req)
+{
+    uint32_t i;
+
+    if (req->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+        mock_free_inputs(m);
+        req->count = req->count < MOCK_INPUTS ? req->count : MOCK_INPUTS;
+        for (i = 0; i < req->count; i++) {
+            if ((m->input_fds[i] = mock_memfd("mock-bitstream", m->input_size)) < 0)
+                return -1;
+            m->input_state[i] = BUF_DEQUEUED;
+            m->num_inputs = i + 1;
+        }
+        return 0;
+    }
+
+    if (req->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        mock_free_captures(m);
+        req->count = req->count < MOCK_CAPTURES ? req->count : MOCK_CAPTURES;
+        m->capture_size = m->width * m->height * 3 / 2;
+        for (i = 0; i < req->count; i++) {
+            int fd = mock_memfd("mock-frame", m->capture_size);
+
+            if (fd < 0)
+                return -1;
+            m->capture_fds[i] = fd;
+            m->capture_maps[i] = mmap(NULL, m->capture_size,
+                    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            mock_buffer_id(fd, &m->capture_dev[i], &m->capture_ino[i]);
+            m->capture_state[i] = BUF_DEQUEUED;
+            m->num_captures = i + 1;
+        }
+        return 0;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+static int mock_qbuf(mock_dev_t *m, struct v4l2_buffer *buf)
+{
+    int i, in_flight;
+
+    if (buf->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+        if (mock_v4l2.fail_qbuf_input && !--mock_v4l2.fail_qbuf_input) {
+            errno = EIO;
+            return -1;
+        }
+        if (buf->index >= m->num_inputs || m->input_state[buf->index] != BUF_DEQUEUED) {
+            STAT_ADD(double_queued, 1);
+            errno = EINVAL;
+            return -1;
+        }
+        m->input_state[buf->index] = BUF_QUEUED;
+        m->input_store[buf->index] = buf->config_store;
+        ring_push(&m->jobs, buf->index);
+        /* waiting and the one being decoded */
+        for (i = 0, in_flight = m->jobs.count; i < m->num_inputs; i++)
+            in_flight += m->input_state[i] == BUF_ACTIVE;
+        if (in_flight > stats.max_jobs_queued)
+            stats.max_jobs_queued = in_flight;
+    } else {
+        if (buf->index >= m->num_captures || m->capture_state[buf->index] != BUF_DEQUEUED) {
+            STAT_ADD(double_queued, 1);
+            errno = EINVAL;
+            return -1;
+        }
+        m->capture_state[buf->index] = BUF_QUEUED;
+        ring_push(&m->captures, buf->index);
+    }
+
+    pthread_cond_broadcast(&m->cond);
+    return 0;
+}
+
+static int mock_dqbuf(mock_dev_t *m, struct v4l2_buffer *buf)
+{
+    int index;
+
+    if (buf->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+        if ((index = ring_pop(&m->inputs_done)) >= 0)
+            m->input_state[index] = BUF_DEQUEUED;
+    } else {
+        if ((index = ring_pop(&m->captures_done)) >= 0)
+            m->capture_state[index] = BUF_DEQUEUED;
+    }
+
+    if (index < 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    buf->index = index;
+    return 0;
+}
+
+static int mock_s_ext_ctrls(mock_dev_t *m, struct v4l2_ext_controls *ctrls)
+{
+    mock_params_t *store = &m->stores[ctrls->config_store % MOCK_STORES];
+    uint32_t i;
+
+    STAT_ADD(ext_ctrls, 1);
+    if (mock_v4l2.fail_ext_ctrls && !--mock_v4l2.fail_ext_ctrls) {
+        errno = EIO;
+        return -1;
+    }
+
+    for (i = 0; i < ctrls->count; i++) {
+        struct v4l2_ext_control *c = &ctrls->controls[i];
+
+        switch (c->id) {
+        case V4L2_CID_MPEG_VIDEO_H264_SPS:
+            memcpy(&store->sps, c->ptr, sizeof(store->sps));
+            store->set |= PARAM_SPS;
+            STAT_ADD(sps_sets, 1);
+            break;
+        case V4L2_CID_MPEG_VIDEO_H264_PPS:
+            memcpy(&store->pps, c->ptr, sizeof(store->pps));
+            store->set |= PARAM_PPS;
+            STAT_ADD(pps_sets, 1);
+            break;
+        case V4L2_CID_MPEG_VIDEO_H264_SCALING_MATRIX:
+            memcpy(&store->scaling, c->ptr, sizeof(store->scaling));
+            store->set |= PARAM_SCALING;
+            break;
+        case V4L2_CID_MPEG_VIDEO_H264_DECODE_PARAM:
+            memcpy(&store->decode, c->ptr, sizeof(store->decode));
+            store->set |= PARAM_DECODE;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static void mock_stream_off(mock_dev_t *m)
+{
+    int i;
+
+    m->streaming = 0;
+    while (1) {
+        int active = 0;
+
+        for (i = 0; i < m->num_inputs; i++)
+            active |= m->input_state[i] == BUF_ACTIVE;
+        if (!active)
+            break;
+        pthread_cond_wait(&m->cond, &m->mutex);
+    }
+
+    /* like the kernel, every buffer goes back to the application */
+    memset(&m->jobs, 0, sizeof(m->jobs));
+    memset(&m->inputs_done, 0, sizeof(m->inputs_done));
+    memset(&m->captures, 0, sizeof(m->captures));
+    memset(&m->captures_done, 0, sizeof(m->captures_done));
+    for (i = 0; i < m->num_inputs; i++)
+        m->input_state[i] = BUF_DEQUEUED;
+    for (i = 0; i < m->num_captures; i++)
+        m->capture_state[i] = BUF_DEQUEUED;
+}
+
+static int mock_ioctl(void *obj, unsigned long request, void *arg)
+{
+    mock_dev_t *m = obj;
+    int ret = 0;
+
+    pthread_mutex_lock(&m->mutex);
+
+    switch (request) {
+    case VIDIOC_S_FMT: {
+        struct v4l2_format *f = arg;
+
+        if (f->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+            m->input_size = f->fmt.pix_mp.plane_fmt[0].sizeimage;
+        } else {
+            m->width = (f->fmt.pix_mp.width + 15) & ~15;
+            m->height = (f->fmt.pix_mp.height + 15) & ~15;
+            f->fmt.pix_mp.width = m->width;
+            f->fmt.pix_mp.height = m->height;
+        }
+        break;
+    }
+    case VIDIOC_REQBUFS:
+        ret = mock_reqbufs(m, arg);
+        break;
+    case VIDIOC_QUERYBUF: {
+        struct v4l2_buffer *b = arg;
+
+        if (b->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE && b->index < m->num_inputs) {
+            b->m.planes[0].length = m->input_size;
+            b->m.planes[0].m.mem_offset = b->index * m->input_size;
+        } else if (b->index < m->num_captures) {
+            b->m.planes[0].length = m->capture_size;
+        } else {
+            errno = EINVAL;
+            ret = -1;
+        }
+        break;
+    }
+    case VIDIOC_EXPBUF: {
+        struct v4l2_exportbuffer *e = arg;
+
+        if (e->index >= m->num_captures) {
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+        e->fd = fcntl(m->capture_fds[e->index], F_DUPFD_CLOEXEC, 0);
+        ret = e->fd < 0 ? -1 : 0;
+        break;
+    }
+    case VIDIOC_STREAMON:
+        m->streaming = 1;
+        pthread_cond_broadcast(&m->cond);
+        break;
+    case VIDIOC_STREAMOFF:
+        if (m->streaming)
+            mock_stream_off(m);
+        break;
+    case VIDIOC_S_EXT_CTRLS:
+        ret = mock_s_ext_ctrls(m, arg);
+        break;
+    case VIDIOC_QBUF:
+        ret = mock_qbuf(m, arg);
+        break;
+    case VIDIOC_DQBUF:
+        ret = mock_dqbuf(m, arg);
+        break;
+    default:
+        errno = ENOTTY;
+        ret = -1;
+        break;
+    }
+
+    pthread_mutex_unlock(&m->mutex);
+
+    return ret;
+}
+
+static short mock_poll(void *obj, short events, uint64_t *deadline)
+{
+    mock_dev_t *m = obj;
+    short revents = 0;
+
+    if (mock_v4l2.spin_dqbuf) {
+        if (events & POLLIN)
+            usleep(1000);
+        return events & (POLLIN | POLLOUT);
+    }
+
+    pthread_mutex_lock(&m->mutex);
+    if (!m->streaming)
+        revents |= POLLERR;
+    if ((events & POLLIN) && m->captures_done.count)
+        revents |= POLLIN;
+    if ((events & POLLOUT) && m->inputs_done.count)
+        revents |= POLLOUT;
+    pthread_mutex_unlock(&m->mutex);
+
+    return revents;
+}
+
+static void *mock_mmap(void *obj, size_t length, int prot, int flags, off_t offset)
+{
+    mock_dev_t *m = obj;
+    int index = m->input_size ? offset / m->input_size : -1;
+
+    if (index < 0 || index >= m->num_inputs || length > m->input_size) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    return mmap(NULL, length, prot, flags, m->input_fds[index], 0);
+}
+
+static void mock_close(void *obj)
+{
+    mock_dev_t *m = obj;
+    int d;
+
+    pthread_mutex_lock(&devs_mutex);
+    for (d = 0; d < MOCK_MAX_DEVS; d++)
+        if (devs[d] == m)
+            devs[d] = NULL;
+    pthread_mutex_unlock(&devs_mutex);
+
+    pthread_mutex_lock(&m->mutex);
+    if (m->streaming)
+        mock_stream_off(m);
+    m->quit = 1;
+    pthread_cond_broadcast(&m->cond);
+    pthread_mutex_unlock(&m->mutex);
+
+    pthread_join(m->thread, NULL);
+    mock_free_inputs(m);
+    mock_free_captures(m);
+    pthread_cond_destroy(&m->cond);
+    pthread_mutex_destroy(&m->mutex);
+    free(m);
+}
+
+static const mock_fd_ops_t mock_v4l2_ops = {
+    .ioctl = mock_ioctl,
+    .poll = mock_poll,
+    .mmap = mock_mmap,
+    .close = mock_close,
+};
+
+int mock_v4l2_open(const char *path, int flags)
+{
+    pthread_condattr_t attr;
+    mock_dev_t *m;
+    int d;
+
+    if (strcmp(path, MOCK_V4L2_PATH))
+        return MOCK_NOT_MINE;
+
+    if (!(m = calloc(1, sizeof(*m))))
+        return -1;
+
+    pthread_mutex_init(&m->mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&m->thread, NULL, mock_hw_thread, m)) {
+        free(m);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if ((m->fd = mock_fd_open(&mock_v4l2_ops, m)) < 0) {
+        mock_close(m);
+        return -1;
+    }
+
+    pthread_mutex_lock(&devs_mutex);
+    for (d = 0; d < MOCK_MAX_DEVS; d++)
+        if (!devs[d]) {
+            devs[d] = m;
+            break;
+        }
+    pthread_mutex_unlock(&devs_mutex);
+
+    return m->fd;
+}
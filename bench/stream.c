@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+/*
+ * Canned Annex B streams in the layout mock_h264d.c parses. Slice data
+ * is pseudo random with emulation prevention applied, the first NAL of
+ * every access unit has a four byte start code like most muxers write.
+ * Every buffer handed to the decoder holds one NAL, like the players
+ * passing a frame slice by slice.
+ */
+
+typedef struct
+{
+    const char *name;
+    uint32_t width, height;
+    uint32_t fps;
+    uint32_t kbps;
+    uint32_t gop;
+    uint32_t slices;
+    uint32_t frames;
+    /* alternate between two PPS ids, change the PPS every n-th IDR */
+    int pps_switch;
+    int pps_update;
+    /* access unit delimiter and SEI in front of every frame, filler behind */
+    int sei;
+    /* every other P frame is not used for reference */
+    int nonref;
+} stream_desc_t;
+
+static const stream_desc_t streams[] = {
+    { "1080p", 1920, 1080, 30, 8000, 60, 1, 600, 0, 4, 0, 0 },
+    { "4k", 3840, 2160, 30, 20000, 60, 4, 300, 0, 4, 0, 0 },
+    { "720p", 1280, 720, 60, 4000, 120, 1, 600, 0, 2, 0, 1 },
+    { "cif-sei", 352, 288, 30, 500, 30, 2, 600, 1, 1, 1, 0 },
+};
+
+#define STREAM_COUNT (sizeof(streams) / sizeof(streams[0]))
+
+void bench_stream_list(FILE *f)
+{
+    int i;
+
+    for (i = 0; i < STREAM_COUNT; i++)
+        fprintf(f, "  %-8s %ux%u %u fps %u kbit/s, %u frames\n", streams[i].name,
+                streams[i].width, streams[i].height, streams[i].fps,
+                streams[i].kbps, streams[i].frames);
+}
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size, alloc;
+    uint32_t seed;
+} writer_t;
+
+static uint32_t lcg(uint32_t *seed)
+{
+    *seed = *seed * 1664525 + 1013904223;
+    return *seed >> 8;
+}
+
+static int put(writer_t *w, uint8_t b)
+{
+    if (w->size == w->alloc) {
+        size_t alloc = w->alloc ? w->alloc * 2 : 1 << 20;
+        uint8_t *data = realloc(w->data, alloc);
+
+        if (!data)
+            return -1;
+        w->data = data;
+        w->alloc = alloc;
+    }
+
+    w->data[w->size++] = b;
+    return 0;
+}
+
+/* write a NAL, inserting emulation prevention bytes after the header */
+static int put_nal(writer_t *w, int long_start, const uint8_t *header,
+                   size_t header_size, size_t payload)
+{
+    int zeros = 0, ret = 0;
+    size_t i;
+
+    if (long_start)
+        ret |= put(w, 0);
+    ret |= put(w, 0);
+    ret |= put(w, 0);
+    ret |= put(w, 1);
+
+    for (i = 0; i < header_size; i++)
+        ret |= put(w, header[i]);
+
+    for (i = 0; i < payload; i++) {
+        uint8_t b = lcg(&w->seed);
+
+        /* runs of zeros now and then, as in real slice data */
+        if (lcg(&w->seed) % 97 == 0)
+            b = 0;
+        if (i == payload - 1)
+            b = 0x80;
+
+        if (zeros >= 2 && b <= 3) {
+            ret |= put(w, 3);
+            zeros = 0;
+        }
+        ret |= put(w, b);
+        zeros = b ? 0 : zeros + 1;
+    }
+
+    return ret;
+}
+
+int bench_stream_open(bench_stream_t *s, const char *name, uint32_t frames)
+{
+    const stream_desc_t *d = NULL;
+    writer_t w = { NULL, 0, 0, 12345 };
+    size_t *offsets;
+    uint32_t f, i, n, avg;
+    uint8_t pps_version[2] = { 1, 1 };
+    uint8_t sps_version = 1;
+    int ret = 0;
+
+    for (i = 0; i < STREAM_COUNT; i++)
+        if (!strcmp(name, streams[i].name))
+            d = &streams[i];
+    if (!d)
+        return -1;
+
+    memset(s, 0, sizeof(*s));
+    s->name = d->name;
+    s->width = d->width;
+    s->height = d->height;
+    s->frame_count = frames ? frames : d->frames;
+    s->frames = calloc(s->frame_count, sizeof(*s->frames));
+    /* NAL offsets first, the data moves while it grows */
+    offsets = calloc(s->frame_count * BENCH_MAX_NALS, sizeof(*offsets));
+    if (!s->frames || !offsets) {
+        free(offsets);
+        bench_stream_close(s);
+        return -1;
+    }
+
+    avg = d->kbps * 1000 / 8 / d->fps;
+    for (f = 0; f < s->frame_count; f++) {
+        bench_frame_t *frame = &s->frames[f];
+        int idr = f % d->gop == 0;
+        int ref = idr || !d->nonref || (f % d->gop) % 2 == 0;
+        int pps_id = d->pps_switch ? 1 + (f & 1) : 1;
+        size_t start = w.size, size;
+        size_t *off = &offsets[f * BENCH_MAX_NALS];
+        uint32_t nal = 0;
+
+#define PUT_NAL(header, payload) do { \
+            off[nal] = w.size; \
+            ret |= put_nal(&w, !nal, header, sizeof(header), payload); \
+            nal++; \
+        } while (0)
+
+        if (d->sei) {
+            static const uint8_t aud[] = { 0x09, 0xf0 }, sei[] = { 0x06, 0x05 };
+
+            PUT_NAL(aud, 0);
+            PUT_NAL(sei, 24);
+        }
+
+        if (idr) {
+            if (f && d->pps_update && (f / d->gop) % d->pps_update == 0)
+                pps_version[0] = pps_version[0] % 99 + 1;
+
+            uint8_t sps[] = { 0x67, 1, sps_version };
+            PUT_NAL(sps, 8);
+            for (i = 0; i < (d->pps_switch ? 2 : 1); i++) {
+                uint8_t pps[] = { 0x68, 1 + i, 1, pps_version[i] };
+
+                PUT_NAL(pps, 4);
+            }
+        }
+
+        /* IDR frames are several times the size of the others */
+        size = idr ? avg * 6 : avg * (d->gop - 6) / (d->gop - 1);
+        for (i = 0; i < d->slices; i++) {
+            uint8_t slice[] = { idr ? 0x65 : ref ? 0x41 : 0x01, pps_id };
+
+            PUT_NAL(slice, size / d->slices);
+        }
+
+        /* behind the last slice, it must not be the NAL submitted */
+        if (d->sei) {
+            static const uint8_t filler[] = { 0x0c, 0xff };
+
+            PUT_NAL(filler, 4);
+        }
+
+        frame->buffer_count = nal;
+        frame->bytes = w.size - start;
+        frame->idr = idr;
+        frame->ref = ref;
+        /* lengths now, pointers once the data stopped moving */
+        for (n = 0; n < nal; n++)
+            frame->buffers[n].bitstream_bytes =
+                (n + 1 < nal ? off[n + 1] : w.size) - off[n];
+    }
+
+    if (ret) {
+        free(offsets);
+        free(w.data);
+        bench_stream_close(s);
+        return -1;
+    }
+
+    s->data = w.data;
+    s->size = w.size;
+    for (f = 0; f < s->frame_count; f++)
+        for (n = 0; n < s->frames[f].buffer_count; n++) {
+            s->frames[f].buffers[n].struct_version = VDP_BITSTREAM_BUFFER_VERSION;
+            s->frames[f].buffers[n].bitstream = s->data + offsets[f * BENCH_MAX_NALS + n];
+        }
+    free(offsets);
+
+    return 0;
+}
+
+void bench_stream_close(bench_stream_t *s)
+{
+    free(s->frames);
+    free(s->data);
+    memset(s, 0, sizeof(*s));
+}
+
+void bench_picture_info(VdpPictureInfoH264 *info, const bench_frame_t *frame)
+{
+    int i;
+
+    memset(info, 0, sizeof(*info));
+    info->slice_count = 1;
+    info->is_reference = frame->ref;
+    info->num_ref_frames = 4;
+    info->frame_mbs_only_flag = 1;
+    info->log2_max_frame_num_minus4 = 4;
+    info->pic_order_cnt_type = 2;
+    info->pic_init_qp_minus26 = -4;
+    info->entropy_coding_mode_flag = 1;
+    info->direct_8x8_inference_flag = 1;
+    info->transform_8x8_mode_flag = 1;
+
+    for (i = 0; i < 16; i++)
+        info->referenceFrames[i].surface = VDP_INVALID_HANDLE;
+}
@@ -20,9 +20,16 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/dma-buf.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <libdrm/drm_fourcc.h>
 
 #include "vdpau_private.h"
 #include "h264_decoder.h"
+#include "v4l2.h"
 
 VdpStatus vdp_decoder_create(VdpDevice device,
                              VdpDecoderProfile profile,
@@ -31,7 +38,7 @@ VdpStatus vdp_decoder_create(VdpDevice device,
                              uint32_t max_references,
                              VdpDecoder *decoder)
 {
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -46,6 +53,9 @@ VdpStatus vdp_decoder_create(VdpDevice device,
     dec->profile = profile;
     dec->width = width;
     dec->height = height;
+    dec->refs = 1;
+    pthread_mutex_init(&dec->mutex, NULL);
+    pthread_cond_init(&dec->output_cond, NULL);
 
     switch (profile)
     {
@@ -62,7 +72,7 @@ VdpStatus vdp_decoder_create(VdpDevice device,
     if (!dec->private)
         goto err_decoder;
 
-    int handle = handle_create(dec);
+    int handle = handle_create(dec, HANDLE_TYPE_DECODER);
     if (handle == -1)
         goto err_decoder;
     *decoder = handle;
@@ -70,33 +80,293 @@ VdpStatus vdp_decoder_create(VdpDevice device,
     return VDP_STATUS_OK;
 
 err_decoder:
+    pthread_cond_destroy(&dec->output_cond);
+    pthread_mutex_destroy(&dec->mutex);
     free(dec);
 err_ctx:
     return VDP_STATUS_RESOURCES;
 }
 
-VdpStatus vdp_decoder_destroy(VdpDecoder decoder)
+static void decoder_free(decoder_ctx_t *dec)
 {
-    decoder_ctx_t *dec = handle_get(decoder);
-    if (!dec)
-        return VDP_STATUS_INVALID_HANDLE;
+    device_ctx_t *dev = dec->device;
+    int i;
 
-    close_overlay(dec->device);
+    /* take the plane off our framebuffers before they are removed */
+    for (i = 0; i < kOutputBufferCnt; i++)
+        if (dec->fb_ids[i] && dec->fb_ids[i] == dev->overlay.fb_id)
+            close_overlay(dev);
+    decoder_release_framebuffers(dec);
+    decoder_unmap_outputs(dec);
 
     dec->deinit(dec);
 
-    handle_destroy(decoder);
+    pthread_cond_destroy(&dec->output_cond);
+    pthread_mutex_destroy(&dec->mutex);
     free(dec);
+}
+
+void decoder_unref(decoder_ctx_t *dec)
+{
+    int refs;
+
+    pthread_mutex_lock(&dec->mutex);
+    refs = --dec->refs;
+    pthread_mutex_unlock(&dec->mutex);
+
+    if (!refs)
+        decoder_free(dec);
+}
+
+/*
+ * The decoder is torn down once the last picture mixed from it has
+ * left the screen, which may be after its handle is gone. Threads
+ * waiting for one of its pictures are woken up now and give up, as
+ * does any later sync of a picture the hardware has not finished.
+ */
+VdpStatus vdp_decoder_destroy(VdpDecoder decoder)
+{
+    decoder_ctx_t *dec = handle_get(decoder, HANDLE_TYPE_DECODER);
+    if (!dec)
+        return VDP_STATUS_INVALID_HANDLE;
+
+    handle_destroy(decoder);
+    v4l2_interrupt(dec);
+    decoder_unref(dec);
 
     return VDP_STATUS_OK;
 }
 
+/*
+ * Keep a capture buffer from being requeued to the driver while a
+ * video surface or a mixed picture refers to it, h264_release_picture()
+ * defers it.
+ */
+void decoder_hold_output(decoder_ctx_t *dec, int index)
+{
+    pthread_mutex_lock(&dec->mutex);
+    dec->output_holds[index]++;
+    dec->refs++;
+    pthread_mutex_unlock(&dec->mutex);
+}
+
+void decoder_release_output(decoder_ctx_t *dec, int index)
+{
+    pthread_mutex_lock(&dec->mutex);
+    if (!--dec->output_holds[index] && dec->output_release[index]
+        && !dec->output_busy[index]) {
+        dec->output_release[index] = 0;
+        v4l2_qbuf_output(dec, index);
+    }
+    pthread_mutex_unlock(&dec->mutex);
+
+    decoder_unref(dec);
+}
+
+/*
+ * A video surface keeps its picture until it is decoded into again or
+ * destroyed, the parser may drop a non-reference picture before the
+ * client mixed it. The decoder may take the picture back earlier when
+ * it runs out of capture buffers, see h264_reclaim_output().
+ */
+void decoder_release_surface(video_surface_ctx_t *vs)
+{
+    decoder_ctx_t *dec = vs->dec;
+    int index = -1;
+
+    if (dec) {
+        pthread_mutex_lock(&dec->mutex);
+        index = vs->output_index;
+        if (index >= 0 && dec->output_surfaces[index] == vs)
+            dec->output_surfaces[index] = NULL;
+        pthread_mutex_unlock(&dec->mutex);
+    }
+
+    if (index >= 0)
+        decoder_release_output(dec, index);
+
+    vs->dec = NULL;
+    vs->dma_fd = 0;
+    vs->output_index = -1;
+}
+
+void video_frame_set(video_frame_t *frame, video_surface_ctx_t *vs)
+{
+    video_frame_t next = { .output_index = -1 };
+
+    if (vs && vs->dec && vs->output_index >= 0 && vs->dma_fd > 0) {
+        next.dec = vs->dec;
+        next.output_index = vs->output_index;
+        next.fb_id = vs->fb_id;
+        next.dma_fd = vs->dma_fd;
+        next.width = vs->width;
+        next.height = vs->height;
+        next.oes_tex = vs->oes_tex;
+        decoder_hold_output(next.dec, next.output_index);
+    }
+
+    video_frame_release(frame);
+    *frame = next;
+}
+
+void video_frame_copy(video_frame_t *dst, const video_frame_t *src)
+{
+    video_frame_t next = *src;
+
+    if (next.dec)
+        decoder_hold_output(next.dec, next.output_index);
+
+    video_frame_release(dst);
+    *dst = next;
+}
+
+void video_frame_release(video_frame_t *frame)
+{
+    if (frame->dec)
+        decoder_release_output(frame->dec, frame->output_index);
+
+    memset(frame, 0, sizeof(*frame));
+    frame->output_index = -1;
+}
+
+/*
+ * Framebuffer for one of the decoder's exported capture buffers. It is
+ * registered the first time the buffer is shown and reused afterwards.
+ */
+uint32_t decoder_get_framebuffer(decoder_ctx_t *dec, int dma_fd)
+{
+    uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+    int w = dec->coded_width;
+    int h = dec->coded_height;
+    int i;
+
+    for (i = 0; i < kOutputBufferCnt; i++)
+        if (dec->outputs[i] == dma_fd)
+            break;
+
+    if (i == kOutputBufferCnt)
+        return 0;
+
+    if (dec->fb_ids[i])
+        return dec->fb_ids[i];
+
+    if (drmPrimeFDToHandle(dec->device->drm_fd, dma_fd, &dec->fb_handles[i]) < 0) {
+        VDPAU_ERR("Could not get handle");
+        return 0;
+    }
+
+    handles[0] = dec->fb_handles[i];
+    pitches[0] = w;
+    offsets[0] = 0;
+    handles[1] = dec->fb_handles[i];
+    pitches[1] = w;
+    offsets[1] = w * h;
+
+    if (drmModeAddFB2(dec->device->drm_fd, w, h,
+                DRM_FORMAT_NV12, handles, pitches, offsets,
+                &dec->fb_ids[i], 0) < 0) {
+        VDPAU_ERR("Could not add fb");
+        dec->fb_ids[i] = 0;
+        return 0;
+    }
+
+    return dec->fb_ids[i];
+}
+
+void decoder_release_framebuffers(decoder_ctx_t *dec)
+{
+    int i;
+
+    for (i = 0; i < kOutputBufferCnt; i++) {
+        if (dec->fb_ids[i])
+            drmModeRmFB(dec->device->drm_fd, dec->fb_ids[i]);
+        dec->fb_ids[i] = 0;
+
+        if (dec->fb_handles[i]) {
+            struct drm_gem_close gem_close = { .handle = dec->fb_handles[i] };
+            drmIoctl(dec->device->drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+        }
+        dec->fb_handles[i] = 0;
+    }
+}
+
+/*
+ * CPU mapping of one of the decoder's capture buffers, kept until the
+ * decoder is destroyed so frames are not mapped and unmapped each time.
+ * The mixer and readback of different surfaces may ask at once.
+ */
+void *decoder_map_output(decoder_ctx_t *dec, int dma_fd)
+{
+    size_t size = dec->coded_width * dec->coded_height * 3 / 2;
+    void *map = NULL;
+    int i;
+
+    pthread_mutex_lock(&dec->mutex);
+
+    for (i = 0; i < kOutputBufferCnt; i++)
+        if (dec->outputs[i] == dma_fd)
+            break;
+
+    if (i == kOutputBufferCnt)
+        goto out;
+
+    if (dec->output_maps[i] && dec->output_map_sizes[i] == size) {
+        map = dec->output_maps[i];
+        goto out;
+    }
+
+    if (dec->output_maps[i])
+        munmap(dec->output_maps[i], dec->output_map_sizes[i]);
+
+    dec->output_maps[i] = mmap(NULL, size,
+            PROT_READ | PROT_WRITE, MAP_SHARED, dma_fd, 0);
+    if (dec->output_maps[i] == MAP_FAILED) {
+        VDPAU_ERR("Could not map output buffer %d", i);
+        dec->output_maps[i] = NULL;
+        goto out;
+    }
+    dec->output_map_sizes[i] = size;
+    map = dec->output_maps[i];
+
+out:
+    pthread_mutex_unlock(&dec->mutex);
+
+    return map;
+}
+
+/*
+ * Bracket CPU access to a mapped capture buffer so caches are
+ * maintained, on kernels that predate the ioctl this is a no-op.
+ */
+void decoder_sync_output(int dma_fd, int end)
+{
+#ifdef DMA_BUF_IOCTL_SYNC
+    struct dma_buf_sync sync;
+
+    sync.flags = (end ? DMA_BUF_SYNC_END : DMA_BUF_SYNC_START) | DMA_BUF_SYNC_READ;
+    while (ioctl(dma_fd, DMA_BUF_IOCTL_SYNC, &sync) < 0 && (errno == EINTR || errno == EAGAIN))
+        ;
+#endif
+}
+
+void decoder_unmap_outputs(decoder_ctx_t *dec)
+{
+    int i;
+
+    for (i = 0; i < kOutputBufferCnt; i++) {
+        if (dec->output_maps[i])
+            munmap(dec->output_maps[i], dec->output_map_sizes[i]);
+        dec->output_maps[i] = NULL;
+        dec->output_map_sizes[i] = 0;
+    }
+}
+
 VdpStatus vdp_decoder_get_parameters(VdpDecoder decoder,
                                      VdpDecoderProfile *profile,
                                      uint32_t *width,
                                      uint32_t *height)
 {
-    decoder_ctx_t *dec = handle_get(decoder);
+    decoder_ctx_t *dec = handle_get(decoder, HANDLE_TYPE_DECODER);
     if (!dec)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -118,18 +388,20 @@ VdpStatus vdp_decoder_render(VdpDecoder decoder,
                              uint32_t bitstream_buffer_count,
                              VdpBitstreamBuffer const *bitstream_buffers)
 {
-    decoder_ctx_t *dec = handle_get(decoder);
+    decoder_ctx_t *dec = handle_get(decoder, HANDLE_TYPE_DECODER);
     if (!dec)
         return VDP_STATUS_INVALID_HANDLE;
 
-    video_surface_ctx_t *vs = handle_get(target);
+    video_surface_ctx_t *vs = handle_get(target, HANDLE_TYPE_VIDEO_SURFACE);
     if (!vs)
         return VDP_STATUS_INVALID_HANDLE;
 
+    decoder_release_surface(vs);
     vs->source_format = INTERNAL_YCBCR_FORMAT;
     vs->private = dec->private;
     vs->dec = dec;
     vs->dma_fd = 0;
+    vs->output_index = -1;
 
     return dec->decode(dec, vs, picture_info,
             bitstream_buffer_count,
@@ -149,7 +421,7 @@ VdpStatus vdp_decoder_query_capabilities(VdpDevice device,
             !max_width || !max_height)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
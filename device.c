@@ -19,8 +19,10 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
 
 #include "vdpau_private.h"
+#include "latency.h"
 
 __attribute__((constructor))
 static
@@ -35,7 +37,6 @@ VdpStatus vdp_imp_device_create_x11(Display *display,
                                     VdpDevice *device,
                                     VdpGetProcAddress **get_proc_address)
 {
-    printf("11111111111\n");
     if (!display || !device || !get_proc_address)
         return VDP_STATUS_INVALID_POINTER;
 
@@ -43,7 +44,7 @@ VdpStatus vdp_imp_device_create_x11(Display *display,
     if (!dev)
         return VDP_STATUS_RESOURCES;
 
-    int handle = handle_create(dev);
+    int handle = handle_create(dev, HANDLE_TYPE_DEVICE);
     if (handle == -1)
     {
         free(dev);
@@ -53,6 +54,10 @@ VdpStatus vdp_imp_device_create_x11(Display *display,
     dev->display = XOpenDisplay(XDisplayString(display));
     dev->screen = screen;
 
+    pthread_mutex_init(&dev->egl.image_mutex, NULL);
+    pthread_mutex_init(&dev->queue_mutex, NULL);
+    pthread_mutex_init(&dev->overlay.mutex, NULL);
+
     const EGLint configAttribs[] =
     {
         EGL_RED_SIZE, 8,
@@ -117,6 +122,9 @@ VdpStatus vdp_imp_device_create_x11(Display *display,
         return VDP_STATUS_RESOURCES;
     }
 
+    const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+    dev->egl.unpack_subimage = extensions && strstr(extensions, "GL_EXT_unpack_subimage");
+
     int ret = gl_init_shader (&dev->egl.yuvi420_rgb, SHADER_YUVI420_RGB);
     if (ret < 0) {
         VDPAU_DBG ("Could not initialize shader: %d", ret);
@@ -209,16 +217,24 @@ VdpStatus vdp_imp_device_create_x11(Display *display,
             dev->dsp_mode = OVERLAY_FULLSCREEN;
         else
             dev->dsp_mode = OVERLAY;
+
+        if (overlay_probe(dev) < 0)
+            dev->dsp_mode = NO_OVERLAY;
     }
 
 end:
+    dev->rgba_alloc = rgba_alloc_type(getenv("VDPAU_RGBA_ALLOC"));
+    if (dev->rgba_alloc == RGBA_ALLOC_DUMB && dev->drm_fd <= 0)
+        dev->drm_fd = open(DRM_PATH, O_RDWR);
 
     return VDP_STATUS_OK;
 }
 
 VdpStatus vdp_device_destroy(VdpDevice device)
 {
-    device_ctx_t *dev = handle_get(device);
+    int i;
+
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -237,6 +253,13 @@ VdpStatus vdp_device_destroy(VdpDevice device)
     gl_delete_shader(&dev->egl.copy);
     gl_delete_shader(&dev->egl.brswap);
 
+    for (i = 0; i < MAX_EGL_IMAGES; i++)
+        if (dev->egl.images[i].image != EGL_NO_IMAGE_KHR)
+            gl_release_dmabuf_image(dev, dev->egl.images[i].fd);
+    pthread_mutex_destroy(&dev->egl.image_mutex);
+    pthread_mutex_destroy(&dev->queue_mutex);
+    pthread_mutex_destroy(&dev->overlay.mutex);
+
     eglDestroyContext(dev->egl.display, dev->egl.context);
     eglDestroySurface(dev->egl.display, dev->egl.surface);
 
@@ -253,7 +276,7 @@ VdpStatus vdp_preemption_callback_register(VdpDevice device,
                                            VdpPreemptionCallback callback,
                                            void *context)
 {
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -328,6 +351,27 @@ static void *const functions[] =
     [VDP_FUNC_ID_PREEMPTION_CALLBACK_REGISTER]                          = &vdp_preemption_callback_register,
 };
 
+VdpStatus vdp_rockchip_get_latency(VdpDevice device,
+                                   uint32_t stage,
+                                   VdpBool reset,
+                                   VdpRockchipLatency *latency)
+{
+    if (!latency)
+        return VDP_STATUS_INVALID_POINTER;
+
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
+    if (!dev)
+        return VDP_STATUS_INVALID_HANDLE;
+
+    if (latency->struct_version > VDP_ROCKCHIP_LATENCY_VERSION)
+        return VDP_STATUS_INVALID_STRUCT_VERSION;
+
+    if (latency_get(stage, reset, latency) < 0)
+        return VDP_STATUS_INVALID_VALUE;
+
+    return VDP_STATUS_OK;
+}
+
 VdpStatus vdp_get_proc_address(VdpDevice device_handle,
                                VdpFuncId function_id,
                                void **function_pointer)
@@ -335,7 +379,7 @@ VdpStatus vdp_get_proc_address(VdpDevice device_handle,
     if (!function_pointer)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *device = handle_get(device_handle);
+    device_ctx_t *device = handle_get(device_handle, HANDLE_TYPE_DEVICE);
     if (!device)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -353,6 +397,12 @@ VdpStatus vdp_get_proc_address(VdpDevice device_handle,
 
         return VDP_STATUS_OK;
     }
+    else if (function_id == VDP_FUNC_ID_ROCKCHIP_GET_LATENCY)
+    {
+        *function_pointer = &vdp_rockchip_get_latency;
+
+        return VDP_STATUS_OK;
+    }
 
     return VDP_STATUS_INVALID_FUNC_ID;
 }
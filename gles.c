@@ -1,5 +1,8 @@
 #include <string.h>
 #include <errno.h>
+#include <sys/stat.h>
+
+#include <libdrm/drm_fourcc.h>
 
 #include "vdpau_private.h"
 
@@ -393,3 +396,123 @@ gl_create_texture(GLuint tex_filter)
 
     return tex_id;
 }
+
+static void gl_destroy_image_entry(device_ctx_t *dev, egl_image_entry_t *entry)
+{
+    if (entry->image != EGL_NO_IMAGE_KHR)
+        eglDestroyImageKHR(dev->egl.display, entry->image);
+
+    entry->image = EGL_NO_IMAGE_KHR;
+    entry->fd = 0;
+}
+
+/*
+ * Return the EGLImage for a NV12 or packed 32-bit RGB dma-buf, importing
+ * it only the first time the buffer is seen or when its format or size
+ * changed. A cached fd backed by another buffer now is imported again.
+ */
+EGLImageKHR
+gl_get_dmabuf_image(device_ctx_t *dev, int fd, uint32_t format,
+                    uint32_t width, uint32_t height)
+{
+    egl_image_entry_t *entry = NULL;
+    EGLImageKHR image;
+    struct stat st;
+    int i;
+
+    if (fstat(fd, &st) < 0)
+    {
+        VDPAU_ERR("Could not stat dma-buf %d: %s", fd, strerror(errno));
+        return EGL_NO_IMAGE_KHR;
+    }
+
+    pthread_mutex_lock(&dev->egl.image_mutex);
+
+    for (i = 0; i < MAX_EGL_IMAGES; i++)
+    {
+        if (dev->egl.images[i].fd == fd && dev->egl.images[i].image != EGL_NO_IMAGE_KHR)
+        {
+            entry = &dev->egl.images[i];
+            break;
+        }
+        if (!entry && dev->egl.images[i].image == EGL_NO_IMAGE_KHR)
+            entry = &dev->egl.images[i];
+    }
+
+    if (entry && entry->image != EGL_NO_IMAGE_KHR)
+    {
+        if (entry->dev == st.st_dev && entry->ino == st.st_ino &&
+            entry->format == format && entry->width == width && entry->height == height)
+        {
+            image = entry->image;
+            pthread_mutex_unlock(&dev->egl.image_mutex);
+            return image;
+        }
+        gl_destroy_image_entry(dev, entry);
+    }
+
+    if (!entry)
+    {
+        entry = &dev->egl.images[dev->egl.image_victim];
+        dev->egl.image_victim = (dev->egl.image_victim + 1) % MAX_EGL_IMAGES;
+        gl_destroy_image_entry(dev, entry);
+    }
+
+    EGLint attrs[] = {
+        EGL_WIDTH,                     width,
+        EGL_HEIGHT,                    height,
+        EGL_LINUX_DRM_FOURCC_EXT,      format,
+        EGL_DMA_BUF_PLANE0_FD_EXT,     fd,
+        EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
+        EGL_DMA_BUF_PLANE0_PITCH_EXT,  width,
+        EGL_DMA_BUF_PLANE1_FD_EXT,     fd,
+        EGL_DMA_BUF_PLANE1_OFFSET_EXT, width * height,
+        EGL_DMA_BUF_PLANE1_PITCH_EXT,  width,
+        EGL_YUV_COLOR_SPACE_HINT_EXT,  EGL_ITU_REC601_EXT,
+        EGL_SAMPLE_RANGE_HINT_EXT,     EGL_YUV_NARROW_RANGE_EXT,
+        EGL_NONE,
+    };
+
+    /* single plane, terminate after the first plane's attributes */
+    if (format != DRM_FORMAT_NV12)
+    {
+        attrs[11] = width * 4;
+        attrs[12] = EGL_NONE;
+    }
+
+    image = eglCreateImageKHR(dev->egl.display, EGL_NO_CONTEXT,
+                              EGL_LINUX_DMA_BUF_EXT, NULL, attrs);
+    if (image == EGL_NO_IMAGE_KHR)
+    {
+        VDPAU_ERR("Could not import dma-buf %d as EGL image %x", fd, eglGetError());
+    }
+    else
+    {
+        entry->fd = fd;
+        entry->dev = st.st_dev;
+        entry->ino = st.st_ino;
+        entry->format = format;
+        entry->width = width;
+        entry->height = height;
+        entry->image = image;
+    }
+
+    pthread_mutex_unlock(&dev->egl.image_mutex);
+
+    return image;
+}
+
+/* Drop the cached import of a dma-buf before its fd is closed. */
+void
+gl_release_dmabuf_image(device_ctx_t *dev, int fd)
+{
+    int i;
+
+    pthread_mutex_lock(&dev->egl.image_mutex);
+
+    for (i = 0; i < MAX_EGL_IMAGES; i++)
+        if (dev->egl.images[i].fd == fd && dev->egl.images[i].image != EGL_NO_IMAGE_KHR)
+            gl_destroy_image_entry(dev, &dev->egl.images[i]);
+
+    pthread_mutex_unlock(&dev->egl.image_mutex);
+}
@@ -2,6 +2,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdint.h>
+#include <time.h>
 #include <linux/types.h>
 #include <linux/v4l2-controls.h>
 
@@ -9,50 +10,158 @@
 #include "h264_decoder.h"
 
 #include "h264d.h"
+#include "nal.h"
+#include "trace.h"
+#include "latency.h"
 
 #define DEV_NAME_RK3399		    "rockchip-vpu-vdec"
 #define DEV_NAME_RK3288_NEW	    "rockchip-vpu-dec"
 #define DEV_NAME_RK3288_LEGACY	"rk3288-vpu-dec"
 
-#define LOG(fmt, args...) { \
-        FILE *fp = fopen("/tmp/video.log", "a"); \
-        if (fp) { \
-                    fprintf(fp, fmt, ## args); \
-                    fclose(fp); \
-                } \
+/* called with dec->mutex held */
+static void h264_requeue_unrefed(decoder_ctx_t *dec) {
+    int index;
+
+    while ((index = h264d_get_unrefed_picture(dec->private)) >= 0) {
+        /*
+         * still being decoded or shown, requeue it once the hardware is
+         * done and the picture left the screen
+         */
+        if (dec->output_busy[index] || dec->output_holds[index])
+            dec->output_release[index] = 1;
+        else
+            v4l2_qbuf_output(dec, index);
+    }
 }
 
-#define LOG_DEINIT()
+void h264_release_picture(void *p_dec, void *p_vs) {
+    decoder_ctx_t *dec = (decoder_ctx_t *)p_dec;
 
-#define LOG_INIT()
+    pthread_mutex_lock(&dec->mutex);
+    h264_requeue_unrefed(dec);
+    pthread_mutex_unlock(&dec->mutex);
+}
 
-struct timeval last_tv;
-struct timeval tv;
+/*
+ * Every capture buffer is queued, decoding or held. Take back the one
+ * decoded longest ago that only its video surface still holds: the
+ * parser is done with it and nothing mixed it. A client with about as
+ * many surfaces as capture buffers would drain the ring otherwise. The
+ * surface loses its picture. Called with dec->mutex held.
+ */
+static int h264_reclaim_output(decoder_ctx_t *dec) {
+    video_surface_ctx_t *vs;
+    int i, oldest = -1;
 
-void log_time(char *msg)
-{
-    if (getenv("LOG_TIME")) {
-        gettimeofday(&tv, NULL);
-        if (msg)
-            printf("\n%s: %ld ms\n", msg, DURATION(last_tv, tv));
-        last_tv = tv;
+    for (i = 0; i < kOutputBufferCnt; i++) {
+        if (!dec->output_surfaces[i] || dec->output_holds[i] != 1 ||
+            !dec->output_release[i] || dec->output_busy[i])
+            continue;
+        if (oldest < 0 || (int32_t)(dec->output_seq[i] - dec->output_seq[oldest]) < 0)
+            oldest = i;
     }
+    if (oldest < 0)
+        return -1;
+
+    vs = dec->output_surfaces[oldest];
+    vs->output_index = -1;
+    vs->dma_fd = 0;
+    dec->output_surfaces[oldest] = NULL;
+    dec->output_holds[oldest] = 0;
+    /* the decoder handle is still held by the caller */
+    dec->refs--;
+
+    dec->output_release[oldest] = 0;
+    return v4l2_qbuf_output(dec, oldest);
 }
 
-void h264_release_picture(void *p_dec, void *p_vs) {
-    decoder_ctx_t *dec = (decoder_ctx_t *)p_dec;
-    int index;
+/*
+ * Dequeue finished capture buffers until the one wanted is done. Only
+ * one thread waits on the driver at a time, the others sleep until it
+ * has dequeued something and check again.
+ */
+static int h264_wait_picture(decoder_ctx_t *dec, int index) {
+    uint64_t start_us;
+    int done, ret = 0;
+
+    pthread_mutex_lock(&dec->mutex);
+    if (!dec->output_busy[index]) {
+        pthread_mutex_unlock(&dec->mutex);
+        return 0;
+    }
 
-    while ((index = h264d_get_unrefed_picture(dec->private)) >= 0) {
-        v4l2_qbuf_output(dec, index);
+    start_us = latency_now();
+    while (dec->output_busy[index]) {
+        if (dec->output_waiting) {
+            pthread_cond_wait(&dec->output_cond, &dec->mutex);
+            continue;
+        }
+
+        dec->output_waiting = 1;
+        pthread_mutex_unlock(&dec->mutex);
+        done = v4l2_dqbuf_output(dec);
+        pthread_mutex_lock(&dec->mutex);
+        dec->output_waiting = 0;
+        pthread_cond_broadcast(&dec->output_cond);
+
+        if (done < 0) {
+            ret = -1;
+            break;
+        }
+
+        dec->output_busy[done] = 0;
+        TRACE(TRACE_HW_DONE, done);
+        if (dec->output_release[done] && !dec->output_holds[done]) {
+            dec->output_release[done] = 0;
+            v4l2_qbuf_output(dec, done);
+        }
     }
+    pthread_mutex_unlock(&dec->mutex);
+    if (!ret)
+        LATENCY(VDP_ROCKCHIP_STAGE_DECODE_WAIT, start_us);
+
+    return ret;
+}
+
+void h264_sync_picture(void *p_dec, void *p_vs) {
+    decoder_ctx_t *dec = (decoder_ctx_t *)p_dec;
+    video_surface_ctx_t *vs = (video_surface_ctx_t *)p_vs;
+
+    if (vs->output_index >= 0)
+        h264_wait_picture(dec, vs->output_index);
+}
+
+/*
+ * The driver holds a single SPS/PPS/scaling matrix. Each is resent only
+ * when another id becomes active or the cached copy of the same id
+ * differs from the incoming one.
+ */
+static int h264_param_changed(void *cache, size_t stride, int32_t *active,
+                              int id, const void *data, size_t size) {
+    void *slot = (uint8_t *)cache + id * stride;
+
+    if (*active == id && !memcmp(slot, data, size))
+        return 0;
+
+    memcpy(slot, data, size);
+    *active = id;
+    return 1;
 }
 
+/* the driver may lack what the cache says was sent, resend everything */
+static void h264_param_reset(ctrl_arena_t *arena) {
+    arena->active_sps = -1;
+    arena->active_pps = -1;
+    arena->active_scaling_matrix = -1;
+}
+
+/* called with dec->mutex held */
 int h264_submit(decoder_ctx_t* dec, VdpPictureInfoH264 const *info,
-                 void *nal, size_t nal_size, int submit) {
-    int is_frame = 0, i;
+                 int input, void *nal, size_t nal_size, int submit) {
+    int is_frame = 0, i, ret;
     int index;
-    size_t num_ctrls = 0;
+    size_t num_ctrls = 0, count = 0;
+    uint64_t start_us;
     uint32_t ctrl_ids[5];
     void *payloads[5];
     uint32_t payload_sizes[5];
@@ -61,6 +170,7 @@ int h264_submit(decoder_ctx_t* dec, VdpPictureInfoH264 const *info,
     struct v4l2_ctrl_h264_pps *pps;
     struct v4l2_ctrl_h264_decode_param *dec_param;
     struct v4l2_ext_controls ext_ctrls;
+    ctrl_arena_t *arena = &dec->ctrls;
 
     encode_statistics_p statistics = &dec->statistics;
     statistics->stream_bytes += nal_size;
@@ -69,13 +179,21 @@ int h264_submit(decoder_ctx_t* dec, VdpPictureInfoH264 const *info,
             nal_size, &num_ctrls, ctrl_ids,
             payloads, payload_sizes);
 
+    if (!is_frame || !submit)
+        return -1;
+
+    /* patch the parameter sets in the arena, the parser keeps its own */
+    payload_sizes[0] = min(payload_sizes[0], sizeof(arena->sps));
+    payload_sizes[1] = min(payload_sizes[1], sizeof(arena->pps));
+    memcpy(&arena->sps, payloads[0], payload_sizes[0]);
+    memcpy(&arena->pps, payloads[1], payload_sizes[1]);
+    payloads[0] = &arena->sps;
+    payloads[1] = &arena->pps;
+
     sps = (struct v4l2_ctrl_h264_sps *)payloads[0];
     pps = (struct v4l2_ctrl_h264_pps *)payloads[1];
     dec_param = (struct v4l2_ctrl_h264_decode_param *)payloads[4];
 
-    if (!is_frame || !submit)
-        return 0;
-
 #define COPY(param, field) (param->field = info->field)
 #define COPY2(param, field, field2) (param->field = info->field2)
 
@@ -93,29 +211,76 @@ int h264_submit(decoder_ctx_t* dec, VdpPictureInfoH264 const *info,
     COPY(sps, pic_order_cnt_type);
 
     memset(&ext_ctrls, 0, sizeof(ext_ctrls));
-    ext_ctrls.count = num_ctrls;
-    ext_ctrls.controls = calloc(num_ctrls,
-            sizeof(struct v4l2_ext_control));
-
-    for (i = 0; i < num_ctrls; ++i) {
-        ext_ctrls.controls[i].id = ctrl_ids[i];
-        ext_ctrls.controls[i].ptr = payloads[i];
-        ext_ctrls.controls[i].size = payload_sizes[i];
-    }
-    v4l2_s_ext_ctrls(dec, &ext_ctrls);
+    /* bind the controls to this bitstream buffer, others may be in flight */
+    ext_ctrls.config_store = input + 1;
+    ext_ctrls.controls = arena->controls;
+
+    for (i = 0; i < num_ctrls && count < MAX_EXT_CTRLS; ++i) {
+        /* decode and slice params change every frame, the rest rarely */
+        switch (ctrl_ids[i]) {
+        case V4L2_CID_MPEG_VIDEO_H264_SPS:
+            if (!h264_param_changed(arena->sps_cache,
+                        sizeof(arena->sps_cache[0]), &arena->active_sps,
+                        sps->seq_parameter_set_id % MAX_SPS_COUNT,
+                        payloads[i], payload_sizes[i]))
+                continue;
+            TRACE(TRACE_COUNTER_SPS_UPLOADS, ++statistics->sps_uploads);
+            break;
+        case V4L2_CID_MPEG_VIDEO_H264_PPS:
+            if (!h264_param_changed(arena->pps_cache,
+                        sizeof(arena->pps_cache[0]), &arena->active_pps,
+                        pps->pic_parameter_set_id % MAX_PPS_COUNT,
+                        payloads[i], payload_sizes[i]))
+                continue;
+            TRACE(TRACE_COUNTER_PPS_UPLOADS, ++statistics->pps_uploads);
+            break;
+        case V4L2_CID_MPEG_VIDEO_H264_SCALING_MATRIX:
+            if (!h264_param_changed(&arena->scaling_matrix,
+                        sizeof(arena->scaling_matrix),
+                        &arena->active_scaling_matrix, 0, payloads[i],
+                        min(payload_sizes[i],
+                            sizeof(arena->scaling_matrix))))
+                continue;
+            break;
+        }
 
-    free(ext_ctrls.controls);
+        arena->controls[count].id = ctrl_ids[i];
+        arena->controls[count].ptr = payloads[i];
+        arena->controls[count].size = payload_sizes[i];
+        count++;
+    }
+    ext_ctrls.count = count;
+    start_us = latency_now();
+    ret = v4l2_s_ext_ctrls(dec, &ext_ctrls);
+    LATENCY(VDP_ROCKCHIP_STAGE_EXT_CTRLS, start_us);
+    if (ret < 0)
+        goto err_params;
+
+    /* controls set for a job that never runs don't reach the driver either */
+    if ((index = v4l2_next_output(dec)) < 0 &&
+        (h264_reclaim_output(dec) < 0 || (index = v4l2_next_output(dec)) < 0)) {
+        VDPAU_ERR("no capture buffer available");
+        goto err_params;
+    }
 
-    log_time("start decode");
+    if (v4l2_qbuf_input(dec, input) < 0) {
+        v4l2_return_output(dec, index);
+        goto err_params;
+    }
 
-    v4l2_qbuf_input(dec);
+    TRACE(TRACE_SUBMIT, index);
+    TRACE(TRACE_COUNTER_INPUT_DEPTH,
+            dec->input_count - __builtin_popcount(dec->input_free));
 
-    if ((index = v4l2_dqbuf_output(dec)) >= 0) {
-        h264d_picture_ready(dec->private, index);
+    /*
+     * Don't wait for the hardware here, the picture is only needed once
+     * it gets mixed or read back, see h264_sync_picture().
+     */
+    dec->output_busy[index] = 1;
+    h264d_picture_ready(dec->private, index);
 
-        //to workaround plugin bug
-        h264_release_picture(dec, NULL);
-    }
+    //to workaround plugin bug
+    h264_requeue_unrefed(dec);
 
     statistics->frames ++;
     statistics->non_intra_frames ++;
@@ -123,7 +288,7 @@ int h264_submit(decoder_ctx_t* dec, VdpPictureInfoH264 const *info,
     if (dec_param->idr_pic_flag) {
         if (statistics->intra_ratio != statistics->non_intra_frames) {
             statistics->intra_ratio = statistics->non_intra_frames;
-            LOG("intra_ratio:%d\n", statistics->intra_ratio);
+            TRACE(TRACE_COUNTER_INTRA_RATIO, statistics->intra_ratio);
         }
         statistics->non_intra_frames = 0;
     }
@@ -135,27 +300,46 @@ int h264_submit(decoder_ctx_t* dec, VdpPictureInfoH264 const *info,
 
         if (statistics->fps != statistics->frames) {
             statistics->fps = statistics->frames;
-            LOG("fps:%d\n", statistics->fps * 1000 / duration);
+            TRACE(TRACE_COUNTER_FPS, statistics->fps * 1000 / duration);
         }
         if (statistics->bitrate != statistics->stream_bytes) {
             statistics->bitrate = statistics->stream_bytes;
-            LOG("bitrate(KB/S):%d\n",
+            TRACE(TRACE_COUNTER_BITRATE,
                     (statistics->bitrate >> 10) * 1000 / duration);
         }
+        if (statistics->frames) {
+            TRACE(TRACE_COUNTER_COPIED_BYTES,
+                    statistics->copied_bytes / statistics->frames);
+            TRACE(TRACE_COUNTER_ASSEMBLE_US,
+                    statistics->assemble_time / statistics->frames);
+        }
         statistics->frames = 0;
         statistics->stream_bytes = 0;
+        statistics->copied_bytes = 0;
+        statistics->assemble_time = 0;
         statistics->tm = tm;
     }
 
-    log_time("end decode");
+    return index;
+
+err_params:
+    h264_param_reset(arena);
+    return -1;
+}
 
-    v4l2_dqbuf_input(dec);
+/* parameter sets and slices feed the parser, SEI/AUD/filler do not */
+static int h264_nal_needed(const uint8_t *nal, const uint8_t *end)
+{
+    int type;
 
-    if (index >= 0) {
-        return dec->outputs[index];
-    }
+    /* zero byte of a four byte start code, a three byte one has none */
+    if (nal + 4 < end && !nal[0] && !nal[1] && !nal[2] && nal[3] == 1)
+        nal++;
+    if (nal + 3 >= end || nal[0] || nal[1] || nal[2] != 1)
+        return 1;
 
-    return 0;
+    type = nal[3] & 0x1f;
+    return (type >= 1 && type <= 5) || type == 7 || type == 8;
 }
 
 VdpStatus h264_decode(decoder_ctx_t *dec, video_surface_ctx_t *vs,
@@ -163,25 +347,76 @@ VdpStatus h264_decode(decoder_ctx_t *dec, video_surface_ctx_t *vs,
                       uint32_t buffer_count,
                       VdpBitstreamBuffer const *buffers) {
 
-    int i = 0;
-    void *nal = dec->input_buffer;
-    size_t nal_size = 0;
+    int i = 0, index;
+    int input;
+    uint8_t *base;
+    const uint8_t *nal, *next, *end;
+    const uint8_t *last = NULL, *last_end = NULL;
+    size_t size = 0;
+    uint64_t start_us, assemble_us;
+    nal_scan_t scan;
+    uint32_t n;
+
+    /* only blocks when every bitstream buffer is owned by the hardware */
+    if ((input = v4l2_get_input(dec)) < 0)
+        return VDP_STATUS_ERROR;
+    base = dec->input_buffers[input];
+
+    start_us = latency_now();
 
     for(i = 0; i < buffer_count; i++) {
-#define START_CODE "\0\0\1"
-        if (i && !memcmp(START_CODE, buffers[i].bitstream, 3)) {
-            h264_submit(dec, info, nal, nal_size, 0);
-            nal += nal_size;
-            nal_size = 0;
+        if (size + buffers[i].bitstream_bytes > dec->buffer_size) {
+            VDPAU_ERR("bitstream too large for input buffer");
+            v4l2_put_input(dec, input);
+            return VDP_STATUS_RESOURCES;
         }
-        memcpy(nal + nal_size, buffers[i].bitstream,
+        memcpy(base + size, buffers[i].bitstream,
                 buffers[i].bitstream_bytes);
-        nal_size += buffers[i].bitstream_bytes;
+        size += buffers[i].bitstream_bytes;
     }
 
-    vs->dma_fd = h264_submit(dec, info, nal, nal_size, 1);
+    /*
+     * Split the assembled frame at every start code in a single pass.
+     * Each NAL is parsed once, the last one the parser needs gets
+     * submitted to the hardware.
+     */
+    end = base + size;
+    nal_scan(base, size, &scan);
+    pthread_mutex_lock(&dec->mutex);
+    /* bytes in front of the first start code belong to no NAL */
+    n = scan.num_starts ? 1 : 0;
+    for (nal = base + (n ? scan.starts[0] : 0); nal < end; nal = next) {
+        next = n < scan.num_starts ? base + scan.starts[n++] : end;
+        if (!h264_nal_needed(nal, next))
+            continue;
+        if (last)
+            h264_submit(dec, info, input, (void *)last, last_end - last, 0);
+        last = nal;
+        last_end = next;
+    }
 
-    return VDP_STATUS_OK;
+    assemble_us = latency_now() - start_us;
+    dec->statistics.copied_bytes += size;
+    dec->statistics.assemble_time += assemble_us;
+    latency_record(VDP_ROCKCHIP_STAGE_ASSEMBLE, assemble_us);
+
+    index = last ? h264_submit(dec, info, input, (void *)last,
+            last_end - last, 1) : -1;
+    if (index >= 0) {
+        /* held by the surface, see decoder_release_surface() */
+        dec->output_holds[index]++;
+        dec->refs++;
+        dec->output_surfaces[index] = vs;
+        dec->output_seq[index] = ++dec->decode_seq;
+        vs->output_index = index;
+        vs->dma_fd = dec->outputs[index];
+    } else {
+        v4l2_put_input(dec, input);
+    }
+    pthread_mutex_unlock(&dec->mutex);
+
+    /* no job queued, the surface has no picture */
+    return index >= 0 ? VDP_STATUS_OK : VDP_STATUS_ERROR;
 }
 
 static VdpStatus h264_start(struct decoder_ctx_struct *dec,
@@ -207,9 +442,12 @@ static VdpStatus h264_start(struct decoder_ctx_struct *dec,
         v4l2_qbuf_output(dec, i);
     }
 
+    /* a fresh stream has no parameter sets in the driver yet */
+    h264_param_reset(&dec->ctrls);
+
     dec->running = 1;
 
-    LOG("resolution:%dx%d\n",
+    VDPAU_DBG("resolution:%dx%d",
             dec->width, dec->height);
     gettimeofday(&dec->statistics.tm, NULL);
 
@@ -224,6 +462,7 @@ static VdpStatus h264_pre_decode(void *p_dec, void *p_vs,
     decoder_ctx_t *dec = (decoder_ctx_t *)p_dec;
     video_surface_ctx_t *vs = (video_surface_ctx_t *)p_vs;
 
+    pthread_mutex_lock(&dec->mutex);
     if (!dec->running) {
         h264_start(dec, info);
     }
@@ -231,6 +470,7 @@ static VdpStatus h264_pre_decode(void *p_dec, void *p_vs,
     h264d_update_info(dec->private, dec->profile,
             dec->width, dec->height,
             (VdpPictureInfoH264 *)info);
+    pthread_mutex_unlock(&dec->mutex);
 
     return h264_decode(dec, vs,
             (const VdpPictureInfoH264 *)info,
@@ -246,6 +486,9 @@ void h264_deinit(void *p) {
 }
 
 void *h264_init(decoder_ctx_t *dec) {
+    /* calloc()ed, 0 would be stdin to v4l2_deinit() */
+    dec->wake_fd = -1;
+
     dec->fd = v4l2_init_by_name(DEV_NAME_RK3399);
     if (dec->fd <= 0) {
         dec->fd = v4l2_init_by_name(DEV_NAME_RK3288_NEW);
@@ -256,8 +499,12 @@ void *h264_init(decoder_ctx_t *dec) {
         }
     }
 
+    if (v4l2_wakeup_init(dec) < 0)
+        return NULL;
+
     dec->decode = h264_pre_decode;
     dec->release_picture = h264_release_picture;
+    dec->sync_picture = h264_sync_picture;
     dec->deinit = h264_deinit;
 
     if (v4l2_s_fmt_input(dec) < 0)
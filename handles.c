@@ -18,60 +18,161 @@
  */
 
 #include <string.h>
+#include <pthread.h>
 
 #include "vdpau_private.h"
 
 #define INITIAL_SIZE 16
+#define MAX_SEGMENTS 16
 
+/*
+ * A handle is the slot index plus one in the low bits and the slot's
+ * generation above it, so a handle to a destroyed object never matches
+ * the object that reuses its slot.
+ */
+#define INDEX_BITS 20
+#define INDEX_MASK ((1 << INDEX_BITS) - 1)
+#define GENERATION_MASK 0x7ff
+
+typedef struct
+{
+    void *data;
+    int handle;
+    int next_free;
+    uint16_t generation;
+    uint8_t type;
+} handle_entry_t;
+
+/*
+ * Slots live in segments of INITIAL_SIZE << n entries which are never
+ * moved or freed, so handle_get() can run without the lock while other
+ * threads create and destroy handles. Like a seqlock, a lookup only
+ * trusts what it read from a slot if the slot still holds the handle
+ * afterwards.
+ */
 static struct
 {
-    void **data;
+    handle_entry_t *segments[MAX_SEGMENTS];
     int size;
-} ht;
+    int free_head;
+    pthread_mutex_t mutex;
+} ht = { { NULL }, 0, -1, PTHREAD_MUTEX_INITIALIZER };
+
+static handle_entry_t *handle_slot(int index)
+{
+    int segment = 31 - __builtin_clz(index / INITIAL_SIZE + 1);
+    int base = INITIAL_SIZE * ((1 << segment) - 1);
+    handle_entry_t *entries = __atomic_load_n(&ht.segments[segment], __ATOMIC_ACQUIRE);
+
+    return &entries[index - base];
+}
 
-int handle_create(void *data)
+static int handle_grow(void)
 {
+    int segment = 31 - __builtin_clz(ht.size / INITIAL_SIZE + 1);
+    int count = INITIAL_SIZE << segment;
     int index;
 
+    if (segment >= MAX_SEGMENTS || ht.size + count > INDEX_MASK)
+        return -1;
+
+    handle_entry_t *entries = calloc(count, sizeof(handle_entry_t));
+    if (!entries)
+        return -1;
+
+    for (index = count - 1; index >= 0; index--)
+    {
+        entries[index].next_free = ht.free_head;
+        ht.free_head = ht.size + index;
+    }
+
+    __atomic_store_n(&ht.segments[segment], entries, __ATOMIC_RELEASE);
+    __atomic_store_n(&ht.size, ht.size + count, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+int handle_create(void *data, handle_type_t type)
+{
+    int index, handle;
+
     if (!data)
         return -1;
 
-    for (index = 0; index < ht.size; index++)
-        if (ht.data[index] == NULL)
-            break;
+    pthread_mutex_lock(&ht.mutex);
 
-    if (index >= ht.size)
+    if (ht.free_head < 0 && handle_grow() < 0)
     {
-        int new_size = ht.size ? ht.size * 2 : INITIAL_SIZE;
-        void **new_data = realloc(ht.data, new_size * sizeof(void *));
-        if (!new_data)
-            return -1;
-
-        memset(new_data + ht.size, 0, (new_size - ht.size) * sizeof(void *));
-        ht.data = new_data;
-        ht.size = new_size;
+        pthread_mutex_unlock(&ht.mutex);
+        return -1;
     }
 
-    ht.data[index] = data;
-    return index + 1;
+    index = ht.free_head;
+    handle_entry_t *entry = handle_slot(index);
+    ht.free_head = entry->next_free;
+
+    handle = (entry->generation << INDEX_BITS) | (index + 1);
+    __atomic_store_n(&entry->data, data, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->type, type, __ATOMIC_RELAXED);
+    /* publish last, lookups only trust a slot whose handle matches */
+    __atomic_store_n(&entry->handle, handle, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&ht.mutex);
+
+    return handle;
 }
 
-void *handle_get(int handle)
+static handle_entry_t *handle_entry(int handle)
 {
-    if (handle == VDP_INVALID_HANDLE)
+    if (handle == VDP_INVALID_HANDLE || handle <= 0)
         return NULL;
 
-    int index = handle - 1;
-    if (index < ht.size)
-        return ht.data[index];
+    int index = (handle & INDEX_MASK) - 1;
+    if (index < 0 || index >= __atomic_load_n(&ht.size, __ATOMIC_ACQUIRE))
+        return NULL;
 
-    return NULL;
+    handle_entry_t *entry = handle_slot(index);
+    if (__atomic_load_n(&entry->handle, __ATOMIC_ACQUIRE) != handle)
+        return NULL;
+
+    return entry;
+}
+
+void *handle_get(int handle, handle_type_t type)
+{
+    handle_entry_t *entry = handle_entry(handle);
+    void *data;
+
+    if (!entry)
+        return NULL;
+
+    data = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&entry->type, __ATOMIC_RELAXED) != type)
+        return NULL;
+
+    /* the slot may have been destroyed and reused in the meantime */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&entry->handle, __ATOMIC_RELAXED) != handle)
+        return NULL;
+
+    return data;
 }
 
 void handle_destroy(int handle)
 {
-    int index = handle - 1;
+    pthread_mutex_lock(&ht.mutex);
+
+    handle_entry_t *entry = handle_entry(handle);
+    if (entry)
+    {
+        __atomic_store_n(&entry->handle, 0, __ATOMIC_RELAXED);
+        /* lookups that see the slot change also see the handle gone */
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&entry->data, NULL, __ATOMIC_RELAXED);
+        entry->generation = (entry->generation + 1) & GENERATION_MASK;
+        entry->next_free = ht.free_head;
+        ht.free_head = (handle & INDEX_MASK) - 1;
+    }
 
-    if (index < ht.size)
-        ht.data[index] = NULL;
+    pthread_mutex_unlock(&ht.mutex);
 }
@@ -0,0 +1,23 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "vdpau_rockchip.h"
+
+void latency_record(VdpRockchipStage stage, uint64_t us);
+int latency_get(VdpRockchipStage stage, int reset, VdpRockchipLatency *latency);
+
+static inline uint64_t latency_now(void) {
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+
+    return (uint64_t)tp.tv_sec * 1000000ULL + tp.tv_nsec / 1000;
+}
+
+/* record the time since start, taken with latency_now() */
+#define LATENCY(stage, start) latency_record(stage, latency_now() - (start))
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef NAL_H
+#define NAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NAL_MAX_STARTS 512
+#define NAL_MAX_EPBS 512
+
+typedef struct {
+    /* offsets of the 00 00 01 start codes, or 00 00 00 01 */
+    uint32_t num_starts;
+    uint32_t starts[NAL_MAX_STARTS];
+
+    /* offsets of the 03 emulation prevention bytes, counted past the cap */
+    uint32_t num_epbs;
+    uint32_t epbs[NAL_MAX_EPBS];
+} nal_scan_t;
+
+/*
+ * Find every start code and emulation prevention byte in one pass. The
+ * zero byte in front of a four byte start code belongs to it, not to the
+ * NAL before. Scanning stops once NAL_MAX_STARTS start codes have been
+ * recorded, the last NAL then extends to the end of the buffer and its
+ * emulation prevention bytes are not reported.
+ */
+void nal_scan(const uint8_t *buf, size_t size, nal_scan_t *scan);
+
+#endif
@@ -49,8 +49,22 @@ VdpStatus rgba_render_surface(rgba_surface_t *dest,
                               VdpOutputSurfaceRenderBlendState const *blend_state,
                               uint32_t flags);
 
+typedef void (*rgba_region_fn)(rgba_surface_t *rgba, const VdpRect *rect, void *arg);
+
+void rgba_region_reset(rgba_region_t *region);
+void rgba_region_add(rgba_surface_t *rgba, rgba_region_t *region, const VdpRect *rect);
+int rgba_region_empty(const rgba_region_t *region);
+void rgba_region_for_each(rgba_surface_t *rgba, const rgba_region_t *region,
+                          rgba_region_fn fn, void *arg);
+void rgba_region_for_each_band(rgba_surface_t *rgba, const rgba_region_t *region,
+                               rgba_region_fn fn, void *arg);
+
 void rgba_clear(rgba_surface_t *rgba);
 void rgba_fill(rgba_surface_t *dest, const VdpRect *dest_rect, uint32_t color);
 void rgba_blit(rgba_surface_t *dest, const VdpRect *dest_rect, rgba_surface_t *src, const VdpRect *src_rect);
 
+/* src over dst with src alpha, the row uses SIMD where available */
+uint32_t rgba_blend_pixel(uint32_t src, uint32_t dst);
+void rgba_blend_row(uint32_t *dst, const uint32_t *src, int width);
+
 #endif
@@ -0,0 +1,51 @@
+#ifndef RGBA_ALLOC_H
+#define RGBA_ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Backing store of RGBA (output and bitmap) surfaces, chosen with
+ * VDPAU_RGBA_ALLOC. Buffers with a dma-buf fd can be shown without a
+ * texture upload, memfd buffers behave the same on the CPU side but are
+ * not importable, which makes them a stand-in where there is no heap.
+ */
+typedef enum
+{
+    RGBA_ALLOC_MALLOC = 0,
+    RGBA_ALLOC_MEMFD,
+    RGBA_ALLOC_DMA_HEAP,
+    RGBA_ALLOC_DUMB,
+} rgba_alloc_type_t;
+
+typedef struct
+{
+    rgba_alloc_type_t type;
+    void *data;
+    size_t size;
+    int fd;             /* dma-buf or memfd, -1 for malloc */
+    uint32_t handle;    /* GEM handle of a dumb buffer */
+    int drm_fd;
+} rgba_buffer_t;
+
+/* parse VDPAU_RGBA_ALLOC, NULL or unknown names give malloc */
+rgba_alloc_type_t rgba_alloc_type(const char *name);
+
+/*
+ * Allocate width x height pixels of tightly packed 32-bit storage,
+ * falling back to malloc when the requested type is not available.
+ */
+int rgba_alloc(rgba_buffer_t *buf, rgba_alloc_type_t type, int drm_fd,
+               uint32_t width, uint32_t height);
+void rgba_free(rgba_buffer_t *buf);
+
+/* whether the buffer can be imported as an EGLImage */
+static inline int rgba_buffer_is_dmabuf(const rgba_buffer_t *buf)
+{
+    return buf->type == RGBA_ALLOC_DMA_HEAP || buf->type == RGBA_ALLOC_DUMB;
+}
+
+/* bracket CPU access to a shared buffer, a no-op for malloc */
+void rgba_buffer_sync(const rgba_buffer_t *buf, int end);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Frame level tracing, enabled by pointing VDPAU_TRACE at an output
+ * file. A name ending in .json produces a Chrome trace (chrome://tracing),
+ * anything else the raw trace_record_t stream behind a small header.
+ */
+
+typedef enum {
+    /* instant events, value is the capture buffer index if any */
+    TRACE_SUBMIT = 0,
+    TRACE_HW_DONE,
+    TRACE_MIXER,
+    TRACE_PRESENT,
+    TRACE_SWAP,
+
+    /* counters, value is the new count */
+    TRACE_COUNTER_FPS,
+    TRACE_COUNTER_BITRATE,
+    TRACE_COUNTER_INTRA_RATIO,
+    TRACE_COUNTER_SPS_UPLOADS,
+    TRACE_COUNTER_PPS_UPLOADS,
+    TRACE_COUNTER_COPIED_BYTES,
+    TRACE_COUNTER_ASSEMBLE_US,
+    TRACE_COUNTER_INPUT_DEPTH,
+    TRACE_COUNTER_PRESENT_DEPTH,
+    TRACE_COUNTER_UPLOADED_BYTES,
+
+    TRACE_TYPE_COUNT,
+} trace_type_t;
+
+typedef struct {
+    uint64_t time;
+    uint32_t tid;
+    uint16_t type;
+    uint16_t reserved;
+    int64_t value;
+} trace_record_t;
+
+#define TRACE_MAGIC "VDPTRACE"
+#define TRACE_VERSION 1
+
+extern int trace_enabled;
+
+void trace_record(trace_type_t type, int64_t value);
+
+/* a single predictable branch when tracing is off */
+#define TRACE(type, value) do { \
+        if (__builtin_expect(trace_enabled, 0)) \
+            trace_record(type, value); \
+    } while (0)
+
+#endif
@@ -5,6 +5,9 @@
 #define kMaxVideoFrames 4
 #define kPicsInPipeline (kMaxVideoFrames + 2)
 #define kOutputBufferCnt (kPicsInPipeline + kDPBMaxSize)
+#define kInputBufferCnt 4
+#define kMaxInputBufferCnt 8
+#define kPollTimeoutMs 1000
 
 int v4l2_init(const char *device_path);
 int v4l2_init_by_name(const char *name);
@@ -18,7 +21,14 @@ int v4l2_streamon(decoder_ctx_t *dec);
 int v4l2_streamoff(decoder_ctx_t *dec);
 int v4l2_s_ext_ctrls(decoder_ctx_t *dec,
 		struct v4l2_ext_controls* ext_ctrls);
-int v4l2_qbuf_input(decoder_ctx_t *dec);
+int v4l2_get_input(decoder_ctx_t *dec);
+void v4l2_put_input(decoder_ctx_t *dec, int index);
+int v4l2_qbuf_input(decoder_ctx_t *dec, int index);
 int v4l2_qbuf_output(decoder_ctx_t *dec, int index);
+int v4l2_wakeup_init(decoder_ctx_t *dec);
+void v4l2_interrupt(decoder_ctx_t *dec);
+int v4l2_poll(decoder_ctx_t *dec, short events);
 int v4l2_dqbuf_input(decoder_ctx_t *dec);
 int v4l2_dqbuf_output(decoder_ctx_t *dec);
+int v4l2_next_output(decoder_ctx_t *dec);
+void v4l2_return_output(decoder_ctx_t *dec, int index);
@@ -27,10 +27,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/types.h>
 #include <vdpau/vdpau.h>
+#include "vdpau_rockchip.h"
+#include "rgba_alloc.h"
 #include <X11/Xlib.h>
 
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <GLES2/gl2.h>
 
 #include <linux/videodev2.h>
@@ -73,6 +78,23 @@ typedef struct
     GLint texture[3];
 } shader_ctx_t;
 
+#define MAX_EGL_IMAGES VIDEO_MAX_FRAME
+
+/*
+ * An imported dma-buf, reused for as long as the buffer lives. The fd
+ * number alone may have been closed and reused for another buffer, the
+ * buffer is told by the device and inode behind it.
+ */
+typedef struct
+{
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    uint32_t format;
+    uint32_t width, height;
+    EGLImageKHR image;
+} egl_image_entry_t;
+
 typedef struct
 {
     EGLDisplay display;
@@ -80,6 +102,13 @@ typedef struct
     EGLContext context;
     EGLSurface surface;
 
+    egl_image_entry_t images[MAX_EGL_IMAGES];
+    int image_victim;
+    pthread_mutex_t image_mutex;
+
+    /* GL_EXT_unpack_subimage, sub-rectangle uploads without repacking */
+    int unpack_subimage;
+
     shader_ctx_t yuvi420_rgb;
     shader_ctx_t yuyv422_rgb;
     shader_ctx_t uyvy422_rgb;
@@ -91,6 +120,20 @@ typedef struct
     shader_ctx_t oes;
 } device_egl_t;
 
+enum overlay_prop {
+    OVERLAY_PROP_FB_ID,
+    OVERLAY_PROP_CRTC_ID,
+    OVERLAY_PROP_SRC_X,
+    OVERLAY_PROP_SRC_Y,
+    OVERLAY_PROP_SRC_W,
+    OVERLAY_PROP_SRC_H,
+    OVERLAY_PROP_CRTC_X,
+    OVERLAY_PROP_CRTC_Y,
+    OVERLAY_PROP_CRTC_W,
+    OVERLAY_PROP_CRTC_H,
+    OVERLAY_PROP_COUNT,
+};
+
 enum display_mode {
     NO_OVERLAY,
     OVERLAY,
@@ -109,6 +152,32 @@ typedef struct
     int saved_fb;
     enum display_mode dsp_mode;
     Drawable drawable;
+    rgba_alloc_type_t rgba_alloc;
+
+    /* overlay CRTC and plane, see overlay_probe() */
+    struct {
+        int probed;
+        uint32_t crtc_id;
+        uint32_t plane_id;
+        int crtc_x, crtc_y, crtc_w, crtc_h;
+
+        /* plane property ids, only resolved when atomic KMS is usable */
+        int atomic;
+        uint32_t props[OVERLAY_PROP_COUNT];
+        int flip_pending;
+        VdpTime flip_time;
+        /* framebuffer last put on the plane */
+        uint32_t fb_id;
+
+        /*
+         * taken around plane updates and flip waits, close_overlay() may
+         * run on the client thread while the queue thread flips
+         */
+        pthread_mutex_t mutex;
+    } overlay;
+
+    /* guards output_surface_ctx_t.queue across all presentation queues */
+    pthread_mutex_t queue_mutex;
 
     device_egl_t egl;
 } device_ctx_t;
@@ -125,22 +194,83 @@ typedef struct {
     int             bitrate;
     int             intra_ratio;
     int             non_intra_frames;
+
+    int             copied_bytes;
+    int             assemble_time;
+
+    int             sps_uploads;
+    int             pps_uploads;
 } encode_statistics_t, *encode_statistics_p;
 
+#define MAX_EXT_CTRLS 8
+#define MAX_SPS_COUNT 32
+#define MAX_PPS_COUNT 256
+
+/* per-decoder storage for the controls sent with every frame */
+typedef struct {
+    struct v4l2_ext_control controls[MAX_EXT_CTRLS];
+    struct v4l2_ctrl_h264_sps sps;
+    struct v4l2_ctrl_h264_pps pps;
+
+    /* parameter sets as last sent to the driver, by id */
+    struct v4l2_ctrl_h264_sps sps_cache[MAX_SPS_COUNT];
+    struct v4l2_ctrl_h264_pps pps_cache[MAX_PPS_COUNT];
+    struct v4l2_ctrl_h264_scaling_matrix scaling_matrix;
+    int32_t active_sps;
+    int32_t active_pps;
+    int32_t active_scaling_matrix;
+} ctrl_arena_t;
+
 typedef struct decoder_ctx_struct
 {
     uint32_t            width;
     uint32_t            height;
     VdpDecoderProfile   profile;
     device_ctx_t        *device;
-    void                *input_buffer;
+    void                *input_buffers[VIDEO_MAX_FRAME];
+    uint32_t            input_count;
     uint32_t            buffer_size;
     int32_t             fd;
+    int32_t             wake_fd;
     uint32_t            coded_width;
     uint32_t            coded_height;
     int32_t             running;
+    /* the handle and every held output, see decoder_hold_output() */
+    int32_t             refs;
     int32_t             outputs[VIDEO_MAX_FRAME];
+    /* overlay framebuffers registered for outputs[], 0 until first shown */
+    uint32_t            fb_ids[VIDEO_MAX_FRAME];
+    uint32_t            fb_handles[VIDEO_MAX_FRAME];
+    /* CPU mappings of outputs[], made on first use */
+    void                *output_maps[VIDEO_MAX_FRAME];
+    size_t              output_map_sizes[VIDEO_MAX_FRAME];
     encode_statistics_t statistics;
+    ctrl_arena_t        ctrls;
+
+    /*
+     * Guards the parser and the capture buffer state below, which the
+     * decode thread shares with threads mixing or reading back frames.
+     * Never held while blocking on the driver.
+     */
+    pthread_mutex_t     mutex;
+    /* signalled when a thread waiting in v4l2_dqbuf_output() returns */
+    pthread_cond_t      output_cond;
+    int32_t             output_waiting;
+    /* capture buffers queued to the driver, in the order it consumes them */
+    int32_t             output_queue[VIDEO_MAX_FRAME];
+    uint32_t            output_queue_head;
+    uint32_t            output_queue_count;
+    /* capture buffers with a decode in flight, and releases deferred until it lands */
+    uint8_t             output_busy[VIDEO_MAX_FRAME];
+    uint8_t             output_release[VIDEO_MAX_FRAME];
+    /* capture buffers mixed into output surfaces or on screen */
+    uint16_t            output_holds[VIDEO_MAX_FRAME];
+    /* video surface holding each capture buffer, and when it was decoded */
+    struct video_surface_ctx_struct *output_surfaces[VIDEO_MAX_FRAME];
+    uint32_t            output_seq[VIDEO_MAX_FRAME];
+    uint32_t            decode_seq;
+    /* bitmask of bitstream buffers not owned by the driver */
+    uint32_t            input_free;
 
     void                *private;
 
@@ -149,10 +279,11 @@ typedef struct decoder_ctx_struct
             VdpBitstreamBuffer const *buffers,
             VdpVideoSurface output);
     void (*release_picture)(void *dec, void *vs);
+    void (*sync_picture)(void *dec, void *vs);
     void (*deinit)(void *dec);
 } decoder_ctx_t;
 
-typedef struct
+typedef struct video_surface_ctx_struct
 {
     decoder_ctx_t *dec;
     device_ctx_t *device;
@@ -162,6 +293,7 @@ typedef struct
 
     uint32_t fb_id;
     uint32_t dma_fd;
+    int32_t output_index;
     void *private;
 
     GLuint y_tex;
@@ -174,6 +306,21 @@ typedef struct
     GLuint framebuffer;
 } video_surface_ctx_t;
 
+/*
+ * A decoded picture as mixed into an output surface. It holds the
+ * capture buffer and the decoder until released, so neither goes away
+ * while the picture waits in a presentation queue or is on screen.
+ */
+typedef struct
+{
+    decoder_ctx_t *dec;
+    int32_t output_index;
+    uint32_t fb_id;
+    int32_t dma_fd;
+    uint32_t width, height;
+    GLuint oes_tex;
+} video_frame_t;
+
 typedef struct
 {
     device_ctx_t *device;
@@ -181,14 +328,37 @@ typedef struct
 
     EGLSurface surface;
     EGLContext context;
-    GLuint overlay;
 } queue_target_ctx_t;
 
+#define MAX_QUEUED_SURFACES 16
+
+struct output_surface_ctx_struct;
+
+typedef struct
+{
+    struct output_surface_ctx_struct *surface;
+    uint32_t clip_width;
+    uint32_t clip_height;
+    VdpTime time;
+} queue_entry_t;
+
 typedef struct
 {
     queue_target_ctx_t *target;
     VdpColor background;
     device_ctx_t *device;
+
+    /* surfaces waiting for display, sorted by presentation time */
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    queue_entry_t pending[MAX_QUEUED_SURFACES];
+    int pending_count;
+    struct output_surface_ctx_struct *presenting;
+    struct output_surface_ctx_struct *visible;
+    /* picture on screen, released once the next one replaced it */
+    video_frame_t shown;
+    int stop;
 } queue_ctx_t;
 
 typedef struct
@@ -205,26 +375,65 @@ typedef struct
 #define RGBA_FLAG_NEEDS_CLEAR (1 << 1)
 #define RGBA_FLAG_CHANGED (1 << 2)
 
+/*
+ * Coarse bitmap of the tiles of a RGBA surface, one word per tile row.
+ * Tiles are square and sized so that 64x64 of them cover the surface.
+ */
+#define RGBA_REGION_TILES 64
+
+typedef struct
+{
+    uint64_t rows[RGBA_REGION_TILES];
+} rgba_region_t;
+
 typedef struct
 {
     device_ctx_t *device;
     VdpRGBAFormat format;
     uint32_t width, height;
-    void *data;
-    VdpRect dirty;
+    void *data;         /* buffer.data */
+    rgba_buffer_t buffer;
+    uint32_t tile_shift;
+    rgba_region_t dirty;    /* drawn to since the last clear */
+    rgba_region_t changed;  /* modified since the last upload */
     uint32_t flags;
 } rgba_surface_t;
 
-typedef struct
+typedef struct output_surface_ctx_struct
 {
     rgba_surface_t rgba;
     video_surface_ctx_t *vs;
+    video_frame_t frame;
     VdpRect video_src_rect, video_dst_rect;
     int csc_change;
     float brightness;
     float contrast;
     float saturation;
     float hue;
+
+    /*
+     * OSD texture, allocated on first display and then updated in place,
+     * or bound to the surface's dma-buf when overlay_external is set
+     */
+    GLuint overlay_tex;
+    int overlay_external;
+
+    /*
+     * Without GL_OES the picture is copied out of the video surface's
+     * RGB texture when it is mixed, the video surface may be decoded or
+     * mixed into again before the queue shows this one. video_fence
+     * orders the copy before the queue thread samples it.
+     */
+    GLuint video_tex;
+    EGLSyncKHR video_fence;
+
+    /*
+     * presentation state, protected by queue->mutex; queue is only
+     * changed with device->queue_mutex held as well
+     */
+    queue_ctx_t *queue;
+    VdpPresentationQueueStatus status;
+    VdpTime first_presentation_time;
 } output_surface_ctx_t;
 
 typedef struct
@@ -266,26 +475,56 @@ typedef struct
 
 #endif
 
-int handle_create(void *data);
-void *handle_get(int handle);
+typedef enum
+{
+    HANDLE_TYPE_DEVICE = 1,
+    HANDLE_TYPE_DECODER,
+    HANDLE_TYPE_VIDEO_SURFACE,
+    HANDLE_TYPE_OUTPUT_SURFACE,
+    HANDLE_TYPE_BITMAP_SURFACE,
+    HANDLE_TYPE_VIDEO_MIXER,
+    HANDLE_TYPE_PRESENTATION_QUEUE_TARGET,
+    HANDLE_TYPE_PRESENTATION_QUEUE,
+} handle_type_t;
+
+int handle_create(void *data, handle_type_t type);
+void *handle_get(int handle, handle_type_t type);
 void handle_destroy(int handle);
 
 int gl_init_shader (shader_ctx_t *shader, shader_type_t process_type);
 void gl_delete_shader (shader_ctx_t *shader);
 GLuint gl_create_texture(GLuint tex_filter);
+EGLImageKHR gl_get_dmabuf_image(device_ctx_t *dev, int fd, uint32_t format, uint32_t width, uint32_t height);
+void gl_release_dmabuf_image(device_ctx_t *dev, int fd);
 
 VdpStatus vdp_imp_device_create_x11(Display *display, int screen, VdpDevice *device, VdpGetProcAddress **get_proc_address);
 VdpStatus vdp_device_destroy(VdpDevice device);
 VdpStatus vdp_preemption_callback_register(VdpDevice device, VdpPreemptionCallback callback, void *context);
 
+VdpStatus vdp_rockchip_get_latency(VdpDevice device, uint32_t stage, VdpBool reset, VdpRockchipLatency *latency);
 VdpStatus vdp_get_proc_address(VdpDevice device, VdpFuncId function_id, void **function_pointer);
 
 char const *vdp_get_error_string(VdpStatus status);
 VdpStatus vdp_get_api_version(uint32_t *api_version);
 VdpStatus vdp_get_information_string(char const **information_string);
 
+int overlay_probe(device_ctx_t *dev);
 VdpStatus render_overlay(device_ctx_t *dev, int fb_id, int fullscreen, int src_w, int src_h, int clip_w, int clip_h);
 VdpStatus close_overlay(device_ctx_t *dev);
+int overlay_wait_flip(device_ctx_t *dev, VdpTime *time);
+uint32_t decoder_get_framebuffer(decoder_ctx_t *dec, int dma_fd);
+void decoder_release_framebuffers(decoder_ctx_t *dec);
+void *decoder_map_output(decoder_ctx_t *dec, int dma_fd);
+void decoder_unmap_outputs(decoder_ctx_t *dec);
+void decoder_sync_output(int dma_fd, int end);
+void decoder_hold_output(decoder_ctx_t *dec, int index);
+void decoder_release_output(decoder_ctx_t *dec, int index);
+void decoder_unref(decoder_ctx_t *dec);
+void decoder_release_surface(video_surface_ctx_t *vs);
+void video_frame_set(video_frame_t *frame, video_surface_ctx_t *vs);
+void video_frame_copy(video_frame_t *dst, const video_frame_t *src);
+void video_frame_release(video_frame_t *frame);
+void presentation_queue_forget_surface(output_surface_ctx_t *os);
 
 VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device, Drawable drawable, VdpPresentationQueueTarget *target);
 VdpStatus vdp_presentation_queue_target_destroy(VdpPresentationQueueTarget presentation_queue_target);
@@ -0,0 +1,51 @@
+/*
+ * Rockchip specific VDPAU extensions, reachable through
+ * VdpGetProcAddress with the function ids below.
+ */
+
+#ifndef VDPAU_ROCKCHIP_H
+#define VDPAU_ROCKCHIP_H
+
+#include <stdint.h>
+#include <vdpau/vdpau.h>
+
+#define VDP_FUNC_ID_BASE_ROCKCHIP 0x2000
+
+/* pipeline stages with a latency histogram */
+typedef enum {
+    VDP_ROCKCHIP_STAGE_ASSEMBLE = 0,    /* bitstream copy and NAL split */
+    VDP_ROCKCHIP_STAGE_EXT_CTRLS,       /* VIDIOC_S_EXT_CTRLS */
+    VDP_ROCKCHIP_STAGE_DECODE_WAIT,     /* waiting for the hardware */
+    VDP_ROCKCHIP_STAGE_MIXER_IMPORT,    /* mixer picking up a decoded frame */
+    VDP_ROCKCHIP_STAGE_OVERLAY,         /* overlay plane update */
+    VDP_ROCKCHIP_STAGE_SWAP,            /* eglSwapBuffers */
+    VDP_ROCKCHIP_STAGE_COUNT,
+} VdpRockchipStage;
+
+#define VDP_ROCKCHIP_LATENCY_VERSION 0
+
+/* all times in microseconds */
+typedef struct {
+    uint32_t struct_version;
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+} VdpRockchipLatency;
+
+/*
+ * Latency distribution of one stage since the library was loaded, or
+ * since the last call with reset set.
+ */
+typedef VdpStatus VdpRockchipGetLatency(VdpDevice device,
+                                        uint32_t stage,
+                                        VdpBool reset,
+                                        VdpRockchipLatency *latency);
+
+#define VDP_FUNC_ID_ROCKCHIP_GET_LATENCY (VdpFuncId)(VDP_FUNC_ID_BASE_ROCKCHIP + 0)
+
+#endif
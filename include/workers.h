@@ -0,0 +1,25 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <stdint.h>
+
+/*
+ * A small pool of worker threads for splitting CPU work on a picture
+ * into horizontal bands. The pool size defaults to the number of online
+ * CPUs and can be set with VDPAU_THREADS, VDPAU_THREADS=1 runs everything
+ * on the calling thread.
+ */
+
+/* process rows [y0, y1) */
+typedef void (*workers_band_fn)(void *arg, uint32_t y0, uint32_t y1);
+
+/*
+ * Run fn over rows [0, height) of rows row_bytes long and return once
+ * all of them are done. Bands are sized to stay in cache and start on
+ * a multiple of align rows. Small jobs, and jobs issued while the pool
+ * is busy with another one, run inline on the calling thread.
+ */
+void workers_run(workers_band_fn fn, void *arg,
+                 uint32_t height, uint32_t row_bytes, uint32_t align);
+
+#endif
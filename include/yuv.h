@@ -0,0 +1,32 @@
+#ifndef YUV_H
+#define YUV_H
+
+#include <stdint.h>
+
+/* Copy height rows of width bytes between planes of different pitch. */
+void yuv_copy_plane(uint8_t *dst, uint32_t dst_pitch,
+                    const uint8_t *src, uint32_t src_pitch,
+                    uint32_t width, uint32_t height);
+
+/*
+ * Split an interleaved NV12 chroma plane into separate U and V planes.
+ * width is the number of chroma samples per row, not bytes.
+ */
+void yuv_split_chroma(uint8_t *dst_u, uint32_t u_pitch,
+                      uint8_t *dst_v, uint32_t v_pitch,
+                      const uint8_t *src, uint32_t src_pitch,
+                      uint32_t width, uint32_t height);
+
+/*
+ * Read rows [y0, y1) of a NV12 picture into Y, U and V planes, or into
+ * Y and UV planes when dst_v is NULL. y0 must be even, so that bands of
+ * the same picture can be converted independently.
+ */
+void yuv_nv12_read_rows(const uint8_t *src, uint32_t src_pitch,
+                        uint32_t src_height, uint32_t width,
+                        uint32_t y0, uint32_t y1,
+                        uint8_t *dst_y, uint32_t y_pitch,
+                        uint8_t *dst_u, uint32_t u_pitch,
+                        uint8_t *dst_v, uint32_t v_pitch);
+
+#endif
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "latency.h"
+
+/*
+ * Log-linear buckets: values below 16us are exact, above that every
+ * power of two is split into 8 buckets, so any value is known to within
+ * 12.5%. 272 buckets reach past 9 hours.
+ */
+#define LATENCY_EXACT 16
+#define LATENCY_SUB_BITS 3
+#define LATENCY_BUCKETS 272
+#define LATENCY_MAX ((1ULL << 36) - 1)
+
+typedef struct {
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[LATENCY_BUCKETS];
+} latency_histogram_t;
+
+static latency_histogram_t histograms[VDP_ROCKCHIP_STAGE_COUNT];
+
+static const char *stage_names[VDP_ROCKCHIP_STAGE_COUNT] = {
+    [VDP_ROCKCHIP_STAGE_ASSEMBLE] = "assemble",
+    [VDP_ROCKCHIP_STAGE_EXT_CTRLS] = "ext ctrls",
+    [VDP_ROCKCHIP_STAGE_DECODE_WAIT] = "decode wait",
+    [VDP_ROCKCHIP_STAGE_MIXER_IMPORT] = "mixer import",
+    [VDP_ROCKCHIP_STAGE_OVERLAY] = "overlay",
+    [VDP_ROCKCHIP_STAGE_SWAP] = "swap",
+};
+
+static inline int latency_bucket(uint64_t us) {
+    int e;
+
+    if (us < LATENCY_EXACT)
+        return us;
+    if (us > LATENCY_MAX)
+        us = LATENCY_MAX;
+
+    e = 63 - __builtin_clzll(us);
+
+    return LATENCY_EXACT + (e - 4) * 8 +
+        ((us >> (e - LATENCY_SUB_BITS)) & 7);
+}
+
+/* midpoint of a bucket */
+static uint64_t latency_bucket_value(int bucket) {
+    int e, sub;
+
+    if (bucket < LATENCY_EXACT)
+        return bucket;
+
+    e = (bucket - LATENCY_EXACT) / 8 + 4;
+    sub = (bucket - LATENCY_EXACT) % 8;
+
+    return ((8ULL + sub) << (e - LATENCY_SUB_BITS)) +
+        (1ULL << (e - LATENCY_SUB_BITS)) / 2;
+}
+
+void latency_record(VdpRockchipStage stage, uint64_t us) {
+    latency_histogram_t *h = &histograms[stage];
+    uint64_t old;
+
+    __atomic_fetch_add(&h->buckets[latency_bucket(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, us, __ATOMIC_RELAXED);
+
+    /* min is stored plus one, so zero means no sample yet */
+    old = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while ((!old || us + 1 < old) &&
+           !__atomic_compare_exchange_n(&h->min, &old, us + 1, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    old = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (us > old &&
+           !__atomic_compare_exchange_n(&h->max, &old, us, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static inline uint64_t latency_take(uint64_t *field, int reset) {
+    if (reset)
+        return __atomic_exchange_n(field, 0, __ATOMIC_RELAXED);
+
+    return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+int latency_get(VdpRockchipStage stage, int reset, VdpRockchipLatency *latency) {
+    static const uint32_t permille[4] = { 500, 900, 990, 999 };
+    uint64_t *percentiles[4] = { &latency->p50, &latency->p90,
+        &latency->p99, &latency->p999 };
+    latency_histogram_t h;
+    uint64_t count = 0, seen = 0;
+    int i, p = 0;
+
+    if (stage >= VDP_ROCKCHIP_STAGE_COUNT)
+        return -1;
+
+    /*
+     * A snapshot, samples landing meanwhile may be counted or not. On a
+     * reset each field is swapped for zero, a sample is counted in this
+     * snapshot or in the next one but never lost.
+     */
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+        h.buckets[i] = latency_take(&histograms[stage].buckets[i], reset);
+    h.sum = latency_take(&histograms[stage].sum, reset);
+    h.min = latency_take(&histograms[stage].min, reset);
+    h.max = latency_take(&histograms[stage].max, reset);
+
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+        count += h.buckets[i];
+
+    latency->count = count;
+    latency->min = h.min ? h.min - 1 : 0;
+    latency->max = h.max;
+    latency->mean = count ? h.sum / count : 0;
+    latency->p50 = latency->p90 = latency->p99 = latency->p999 = 0;
+
+    for (i = 0; i < LATENCY_BUCKETS && p < 4 && count; i++) {
+        seen += h.buckets[i];
+        while (p < 4 && seen * 1000 >= count * permille[p]) {
+            uint64_t value = latency_bucket_value(i);
+
+            *percentiles[p++] = value < latency->max ? value : latency->max;
+        }
+    }
+
+    return 0;
+}
+
+__attribute__((destructor))
+static void latency_dump(void) {
+    VdpRockchipLatency l;
+    int i;
+
+    if (!getenv("VDPAU_LATENCY"))
+        return;
+
+    fprintf(stderr, "%-14s %10s %8s %8s %8s %8s %8s %8s %8s (us)\n",
+            "stage", "count", "min", "mean", "p50", "p90", "p99", "p99.9", "max");
+
+    for (i = 0; i < VDP_ROCKCHIP_STAGE_COUNT; i++) {
+        latency_get(i, 0, &l);
+        if (!l.count)
+            continue;
+
+        fprintf(stderr, "%-14s %10llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu\n",
+                stage_names[i], (unsigned long long)l.count,
+                (unsigned long long)l.min, (unsigned long long)l.mean,
+                (unsigned long long)l.p50, (unsigned long long)l.p90,
+                (unsigned long long)l.p99, (unsigned long long)l.p999,
+                (unsigned long long)l.max);
+    }
+}
@@ -0,0 +1,81 @@
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "nal.h"
+
+#define NAL_BLOCK 16
+
+/*
+ * Both start codes and emulation prevention bytes begin with two zero
+ * bytes, so any block without a zero byte can be skipped as a whole.
+ */
+static inline int nal_block_has_zero(const uint8_t *p) {
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    uint8x16_t z = vceqq_u8(vld1q_u8(p), vdupq_n_u8(0));
+
+    return vmaxvq_u8(z) != 0;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint8x16_t z = vceqq_u8(vld1q_u8(p), vdupq_n_u8(0));
+    uint8x8_t m = vorr_u8(vget_low_u8(z), vget_high_u8(z));
+
+    return vget_lane_u64(vreinterpret_u64_u8(m), 0) != 0;
+#elif defined(__SSE2__)
+    __m128i z = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p),
+            _mm_setzero_si128());
+
+    return _mm_movemask_epi8(z) != 0;
+#else
+#define HAS_ZERO(v) (((v) - 0x0101010101010101ULL) & ~(v) & \
+        0x8080808080808080ULL)
+    uint64_t a, b;
+
+    memcpy(&a, p, 8);
+    memcpy(&b, p + 8, 8);
+
+    return HAS_ZERO(a) || HAS_ZERO(b);
+#endif
+}
+
+void nal_scan(const uint8_t *buf, size_t size, nal_scan_t *scan) {
+    size_t i = 0, end;
+
+    scan->num_starts = 0;
+    scan->num_epbs = 0;
+
+    if (size < 3)
+        return;
+
+    while (i < size - 2) {
+        if (i + NAL_BLOCK <= size && !nal_block_has_zero(buf + i)) {
+            i += NAL_BLOCK;
+            continue;
+        }
+
+        end = i + NAL_BLOCK < size - 2 ? i + NAL_BLOCK : size - 2;
+        for (; i < end; i++) {
+            if (buf[i + 1]) {
+                i++;
+                continue;
+            }
+            if (buf[i])
+                continue;
+
+            if (buf[i + 2] == 1) {
+                scan->starts[scan->num_starts++] = i && !buf[i - 1] ? i - 1 : i;
+                if (scan->num_starts == NAL_MAX_STARTS)
+                    return;
+                i += 2;
+            } else if (buf[i + 2] == 3) {
+                if (scan->num_epbs < NAL_MAX_EPBS)
+                    scan->epbs[scan->num_epbs] = i + 2;
+                scan->num_epbs++;
+                i += 2;
+            }
+        }
+    }
+}
@@ -18,12 +18,17 @@
  */
 
 #include <time.h>
+#include <string.h>
+#include <poll.h>
+#include <errno.h>
 #include <drm/drm_fourcc.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
 #include "vdpau_private.h"
 #include "rgba.h"
+#include "trace.h"
+#include "latency.h"
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -31,8 +36,8 @@
 #include <GLES2/gl2ext.h>
 #include <libdrm/drm_fourcc.h>
 
-uint64_t time1;
-uint64_t time2;
+/* a flip is due within a few vblanks, longer means the CRTC is off */
+#define kFlipTimeoutMs 100
 
 static uint64_t get_time(void)
 {
@@ -51,7 +56,7 @@ VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device,
     if (!target || !drawable)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -82,22 +87,9 @@ VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device,
         return VDP_STATUS_RESOURCES;
     }
 
-    if (!eglMakeCurrent(dev->egl.display, qt->surface,
-                        qt->surface, qt->context)) {
-        VDPAU_DBG ("Could not set EGL context to current %x", eglGetError());
-        return VDP_STATUS_RESOURCES;
-    }
-
-    qt->overlay = gl_create_texture(GL_LINEAR);
-
-    if (!eglMakeCurrent(dev->egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT)) {
-        VDPAU_DBG ("Could not set EGL context to none %x", eglGetError());
-        return VDP_STATUS_RESOURCES;
-    }
-
     XSetWindowBackground(dev->display, qt->drawable, 0x000102);
 
-    int handle = handle_create(qt);
+    int handle = handle_create(qt, HANDLE_TYPE_PRESENTATION_QUEUE_TARGET);
     if (handle == -1)
         goto out_handle_create;
 
@@ -111,7 +103,7 @@ out_handle_create:
 
 VdpStatus vdp_presentation_queue_target_destroy(VdpPresentationQueueTarget presentation_queue_target)
 {
-    queue_target_ctx_t *qt = handle_get(presentation_queue_target);
+    queue_target_ctx_t *qt = handle_get(presentation_queue_target, HANDLE_TYPE_PRESENTATION_QUEUE_TARGET);
     if (!qt)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -129,6 +121,39 @@ VdpStatus vdp_presentation_queue_target_destroy(VdpPresentationQueueTarget prese
     return VDP_STATUS_OK;
 }
 
+static void *queue_thread(void *param);
+static void queue_forget_surface(output_surface_ctx_t *os);
+
+static void queue_stop(queue_ctx_t *q)
+{
+    int i;
+
+    pthread_mutex_lock(&q->mutex);
+    q->stop = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+
+    pthread_join(q->thread, NULL);
+    video_frame_release(&q->shown);
+
+    /* surfaces still pending are dropped and no longer belong to the queue */
+    pthread_mutex_lock(&q->device->queue_mutex);
+    for (i = 0; i < q->pending_count; i++)
+    {
+        q->pending[i].surface->queue = NULL;
+        q->pending[i].surface->status = VDP_PRESENTATION_QUEUE_STATUS_IDLE;
+    }
+    q->pending_count = 0;
+
+    if (q->visible)
+    {
+        q->visible->queue = NULL;
+        q->visible->status = VDP_PRESENTATION_QUEUE_STATUS_IDLE;
+        q->visible = NULL;
+    }
+    pthread_mutex_unlock(&q->device->queue_mutex);
+}
+
 VdpStatus vdp_presentation_queue_create(VdpDevice device,
                                         VdpPresentationQueueTarget presentation_queue_target,
                                         VdpPresentationQueue *presentation_queue)
@@ -136,11 +161,11 @@ VdpStatus vdp_presentation_queue_create(VdpDevice device,
     if (!presentation_queue)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
-    queue_target_ctx_t *qt = handle_get(presentation_queue_target);
+    queue_target_ctx_t *qt = handle_get(presentation_queue_target, HANDLE_TYPE_PRESENTATION_QUEUE_TARGET);
     if (!qt)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -151,24 +176,46 @@ VdpStatus vdp_presentation_queue_create(VdpDevice device,
     q->target = qt;
     q->device = dev;
 
-    int handle = handle_create(q);
-    if (handle == -1)
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&q->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&q->mutex, NULL);
+
+    if (pthread_create(&q->thread, NULL, queue_thread, q))
     {
-        free(q);
-        return VDP_STATUS_RESOURCES;
+        VDPAU_ERR("Could not start presentation thread");
+        goto out_thread;
     }
 
+    int handle = handle_create(q, HANDLE_TYPE_PRESENTATION_QUEUE);
+    if (handle == -1)
+        goto out_handle_create;
+
     *presentation_queue = handle;
     return VDP_STATUS_OK;
+
+out_handle_create:
+    queue_stop(q);
+out_thread:
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->mutex);
+    free(q);
+    return VDP_STATUS_RESOURCES;
 }
 
 VdpStatus vdp_presentation_queue_destroy(VdpPresentationQueue presentation_queue)
 {
-    queue_ctx_t *q = handle_get(presentation_queue);
+    queue_ctx_t *q = handle_get(presentation_queue, HANDLE_TYPE_PRESENTATION_QUEUE);
     if (!q)
         return VDP_STATUS_INVALID_HANDLE;
 
     handle_destroy(presentation_queue);
+
+    queue_stop(q);
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->mutex);
     free(q);
 
     return VDP_STATUS_OK;
@@ -180,7 +227,7 @@ VdpStatus vdp_presentation_queue_set_background_color(VdpPresentationQueue prese
     if (!background_color)
         return VDP_STATUS_INVALID_POINTER;
 
-    queue_ctx_t *q = handle_get(presentation_queue);
+    queue_ctx_t *q = handle_get(presentation_queue, HANDLE_TYPE_PRESENTATION_QUEUE);
     if (!q)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -198,7 +245,7 @@ VdpStatus vdp_presentation_queue_get_background_color(VdpPresentationQueue prese
     if (!background_color)
         return VDP_STATUS_INVALID_POINTER;
 
-    queue_ctx_t *q = handle_get(presentation_queue);
+    queue_ctx_t *q = handle_get(presentation_queue, HANDLE_TYPE_PRESENTATION_QUEUE);
     if (!q)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -213,7 +260,7 @@ VdpStatus vdp_presentation_queue_get_background_color(VdpPresentationQueue prese
 VdpStatus vdp_presentation_queue_get_time(VdpPresentationQueue presentation_queue,
                                           VdpTime *current_time)
 {
-    queue_ctx_t *q = handle_get(presentation_queue);
+    queue_ctx_t *q = handle_get(presentation_queue, HANDLE_TYPE_PRESENTATION_QUEUE);
     if (!q)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -221,27 +268,80 @@ VdpStatus vdp_presentation_queue_get_time(VdpPresentationQueue presentation_queu
     return VDP_STATUS_OK;
 }
 
-VdpStatus render_overlay(device_ctx_t *dev, int fb_id, int fullscreen,
-                            int src_w, int src_h, int clip_w, int clip_h)
+static const char *overlay_prop_names[OVERLAY_PROP_COUNT] =
+{
+    [OVERLAY_PROP_FB_ID] = "FB_ID",
+    [OVERLAY_PROP_CRTC_ID] = "CRTC_ID",
+    [OVERLAY_PROP_SRC_X] = "SRC_X",
+    [OVERLAY_PROP_SRC_Y] = "SRC_Y",
+    [OVERLAY_PROP_SRC_W] = "SRC_W",
+    [OVERLAY_PROP_SRC_H] = "SRC_H",
+    [OVERLAY_PROP_CRTC_X] = "CRTC_X",
+    [OVERLAY_PROP_CRTC_Y] = "CRTC_Y",
+    [OVERLAY_PROP_CRTC_W] = "CRTC_W",
+    [OVERLAY_PROP_CRTC_H] = "CRTC_H",
+};
+
+static int overlay_probe_props(device_ctx_t *dev)
+{
+    drmModeObjectPropertiesPtr props;
+    int i, j;
+
+    memset(dev->overlay.props, 0, sizeof(dev->overlay.props));
+
+    props = drmModeObjectGetProperties(dev->drm_fd, dev->overlay.plane_id,
+            DRM_MODE_OBJECT_PLANE);
+    if (!props)
+        return -1;
+
+    for (i = 0; i < props->count_props; i++)
+    {
+        drmModePropertyPtr prop = drmModeGetProperty(dev->drm_fd, props->props[i]);
+        if (!prop)
+            continue;
+
+        for (j = 0; j < OVERLAY_PROP_COUNT; j++)
+            if (!strcmp(prop->name, overlay_prop_names[j]))
+                dev->overlay.props[j] = prop->prop_id;
+
+        drmModeFreeProperty(prop);
+    }
+
+    drmModeFreeObjectProperties(props);
+
+    for (j = 0; j < OVERLAY_PROP_COUNT; j++)
+        if (!dev->overlay.props[j])
+            return -1;
+
+    return 0;
+}
+
+/*
+ * Find the CRTC and NV12 capable plane used for the overlay. This walks
+ * every DRM object, so it runs once and again only if the plane update
+ * fails because the topology changed.
+ */
+int overlay_probe(device_ctx_t *dev)
 {
     drmModeResPtr r;
     drmModePlaneResPtr pr;
 
-    int crtc_x = 0, crtc_y = 0, crtc_w = 0, crtc_h = 0;
-    int old_fb = 0;
-    int ret = -1;
     int i, j;
-    int plane_id = 0;
     int crtc = 0;
 
-    Window win;
+    dev->overlay.plane_id = 0;
+    dev->overlay.crtc_id = 0;
+    dev->overlay.probed = 1;
+
+    dev->overlay.atomic = 0;
 
     /**
      * enable all planes
      */
     drmSetClientCap(dev->drm_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
 #ifdef DRM_CLIENT_CAP_ATOMIC
-    drmSetClientCap(dev->drm_fd, DRM_CLIENT_CAP_ATOMIC, 1);
+    if (!getenv("OVERLAY_LEGACY"))
+        dev->overlay.atomic = drmSetClientCap(dev->drm_fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
 #endif
 
     /**
@@ -260,10 +360,11 @@ VdpStatus render_overlay(device_ctx_t *dev, int fb_id, int fullscreen,
         if (c && c->mode_valid)
         {
             crtc = i;
-            crtc_x = c->x;
-            crtc_y = c->y;
-            crtc_w = c->width;
-            crtc_h = c->height;
+            dev->overlay.crtc_id = r->crtcs[i - 1];
+            dev->overlay.crtc_x = c->x;
+            dev->overlay.crtc_y = c->y;
+            dev->overlay.crtc_w = c->width;
+            dev->overlay.crtc_h = c->height;
         }
         drmModeFreeCrtc(c);
     }
@@ -282,102 +383,363 @@ VdpStatus render_overlay(device_ctx_t *dev, int fb_id, int fullscreen,
     {
         drmModePlanePtr p = drmModeGetPlane(dev->drm_fd, pr->planes[i]);
         if (p && p->possible_crtcs == crtc)
-            for (j = 0; j < p->count_formats && !plane_id; j++)
+            for (j = 0; j < p->count_formats && !dev->overlay.plane_id; j++)
                 if (p->formats[j] == DRM_FORMAT_NV12)
                 {
-                    plane_id = pr->planes[i];
-                    old_fb = p->fb_id;
+                    dev->overlay.plane_id = pr->planes[i];
+                    if (dev->saved_fb < 0)
+                    {
+                        dev->saved_fb = p->fb_id;
+                        VDPAU_DBG ("store fb:%d", p->fb_id);
+                    }
                 }
         drmModeFreePlane(p);
     }
 
+    drmModeFreePlaneResources(pr);
+err_plane_res:
+    drmModeFreeResources(r);
+err_res:
+
     /**
      * failed to get crtc or plane
      */
-    if (!crtc || ! plane_id)
-        goto err_overlay;
+    if (!crtc || !dev->overlay.plane_id)
+    {
+        VDPAU_ERR("No NV12 capable plane found");
+        return -1;
+    }
 
-    if (!fullscreen)
+    if (dev->overlay.atomic && overlay_probe_props(dev) < 0)
     {
-        /**
-         * get window's x y w h
-         */
-        XTranslateCoordinates(dev->display,
-                dev->drawable,
-                RootWindow(dev->display, dev->screen),
-                0, 0, &crtc_x, &crtc_y, &win);
-
-        XTranslateCoordinates(dev->display,
-                dev->drawable,
-                RootWindow(dev->display, dev->screen),
-                clip_w, clip_h, &crtc_w, &crtc_h, &win);
+        VDPAU_DBG ("plane properties missing, using legacy plane updates");
+        dev->overlay.atomic = 0;
     }
 
-    ret = drmModeSetPlane(dev->drm_ctl_fd, plane_id,
-            r->crtcs[crtc - 1], fb_id, 0,
-            crtc_x, crtc_y, crtc_w, crtc_h,
-            0, 0, (src_w ? src_w : crtc_w) << 16,
-            (src_h ? src_h : crtc_h) << 16);
+    return 0;
+}
+
+static void overlay_flip_handler(int fd, unsigned int frame, unsigned int sec,
+                                 unsigned int usec, void *data)
+{
+    device_ctx_t *dev = data;
+
+    dev->overlay.flip_time = (VdpTime)sec * 1000000000ULL + (VdpTime)usec * 1000ULL;
+    dev->overlay.flip_pending = 0;
+}
+
+/* called with dev->overlay.mutex held */
+static int overlay_flip_wait(device_ctx_t *dev, VdpTime *time)
+{
+    drmEventContext evctx;
+    struct pollfd pfd;
+
+    if (!dev->overlay.flip_pending)
+        return -1;
 
-    if (dev->saved_fb < 0)
+    memset(&evctx, 0, sizeof(evctx));
+    evctx.version = DRM_EVENT_CONTEXT_VERSION;
+    evctx.page_flip_handler = overlay_flip_handler;
+
+    pfd.fd = dev->drm_fd;
+    pfd.events = POLLIN;
+
+    while (dev->overlay.flip_pending)
     {
-        dev->saved_fb = old_fb;
-        VDPAU_DBG ("store fb:%d", old_fb);
-    } else {
-        drmModeRmFB(dev->drm_ctl_fd, old_fb);
+        int ret = poll(&pfd, 1, kFlipTimeoutMs);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+        {
+            VDPAU_ERR("Timeout waiting for page flip");
+            dev->overlay.flip_pending = 0;
+            return -1;
+        }
+        drmHandleEvent(dev->drm_fd, &evctx);
     }
-err_overlay:
-    drmModeFreePlaneResources(pr);
-err_plane_res:
-    drmModeFreeResources(r);
-err_res:
 
-    if (ret < 0)
+    *time = dev->overlay.flip_time;
+
+    return 0;
+}
+
+/*
+ * Wait for the page flip of the last atomic commit. Returns -1 when no
+ * flip is outstanding, otherwise the time the frame went on screen.
+ */
+int overlay_wait_flip(device_ctx_t *dev, VdpTime *time)
+{
+    int ret;
+
+    pthread_mutex_lock(&dev->overlay.mutex);
+    ret = overlay_flip_wait(dev, time);
+    pthread_mutex_unlock(&dev->overlay.mutex);
+
+    return ret;
+}
+
+static int overlay_commit(device_ctx_t *dev, int fb_id,
+                          int crtc_x, int crtc_y, int crtc_w, int crtc_h,
+                          int src_w, int src_h, int nonblock)
+{
+    drmModeAtomicReqPtr req;
+    uint32_t *props = dev->overlay.props;
+    uint32_t plane = dev->overlay.plane_id;
+    uint32_t flags = 0;
+    VdpTime time;
+    int ret;
+
+    req = drmModeAtomicAlloc();
+    if (!req)
+        return -1;
+
+    drmModeAtomicAddProperty(req, plane, props[OVERLAY_PROP_FB_ID], fb_id);
+    /* a plane without framebuffer must not be bound to a CRTC either */
+    drmModeAtomicAddProperty(req, plane, props[OVERLAY_PROP_CRTC_ID],
+            fb_id ? dev->overlay.crtc_id : 0);
+    if (fb_id)
+    {
+        drmModeAtomicAddProperty(req, plane, props[OVERLAY_PROP_SRC_X], 0);
+        drmModeAtomicAddProperty(req, plane, props[OVERLAY_PROP_SRC_Y], 0);
+        drmModeAtomicAddProperty(req, plane, props[OVERLAY_PROP_SRC_W], src_w << 16);
+        drmModeAtomicAddProperty(req, plane, props[OVERLAY_PROP_SRC_H], src_h << 16);
+        drmModeAtomicAddProperty(req, plane, props[OVERLAY_PROP_CRTC_X], crtc_x);
+        drmModeAtomicAddProperty(req, plane, props[OVERLAY_PROP_CRTC_Y], crtc_y);
+        drmModeAtomicAddProperty(req, plane, props[OVERLAY_PROP_CRTC_W], crtc_w);
+        drmModeAtomicAddProperty(req, plane, props[OVERLAY_PROP_CRTC_H], crtc_h);
+    }
+
+    /*
+     * only one non-blocking commit may be in flight per CRTC, and the
+     * event of a pending one is consumed before a blocking commit too
+     */
+    overlay_flip_wait(dev, &time);
+    if (nonblock)
+        flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+
+    ret = drmModeAtomicCommit(dev->drm_fd, req, flags, dev);
+    if (ret == 0 && nonblock)
+        dev->overlay.flip_pending = 1;
+
+    drmModeAtomicFree(req);
+
+    return ret;
+}
+
+/* called with dev->overlay.mutex held */
+static VdpStatus overlay_update(device_ctx_t *dev, int fb_id, int fullscreen,
+                                int src_w, int src_h, int clip_w, int clip_h,
+                                int nonblock)
+{
+    int crtc_x, crtc_y, crtc_w, crtc_h;
+    int ret, retry;
+
+    Window win;
+
+    if (!dev->overlay.probed && overlay_probe(dev) < 0)
         return VDP_STATUS_ERROR;
 
-    return VDP_STATUS_OK;
+    for (retry = 0; retry < 2; retry++)
+    {
+        if (!dev->overlay.plane_id)
+            return VDP_STATUS_ERROR;
+
+        crtc_x = dev->overlay.crtc_x;
+        crtc_y = dev->overlay.crtc_y;
+        crtc_w = dev->overlay.crtc_w;
+        crtc_h = dev->overlay.crtc_h;
+
+        if (!fullscreen)
+        {
+            /**
+             * get window's x y w h
+             */
+            XLockDisplay(dev->display);
+            XTranslateCoordinates(dev->display,
+                    dev->drawable,
+                    RootWindow(dev->display, dev->screen),
+                    0, 0, &crtc_x, &crtc_y, &win);
+
+            XTranslateCoordinates(dev->display,
+                    dev->drawable,
+                    RootWindow(dev->display, dev->screen),
+                    clip_w, clip_h, &crtc_w, &crtc_h, &win);
+            XUnlockDisplay(dev->display);
+        }
+
+        /* decoder framebuffers are cached and removed with the decoder */
+        if (dev->overlay.atomic)
+            ret = overlay_commit(dev, fb_id, crtc_x, crtc_y, crtc_w, crtc_h,
+                    src_w ? src_w : crtc_w, src_h ? src_h : crtc_h, nonblock);
+        else
+            ret = drmModeSetPlane(dev->drm_ctl_fd, dev->overlay.plane_id,
+                    dev->overlay.crtc_id, fb_id, 0,
+                    crtc_x, crtc_y, crtc_w, crtc_h,
+                    0, 0, (src_w ? src_w : crtc_w) << 16,
+                    (src_h ? src_h : crtc_h) << 16);
+        if (ret >= 0)
+        {
+            dev->overlay.fb_id = fb_id;
+            return VDP_STATUS_OK;
+        }
+
+        /* the display may have been reconfigured, look again once */
+        VDPAU_DBG ("plane update failed, probing display again");
+        if (overlay_probe(dev) < 0)
+            break;
+    }
+
+    return VDP_STATUS_ERROR;
+}
+
+VdpStatus render_overlay(device_ctx_t *dev, int fb_id, int fullscreen,
+                            int src_w, int src_h, int clip_w, int clip_h)
+{
+    VdpStatus ret = VDP_STATUS_ERROR;
+
+    /* the overlay may have been closed since the caller checked */
+    pthread_mutex_lock(&dev->overlay.mutex);
+    if (dev->dsp_mode != NO_OVERLAY)
+        ret = overlay_update(dev, fb_id, fullscreen, src_w, src_h,
+                             clip_w, clip_h, 1);
+    pthread_mutex_unlock(&dev->overlay.mutex);
+
+    return ret;
 }
 
 VdpStatus close_overlay(device_ctx_t *dev)
 {
-    VDPAU_DBG ("restore fb:%d", dev->saved_fb);
-    render_overlay(dev, dev->saved_fb, 1, 0, 0, 0, 0);
+    pthread_mutex_lock(&dev->overlay.mutex);
+    /* nothing to restore on a plane that was never set up */
+    if (dev->overlay.probed)
+    {
+        VDPAU_DBG ("restore fb:%d", dev->saved_fb);
+        overlay_update(dev, dev->saved_fb > 0 ? dev->saved_fb : 0,
+                       1, 0, 0, 0, 0, 0);
+    }
     dev->dsp_mode = NO_OVERLAY;
+    pthread_mutex_unlock(&dev->overlay.mutex);
 
     return VDP_STATUS_OK;
 }
 
 
-VdpStatus vdp_presentation_queue_display(VdpPresentationQueue presentation_queue,
-                                         VdpOutputSurface surface,
-                                         uint32_t clip_width,
-                                         uint32_t clip_height,
-                                         VdpTime earliest_presentation_time)
+static void upload_rect(rgba_surface_t *rgba, const VdpRect *rect, void *arg)
 {
-    //time2 = time1;
-    //time1 = get_time();
-    //printf("time : %ul \n", time1 - time2);
+    uint64_t *bytes = arg;
 
+    glTexSubImage2D(GL_TEXTURE_2D, 0, rect->x0, rect->y0,
+            rect->x1 - rect->x0, rect->y1 - rect->y0, GL_RGBA, GL_UNSIGNED_BYTE,
+            (uint8_t *)rgba->data + (rect->y0 * rgba->width + rect->x0) * 4);
+    CHECKEGL
+    *bytes += (rect->x1 - rect->x0) * (rect->y1 - rect->y0) * 4;
+}
 
-    queue_ctx_t *q = handle_get(presentation_queue);
-    if (!q)
-        return VDP_STATUS_INVALID_HANDLE;
+#ifdef GL_OES
+/* sample a dma-buf backed surface in place, nothing to upload */
+static int queue_import_osd(queue_ctx_t *q, output_surface_ctx_t *os)
+{
+    EGLImageKHR image = gl_get_dmabuf_image(q->device, os->rgba.buffer.fd,
+            os->rgba.format == VDP_RGBA_FORMAT_B8G8R8A8 ?
+                DRM_FORMAT_ARGB8888 : DRM_FORMAT_ABGR8888,
+            os->rgba.width, os->rgba.height);
 
-    output_surface_ctx_t *os = handle_get(surface);
-    if (!os)
-        return VDP_STATUS_INVALID_HANDLE;
+    if (image == EGL_NO_IMAGE_KHR && !os->overlay_external)
+        return 0;
+
+    if (!os->overlay_tex) {
+        glGenTextures(1, &os->overlay_tex);
+        glBindTexture(GL_TEXTURE_EXTERNAL_OES, os->overlay_tex);
+        CHECKEGL
+        glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        CHECKEGL
+        os->overlay_external = 1;
+    }
+
+    glBindTexture(GL_TEXTURE_EXTERNAL_OES, os->overlay_tex);
+    CHECKEGL
+    if (image != EGL_NO_IMAGE_KHR) {
+        glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image);
+        CHECKEGL
+    }
+
+    return 1;
+}
+#endif
+
+/*
+ * Bind the OSD texture of os and return its target. dma-buf surfaces
+ * are imported as is, others get a texture allocated the first time
+ * round and after that just the tiles changed since the last display
+ * uploaded.
+ */
+static GLenum queue_bind_osd(queue_ctx_t *q, output_surface_ctx_t *os)
+{
+    uint64_t bytes = 0;
 
-    if (earliest_presentation_time != 0)
-        VDPAU_DBG_ONCE("Presentation time not supported");
+#ifdef GL_OES
+    if (rgba_buffer_is_dmabuf(&os->rgba.buffer) &&
+        (!os->overlay_tex || os->overlay_external) &&
+        queue_import_osd(q, os)) {
+        os->rgba.flags &= ~RGBA_FLAG_CHANGED;
+        rgba_region_reset(&os->rgba.changed);
+        TRACE(TRACE_COUNTER_UPLOADED_BYTES, 0);
+        return GL_TEXTURE_EXTERNAL_OES;
+    }
+#endif
 
-    if (os->vs && q->device->dsp_mode != NO_OVERLAY)
+    if (!os->overlay_tex) {
+        os->overlay_tex = gl_create_texture(GL_LINEAR);
+        glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA, os->rgba.width, os->rgba.height, 0, GL_RGBA,
+                  GL_UNSIGNED_BYTE, os->rgba.data);
+        CHECKEGL
+        bytes = os->rgba.width * os->rgba.height * 4;
+    } else {
+        glBindTexture (GL_TEXTURE_2D, os->overlay_tex);
+        CHECKEGL
+
+        if (os->rgba.flags & RGBA_FLAG_CHANGED) {
+#ifdef GL_UNPACK_ROW_LENGTH_EXT
+            if (q->device->egl.unpack_subimage) {
+                glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, os->rgba.width);
+                rgba_region_for_each(&os->rgba, &os->rgba.changed, upload_rect, &bytes);
+                glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+            } else
+#endif
+            /* without GL_UNPACK_ROW_LENGTH only whole rows can be uploaded */
+            rgba_region_for_each_band(&os->rgba, &os->rgba.changed, upload_rect, &bytes);
+        }
+    }
+
+    os->rgba.flags &= ~RGBA_FLAG_CHANGED;
+    rgba_region_reset(&os->rgba.changed);
+    TRACE(TRACE_COUNTER_UPLOADED_BYTES, bytes);
+
+    return GL_TEXTURE_2D;
+}
+
+/*
+ * Show an output surface. The picture mixed into it comes from the
+ * frame held by the caller, the video surface it was mixed from may
+ * already carry the next one.
+ */
+static VdpStatus queue_present(queue_ctx_t *q, output_surface_ctx_t *os,
+                               const video_frame_t *frame,
+                               uint32_t clip_width, uint32_t clip_height)
+{
+    if (frame->dec && q->device->dsp_mode != NO_OVERLAY)
     {
         VdpStatus ret;
+        uint64_t start_us = latency_now();
 
-        ret = render_overlay(q->device, os->vs->fb_id,
+        ret = render_overlay(q->device, frame->fb_id,
                 q->device->dsp_mode == OVERLAY_FULLSCREEN,
-                os->vs->dec->coded_width, os->vs->dec->coded_height,
+                frame->dec->coded_width, frame->dec->coded_height,
                 clip_width, clip_height);
+        LATENCY(VDP_ROCKCHIP_STAGE_OVERLAY, start_us);
         if (ret != VDP_STATUS_OK)
         {
             VDPAU_ERR("Could not render overlay");
@@ -398,42 +760,17 @@ VdpStatus vdp_presentation_queue_display(VdpPresentationQueue presentation_queue
     CHECKEGL
     
 #ifdef GL_OES
-    if (os->vs && q->device->dsp_mode == NO_OVERLAY)
+    if (frame->dec && q->device->dsp_mode == NO_OVERLAY)
     {
         /* Do the GLES display of the video */
   static const float kVertices[] =
       { -1.f, 1.f, -1.f, -1.f, 1.f, 1.f, 1.f, -1.f, };
   static const float kTextureCoords[] = { 0, 1, 0, 0, 1, 1, 1, 0, };
 
-        video_surface_ctx_t *vs = os->vs;
-
-        shader_ctx_t * shader = &vs->device->egl.oes;
-
-        EGLint attrs[] = {
-            EGL_WIDTH,                     0, EGL_HEIGHT,                    0,
-            EGL_LINUX_DRM_FOURCC_EXT,      0, EGL_DMA_BUF_PLANE0_FD_EXT,     0,
-            EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0, EGL_DMA_BUF_PLANE0_PITCH_EXT,  0,
-            EGL_DMA_BUF_PLANE1_FD_EXT,     0, EGL_DMA_BUF_PLANE1_OFFSET_EXT, 0,
-            EGL_DMA_BUF_PLANE1_PITCH_EXT,  0, EGL_YUV_COLOR_SPACE_HINT_EXT, 0,
-            EGL_SAMPLE_RANGE_HINT_EXT, 0, EGL_NONE, };
-
-        attrs[1] = vs->width;
-        attrs[3] = vs->height;
-        attrs[5] = DRM_FORMAT_NV12;
-        attrs[7]  = vs->y_tex;
-        attrs[9]  = 0;
-        attrs[11] = vs->width;
+        shader_ctx_t * shader = &q->device->egl.oes;
 
-        attrs[13] = vs->y_tex;
-        attrs[15] = vs->width * vs->height;
-        attrs[17] = vs->width;
-        attrs[19] = EGL_ITU_REC601_EXT;
-        attrs[21] = EGL_YUV_NARROW_RANGE_EXT;
-
-        EGLImageKHR egl_image = eglCreateImageKHR(
-                    q->device->egl.display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attrs);
-        if (egl_image == EGL_NO_IMAGE_KHR)
-            printf("jeffy, failed egl image\n");
+        EGLImageKHR egl_image = gl_get_dmabuf_image(q->device, frame->dma_fd,
+                DRM_FORMAT_NV12, frame->width, frame->height);
 
         glClear (GL_COLOR_BUFFER_BIT);
         CHECKEGL
@@ -464,14 +801,14 @@ VdpStatus vdp_presentation_queue_display(VdpPresentationQueue presentation_queue
 
             glActiveTexture(GL_TEXTURE0);
             CHECKEGL
-            glBindTexture(GL_TEXTURE_EXTERNAL_OES, vs->oes_tex);
+            glBindTexture(GL_TEXTURE_EXTERNAL_OES, frame->oes_tex);
             CHECKEGL
             glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, egl_image);
             CHECKEGL
 
             glActiveTexture(GL_TEXTURE0);
             CHECKEGL
-            glBindTexture(GL_TEXTURE_EXTERNAL_OES, vs->oes_tex);
+            glBindTexture(GL_TEXTURE_EXTERNAL_OES, frame->oes_tex);
             CHECKEGL          
             glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
             CHECKEGL
@@ -480,15 +817,13 @@ VdpStatus vdp_presentation_queue_display(VdpPresentationQueue presentation_queue
             CHECKEGL
             glBindTexture(GL_TEXTURE_EXTERNAL_OES, 0);
             CHECKEGL
-
-            //eglDestroyImageKHR(q->device->egl.display, egl_image);
         }
 
 #else
 
-    if (os->vs && q->device->dsp_mode == NO_OVERLAY)
+    if (os->video_tex && q->device->dsp_mode == NO_OVERLAY)
     {
-        /* Do the GLES display of the video */
+        /* Do the GLES display of the video, copied when it was mixed */
         GLfloat vVertices[] =
         {
             -1.0f, -1.0f,
@@ -535,9 +870,13 @@ VdpStatus vdp_presentation_queue_display(VdpPresentationQueue presentation_queue
         glEnableVertexAttribArray (shader->texcoord_loc);
         CHECKEGL
 
+        if (os->video_fence != EGL_NO_SYNC_KHR)
+            eglClientWaitSyncKHR(q->device->egl.display, os->video_fence, 0,
+                                 EGL_FOREVER_KHR);
+
         glActiveTexture(GL_TEXTURE3);
         CHECKEGL
-        glBindTexture (GL_TEXTURE_2D, os->vs->rgb_tex);
+        glBindTexture (GL_TEXTURE_2D, os->video_tex);
         CHECKEGL
         glUniform1i (shader->texture[0], 3);
         CHECKEGL
@@ -572,8 +911,15 @@ VdpStatus vdp_presentation_queue_display(VdpPresentationQueue presentation_queue
         };
         GLushort indices[] = { 0, 1, 2, 0, 2, 3 };
 
+        glActiveTexture(GL_TEXTURE0);
+        CHECKEGL
+        GLenum tex_target = queue_bind_osd(q, os);
+
         shader_ctx_t *shader;
-        if(os->rgba.format == VDP_RGBA_FORMAT_B8G8R8A8) {
+        if (tex_target != GL_TEXTURE_2D) {
+            /* the dma-buf fourcc already describes the byte order */
+            shader = &q->device->egl.oes;
+        } else if(os->rgba.format == VDP_RGBA_FORMAT_B8G8R8A8) {
             shader = &q->device->egl.brswap;
         } else {
             shader = &q->device->egl.copy;
@@ -597,16 +943,6 @@ VdpStatus vdp_presentation_queue_display(VdpPresentationQueue presentation_queue
         glEnableVertexAttribArray (shader->texcoord_loc);
         CHECKEGL
 
-        glActiveTexture(GL_TEXTURE0);
-        CHECKEGL
-        glBindTexture (GL_TEXTURE_2D, q->target->overlay);
-        CHECKEGL
-        if (os->rgba.flags & RGBA_FLAG_CHANGED) {
-            glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA, os->rgba.width, os->rgba.height, 0, GL_RGBA,
-                      GL_UNSIGNED_BYTE, os->rgba.data);
-            CHECKEGL
-            os->rgba.flags &= ~RGBA_FLAG_CHANGED;
-        }
         glUniform1i (shader->texture[0], 0);
         CHECKEGL
 
@@ -623,20 +959,154 @@ VdpStatus vdp_presentation_queue_display(VdpPresentationQueue presentation_queue
 
         glDisable(GL_BLEND);
         CHECKEGL
+
+        if (tex_target != GL_TEXTURE_2D) {
+            glBindTexture(tex_target, 0);
+            CHECKEGL
+        }
     }
 
 
 
+    uint64_t start_us = latency_now();
     eglSwapBuffers (q->device->egl.display, q->target->surface);
+    LATENCY(VDP_ROCKCHIP_STAGE_SWAP, start_us);
+    TRACE(TRACE_SWAP, frame->output_index);
+
+
+    eglMakeCurrent(q->device->egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+
+
+    return VDP_STATUS_OK;
+}
+
+static int queue_find(queue_ctx_t *q, output_surface_ctx_t *os)
+{
+    int i;
+
+    for (i = 0; i < q->pending_count; i++)
+        if (q->pending[i].surface == os)
+            return 1;
+
+    return 0;
+}
 
-    time2 = time1;
-    time1 = get_time();
-    printf("time : %llu \n", time1 - time2);
+static void *queue_thread(void *param)
+{
+    queue_ctx_t *q = param;
+
+    pthread_mutex_lock(&q->mutex);
+
+    while (!q->stop)
+    {
+        if (!q->pending_count)
+        {
+            pthread_cond_wait(&q->cond, &q->mutex);
+            continue;
+        }
+
+        queue_entry_t entry = q->pending[0];
+        if (entry.time > get_time())
+        {
+            struct timespec ts;
+
+            ts.tv_sec = entry.time / 1000000000ULL;
+            ts.tv_nsec = entry.time % 1000000000ULL;
+            pthread_cond_timedwait(&q->cond, &q->mutex, &ts);
+            continue;
+        }
+
+        q->pending_count--;
+        memmove(&q->pending[0], &q->pending[1], q->pending_count * sizeof(queue_entry_t));
+        q->presenting = entry.surface;
+        video_frame_t frame = { .output_index = -1 };
+        video_frame_copy(&frame, &entry.surface->frame);
+        pthread_mutex_unlock(&q->mutex);
+
+        TRACE(TRACE_PRESENT, frame.output_index);
+        TRACE(TRACE_COUNTER_PRESENT_DEPTH, q->pending_count);
+
+        VdpTime now;
+        queue_present(q, entry.surface, &frame, entry.clip_width, entry.clip_height);
+        /* overlay frames count as shown once their page flip completed */
+        if (overlay_wait_flip(q->device, &now) < 0)
+            now = get_time();
+
+        /*
+         * The previous picture left the screen, unless nothing replaced
+         * it on the overlay plane.
+         */
+        if (frame.dec || q->device->dsp_mode == NO_OVERLAY)
+        {
+            video_frame_release(&q->shown);
+            q->shown = frame;
+        }
+        else
+            video_frame_release(&frame);
+
+        pthread_mutex_lock(&q->mutex);
+        if (q->visible && q->visible != entry.surface && q->visible->status == VDP_PRESENTATION_QUEUE_STATUS_VISIBLE)
+            q->visible->status = VDP_PRESENTATION_QUEUE_STATUS_IDLE;
+        /* the surface may have been queued again while it was presented */
+        if (entry.surface->status != VDP_PRESENTATION_QUEUE_STATUS_QUEUED
+            || !queue_find(q, entry.surface))
+            entry.surface->status = VDP_PRESENTATION_QUEUE_STATUS_VISIBLE;
+        entry.surface->first_presentation_time = now;
+        q->visible = entry.surface;
+        q->presenting = NULL;
+        pthread_cond_broadcast(&q->cond);
+    }
+
+    pthread_mutex_unlock(&q->mutex);
 
+    return NULL;
+}
 
-    eglMakeCurrent(q->device->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+VdpStatus vdp_presentation_queue_display(VdpPresentationQueue presentation_queue,
+                                         VdpOutputSurface surface,
+                                         uint32_t clip_width,
+                                         uint32_t clip_height,
+                                         VdpTime earliest_presentation_time)
+{
+    queue_ctx_t *q = handle_get(presentation_queue, HANDLE_TYPE_PRESENTATION_QUEUE);
+    if (!q)
+        return VDP_STATUS_INVALID_HANDLE;
 
+    output_surface_ctx_t *os = handle_get(surface, HANDLE_TYPE_OUTPUT_SURFACE);
+    if (!os)
+        return VDP_STATUS_INVALID_HANDLE;
+
+    pthread_mutex_lock(&q->device->queue_mutex);
+
+    if (os->queue && os->queue != q)
+        queue_forget_surface(os);
 
+    pthread_mutex_lock(&q->mutex);
+
+    while (q->pending_count == MAX_QUEUED_SURFACES)
+        pthread_cond_wait(&q->cond, &q->mutex);
+
+    /* keep the queue sorted, surfaces with equal times stay in order */
+    int i = q->pending_count;
+    while (i > 0 && q->pending[i - 1].time > earliest_presentation_time)
+    {
+        q->pending[i] = q->pending[i - 1];
+        i--;
+    }
+
+    q->pending[i].surface = os;
+    q->pending[i].clip_width = clip_width;
+    q->pending[i].clip_height = clip_height;
+    q->pending[i].time = earliest_presentation_time;
+    q->pending_count++;
+
+    os->queue = q;
+    os->status = VDP_PRESENTATION_QUEUE_STATUS_QUEUED;
+
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+    pthread_mutex_unlock(&q->device->queue_mutex);
 
     return VDP_STATUS_OK;
 }
@@ -645,15 +1115,31 @@ VdpStatus vdp_presentation_queue_block_until_surface_idle(VdpPresentationQueue p
                                                           VdpOutputSurface surface,
                                                           VdpTime *first_presentation_time)
 {
-    queue_ctx_t *q = handle_get(presentation_queue);
+    if (!first_presentation_time)
+        return VDP_STATUS_INVALID_POINTER;
+
+    queue_ctx_t *q = handle_get(presentation_queue, HANDLE_TYPE_PRESENTATION_QUEUE);
     if (!q)
         return VDP_STATUS_INVALID_HANDLE;
 
-    output_surface_ctx_t *out = handle_get(surface);
+    output_surface_ctx_t *out = handle_get(surface, HANDLE_TYPE_OUTPUT_SURFACE);
     if (!out)
         return VDP_STATUS_INVALID_HANDLE;
 
-    *first_presentation_time = get_time();
+    pthread_mutex_lock(&q->mutex);
+
+    /*
+     * A visible surface only turns idle once another one replaces it, so
+     * wait for that only if something is actually queued behind it.
+     */
+    while (out->queue == q && !q->stop
+           && (out->status == VDP_PRESENTATION_QUEUE_STATUS_QUEUED
+               || (out->status == VDP_PRESENTATION_QUEUE_STATUS_VISIBLE && q->pending_count)))
+        pthread_cond_wait(&q->cond, &q->mutex);
+
+    *first_presentation_time = out->first_presentation_time;
+
+    pthread_mutex_unlock(&q->mutex);
 
     return VDP_STATUS_OK;
 }
@@ -663,16 +1149,69 @@ VdpStatus vdp_presentation_queue_query_surface_status(VdpPresentationQueue prese
                                                       VdpPresentationQueueStatus *status,
                                                       VdpTime *first_presentation_time)
 {
-    queue_ctx_t *q = handle_get(presentation_queue);
+    if (!status || !first_presentation_time)
+        return VDP_STATUS_INVALID_POINTER;
+
+    queue_ctx_t *q = handle_get(presentation_queue, HANDLE_TYPE_PRESENTATION_QUEUE);
     if (!q)
         return VDP_STATUS_INVALID_HANDLE;
 
-    output_surface_ctx_t *out = handle_get(surface);
+    output_surface_ctx_t *out = handle_get(surface, HANDLE_TYPE_OUTPUT_SURFACE);
     if (!out)
         return VDP_STATUS_INVALID_HANDLE;
 
-    *status = VDP_PRESENTATION_QUEUE_STATUS_VISIBLE;
-    *first_presentation_time = get_time();
+    pthread_mutex_lock(&q->mutex);
+
+    if (out->queue == q)
+    {
+        *status = out->status;
+        *first_presentation_time = out->first_presentation_time;
+    }
+    else
+    {
+        *status = VDP_PRESENTATION_QUEUE_STATUS_IDLE;
+        *first_presentation_time = 0;
+    }
+
+    pthread_mutex_unlock(&q->mutex);
 
     return VDP_STATUS_OK;
 }
+
+/* called with device->queue_mutex held */
+static void queue_forget_surface(output_surface_ctx_t *os)
+{
+    queue_ctx_t *q = os->queue;
+    int i, j;
+
+    if (!q)
+        return;
+
+    pthread_mutex_lock(&q->mutex);
+
+    for (i = 0, j = 0; i < q->pending_count; i++)
+        if (q->pending[i].surface != os)
+            q->pending[j++] = q->pending[i];
+    q->pending_count = j;
+
+    while (q->presenting == os)
+        pthread_cond_wait(&q->cond, &q->mutex);
+
+    if (q->visible == os)
+        q->visible = NULL;
+
+    os->queue = NULL;
+    os->status = VDP_PRESENTATION_QUEUE_STATUS_IDLE;
+
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+void presentation_queue_forget_surface(output_surface_ctx_t *os)
+{
+    device_ctx_t *dev = os->rgba.device;
+
+    pthread_mutex_lock(&dev->queue_mutex);
+    queue_forget_surface(os);
+    pthread_mutex_unlock(&dev->queue_mutex);
+}
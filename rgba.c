@@ -19,21 +19,153 @@
 
 #include <string.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "vdpau_private.h"
 #include "rgba.h"
+#include "workers.h"
+
+void rgba_region_reset(rgba_region_t *region)
+{
+    memset(region, 0, sizeof(*region));
+}
+
+void rgba_region_add(rgba_surface_t *rgba, rgba_region_t *region, const VdpRect *rect)
+{
+    uint32_t tx0, tx1, ty;
+    uint64_t mask;
+
+    if (rect->x1 <= rect->x0 || rect->y1 <= rect->y0)
+        return;
+
+    tx0 = rect->x0 >> rgba->tile_shift;
+    tx1 = (rect->x1 - 1) >> rgba->tile_shift;
+    mask = (~0ULL >> (63 - tx1)) & (~0ULL << tx0);
+
+    for (ty = rect->y0 >> rgba->tile_shift; ty <= (rect->y1 - 1) >> rgba->tile_shift; ty++)
+        region->rows[ty] |= mask;
+}
+
+int rgba_region_empty(const rgba_region_t *region)
+{
+    int i;
+
+    for (i = 0; i < RGBA_REGION_TILES; i++)
+        if (region->rows[i])
+            return 0;
+
+    return 1;
+}
+
+/*
+ * Call fn for each run of set tiles, runs in consecutive tile rows with
+ * the same bits are merged into one rectangle.
+ */
+void rgba_region_for_each(rgba_surface_t *rgba, const rgba_region_t *region,
+                          rgba_region_fn fn, void *arg)
+{
+    uint32_t shift = rgba->tile_shift;
+    int ty0 = 0, ty1;
+
+    while (ty0 < RGBA_REGION_TILES) {
+        uint64_t bits = region->rows[ty0];
+
+        if (!bits) {
+            ty0++;
+            continue;
+        }
+
+        for (ty1 = ty0 + 1; ty1 < RGBA_REGION_TILES && region->rows[ty1] == bits; ty1++)
+            ;
+
+        while (bits) {
+            int tx0 = __builtin_ctzll(bits);
+            int tx1 = tx0;
+            VdpRect rect;
+
+            while (tx1 < 64 && (bits >> tx1) & 1)
+                tx1++;
+            bits &= tx1 < 64 ? ~0ULL << tx1 : 0;
+
+            rect.x0 = tx0 << shift;
+            rect.y0 = ty0 << shift;
+            rect.x1 = min((uint32_t)tx1 << shift, rgba->width);
+            rect.y1 = min((uint32_t)ty1 << shift, rgba->height);
+            fn(rgba, &rect, arg);
+        }
+
+        ty0 = ty1;
+    }
+}
+
+/*
+ * Call fn for each band of consecutive tile rows with any tile set, as
+ * one rectangle of full rows. For uploads that can't skip within a row,
+ * where the runs of rgba_region_for_each() would overlap.
+ */
+void rgba_region_for_each_band(rgba_surface_t *rgba, const rgba_region_t *region,
+                               rgba_region_fn fn, void *arg)
+{
+    uint32_t shift = rgba->tile_shift;
+    int ty0 = 0, ty1;
+
+    while (ty0 < RGBA_REGION_TILES) {
+        VdpRect rect;
+
+        if (!region->rows[ty0]) {
+            ty0++;
+            continue;
+        }
+
+        for (ty1 = ty0 + 1; ty1 < RGBA_REGION_TILES && region->rows[ty1]; ty1++)
+            ;
+
+        rect.x0 = 0;
+        rect.y0 = ty0 << shift;
+        rect.x1 = rgba->width;
+        rect.y1 = min((uint32_t)ty1 << shift, rgba->height);
+        fn(rgba, &rect, arg);
 
-static void dirty_add_rect(VdpRect *dirty, const VdpRect *rect)
+        ty0 = ty1;
+    }
+}
+
+/* whether everything drawn since the last clear lies within rect */
+static int dirty_in_rect(rgba_surface_t *rgba, const VdpRect *rect)
 {
-    dirty->x0 = min(dirty->x0, rect->x0);
-    dirty->y0 = min(dirty->y0, rect->y0);
-    dirty->x1 = max(dirty->x1, rect->x1);
-    dirty->y1 = max(dirty->y1, rect->y1);
+    uint64_t cols = 0;
+    int ty0 = -1, ty1 = -1, i;
+    VdpRect bounds;
+
+    for (i = 0; i < RGBA_REGION_TILES; i++) {
+        if (rgba->dirty.rows[i]) {
+            cols |= rgba->dirty.rows[i];
+            if (ty0 < 0)
+                ty0 = i;
+            ty1 = i + 1;
+        }
+    }
+
+    if (!cols)
+        return 1;
+
+    bounds.x0 = __builtin_ctzll(cols) << rgba->tile_shift;
+    bounds.y0 = ty0 << rgba->tile_shift;
+    bounds.x1 = min((uint32_t)(64 - __builtin_clzll(cols)) << rgba->tile_shift, rgba->width);
+    bounds.y1 = min((uint32_t)ty1 << rgba->tile_shift, rgba->height);
+
+    return (bounds.x0 >= rect->x0) && (bounds.y0 >= rect->y0) &&
+           (bounds.x1 <= rect->x1) && (bounds.y1 <= rect->y1);
 }
 
-static int dirty_in_rect(const VdpRect *dirty, const VdpRect *rect)
+static void dirty_add_rect(rgba_surface_t *rgba, const VdpRect *rect)
 {
-    return (dirty->x0 >= rect->x0) && (dirty->y0 >= rect->y0) &&
-           (dirty->x1 <= rect->x1) && (dirty->y1 <= rect->y1);
+    rgba_region_add(rgba, &rgba->dirty, rect);
+    rgba_region_add(rgba, &rgba->changed, rect);
 }
 
 static VdpRect rgba_clip(rgba_surface_t *rgba, const VdpRect *rect) {
@@ -47,6 +179,8 @@ static VdpRect rgba_clip(rgba_surface_t *rgba, const VdpRect *rect) {
     return d_rect;
 }
 
+static void rgba_clear_dirty(rgba_surface_t *rgba);
+
 VdpStatus rgba_create(rgba_surface_t *rgba,
                       device_ctx_t *device,
                       uint32_t width,
@@ -64,22 +198,30 @@ VdpStatus rgba_create(rgba_surface_t *rgba,
     rgba->height = height;
     rgba->format = format;
 
-    rgba->data = malloc(width * height * 4);
-    if (!rgba->data)
+    if (rgba_alloc(&rgba->buffer, device->rgba_alloc, device->drm_fd, width, height) < 0)
         return VDP_STATUS_RESOURCES;
+    rgba->data = rgba->buffer.data;
+
+    rgba->tile_shift = 5;
+    while ((RGBA_REGION_TILES << rgba->tile_shift) < max(width, height))
+        rgba->tile_shift++;
 
-    rgba->dirty.x0 = width;
-    rgba->dirty.y0 = height;
-    rgba->dirty.x1 = 0;
-    rgba->dirty.y1 = 0;
+    rgba_region_reset(&rgba->dirty);
+    rgba_region_reset(&rgba->changed);
+    rgba_buffer_sync(&rgba->buffer, 0);
     rgba_fill(rgba, NULL, 0x00000000);
+    rgba_buffer_sync(&rgba->buffer, 1);
 
     return VDP_STATUS_OK;
 }
 
 void rgba_destroy(rgba_surface_t *rgba)
 {
-    free(rgba->data);
+    if (rgba_buffer_is_dmabuf(&rgba->buffer))
+        gl_release_dmabuf_image(rgba->device, rgba->buffer.fd);
+
+    rgba_free(&rgba->buffer);
+    rgba->data = NULL;
 }
 
 VdpStatus rgba_put_bits_native(rgba_surface_t *rgba,
@@ -89,8 +231,10 @@ VdpStatus rgba_put_bits_native(rgba_surface_t *rgba,
 {
     VdpRect d_rect = rgba_clip(rgba, destination_rect);
 
-    if ((rgba->flags & RGBA_FLAG_NEEDS_CLEAR) && !dirty_in_rect(&rgba->dirty, &d_rect))
-        rgba_clear(rgba);
+    rgba_buffer_sync(&rgba->buffer, 0);
+
+    if ((rgba->flags & RGBA_FLAG_NEEDS_CLEAR) && !dirty_in_rect(rgba, &d_rect))
+        rgba_clear_dirty(rgba);
 
     if (0 == d_rect.x0 && rgba->width == d_rect.x1 && source_pitches[0] == d_rect.x1) {
         // full width
@@ -111,7 +255,9 @@ VdpStatus rgba_put_bits_native(rgba_surface_t *rgba,
     rgba->flags &= ~RGBA_FLAG_NEEDS_CLEAR;
     rgba->flags |= RGBA_FLAG_DIRTY;
     rgba->flags |= RGBA_FLAG_CHANGED;
-    dirty_add_rect(&rgba->dirty, &d_rect);
+    dirty_add_rect(rgba, &d_rect);
+
+    rgba_buffer_sync(&rgba->buffer, 1);
 
     return VDP_STATUS_OK;
 }
@@ -127,6 +273,10 @@ VdpStatus rgba_put_bits_indexed(rgba_surface_t *rgba,
     if (color_table_format != VDP_COLOR_TABLE_FORMAT_B8G8R8X8)
         return VDP_STATUS_INVALID_COLOR_TABLE_FORMAT;
 
+    if (source_indexed_format != VDP_INDEXED_FORMAT_I8A8 &&
+        source_indexed_format != VDP_INDEXED_FORMAT_A8I8)
+        return VDP_STATUS_INVALID_INDEXED_FORMAT;
+
     int x, y;
     const uint32_t *colormap = color_table;
     const uint8_t *src_ptr = source_data[0];
@@ -134,8 +284,10 @@ VdpStatus rgba_put_bits_indexed(rgba_surface_t *rgba,
 
     VdpRect d_rect = rgba_clip(rgba, destination_rect);
 
-    if ((rgba->flags & RGBA_FLAG_NEEDS_CLEAR) && !dirty_in_rect(&rgba->dirty, &d_rect))
-        rgba_clear(rgba);
+    rgba_buffer_sync(&rgba->buffer, 0);
+
+    if ((rgba->flags & RGBA_FLAG_NEEDS_CLEAR) && !dirty_in_rect(rgba, &d_rect))
+        rgba_clear_dirty(rgba);
 
     dst_ptr += d_rect.y0 * rgba->width;
     dst_ptr += d_rect.x0;
@@ -145,18 +297,15 @@ VdpStatus rgba_put_bits_indexed(rgba_surface_t *rgba,
         for (x = 0; x < d_rect.x1 - d_rect.x0; x++)
         {
             uint8_t i, a;
-            switch (source_indexed_format)
+            if (source_indexed_format == VDP_INDEXED_FORMAT_I8A8)
             {
-            case VDP_INDEXED_FORMAT_I8A8:
                 i = src_ptr[x * 2];
                 a = src_ptr[x * 2 + 1];
-                break;
-            case VDP_INDEXED_FORMAT_A8I8:
+            }
+            else
+            {
                 a = src_ptr[x * 2];
                 i = src_ptr[x * 2 + 1];
-                break;
-            default:
-                return VDP_STATUS_INVALID_INDEXED_FORMAT;
             }
             // TODO if rgba->format == VDP_RGBA_FORMAT_R8G8B8A8 then swap!
             dst_ptr[x] = (colormap[i] & 0x00ffffff) | (a << 24);
@@ -168,7 +317,9 @@ VdpStatus rgba_put_bits_indexed(rgba_surface_t *rgba,
     rgba->flags &= ~RGBA_FLAG_NEEDS_CLEAR;
     rgba->flags |= RGBA_FLAG_DIRTY;
     rgba->flags |= RGBA_FLAG_CHANGED;
-    dirty_add_rect(&rgba->dirty, &d_rect);
+    dirty_add_rect(rgba, &d_rect);
+
+    rgba_buffer_sync(&rgba->buffer, 1);
 
     return VDP_STATUS_OK;
 }
@@ -200,8 +351,10 @@ VdpStatus rgba_render_surface(rgba_surface_t *dest,
         d_rect.x0 == d_rect.x1 || d_rect.y0 == d_rect.y1)
         return VDP_STATUS_OK;
 
-    if ((dest->flags & RGBA_FLAG_NEEDS_CLEAR) && !dirty_in_rect(&dest->dirty, &d_rect))
-        rgba_clear(dest);
+    rgba_buffer_sync(&dest->buffer, 0);
+
+    if ((dest->flags & RGBA_FLAG_NEEDS_CLEAR) && !dirty_in_rect(dest, &d_rect))
+        rgba_clear_dirty(dest);
 
     if (!src)
         rgba_fill(dest, &d_rect, 0xffffffff);
@@ -211,28 +364,64 @@ VdpStatus rgba_render_surface(rgba_surface_t *dest,
     dest->flags &= ~RGBA_FLAG_NEEDS_CLEAR;
     dest->flags |= RGBA_FLAG_DIRTY;
     dest->flags |= RGBA_FLAG_CHANGED;
-    dirty_add_rect(&dest->dirty, &d_rect);
+    dirty_add_rect(dest, &d_rect);
+
+    rgba_buffer_sync(&dest->buffer, 1);
 
     return VDP_STATUS_OK;
 }
 
-void rgba_clear(rgba_surface_t *rgba)
+static void clear_rect(rgba_surface_t *rgba, const VdpRect *rect, void *arg)
+{
+    rgba_fill(rgba, rect, 0x00000000);
+    rgba_region_add(rgba, &rgba->changed, rect);
+}
+
+/* only the tiles drawn to since the last clear can hold anything */
+static void rgba_clear_dirty(rgba_surface_t *rgba)
 {
     if (!(rgba->flags & RGBA_FLAG_DIRTY))
         return;
 
-    rgba_fill(rgba, &rgba->dirty, 0x00000000);
+    rgba_region_for_each(rgba, &rgba->dirty, clear_rect, NULL);
+    rgba_region_reset(&rgba->dirty);
     rgba->flags &= ~(RGBA_FLAG_DIRTY | RGBA_FLAG_NEEDS_CLEAR);
     rgba->flags |= RGBA_FLAG_CHANGED;
-    rgba->dirty.x0 = rgba->width;
-    rgba->dirty.y0 = rgba->height;
-    rgba->dirty.x1 = 0;
-    rgba->dirty.y1 = 0;
+}
+
+void rgba_clear(rgba_surface_t *rgba)
+{
+    if (!(rgba->flags & RGBA_FLAG_DIRTY))
+        return;
+
+    rgba_buffer_sync(&rgba->buffer, 0);
+    rgba_clear_dirty(rgba);
+    rgba_buffer_sync(&rgba->buffer, 1);
+}
+
+typedef struct {
+    uint8_t *data;
+    uint32_t stride;
+    uint32_t bytes;
+    uint32_t color;
+} fill_job_t;
+
+static void fill_band(void *arg, uint32_t y0, uint32_t y1)
+{
+    fill_job_t *job = arg;
+    uint32_t i;
+
+    if (job->bytes == job->stride) {
+        memset(job->data + y0 * job->stride, job->color, (y1 - y0) * job->stride);
+    } else {
+        for (i = y0; i < y1; i++)
+            memset(job->data + i * job->stride, job->color, job->bytes);
+    }
 }
 
 void rgba_fill(rgba_surface_t *dest, const VdpRect *dest_rect, uint32_t color)
 {
-    int x, y, w, h, i;
+    int x, y, w, h;
     if (dest_rect) {
         x = dest_rect->x0;
         y = dest_rect->y0;
@@ -245,15 +434,18 @@ void rgba_fill(rgba_surface_t *dest, const VdpRect *dest_rect, uint32_t color)
         h = dest->height;
     }
 
-    if(x == 0 && y == 0 && w == dest->width && h == dest->height) {
-        memset(dest->data, color, dest->width * dest->height * 4);
-    } else {
-        for(i=y ; i<y+h ; i++) {
-            memset(dest->data + (i*dest->width + x)*4, color, w*4);
-        }
-    }
-}
+    if (w <= 0 || h <= 0)
+        return;
+
+    fill_job_t job = {
+        .data = dest->data + (y * dest->width + x) * 4,
+        .stride = dest->width * 4,
+        .bytes = w * 4,
+        .color = color,
+    };
 
+    workers_run(fill_band, &job, h, w * 4, 1);
+}
 
 #define DUFFS_LOOP4(pixel_copy_increment, width)                        \
 { int n = (width+3)/4;                                                  \
@@ -266,6 +458,157 @@ void rgba_fill(rgba_surface_t *dest, const VdpRect *dest_rect, uint32_t color)
     }                                                                   \
 }
 
+/*
+ * The packed scalar blend below works out to, per color channel,
+ *   c = d + floor((s - d) * alpha / 256) = (d * (256 - alpha) + s * alpha) >> 8
+ * and for the alpha channel
+ *   a = alpha + (dalpha * (255 - alpha) >> 8),
+ * with alpha 0 keeping the destination and alpha 255 copying the source.
+ * The SIMD kernels compute exactly that, so all paths are bit-identical.
+ */
+uint32_t rgba_blend_pixel(uint32_t s, uint32_t d)
+{
+    uint32_t dalpha;
+    uint32_t s1;
+    uint32_t d1;
+    uint32_t alpha = s >> 24;
+
+    if (!alpha)
+        return d;
+    if (alpha == 0xFF)
+        return s;
+
+    /*
+     * take out the middle component (green), and process
+     * the other two in parallel. One multiply less.
+     */
+    dalpha = d >> 24;
+    s1 = s & 0xff00ff;
+    d1 = d & 0xff00ff;
+    d1 = (d1 + ((s1 - d1) * alpha >> 8)) & 0xff00ff;
+    s &= 0xff00;
+    d &= 0xff00;
+    d = (d + ((s - d) * alpha >> 8)) & 0xff00;
+    dalpha = alpha + (dalpha * (alpha ^ 0xFF) >> 8);
+
+    return d1 | d | (dalpha << 24);
+}
+
+#if defined(__SSE2__)
+static inline __m128i blend_half_sse2(__m128i s, __m128i d)
+{
+    const __m128i alpha_lanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    const __m128i c255 = _mm_set1_epi16(255);
+    const __m128i c256 = _mm_set1_epi16(256);
+
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+    __m128i c = _mm_srli_epi16(_mm_add_epi16(
+                _mm_mullo_epi16(d, _mm_sub_epi16(c256, a)),
+                _mm_mullo_epi16(s, a)), 8);
+    __m128i da = _mm_add_epi16(a, _mm_srli_epi16(
+                _mm_mullo_epi16(d, _mm_sub_epi16(c255, a)), 8));
+
+    return _mm_or_si128(_mm_andnot_si128(alpha_lanes, c),
+                        _mm_and_si128(alpha_lanes, da));
+}
+#endif
+
+/* blend one row, 4 (SSE2) or 8 (NEON) pixels at a time */
+void rgba_blend_row(uint32_t *dstp, const uint32_t *srcp, int width)
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; width >= 8; width -= 8, srcp += 8, dstp += 8) {
+        uint8x8x4_t s = vld4_u8((const uint8_t *)srcp);
+        uint8x8_t a = s.val[3];
+        uint64_t alphas = vget_lane_u64(vreinterpret_u64_u8(a), 0);
+
+        if (!alphas)
+            continue;
+        if (alphas == ~0ULL) {
+            vst4_u8((uint8_t *)dstp, s);
+            continue;
+        }
+
+        uint8x8x4_t d = vld4_u8((const uint8_t *)dstp);
+        uint8x8_t inv = vsub_u8(vdup_n_u8(0), a);       /* 256 - a, mod 256 */
+        uint8x8_t clear = vceq_u8(a, vdup_n_u8(0));
+        uint8x8_t opaque = vceq_u8(a, vdup_n_u8(0xff));
+        uint8x8x4_t r;
+        int i;
+
+        for (i = 0; i < 3; i++) {
+            uint16x8_t c = vmlal_u8(vmull_u8(d.val[i], inv), s.val[i], a);
+            r.val[i] = vshrn_n_u16(c, 8);
+        }
+        r.val[3] = vadd_u8(a, vshrn_n_u16(vmull_u8(d.val[3], vmvn_u8(a)), 8));
+
+        for (i = 0; i < 4; i++)
+            r.val[i] = vbsl_u8(opaque, s.val[i], vbsl_u8(clear, d.val[i], r.val[i]));
+
+        vst4_u8((uint8_t *)dstp, r);
+    }
+#elif defined(__SSE2__)
+    const __m128i amask = _mm_set1_epi32(0xff000000);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; width >= 4; width -= 4, srcp += 4, dstp += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)srcp);
+        __m128i sa = _mm_and_si128(s, amask);
+        __m128i clear = _mm_cmpeq_epi32(sa, zero);
+        __m128i opaque = _mm_cmpeq_epi32(sa, amask);
+
+        if (_mm_movemask_epi8(clear) == 0xffff)
+            continue;
+        if (_mm_movemask_epi8(opaque) == 0xffff) {
+            _mm_storeu_si128((__m128i *)dstp, s);
+            continue;
+        }
+
+        __m128i d = _mm_loadu_si128((__m128i *)dstp);
+        __m128i r = _mm_packus_epi16(
+                blend_half_sse2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero)),
+                blend_half_sse2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero)));
+
+        r = _mm_or_si128(_mm_and_si128(clear, d), _mm_andnot_si128(clear, r));
+        r = _mm_or_si128(_mm_and_si128(opaque, s), _mm_andnot_si128(opaque, r));
+        _mm_storeu_si128((__m128i *)dstp, r);
+    }
+#endif
+
+    if (width > 0)
+        DUFFS_LOOP4({
+            *dstp = rgba_blend_pixel(*srcp, *dstp);
+            ++srcp;
+            ++dstp;
+        }, width);
+}
+
+typedef struct {
+    uint32_t *dstp;
+    const uint32_t *srcp;
+    uint32_t dst_stride;
+    uint32_t src_stride;
+    int width;
+    int copy;
+} blit_job_t;
+
+static void blit_band(void *arg, uint32_t y0, uint32_t y1)
+{
+    blit_job_t *job = arg;
+    uint32_t *dstp = job->dstp + y0 * job->dst_stride;
+    const uint32_t *srcp = job->srcp + y0 * job->src_stride;
+    uint32_t y;
+
+    for (y = y0; y < y1; y++) {
+        if (job->copy)
+            memcpy(dstp, srcp, job->width * 4);
+        else
+            rgba_blend_row(dstp, srcp, job->width);
+        dstp += job->dst_stride;
+        srcp += job->src_stride;
+    }
+}
+
 /* fast ARGB888->(A)RGB888 blending with pixel alpha */
 void rgba_blit(rgba_surface_t *dest, const VdpRect *dest_rect, rgba_surface_t *src, const VdpRect *src_rect) {
     int width = src_rect->x1 - src_rect->x0;
@@ -276,53 +619,20 @@ void rgba_blit(rgba_surface_t *dest, const VdpRect *dest_rect, rgba_surface_t *s
     width = width + dest_rect->x0 > dest->width ? dest->width - dest_rect->x0 : width;
 
     uint32_t *srcp = (uint32_t *) src->data + src_rect->x0 + src_rect->y0 * src->width;
-    int srcskip = src->width - width;
 
     uint32_t *dstp = (uint32_t *) dest->data + dest_rect->x0 + dest_rect->y0 * dest->width;
-    int dstskip = dest->width - width;
 
-    if (dest->flags & RGBA_FLAG_NEEDS_CLEAR) {
-        while(height--) {
-            memcpy(dstp, srcp, width*4);
-            dstp += dest->width;
-            srcp += src->width;
-        }
+    if (width <= 0 || height <= 0)
         return;
-    }
 
-    while (height--) {
-        DUFFS_LOOP4({
-            uint32_t dalpha;
-            uint32_t d;
-            uint32_t s1;
-            uint32_t d1;
-            uint32_t s = *srcp;
-            uint32_t alpha = s >> 24;
-            if (alpha) {
-              if (alpha == 0xFF) {
-                *dstp = *srcp;
-              } else {
-                /*
-                 * take out the middle component (green), and process
-                 * the other two in parallel. One multiply less.
-                 */
-                d = *dstp;
-                dalpha = d >> 24;
-                s1 = s & 0xff00ff;
-                d1 = d & 0xff00ff;
-                d1 = (d1 + ((s1 - d1) * alpha >> 8)) & 0xff00ff;
-                s &= 0xff00;
-                d &= 0xff00;
-                d = (d + ((s - d) * alpha >> 8)) & 0xff00;
-                dalpha = alpha + (dalpha * (alpha ^ 0xFF) >> 8);
-                *dstp = d1 | d | (dalpha << 24);
-              }
-            }
-            ++srcp;
-            ++dstp;
-        }, width);
-        srcp += srcskip;
-        dstp += dstskip;
-    }
-}
+    blit_job_t job = {
+        .dstp = dstp,
+        .srcp = srcp,
+        .dst_stride = dest->width,
+        .src_stride = src->width,
+        .width = width,
+        .copy = dest->flags & RGBA_FLAG_NEEDS_CLEAR,
+    };
 
+    workers_run(blit_band, &job, height, width * 4, 1);
+}
@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+#ifdef __has_include
+#if __has_include(<linux/dma-heap.h>)
+#include <linux/dma-heap.h>
+#endif
+#endif
+#include <xf86drm.h>
+
+#include "vdpau_private.h"
+#include "rgba_alloc.h"
+
+#define DMA_HEAP_PATH "/dev/dma_heap/system"
+
+static const char *rgba_alloc_names[] = {
+    [RGBA_ALLOC_MALLOC] = "malloc",
+    [RGBA_ALLOC_MEMFD] = "memfd",
+    [RGBA_ALLOC_DMA_HEAP] = "dma-heap",
+    [RGBA_ALLOC_DUMB] = "dumb",
+};
+
+rgba_alloc_type_t rgba_alloc_type(const char *name) {
+    int i;
+
+    if (!name)
+        return RGBA_ALLOC_MALLOC;
+
+    for (i = 0; i < sizeof(rgba_alloc_names) / sizeof(rgba_alloc_names[0]); i++)
+        if (!strcmp(name, rgba_alloc_names[i]))
+            return i;
+
+    VDPAU_ERR("Unknown VDPAU_RGBA_ALLOC %s, using malloc", name);
+    return RGBA_ALLOC_MALLOC;
+}
+
+static int rgba_alloc_memfd(rgba_buffer_t *buf) {
+#ifdef MFD_CLOEXEC
+    buf->fd = memfd_create("vdpau-rgba", MFD_CLOEXEC);
+#endif
+    if (buf->fd < 0)
+        return -1;
+
+    if (ftruncate(buf->fd, buf->size) < 0)
+        return -1;
+
+    return 0;
+}
+
+static int rgba_alloc_dma_heap(rgba_buffer_t *buf) {
+#ifdef DMA_HEAP_IOCTL_ALLOC
+    struct dma_heap_allocation_data data = {
+        .len = buf->size,
+        .fd_flags = O_RDWR | O_CLOEXEC,
+    };
+    int heap = open(DMA_HEAP_PATH, O_RDWR | O_CLOEXEC);
+
+    if (heap < 0)
+        return -1;
+
+    if (ioctl(heap, DMA_HEAP_IOCTL_ALLOC, &data) == 0)
+        buf->fd = data.fd;
+
+    close(heap);
+#endif
+    return buf->fd < 0 ? -1 : 0;
+}
+
+/* only taken when the pitch is exactly width * 4, as rgba.c assumes */
+static int rgba_alloc_dumb(rgba_buffer_t *buf, uint32_t width, uint32_t height) {
+    struct drm_mode_create_dumb create = {
+        .width = width,
+        .height = height,
+        .bpp = 32,
+    };
+
+    if (buf->drm_fd <= 0 || drmIoctl(buf->drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0)
+        return -1;
+
+    buf->handle = create.handle;
+
+    if (create.pitch != width * 4)
+        return -1;
+
+    if (drmPrimeHandleToFD(buf->drm_fd, buf->handle, DRM_CLOEXEC | DRM_RDWR, &buf->fd) < 0) {
+        buf->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* release whatever a failed or finished allocation left behind */
+static void rgba_release(rgba_buffer_t *buf) {
+    if (buf->data && buf->type != RGBA_ALLOC_MALLOC)
+        munmap(buf->data, buf->size);
+    else
+        free(buf->data);
+    buf->data = NULL;
+
+    if (buf->fd >= 0)
+        close(buf->fd);
+    buf->fd = -1;
+
+    if (buf->handle) {
+        struct drm_mode_destroy_dumb destroy = { .handle = buf->handle };
+        drmIoctl(buf->drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    }
+    buf->handle = 0;
+}
+
+int rgba_alloc(rgba_buffer_t *buf, rgba_alloc_type_t type, int drm_fd,
+               uint32_t width, uint32_t height) {
+    int ret = -1;
+
+    memset(buf, 0, sizeof(*buf));
+    buf->fd = -1;
+    buf->drm_fd = drm_fd;
+    buf->size = (size_t)width * height * 4;
+    buf->type = type;
+
+    switch (type) {
+    case RGBA_ALLOC_MEMFD:
+        ret = rgba_alloc_memfd(buf);
+        break;
+    case RGBA_ALLOC_DMA_HEAP:
+        ret = rgba_alloc_dma_heap(buf);
+        break;
+    case RGBA_ALLOC_DUMB:
+        ret = rgba_alloc_dumb(buf, width, height);
+        break;
+    default:
+        break;
+    }
+
+    if (ret == 0) {
+        buf->data = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED, buf->fd, 0);
+        if (buf->data == MAP_FAILED) {
+            buf->data = NULL;
+            ret = -1;
+        }
+    }
+
+    if (ret < 0) {
+        if (type != RGBA_ALLOC_MALLOC)
+            VDPAU_DBG("Could not allocate %ux%u %s buffer, using malloc",
+                      width, height, rgba_alloc_names[type]);
+        rgba_release(buf);
+        buf->type = RGBA_ALLOC_MALLOC;
+        buf->data = malloc(buf->size);
+    }
+
+    return buf->data ? 0 : -1;
+}
+
+void rgba_free(rgba_buffer_t *buf) {
+    rgba_release(buf);
+}
+
+void rgba_buffer_sync(const rgba_buffer_t *buf, int end) {
+#ifdef DMA_BUF_IOCTL_SYNC
+    struct dma_buf_sync sync;
+
+    if (!rgba_buffer_is_dmabuf(buf))
+        return;
+
+    sync.flags = (end ? DMA_BUF_SYNC_END : DMA_BUF_SYNC_START) | DMA_BUF_SYNC_RW;
+    while (ioctl(buf->fd, DMA_BUF_IOCTL_SYNC, &sync) < 0 && (errno == EINTR || errno == EAGAIN))
+        ;
+#endif
+}
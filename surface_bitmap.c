@@ -32,7 +32,7 @@ VdpStatus vdp_bitmap_surface_create(VdpDevice device,
     if (!surface)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -49,7 +49,7 @@ VdpStatus vdp_bitmap_surface_create(VdpDevice device,
         return ret;
     }
 
-    int handle = handle_create(out);
+    int handle = handle_create(out, HANDLE_TYPE_BITMAP_SURFACE);
     if (handle == -1)
     {
         rgba_destroy(&out->rgba);
@@ -64,7 +64,7 @@ VdpStatus vdp_bitmap_surface_create(VdpDevice device,
 
 VdpStatus vdp_bitmap_surface_destroy(VdpBitmapSurface surface)
 {
-    bitmap_surface_ctx_t *out = handle_get(surface);
+    bitmap_surface_ctx_t *out = handle_get(surface, HANDLE_TYPE_BITMAP_SURFACE);
     if (!out)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -82,7 +82,7 @@ VdpStatus vdp_bitmap_surface_get_parameters(VdpBitmapSurface surface,
                                             uint32_t *height,
                                             VdpBool *frequently_accessed)
 {
-    bitmap_surface_ctx_t *out = handle_get(surface);
+    bitmap_surface_ctx_t *out = handle_get(surface, HANDLE_TYPE_BITMAP_SURFACE);
     if (!out)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -106,7 +106,7 @@ VdpStatus vdp_bitmap_surface_put_bits_native(VdpBitmapSurface surface,
                                              uint32_t const *source_pitches,
                                              VdpRect const *destination_rect)
 {
-    bitmap_surface_ctx_t *out = handle_get(surface);
+    bitmap_surface_ctx_t *out = handle_get(surface, HANDLE_TYPE_BITMAP_SURFACE);
     if (!out)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -124,7 +124,7 @@ VdpStatus vdp_bitmap_surface_query_capabilities(VdpDevice device,
     if (!is_supported || !max_width || !max_height)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -31,7 +31,7 @@ VdpStatus vdp_output_surface_create(VdpDevice device,
     if (!surface)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -49,7 +49,7 @@ VdpStatus vdp_output_surface_create(VdpDevice device,
         return ret;
     }
 
-    int handle = handle_create(out);
+    int handle = handle_create(out, HANDLE_TYPE_OUTPUT_SURFACE);
     if (handle == -1)
     {
         rgba_destroy(&out->rgba);
@@ -64,10 +64,33 @@ VdpStatus vdp_output_surface_create(VdpDevice device,
 
 VdpStatus vdp_output_surface_destroy(VdpOutputSurface surface)
 {
-    output_surface_ctx_t *out = handle_get(surface);
+    output_surface_ctx_t *out = handle_get(surface, HANDLE_TYPE_OUTPUT_SURFACE);
     if (!out)
         return VDP_STATUS_INVALID_HANDLE;
 
+    presentation_queue_forget_surface(out);
+    video_frame_release(&out->frame);
+
+#ifndef GL_OES
+    if (out->video_fence != EGL_NO_SYNC_KHR)
+        eglDestroySyncKHR(out->rgba.device->egl.display, out->video_fence);
+#endif
+
+    if (out->overlay_tex || out->video_tex) {
+        device_ctx_t *dev = out->rgba.device;
+
+        if (eglMakeCurrent(dev->egl.display, dev->egl.surface,
+                           dev->egl.surface, dev->egl.context)) {
+            if (out->overlay_tex)
+                glDeleteTextures(1, &out->overlay_tex);
+            if (out->video_tex)
+                glDeleteTextures(1, &out->video_tex);
+            eglMakeCurrent(dev->egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        } else {
+            VDPAU_DBG ("Could not set EGL context to current %x", eglGetError());
+        }
+    }
+
     rgba_destroy(&out->rgba);
 
     handle_destroy(surface);
@@ -81,7 +104,7 @@ VdpStatus vdp_output_surface_get_parameters(VdpOutputSurface surface,
                                             uint32_t *width,
                                             uint32_t *height)
 {
-    output_surface_ctx_t *out = handle_get(surface);
+    output_surface_ctx_t *out = handle_get(surface, HANDLE_TYPE_OUTPUT_SURFACE);
     if (!out)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -102,7 +125,7 @@ VdpStatus vdp_output_surface_get_bits_native(VdpOutputSurface surface,
                                              void *const *destination_data,
                                              uint32_t const *destination_pitches)
 {
-    output_surface_ctx_t *out = handle_get(surface);
+    output_surface_ctx_t *out = handle_get(surface, HANDLE_TYPE_OUTPUT_SURFACE);
     if (!out)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -114,7 +137,7 @@ VdpStatus vdp_output_surface_put_bits_native(VdpOutputSurface surface,
                                              uint32_t const *source_pitches,
                                              VdpRect const *destination_rect)
 {
-    output_surface_ctx_t *out = handle_get(surface);
+    output_surface_ctx_t *out = handle_get(surface, HANDLE_TYPE_OUTPUT_SURFACE);
     if (!out)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -129,7 +152,7 @@ VdpStatus vdp_output_surface_put_bits_indexed(VdpOutputSurface surface,
                                               VdpColorTableFormat color_table_format,
                                               void const *color_table)
 {
-    output_surface_ctx_t *out = handle_get(surface);
+    output_surface_ctx_t *out = handle_get(surface, HANDLE_TYPE_OUTPUT_SURFACE);
     if (!out)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -144,7 +167,7 @@ VdpStatus vdp_output_surface_put_bits_y_cb_cr(VdpOutputSurface surface,
                                               VdpRect const *destination_rect,
                                               VdpCSCMatrix const *csc_matrix)
 {
-    output_surface_ctx_t *out = handle_get(surface);
+    output_surface_ctx_t *out = handle_get(surface, HANDLE_TYPE_OUTPUT_SURFACE);
     if (!out)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -159,11 +182,11 @@ VdpStatus vdp_output_surface_render_output_surface(VdpOutputSurface destination_
                                                    VdpOutputSurfaceRenderBlendState const *blend_state,
                                                    uint32_t flags)
 {
-    output_surface_ctx_t *out = handle_get(destination_surface);
+    output_surface_ctx_t *out = handle_get(destination_surface, HANDLE_TYPE_OUTPUT_SURFACE);
     if (!out)
         return VDP_STATUS_INVALID_HANDLE;
 
-    output_surface_ctx_t *in = handle_get(source_surface);
+    output_surface_ctx_t *in = handle_get(source_surface, HANDLE_TYPE_OUTPUT_SURFACE);
 
     return rgba_render_surface(&out->rgba, destination_rect, in ? &in->rgba : NULL, source_rect,
                     colors, blend_state, flags);
@@ -177,11 +200,11 @@ VdpStatus vdp_output_surface_render_bitmap_surface(VdpOutputSurface destination_
                                                    VdpOutputSurfaceRenderBlendState const *blend_state,
                                                    uint32_t flags)
 {
-    output_surface_ctx_t *out = handle_get(destination_surface);
+    output_surface_ctx_t *out = handle_get(destination_surface, HANDLE_TYPE_OUTPUT_SURFACE);
     if (!out)
         return VDP_STATUS_INVALID_HANDLE;
 
-    bitmap_surface_ctx_t *in = handle_get(source_surface);
+    bitmap_surface_ctx_t *in = handle_get(source_surface, HANDLE_TYPE_BITMAP_SURFACE);
 
     return rgba_render_surface(&out->rgba, destination_rect, in ? &in->rgba : NULL, source_rect,
                     colors, blend_state, flags);
@@ -196,7 +219,7 @@ VdpStatus vdp_output_surface_query_capabilities(VdpDevice device,
     if (!is_supported || !max_width || !max_height)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -214,7 +237,7 @@ VdpStatus vdp_output_surface_query_get_put_bits_native_capabilities(VdpDevice de
     if (!is_supported)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -232,7 +255,7 @@ VdpStatus vdp_output_surface_query_put_bits_indexed_capabilities(VdpDevice devic
     if (!is_supported)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -249,7 +272,7 @@ VdpStatus vdp_output_surface_query_put_bits_y_cb_cr_capabilities(VdpDevice devic
     if (!is_supported)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
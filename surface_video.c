@@ -21,6 +21,8 @@
 #include <sys/mman.h>
 #include <time.h>
 #include "vdpau_private.h"
+#include "yuv.h"
+#include "workers.h"
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -28,19 +30,6 @@
 #include <GLES2/gl2ext.h>
 #include <libdrm/drm_fourcc.h>
 
-extern uint64_t time1;
-extern uint64_t time2;
-
-static uint64_t get_time(void)
-{
-    struct timespec tp;
-
-    if (clock_gettime(CLOCK_MONOTONIC, &tp) == -1)
-        return 0;
-
-    return (uint64_t)tp.tv_sec * 1000000000ULL + (uint64_t)tp.tv_nsec;
-}
-
 
 VdpStatus vdp_video_surface_create(VdpDevice device,
                                    VdpChromaType chroma_type,
@@ -54,7 +43,7 @@ VdpStatus vdp_video_surface_create(VdpDevice device,
     if (!width || !height)
         return VDP_STATUS_INVALID_SIZE;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -66,6 +55,7 @@ VdpStatus vdp_video_surface_create(VdpDevice device,
     vs->width = width;
     vs->height = height;
     vs->chroma_type = chroma_type;
+    vs->output_index = -1;
 
     switch (chroma_type)
     {
@@ -119,7 +109,7 @@ VdpStatus vdp_video_surface_create(VdpDevice device,
         return VDP_STATUS_RESOURCES;
     }
 
-    int handle = handle_create(vs);
+    int handle = handle_create(vs, HANDLE_TYPE_VIDEO_SURFACE);
     if (handle == -1)
     {
         free(vs);
@@ -133,7 +123,7 @@ VdpStatus vdp_video_surface_create(VdpDevice device,
 
 VdpStatus vdp_video_surface_destroy(VdpVideoSurface surface)
 {
-    video_surface_ctx_t *vs = handle_get(surface);
+    video_surface_ctx_t *vs = handle_get(surface, HANDLE_TYPE_VIDEO_SURFACE);
     if (!vs)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -151,6 +141,7 @@ VdpStatus vdp_video_surface_destroy(VdpVideoSurface surface)
     glDeleteFramebuffers (1, framebuffers);
     glDeleteTextures (4, textures);
 
+    decoder_release_surface(vs);
     handle_destroy(surface);
     free(vs);
 
@@ -162,7 +153,7 @@ VdpStatus vdp_video_surface_get_parameters(VdpVideoSurface surface,
                                            uint32_t *width,
                                            uint32_t *height)
 {
-    video_surface_ctx_t *vid = handle_get(surface);
+    video_surface_ctx_t *vid = handle_get(surface, HANDLE_TYPE_VIDEO_SURFACE);
     if (!vid)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -178,37 +169,81 @@ VdpStatus vdp_video_surface_get_parameters(VdpVideoSurface surface,
     return VDP_STATUS_OK;
 }
 
+typedef struct {
+    const uint8_t *src;
+    uint32_t src_pitch;
+    uint32_t src_height;
+    uint32_t width;
+    uint8_t *dst_y;
+    uint32_t y_pitch;
+    uint8_t *dst_u;
+    uint32_t u_pitch;
+    uint8_t *dst_v;
+    uint32_t v_pitch;
+} readback_job_t;
+
+static void readback_band(void *arg, uint32_t y0, uint32_t y1)
+{
+    readback_job_t *job = arg;
+
+    yuv_nv12_read_rows(job->src, job->src_pitch, job->src_height, job->width,
+            y0, y1, job->dst_y, job->y_pitch, job->dst_u, job->u_pitch,
+            job->dst_v, job->v_pitch);
+}
+
 VdpStatus vdp_video_surface_get_bits_y_cb_cr(VdpVideoSurface surface,
                                              VdpYCbCrFormat dst_format,
                                              void *const *dst_data,
                                              uint32_t const *dst_pitches)
 {
-    video_surface_ctx_t *vs = handle_get(surface);
+    video_surface_ctx_t *vs = handle_get(surface, HANDLE_TYPE_VIDEO_SURFACE);
     if (!vs || vs->dma_fd <= 0)
         return VDP_STATUS_INVALID_HANDLE;
 
-    if (dst_format != VDP_YCBCR_FORMAT_YV12)
-        return VDP_STATUS_RESOURCES;
+    if (dst_format != VDP_YCBCR_FORMAT_YV12 && dst_format != VDP_YCBCR_FORMAT_NV12)
+        return VDP_STATUS_INVALID_Y_CB_CR_FORMAT;
+
+    if (!dst_data || !dst_pitches)
+        return VDP_STATUS_INVALID_POINTER;
+
+    vs->dec->sync_picture(vs->dec, vs);
 
     int w = vs->dec->coded_width;
     int h = vs->dec->coded_height;
 
-    size_t size = w * h * 3 / 2;
-    void *buf = mmap(NULL, size,
-            PROT_READ | PROT_WRITE, MAP_SHARED,
-            vs->dma_fd, 0);
-
+    void *buf = decoder_map_output(vs->dec, vs->dma_fd);
     if (!buf)
         return VDP_STATUS_RESOURCES;
 
-    memcpy(dst_data[0], buf, w * h);
+    /* the coded picture is padded, only hand out the visible part */
+    uint32_t width = min(vs->width, (uint32_t)w);
+    uint32_t height = min(vs->height, (uint32_t)h);
 
-    int i;
-    for (i = 0; i < (w * h / 2); i ++) {
-        ((uint8_t*)dst_data[2 - i % 2])[i >> 1] = ((uint8_t*)buf)[w * h + i];
+    decoder_sync_output(vs->dma_fd, 0);
+
+    readback_job_t job = {
+        .src = buf,
+        .src_pitch = w,
+        .src_height = h,
+        .width = width,
+        .dst_y = dst_data[0],
+        .y_pitch = dst_pitches[0],
+    };
+
+    if (dst_format == VDP_YCBCR_FORMAT_NV12) {
+        job.dst_u = dst_data[1];
+        job.u_pitch = dst_pitches[1];
+    } else {
+        job.dst_u = dst_data[2];
+        job.u_pitch = dst_pitches[2];
+        job.dst_v = dst_data[1];
+        job.v_pitch = dst_pitches[1];
     }
 
-    munmap(buf, size);
+    /* luma plus half a row of chroma per row, bands on even rows */
+    workers_run(readback_band, &job, height, width + width / 2, 2);
+
+    decoder_sync_output(vs->dma_fd, 1);
 
     return VDP_STATUS_OK;
 }
@@ -481,9 +516,7 @@ VdpStatus vdp_video_surface_put_bits_y_cb_cr(VdpVideoSurface surface,
                                              void const *const *source_data,
                                              uint32_t const *source_pitches)
 {
-    time2 = time1;
-    time1 = get_time();
-    video_surface_ctx_t *vs = handle_get(surface);
+    video_surface_ctx_t *vs = handle_get(surface, HANDLE_TYPE_VIDEO_SURFACE);
     if (!vs)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -496,9 +529,8 @@ VdpStatus vdp_video_surface_put_bits_y_cb_cr(VdpVideoSurface surface,
 VdpStatus video_surface_render_picture(video_surface_ctx_t *vs,
                                        void const *const source_data)
 {
-    time1 = get_time();
 #ifdef GL_OES
-    vs->y_tex = (int)source_data;
+    vs->y_tex = (intptr_t)source_data;
     return VDP_STATUS_OK;
 #else
     return video_surface_put_bits_y_cb_cr(vs, vs->source_format,
@@ -515,7 +547,7 @@ VdpStatus vdp_video_surface_query_capabilities(VdpDevice device,
     if (!is_supported || !max_width || !max_height)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -534,7 +566,7 @@ VdpStatus vdp_video_surface_query_get_put_bits_y_cb_cr_capabilities(VdpDevice de
     if (!is_supported)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
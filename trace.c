@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#define TRACE_RING_SIZE 4096
+
+/*
+ * Every thread records into its own ring, so recording needs neither a
+ * lock nor an atomic read-modify-write. A ring is written out by its
+ * owner when it fills up and by the exit handler for what is left.
+ * When its thread exits the ring is flushed and kept for the next new
+ * thread, decoders and queues come and go with their threads.
+ */
+typedef struct trace_ring {
+    struct trace_ring *next;
+    uint32_t tid;
+    uint32_t head;
+    uint32_t flushed;
+    trace_record_t records[TRACE_RING_SIZE];
+} trace_ring_t;
+
+int trace_enabled;
+
+static FILE *trace_file;
+static int trace_json;
+static int trace_first = 1;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *trace_rings;
+static trace_ring_t *trace_free_rings;
+static __thread trace_ring_t *trace_ring;
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static int trace_key_valid;
+
+static const char *trace_names[TRACE_TYPE_COUNT] = {
+    [TRACE_SUBMIT] = "submit",
+    [TRACE_HW_DONE] = "hw-done",
+    [TRACE_MIXER] = "mixer",
+    [TRACE_PRESENT] = "present",
+    [TRACE_SWAP] = "swap",
+    [TRACE_COUNTER_FPS] = "fps",
+    [TRACE_COUNTER_BITRATE] = "bitrate(KB/s)",
+    [TRACE_COUNTER_INTRA_RATIO] = "intra ratio",
+    [TRACE_COUNTER_SPS_UPLOADS] = "sps uploads",
+    [TRACE_COUNTER_PPS_UPLOADS] = "pps uploads",
+    [TRACE_COUNTER_COPIED_BYTES] = "copied(B/frame)",
+    [TRACE_COUNTER_ASSEMBLE_US] = "assemble(us/frame)",
+    [TRACE_COUNTER_INPUT_DEPTH] = "input depth",
+    [TRACE_COUNTER_PRESENT_DEPTH] = "present depth",
+    [TRACE_COUNTER_UPLOADED_BYTES] = "uploaded(B/frame)",
+};
+
+static void trace_write(const trace_record_t *rec) {
+    if (!trace_json) {
+        fwrite(rec, sizeof(*rec), 1, trace_file);
+        return;
+    }
+
+    fprintf(trace_file, "%s\n", trace_first ? "" : ",");
+    trace_first = 0;
+
+    if (rec->type >= TRACE_COUNTER_FPS)
+        fprintf(trace_file, "{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,"
+                "\"pid\":%d,\"args\":{\"value\":%lld}}",
+                trace_names[rec->type], rec->time / 1000.0, getpid(),
+                (long long)rec->value);
+    else
+        fprintf(trace_file, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+                "\"ts\":%.3f,\"pid\":%d,\"tid\":%u,\"args\":{\"value\":%lld}}",
+                trace_names[rec->type], rec->time / 1000.0, getpid(),
+                rec->tid, (long long)rec->value);
+}
+
+/* called with trace_mutex held */
+static void trace_flush_ring(trace_ring_t *ring) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (!trace_file)
+        return;
+
+    /* records older than one ring were overwritten before the flush */
+    if (head - ring->flushed > TRACE_RING_SIZE)
+        ring->flushed = head - TRACE_RING_SIZE;
+
+    for (; ring->flushed != head; ring->flushed++)
+        trace_write(&ring->records[ring->flushed % TRACE_RING_SIZE]);
+}
+
+/* thread exit, flush what is left and put the ring up for reuse */
+static void trace_ring_exit(void *arg) {
+    trace_ring_t *ring = arg, **p;
+
+    pthread_mutex_lock(&trace_mutex);
+    trace_flush_ring(ring);
+
+    for (p = &trace_rings; *p; p = &(*p)->next) {
+        if (*p == ring) {
+            *p = ring->next;
+            break;
+        }
+    }
+    ring->next = trace_free_rings;
+    trace_free_rings = ring;
+    pthread_mutex_unlock(&trace_mutex);
+
+    trace_ring = NULL;
+}
+
+static void trace_key_create(void) {
+    trace_key_valid = !pthread_key_create(&trace_key, trace_ring_exit);
+}
+
+static trace_ring_t *trace_ring_create(void) {
+    trace_ring_t *ring;
+
+    pthread_once(&trace_key_once, trace_key_create);
+
+    pthread_mutex_lock(&trace_mutex);
+    ring = trace_free_rings;
+    if (ring)
+        trace_free_rings = ring->next;
+    pthread_mutex_unlock(&trace_mutex);
+
+    if (!ring && !(ring = malloc(sizeof(trace_ring_t))))
+        return NULL;
+
+    ring->tid = syscall(SYS_gettid);
+    ring->head = 0;
+    ring->flushed = 0;
+
+    pthread_mutex_lock(&trace_mutex);
+    ring->next = trace_rings;
+    trace_rings = ring;
+    pthread_mutex_unlock(&trace_mutex);
+
+    if (trace_key_valid)
+        pthread_setspecific(trace_key, ring);
+
+    return ring;
+}
+
+void trace_record(trace_type_t type, int64_t value) {
+    trace_ring_t *ring = trace_ring;
+    struct timespec tp;
+    trace_record_t *rec;
+
+    if (!ring && !(ring = trace_ring = trace_ring_create()))
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+
+    rec = &ring->records[ring->head % TRACE_RING_SIZE];
+    rec->time = (uint64_t)tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+    rec->tid = ring->tid;
+    rec->type = type;
+    rec->reserved = 0;
+    rec->value = value;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+
+    if (ring->head - ring->flushed >= TRACE_RING_SIZE) {
+        pthread_mutex_lock(&trace_mutex);
+        trace_flush_ring(ring);
+        pthread_mutex_unlock(&trace_mutex);
+    }
+}
+
+__attribute__((constructor))
+static void trace_init(void) {
+    const char *path = getenv("VDPAU_TRACE");
+    size_t len;
+
+    if (!path || !*path)
+        return;
+
+    trace_file = fopen(path, "w");
+    if (!trace_file) {
+        fprintf(stderr, "VDPAU_TRACE: could not open %s\n", path);
+        return;
+    }
+
+    len = strlen(path);
+    trace_json = len > 5 && !strcmp(path + len - 5, ".json");
+
+    if (trace_json) {
+        fprintf(trace_file, "[");
+    } else {
+        uint32_t version = TRACE_VERSION;
+
+        fwrite(TRACE_MAGIC, 8, 1, trace_file);
+        fwrite(&version, sizeof(version), 1, trace_file);
+    }
+
+    trace_enabled = 1;
+}
+
+__attribute__((destructor))
+static void trace_exit(void) {
+    trace_ring_t *ring;
+
+    if (!trace_enabled)
+        return;
+
+    pthread_mutex_lock(&trace_mutex);
+    trace_enabled = 0;
+
+    for (ring = trace_rings; ring; ring = ring->next)
+        trace_flush_ring(ring);
+
+    if (trace_json)
+        fprintf(trace_file, "\n]\n");
+
+    fclose(trace_file);
+    trace_file = NULL;
+    pthread_mutex_unlock(&trace_mutex);
+
+    /* threads exiting after the library is gone must not call back in */
+    if (trace_key_valid)
+        pthread_key_delete(trace_key);
+    trace_key_valid = 0;
+}
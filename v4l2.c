@@ -7,6 +7,7 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include <sys/errno.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
@@ -88,6 +89,17 @@ int v4l2_init_by_name(const char *name) {
 
 int v4l2_deinit(decoder_ctx_t *dec) {
     struct v4l2_requestbuffers reqbufs;
+    int i;
+
+    /* imports of the capture buffers would keep them alive */
+    for (i = 0; i < kOutputBufferCnt; i++) {
+        if (dec->outputs[i] <= 0)
+            continue;
+        gl_release_dmabuf_image(dec->device, dec->outputs[i]);
+        close(dec->outputs[i]);
+        dec->outputs[i] = 0;
+    }
+
     memset(&reqbufs, 0, sizeof(reqbufs));
     reqbufs.count = 0;
     reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
@@ -100,22 +112,41 @@ int v4l2_deinit(decoder_ctx_t *dec) {
     reqbufs.memory = V4L2_MEMORY_MMAP;
     IOCTL_OR_ERROR_RETURN(VIDIOC_REQBUFS, &reqbufs);
 
-    munmap(dec->input_buffer, dec->buffer_size);
+    for (i = 0; i < dec->input_count; i++)
+        munmap(dec->input_buffers[i], dec->buffer_size);
+    dec->input_count = 0;
 
     close(dec->fd);
     dec->fd = 0;
 
+    if (dec->wake_fd >= 0)
+        close(dec->wake_fd);
+    dec->wake_fd = -1;
+
     return 0;
 }
 
 int v4l2_reqbufs(decoder_ctx_t *dec) {
     struct v4l2_requestbuffers reqbufs;
+    int count = kInputBufferCnt;
+
+    if (getenv("INPUT_BUFFER_CNT"))
+        count = atoi(getenv("INPUT_BUFFER_CNT"));
+    if (count < 1 || count > kMaxInputBufferCnt)
+        count = kInputBufferCnt;
+
     memset(&reqbufs, 0, sizeof(reqbufs));
-    reqbufs.count = 1;
+    reqbufs.count = count;
     reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
     reqbufs.memory = V4L2_MEMORY_MMAP;
     IOCTL_OR_ERROR_RETURN(VIDIOC_REQBUFS, &reqbufs);
 
+    if (!reqbufs.count) {
+        PRINT("no bitstream buffers allocated\n");
+        return -1;
+    }
+    dec->input_count = min(reqbufs.count, kMaxInputBufferCnt);
+
     memset(&reqbufs, 0, sizeof(reqbufs));
     reqbufs.count = kOutputBufferCnt;
     reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
@@ -126,27 +157,34 @@ int v4l2_reqbufs(decoder_ctx_t *dec) {
 }
 
 int v4l2_querybuf(decoder_ctx_t *dec) {
-    struct v4l2_plane planes[VIDEO_MAX_PLANES];
-    struct v4l2_buffer buffer;
-    memset(&buffer, 0, sizeof(buffer));
-    memset(planes, 0, sizeof(planes));
-    buffer.index = 0;
-    buffer.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-    buffer.memory = V4L2_MEMORY_MMAP;
-    buffer.m.planes = planes;
-    buffer.length = 1;
-    IOCTL_OR_ERROR_RETURN(VIDIOC_QUERYBUF, &buffer);
-
-    dec->buffer_size = buffer.m.planes[0].length;
-    dec->input_buffer = mmap(NULL, dec->buffer_size,
-            PROT_READ | PROT_WRITE,
-            MAP_SHARED, dec->fd,
-            buffer.m.planes[0].m.mem_offset);
-    if (dec->input_buffer == MAP_FAILED) {
-        PRINT("create input buffer: mmap() failed");
-        return -1;
+    int i;
+
+    for (i = 0; i < dec->input_count; i++) {
+        struct v4l2_plane planes[VIDEO_MAX_PLANES];
+        struct v4l2_buffer buffer;
+        memset(&buffer, 0, sizeof(buffer));
+        memset(planes, 0, sizeof(planes));
+        buffer.index = i;
+        buffer.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+        buffer.memory = V4L2_MEMORY_MMAP;
+        buffer.m.planes = planes;
+        buffer.length = 1;
+        IOCTL_OR_ERROR_RETURN(VIDIOC_QUERYBUF, &buffer);
+
+        dec->buffer_size = buffer.m.planes[0].length;
+        dec->input_buffers[i] = mmap(NULL, dec->buffer_size,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED, dec->fd,
+                buffer.m.planes[0].m.mem_offset);
+        if (dec->input_buffers[i] == MAP_FAILED) {
+            PRINT("create input buffer: mmap() failed");
+            dec->input_count = i;
+            return -1;
+        }
     }
 
+    dec->input_free = (1u << dec->input_count) - 1;
+
     return 0;
 }
 
@@ -223,17 +261,52 @@ int v4l2_s_ext_ctrls(decoder_ctx_t *dec,
     return 0;
 }
 
-int v4l2_qbuf_input(decoder_ctx_t *dec) {
+/*
+ * Bitstream buffers are handed out from a bitmask free-list, so one can
+ * be filled while the hardware is still reading the others.
+ */
+static int v4l2_acquire_input(decoder_ctx_t *dec) {
+    uint32_t free = __atomic_load_n(&dec->input_free, __ATOMIC_ACQUIRE);
+
+    while (free) {
+        int index = __builtin_ctz(free);
+
+        if (__atomic_compare_exchange_n(&dec->input_free, &free,
+                    free & ~(1u << index), 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return index;
+    }
+
+    return -1;
+}
+
+void v4l2_put_input(decoder_ctx_t *dec, int index) {
+    __atomic_fetch_or(&dec->input_free, 1u << index, __ATOMIC_RELEASE);
+}
+
+int v4l2_get_input(decoder_ctx_t *dec) {
+    int index;
+
+    while ((index = v4l2_acquire_input(dec)) < 0) {
+        if (v4l2_dqbuf_input(dec) < 0)
+            return -1;
+    }
+
+    return index;
+}
+
+int v4l2_qbuf_input(decoder_ctx_t *dec, int index) {
     struct v4l2_buffer qbuf;
     struct v4l2_plane qbuf_planes[VIDEO_MAX_PLANES];
     memset(&qbuf, 0, sizeof(qbuf));
     memset(qbuf_planes, 0, sizeof(qbuf_planes));
-    qbuf.index = 0;
+    qbuf.index = index;
     qbuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
     qbuf.memory = V4L2_MEMORY_MMAP;
     qbuf.m.planes = qbuf_planes;
     qbuf.m.planes[0].bytesused = dec->buffer_size;
     qbuf.length = 1;
+    qbuf.config_store = index + 1;
     IOCTL_OR_ERROR_RETURN(VIDIOC_QBUF, &qbuf);
 
     return 0;
@@ -251,6 +324,93 @@ int v4l2_qbuf_output(decoder_ctx_t *dec, int index) {
     qbuf.length = 1;
     IOCTL_OR_ERROR_RETURN(VIDIOC_QBUF, &qbuf);
 
+    dec->output_queue[(dec->output_queue_head + dec->output_queue_count)
+        % VIDEO_MAX_FRAME] = index;
+    dec->output_queue_count++;
+
+    return 0;
+}
+
+/*
+ * The driver decodes into the capture buffers in the order they were
+ * queued, so the target of the next job is known before it completes.
+ */
+int v4l2_next_output(decoder_ctx_t *dec) {
+    int index;
+
+    if (!dec->output_queue_count)
+        return -1;
+
+    index = dec->output_queue[dec->output_queue_head];
+    dec->output_queue_head = (dec->output_queue_head + 1) % VIDEO_MAX_FRAME;
+    dec->output_queue_count--;
+
+    return index;
+}
+
+/* Undo v4l2_next_output() when no job was queued for the buffer. */
+void v4l2_return_output(decoder_ctx_t *dec, int index) {
+    dec->output_queue_head = (dec->output_queue_head + VIDEO_MAX_FRAME - 1)
+        % VIDEO_MAX_FRAME;
+    dec->output_queue[dec->output_queue_head] = index;
+    dec->output_queue_count++;
+}
+
+int v4l2_wakeup_init(decoder_ctx_t *dec) {
+    dec->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (dec->wake_fd < 0) {
+        PRINT("eventfd() failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Wake up and fail any v4l2_poll(), now and from then on. Called when
+ * the decoder handle is destroyed, a thread syncing a surface of it
+ * gives up instead of waiting out kPollTimeoutMs.
+ */
+void v4l2_interrupt(decoder_ctx_t *dec) {
+    uint64_t val = 1;
+
+    if (dec->wake_fd >= 0 && write(dec->wake_fd, &val, sizeof(val)) < 0)
+        PRINT("failed to interrupt decoder\n");
+}
+
+/*
+ * Wait until a buffer is ready to be dequeued, POLLIN for the capture
+ * queue and POLLOUT for the output queue.
+ */
+int v4l2_poll(decoder_ctx_t *dec, short events) {
+    struct pollfd fds[2];
+    int ret;
+
+    fds[0].fd = dec->fd;
+    fds[0].events = events;
+    fds[1].fd = dec->wake_fd;
+    fds[1].events = POLLIN;
+
+    do {
+        ret = poll(fds, 2, kPollTimeoutMs);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        PRINT("poll() failed\n");
+        return -1;
+    }
+
+    if (!ret) {
+        PRINT("poll() timed out after %d ms\n", kPollTimeoutMs);
+        return -1;
+    }
+
+    if (fds[1].revents)
+        return -1;
+
+    if (fds[0].revents & POLLERR)
+        return -1;
+
     return 0;
 }
 
@@ -264,14 +424,15 @@ int v4l2_dqbuf_input(decoder_ctx_t *dec) {
     dqbuf.m.planes = planes;
     dqbuf.length = 1;
     while (ioctl(dec->fd, VIDIOC_DQBUF, &dqbuf) != 0) {
-        if (errno == EAGAIN) {
+        if (errno == EAGAIN && !v4l2_poll(dec, POLLOUT))
             continue;
-        }
         PRINT("ioctl() failed: VIDIOC_DQBUF");
         return -1;
     }
 
-    return 0;
+    v4l2_put_input(dec, dqbuf.index);
+
+    return dqbuf.index;
 }
 
 int v4l2_dqbuf_output(decoder_ctx_t *dec) {
@@ -286,10 +447,8 @@ int v4l2_dqbuf_output(decoder_ctx_t *dec) {
     dqbuf.length = 1;
 
     while (ioctl(dec->fd, VIDIOC_DQBUF, &dqbuf) != 0) {
-        if (errno == EAGAIN) {
-            usleep(1000);
+        if (errno == EAGAIN && !v4l2_poll(dec, POLLIN))
             continue;
-        }
         PRINT("ioctl() failed: VIDIOC_DQBUF");
         return -1;
     }
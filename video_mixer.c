@@ -25,6 +25,8 @@
 
 #include "vdpau_private.h"
 #include "rgba.h"
+#include "trace.h"
+#include "latency.h"
 
 VdpStatus vdp_video_mixer_create(VdpDevice device,
                                  uint32_t feature_count,
@@ -34,7 +36,7 @@ VdpStatus vdp_video_mixer_create(VdpDevice device,
                                  void const *const *parameter_values,
                                  VdpVideoMixer *mixer)
 {
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -46,7 +48,7 @@ VdpStatus vdp_video_mixer_create(VdpDevice device,
     mix->contrast = 1.0;
     mix->saturation = 1.0;
 
-    int handle = handle_create(mix);
+    int handle = handle_create(mix, HANDLE_TYPE_VIDEO_MIXER);
     if (handle == -1)
     {
         free(mix);
@@ -60,7 +62,7 @@ VdpStatus vdp_video_mixer_create(VdpDevice device,
 
 VdpStatus vdp_video_mixer_destroy(VdpVideoMixer mixer)
 {
-    mixer_ctx_t *mix = handle_get(mixer);
+    mixer_ctx_t *mix = handle_get(mixer, HANDLE_TYPE_VIDEO_MIXER);
     if (!mix)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -70,6 +72,45 @@ VdpStatus vdp_video_mixer_destroy(VdpVideoMixer mixer)
     return VDP_STATUS_OK;
 }
 
+#ifndef GL_OES
+/*
+ * Copy the RGB picture out of the video surface into the output surface,
+ * the queue thread draws it from another context once it is due. The
+ * fence is flushed so that context can wait for it.
+ */
+static void mixer_copy_picture(output_surface_ctx_t *os)
+{
+    video_surface_ctx_t *vs = os->vs;
+    device_ctx_t *dev = vs->device;
+
+    if (!eglMakeCurrent(dev->egl.display, dev->egl.surface,
+                        dev->egl.surface, dev->egl.context)) {
+        VDPAU_ERR("Could not set EGL context to current %x", eglGetError());
+        return;
+    }
+
+    if (!os->video_tex)
+        os->video_tex = gl_create_texture(GL_LINEAR);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, vs->framebuffer);
+    CHECKEGL
+    glBindTexture(GL_TEXTURE_2D, os->video_tex);
+    CHECKEGL
+    glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 0, 0, vs->width, vs->height, 0);
+    CHECKEGL
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    CHECKEGL
+
+    if (os->video_fence != EGL_NO_SYNC_KHR)
+        eglDestroySyncKHR(dev->egl.display, os->video_fence);
+    os->video_fence = eglCreateSyncKHR(dev->egl.display, EGL_SYNC_FENCE_KHR, NULL);
+    glFlush();
+
+    if (!eglMakeCurrent(dev->egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT))
+        VDPAU_ERR("Could not set EGL context to none %x", eglGetError());
+}
+#endif
+
 VdpStatus vdp_video_mixer_render(VdpVideoMixer mixer,
                                  VdpOutputSurface background_surface,
                                  VdpRect const *background_source_rect,
@@ -86,7 +127,7 @@ VdpStatus vdp_video_mixer_render(VdpVideoMixer mixer,
                                  uint32_t layer_count,
                                  VdpLayer const *layers)
 {
-    mixer_ctx_t *mix = handle_get(mixer);
+    mixer_ctx_t *mix = handle_get(mixer, HANDLE_TYPE_VIDEO_MIXER);
     if (!mix)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -96,11 +137,11 @@ VdpStatus vdp_video_mixer_render(VdpVideoMixer mixer,
     if (current_picture_structure != VDP_VIDEO_MIXER_PICTURE_STRUCTURE_FRAME)
         VDPAU_DBG_ONCE("Requested unimplemented picture_structure");
 
-    output_surface_ctx_t *os = handle_get(destination_surface);
+    output_surface_ctx_t *os = handle_get(destination_surface, HANDLE_TYPE_OUTPUT_SURFACE);
     if (!os)
         return VDP_STATUS_INVALID_HANDLE;
 
-    os->vs = handle_get(video_surface_current);
+    os->vs = handle_get(video_surface_current, HANDLE_TYPE_VIDEO_SURFACE);
     if (!(os->vs))
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -129,62 +170,58 @@ VdpStatus vdp_video_mixer_render(VdpVideoMixer mixer,
     if (os->vs->source_format == INTERNAL_YCBCR_FORMAT) {
         if (os->vs->dma_fd > 0) {
 
+            os->vs->dec->sync_picture(os->vs->dec, os->vs);
+            TRACE(TRACE_MIXER, os->vs->output_index);
+            uint64_t start_us = latency_now();
+
             os->vs->source_format = VDP_YCBCR_FORMAT_NV12;
-            int w = os->vs->dec->coded_width;
-            int h = os->vs->dec->coded_height;
 
             if (os->vs->device->dsp_mode != NO_OVERLAY) {
-                uint32_t handles[4], pitches[4], offsets[4];
-                uint32_t handle = 0;
-                int ret = 0;
-
-                ret = drmPrimeFDToHandle(os->vs->device->drm_fd,
-                        os->vs->dma_fd, &handle);
-                if (ret < 0) {
-                    VDPAU_ERR("Could not get handle");
-                    os->vs->device->dsp_mode = NO_OVERLAY;
-                }
-
-                handles[0] = handle;
-                pitches[0] = w;
-                offsets[0] = 0;
-                handles[1] = handle;
-                pitches[1] = w;
-                offsets[1] = w * h;
-
-                ret = drmModeAddFB2(os->vs->device->drm_fd, w, h,
-                        DRM_FORMAT_NV12, handles, pitches, offsets,
-                        &os->vs->fb_id, 0);
-                if (ret < 0) {
-                    VDPAU_ERR("Could not add fb");
+                os->vs->fb_id = decoder_get_framebuffer(os->vs->dec, os->vs->dma_fd);
+                if (!os->vs->fb_id)
                     os->vs->device->dsp_mode = NO_OVERLAY;
-                }
             }
 
             if (os->vs->device->dsp_mode == NO_OVERLAY) {
-                void *buffers[2];
-                size_t size = w * h * 3 / 2;
-                void *buf = mmap(NULL, size,
-                        PROT_READ | PROT_WRITE, MAP_SHARED,
-                        os->vs->dma_fd, 0);
-
-                /* y */
-                buffers[0] = buf;
-                /* uv */
-                buffers[1] = buf + w * h;
-
 #ifdef GL_OES
-                video_surface_render_picture(os->vs, os->vs->dma_fd);
+                /* the dma-buf is imported as is, no CPU access needed */
+                video_surface_render_picture(os->vs, (void *)(intptr_t)os->vs->dma_fd);
 #else
-                video_surface_render_picture(os->vs, buffers); 
+                void *buffers[2];
+                int w = os->vs->dec->coded_width;
+                int h = os->vs->dec->coded_height;
+                void *buf = decoder_map_output(os->vs->dec, os->vs->dma_fd);
+
+                if (buf) {
+                    /* y */
+                    buffers[0] = buf;
+                    /* uv */
+                    buffers[1] = buf + w * h;
+
+                    decoder_sync_output(os->vs->dma_fd, 0);
+                    video_surface_render_picture(os->vs, buffers);
+                    decoder_sync_output(os->vs->dma_fd, 1);
+                }
 #endif
-                munmap(buf, size);
             }
 
-            os->vs->dec->release_picture(os->vs->dec, os->vs);
+            LATENCY(VDP_ROCKCHIP_STAGE_MIXER_IMPORT, start_us);
         }
     }
 
+#ifndef GL_OES
+    if (os->vs->device->dsp_mode == NO_OVERLAY)
+        mixer_copy_picture(os);
+#endif
+
+    /*
+     * Hold the picture until it has been shown and replaced, only then
+     * may the parser hand its capture buffer back to the driver.
+     */
+    video_frame_set(&os->frame, os->vs);
+    if (os->frame.dec)
+        os->frame.dec->release_picture(os->frame.dec, os->vs);
+
     if (layer_count != 0)
         VDPAU_DBG_ONCE("Requested unimplemented additional layers");
 
@@ -202,7 +239,7 @@ VdpStatus vdp_video_mixer_get_feature_support(VdpVideoMixer mixer,
     if (!features || !feature_supports)
         return VDP_STATUS_INVALID_POINTER;
 
-    mixer_ctx_t *mix = handle_get(mixer);
+    mixer_ctx_t *mix = handle_get(mixer, HANDLE_TYPE_VIDEO_MIXER);
     if (!mix)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -220,7 +257,7 @@ VdpStatus vdp_video_mixer_set_feature_enables(VdpVideoMixer mixer,
     if (!features || !feature_enables)
         return VDP_STATUS_INVALID_POINTER;
 
-    mixer_ctx_t *mix = handle_get(mixer);
+    mixer_ctx_t *mix = handle_get(mixer, HANDLE_TYPE_VIDEO_MIXER);
     if (!mix)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -235,7 +272,7 @@ VdpStatus vdp_video_mixer_get_feature_enables(VdpVideoMixer mixer,
     if (!features || !feature_enables)
         return VDP_STATUS_INVALID_POINTER;
 
-    mixer_ctx_t *mix = handle_get(mixer);
+    mixer_ctx_t *mix = handle_get(mixer, HANDLE_TYPE_VIDEO_MIXER);
     if (!mix)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -270,7 +307,7 @@ VdpStatus vdp_video_mixer_set_attribute_values(VdpVideoMixer mixer,
     if (!attributes || !attribute_values)
         return VDP_STATUS_INVALID_POINTER;
 
-    mixer_ctx_t *mix = handle_get(mixer);
+    mixer_ctx_t *mix = handle_get(mixer, HANDLE_TYPE_VIDEO_MIXER);
     if (!mix)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -290,7 +327,7 @@ VdpStatus vdp_video_mixer_get_parameter_values(VdpVideoMixer mixer,
     if (!parameters || !parameter_values)
         return VDP_STATUS_INVALID_POINTER;
 
-    mixer_ctx_t *mix = handle_get(mixer);
+    mixer_ctx_t *mix = handle_get(mixer, HANDLE_TYPE_VIDEO_MIXER);
     if (!mix)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -305,7 +342,7 @@ VdpStatus vdp_video_mixer_get_attribute_values(VdpVideoMixer mixer,
     if (!attributes || !attribute_values)
         return VDP_STATUS_INVALID_POINTER;
 
-    mixer_ctx_t *mix = handle_get(mixer);
+    mixer_ctx_t *mix = handle_get(mixer, HANDLE_TYPE_VIDEO_MIXER);
     if (!mix)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -319,7 +356,7 @@ VdpStatus vdp_video_mixer_query_feature_support(VdpDevice device,
     if (!is_supported)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -334,7 +371,7 @@ VdpStatus vdp_video_mixer_query_parameter_support(VdpDevice device,
     if (!is_supported)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -362,7 +399,7 @@ VdpStatus vdp_video_mixer_query_parameter_value_range(VdpDevice device,
     if (!min_value || !max_value)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -389,7 +426,7 @@ VdpStatus vdp_video_mixer_query_attribute_support(VdpDevice device,
     if (!is_supported)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
@@ -406,7 +443,7 @@ VdpStatus vdp_video_mixer_query_attribute_value_range(VdpDevice device,
     if (!min_value || !max_value)
         return VDP_STATUS_INVALID_POINTER;
 
-    device_ctx_t *dev = handle_get(device);
+    device_ctx_t *dev = handle_get(device, HANDLE_TYPE_DEVICE);
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
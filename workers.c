@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "vdpau_private.h"
+#include "workers.h"
+
+#define WORKERS_MAX 8
+
+/* bytes of destination per band, about what fits in L1/L2 next to the source */
+#define WORKERS_BAND_BYTES (64 * 1024)
+
+/* below this the wakeups cost more than they save */
+#define WORKERS_MIN_BYTES (256 * 1024)
+
+/*
+ * Bands are handed out through an atomic counter, the calling thread
+ * takes part as well and then waits for the workers that joined in.
+ * Only one job runs at a time, a second caller just does its own work.
+ */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    pthread_t threads[WORKERS_MAX];
+    int count;
+    int stop;
+    uint64_t generation;
+    int active;
+
+    workers_band_fn fn;
+    void *arg;
+    uint32_t height;
+    uint32_t band_rows;
+    uint32_t next;
+} pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_mutex_t pool_busy = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void workers_run_bands(void) {
+    uint32_t band;
+
+    while ((band = __atomic_fetch_add(&pool.next, 1, __ATOMIC_RELAXED)) <
+           (pool.height + pool.band_rows - 1) / pool.band_rows) {
+        uint32_t y0 = band * pool.band_rows;
+
+        pool.fn(pool.arg, y0, min(y0 + pool.band_rows, pool.height));
+    }
+}
+
+static void *workers_thread(void *param) {
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool.mutex);
+    for (;;) {
+        while (pool.generation == seen && !pool.stop)
+            pthread_cond_wait(&pool.start, &pool.mutex);
+        if (pool.stop)
+            break;
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.mutex);
+
+        workers_run_bands();
+
+        pthread_mutex_lock(&pool.mutex);
+        if (--pool.active == 0)
+            pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    return NULL;
+}
+
+/* threads are only started by the first job big enough to use them */
+static void workers_init(void) {
+    const char *env = getenv("VDPAU_THREADS");
+    long cpus = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if (cpus > WORKERS_MAX)
+        cpus = WORKERS_MAX;
+
+    for (i = 0; i < cpus - 1; i++) {
+        if (pthread_create(&pool.threads[i], NULL, workers_thread, NULL)) {
+            VDPAU_ERR("could not start worker thread %d", i);
+            break;
+        }
+        pool.count++;
+    }
+
+    VDPAU_DBG("%d worker threads", pool.count);
+}
+
+__attribute__((destructor))
+static void workers_exit(void) {
+    int i;
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.mutex);
+
+    for (i = 0; i < pool.count; i++)
+        pthread_join(pool.threads[i], NULL);
+    pool.count = 0;
+}
+
+void workers_run(workers_band_fn fn, void *arg,
+                 uint32_t height, uint32_t row_bytes, uint32_t align) {
+    uint32_t band_rows;
+
+    if (!height)
+        return;
+
+    if ((uint64_t)height * row_bytes < WORKERS_MIN_BYTES) {
+        fn(arg, 0, height);
+        return;
+    }
+
+    pthread_once(&pool_once, workers_init);
+
+    if (!pool.count || pthread_mutex_trylock(&pool_busy)) {
+        fn(arg, 0, height);
+        return;
+    }
+
+    band_rows = row_bytes ? WORKERS_BAND_BYTES / row_bytes : height;
+    if (align < 1)
+        align = 1;
+    band_rows = max(band_rows / align * align, align);
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.height = height;
+    pool.band_rows = band_rows;
+    pool.next = 0;
+    pool.active = pool.count;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.mutex);
+
+    workers_run_bands();
+
+    pthread_mutex_lock(&pool.mutex);
+    while (pool.active)
+        pthread_cond_wait(&pool.done, &pool.mutex);
+    pthread_mutex_unlock(&pool.mutex);
+
+    pthread_mutex_unlock(&pool_busy);
+}
@@ -0,0 +1,136 @@
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "yuv.h"
+
+/*
+ * Pictures read back are consumed once by the caller, so the copy uses
+ * non-temporal stores where available instead of filling the caches.
+ */
+static inline void yuv_stream_copy(uint8_t *dst, const uint8_t *src, size_t n) {
+#if defined(__SSE2__)
+    size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+
+    if (n < head + 64) {
+        memcpy(dst, src, n);
+        return;
+    }
+
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    n -= head;
+
+    for (; n >= 64; n -= 64, src += 64, dst += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+#elif defined(__aarch64__)
+    for (; n >= 64; n -= 64, src += 64, dst += 64)
+        __asm__ volatile(
+            "ldp q0, q1, [%1]\n"
+            "ldp q2, q3, [%1, #32]\n"
+            "stnp q0, q1, [%0]\n"
+            "stnp q2, q3, [%0, #32]\n"
+            : : "r" (dst), "r" (src) : "v0", "v1", "v2", "v3", "memory");
+#endif
+
+    memcpy(dst, src, n);
+}
+
+void yuv_copy_plane(uint8_t *dst, uint32_t dst_pitch,
+                    const uint8_t *src, uint32_t src_pitch,
+                    uint32_t width, uint32_t height) {
+    uint32_t y;
+
+    if (dst_pitch == width && src_pitch == width)
+        yuv_stream_copy(dst, src, (size_t)width * height);
+    else
+        for (y = 0; y < height; y++)
+            yuv_stream_copy(dst + (size_t)y * dst_pitch,
+                    src + (size_t)y * src_pitch, width);
+
+#if defined(__SSE2__)
+    _mm_sfence();
+#endif
+}
+
+static inline void yuv_split_row(uint8_t *u, uint8_t *v,
+                                 const uint8_t *src, uint32_t width) {
+    uint32_t x = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x2_t uv = vld2q_u8(src + 2 * x);
+
+        vst1q_u8(u + x, uv.val[0]);
+        vst1q_u8(v + x, uv.val[1]);
+    }
+#elif defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + 2 * x));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 2 * x + 16));
+
+        _mm_storeu_si128((__m128i *)(u + x),
+                _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+        _mm_storeu_si128((__m128i *)(v + x),
+                _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+#endif
+
+    for (; x < width; x++) {
+        u[x] = src[2 * x];
+        v[x] = src[2 * x + 1];
+    }
+}
+
+void yuv_split_chroma(uint8_t *dst_u, uint32_t u_pitch,
+                      uint8_t *dst_v, uint32_t v_pitch,
+                      const uint8_t *src, uint32_t src_pitch,
+                      uint32_t width, uint32_t height) {
+    uint32_t y;
+
+    for (y = 0; y < height; y++)
+        yuv_split_row(dst_u + (size_t)y * u_pitch, dst_v + (size_t)y * v_pitch,
+                src + (size_t)y * src_pitch, width);
+}
+
+void yuv_nv12_read_rows(const uint8_t *src, uint32_t src_pitch,
+                        uint32_t src_height, uint32_t width,
+                        uint32_t y0, uint32_t y1,
+                        uint8_t *dst_y, uint32_t y_pitch,
+                        uint8_t *dst_u, uint32_t u_pitch,
+                        uint8_t *dst_v, uint32_t v_pitch) {
+    const uint8_t *src_uv = src + (size_t)src_pitch * src_height;
+    uint32_t c0 = y0 / 2, c1 = (y1 + 1) / 2;
+
+    if (y1 <= y0)
+        return;
+
+    yuv_copy_plane(dst_y + (size_t)y0 * y_pitch, y_pitch,
+            src + (size_t)y0 * src_pitch, src_pitch, width, y1 - y0);
+
+    if (!dst_v)
+        yuv_copy_plane(dst_u + (size_t)c0 * u_pitch, u_pitch,
+                src_uv + (size_t)c0 * src_pitch, src_pitch,
+                (width + 1) & ~1, c1 - c0);
+    else
+        yuv_split_chroma(dst_u + (size_t)c0 * u_pitch, u_pitch,
+                dst_v + (size_t)c0 * v_pitch, v_pitch,
+                src_uv + (size_t)c0 * src_pitch, src_pitch,
+                (width + 1) / 2, c1 - c0);
+}